@@ -0,0 +1,504 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisBitmap.h"
+#include "xRedisUtil.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XREDIS_BITMAP_X86 1
+#if defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#include <immintrin.h>
+#define XREDIS_BITMAP_AVX2 1
+#endif
+#if defined(__GNUC__) && (__GNUC__ >= 5)
+#define XREDIS_BITMAP_AVX512 1
+#endif
+#endif
+
+using namespace xrcp;
+
+#define BITMAP_MAX_THREADS 8
+#define BITMAP_CHUNK (1024 * 1024)  // bytes per GETRANGE/SETRANGE
+#define BITMAP_WINDOW 8             // chunks in flight
+
+typedef void (* COMBINEFUN)(BITOP op, uint8_t* dst, const uint8_t* src, size_t len);
+typedef uint64_t (* POPCOUNTFUN)(const uint8_t* p, size_t len);
+
+typedef struct _BITMAP_TASK_ {
+    xRedisClient* client;
+    const SliceIndex* index;
+    const KEY* key;
+    string value;
+    bool ok;
+} BitmapTask;
+
+static const char* gBitopNames[] = {"AND", "OR", "XOR", "NOT"};
+
+static void CombineScalar(BITOP op, uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a = 0;
+        uint64_t b = 0;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        switch (op) {
+            case AND:
+                a &= b;
+                break;
+            case OR:
+                a |= b;
+                break;
+            case XOR:
+                a ^= b;
+                break;
+            default:
+                a = ~b;
+                break;
+        }
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; ++i) {
+        switch (op) {
+            case AND:
+                dst[i] &= src[i];
+                break;
+            case OR:
+                dst[i] |= src[i];
+                break;
+            case XOR:
+                dst[i] ^= src[i];
+                break;
+            default:
+                dst[i] = (uint8_t) ~src[i];
+                break;
+        }
+    }
+}
+
+static uint64_t PopCountScalar(const uint8_t* p, size_t len) {
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, p + i, 8);
+        count += (uint64_t) __builtin_popcountll(word);
+    }
+    for (; i < len; ++i) {
+        count += (uint64_t) __builtin_popcount(p[i]);
+    }
+    return count;
+}
+
+#ifdef XREDIS_BITMAP_X86
+__attribute__((target("popcnt")))
+static uint64_t PopCountPOPCNT(const uint8_t* p, size_t len) {
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, p + i, 8);
+        count += (uint64_t) __builtin_popcountll(word);
+    }
+    for (; i < len; ++i) {
+        count += (uint64_t) __builtin_popcount(p[i]);
+    }
+    return count;
+}
+#endif
+
+#ifdef XREDIS_BITMAP_AVX2
+__attribute__((target("avx2")))
+static void CombineAVX2(BITOP op, uint8_t* dst, const uint8_t* src, size_t len) {
+    const __m256i ones = _mm256_set1_epi8((char) 0xff);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        switch (op) {
+            case AND:
+                a = _mm256_and_si256(a, b);
+                break;
+            case OR:
+                a = _mm256_or_si256(a, b);
+                break;
+            case XOR:
+                a = _mm256_xor_si256(a, b);
+                break;
+            default:
+                a = _mm256_xor_si256(b, ones);
+                break;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), a);
+    }
+    CombineScalar(op, dst + i, src + i, len - i);
+}
+
+// Nibble lookup popcount (Mula): byte counts are summed for up to 31
+// rounds before SAD widens them to 64-bit lanes.
+__attribute__((target("avx2,popcnt")))
+static uint64_t PopCountAVX2(const uint8_t* p, size_t len) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i bytes = zero;
+        for (uint32_t round = 0; (round < 31) && (i + 32 <= len); ++round, i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            __m256i lo = _mm256_and_si256(v, low);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+            bytes = _mm256_add_epi8(bytes, _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi)));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + PopCountPOPCNT(p + i, len - i);
+}
+#endif
+
+#ifdef XREDIS_BITMAP_AVX512
+__attribute__((target("avx512f")))
+static void CombineAVX512(BITOP op, uint8_t* dst, const uint8_t* src, size_t len) {
+    const __m512i ones = _mm512_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i a = _mm512_loadu_si512(dst + i);
+        __m512i b = _mm512_loadu_si512(src + i);
+        switch (op) {
+            case AND:
+                a = _mm512_and_si512(a, b);
+                break;
+            case OR:
+                a = _mm512_or_si512(a, b);
+                break;
+            case XOR:
+                a = _mm512_xor_si512(a, b);
+                break;
+            default:
+                a = _mm512_xor_si512(b, ones);
+                break;
+        }
+        _mm512_storeu_si512(dst + i, a);
+    }
+    CombineScalar(op, dst + i, src + i, len - i);
+}
+#endif
+
+static COMBINEFUN SelectCombine(const char** name) {
+#ifdef XREDIS_BITMAP_X86
+    __builtin_cpu_init();
+#endif
+#ifdef XREDIS_BITMAP_AVX512
+    if (__builtin_cpu_supports("avx512f")) {
+        *name = "avx512f";
+        return CombineAVX512;
+    }
+#endif
+#ifdef XREDIS_BITMAP_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return CombineAVX2;
+    }
+#endif
+    *name = "scalar";
+    return CombineScalar;
+}
+
+static POPCOUNTFUN SelectPopCount() {
+#ifdef XREDIS_BITMAP_X86
+    __builtin_cpu_init();
+#endif
+#ifdef XREDIS_BITMAP_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return PopCountAVX2;
+#endif
+#ifdef XREDIS_BITMAP_X86
+    if (__builtin_cpu_supports("popcnt"))
+        return PopCountPOPCNT;
+#endif
+    return PopCountScalar;
+}
+
+static const char* gCombineName = "scalar";
+static COMBINEFUN gCombine = SelectCombine(&gCombineName);
+static POPCOUNTFUN gPopCount = SelectPopCount();
+
+static void FetchTask(void* arg) {
+    BitmapTask* pTask = static_cast<BitmapTask*>(arg);
+    pTask->ok = xRedisBitmap::Fetch(pTask->client, *pTask->index, *pTask->key, pTask->value);
+}
+
+void xRedisBitmap::Combine(BITOP op, uint8_t* dst, const uint8_t* src, size_t len) {
+    gCombine(op, dst, src, len);
+}
+
+uint64_t xRedisBitmap::PopCount(const uint8_t* p, size_t len) {
+    return gPopCount(p, len);
+}
+
+const char* xRedisBitmap::GetKernelName() {
+    return gCombineName;
+}
+
+bool xRedisBitmap::Fetch(xRedisClient* client, const SliceIndex& index, const KEY& key, string& value) {
+    uint32_t ioType = SLAVE;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+
+    value.clear();
+    RedisPool* pRedisPool = client->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+
+    // A chunk shorter than BITMAP_CHUNK marks the end of the value.
+    bool bRet = true;
+    bool done = false;
+    uint64_t offset = 0;
+    while (bRet && !done) {
+        std::vector<VDATA> vCmds(BITMAP_WINDOW);
+        for (uint32_t i = 0; i < BITMAP_WINDOW; ++i) {
+            vCmds[i].push_back("GETRANGE");
+            vCmds[i].push_back(key);
+            vCmds[i].push_back(toString(offset));
+            vCmds[i].push_back(toString(offset + BITMAP_CHUNK - 1));
+            offset += BITMAP_CHUNK;
+        }
+        std::vector<redisReply*> vReplies;
+        bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+        if (!bRet) {
+            const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+            pRedisConn->RedisReConnect();
+            break;
+        }
+        for (size_t i = 0; (i < vReplies.size()) && bRet && !done; ++i) {
+            const redisReply* reply = vReplies[i];
+            if (REDIS_REPLY_STRING == reply->type) {
+                value.append(reply->str, reply->len);
+                done = reply->len < BITMAP_CHUNK;
+            } else {
+                if (REDIS_REPLY_ERROR == reply->type)
+                    const_cast<SliceIndex&>(index).SetErrInfo(reply->str, reply->len);
+                bRet = false;
+            }
+        }
+        FreeReplies(vReplies);
+    }
+    pRedisPool->FreeConnection(pRedisConn);
+    return bRet;
+}
+
+bool xRedisBitmap::Store(xRedisClient* client, const SliceIndex& index, const KEY& key, const string& value) {
+    RedisPool* pRedisPool = client->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, MASTER);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+
+    // Built under a temporary name and renamed over key in one step.
+    string tmpKey = key + ":xredis-tmp:" + toString(getpid()) + ":" + toString(GetMonotonicUs());
+    std::vector<VDATA> vCmds;
+    vCmds.push_back(VDATA());
+    vCmds.back().push_back("DEL");
+    vCmds.back().push_back(value.empty() ? key : tmpKey);
+
+    bool bRet = true;
+    size_t pos = 0;
+    while (bRet) {
+        while ((pos < value.size()) && (vCmds.size() < BITMAP_WINDOW)) {
+            size_t len = std::min(value.size() - pos, (size_t) BITMAP_CHUNK);
+            vCmds.push_back(VDATA());
+            vCmds.back().push_back("SETRANGE");
+            vCmds.back().push_back(tmpKey);
+            vCmds.back().push_back(toString(pos));
+            vCmds.back().push_back(value.substr(pos, len));
+            pos += len;
+        }
+        if ((pos == value.size()) && !value.empty()) {
+            vCmds.push_back(VDATA());
+            vCmds.back().push_back("RENAME");
+            vCmds.back().push_back(tmpKey);
+            vCmds.back().push_back(key);
+        }
+
+        std::vector<redisReply*> vReplies;
+        bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+        if (!bRet) {
+            const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+            pRedisConn->RedisReConnect();
+            break;
+        }
+        for (size_t i = 0; i < vReplies.size(); ++i) {
+            if (REDIS_REPLY_ERROR == vReplies[i]->type) {
+                const_cast<SliceIndex&>(index).SetErrInfo(vReplies[i]->str, vReplies[i]->len);
+                bRet = false;
+                break;
+            }
+        }
+        FreeReplies(vReplies);
+        vCmds.clear();
+        if (pos == value.size())
+            break;
+    }
+
+    if (!bRet && !value.empty()) {
+        redisReply* reply = static_cast<redisReply*>(redisCommand(pRedisConn->getCtx(), "DEL %b", tmpKey.data(), tmpKey.size()));
+        RedisPool::FreeReply(reply);
+    }
+    pRedisPool->FreeConnection(pRedisConn);
+    return bRet;
+}
+
+bool xRedisBitmap::IsColocated(const DBIArray& vdbi, const SliceIndex* dest) {
+    const SliceIndex& first = (NULL != dest) ? *dest : vdbi[0];
+    for (size_t i = 0; i < vdbi.size(); ++i) {
+        if ((vdbi[i].mNodeIndex != first.mNodeIndex) || (vdbi[i].mSliceIndex != first.mSliceIndex))
+            return false;
+    }
+    return true;
+}
+
+bool xRedisBitmap::Native(xRedisClient* client, BITOP op, const SliceIndex& index, const KEY& destination, const KEYS& keys, bool count, int64_t& value) {
+    if (!count) {
+        VDATA vCmdData;
+        vCmdData.push_back("BITOP");
+        vCmdData.push_back(gBitopNames[op]);
+        vCmdData.push_back(destination);
+        vCmdData.insert(vCmdData.end(), keys.begin(), keys.end());
+        if (!index.mIOFlag)
+            const_cast<SliceIndex&>(index).IOtype(MASTER);
+        return client->commandargv_integer(index, vCmdData, value);
+    }
+
+    // A count needs the combined bitmap only on the server: BITOP into a
+    // scratch key, BITCOUNT it and drop it in one round trip.
+    string tmpKey = keys[0] + ":xredis-tmp:" + toString(getpid()) + ":" + toString(GetMonotonicUs());
+    std::vector<VDATA> vCmds(3);
+    vCmds[0].push_back("BITOP");
+    vCmds[0].push_back(gBitopNames[op]);
+    vCmds[0].push_back(tmpKey);
+    vCmds[0].insert(vCmds[0].end(), keys.begin(), keys.end());
+    vCmds[1].push_back("BITCOUNT");
+    vCmds[1].push_back(tmpKey);
+    vCmds[2].push_back("DEL");
+    vCmds[2].push_back(tmpKey);
+
+    RedisPool* pRedisPool = client->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, MASTER);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+    std::vector<redisReply*> vReplies;
+    bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+    if (!bRet) {
+        const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+        pRedisConn->RedisReConnect();
+    }
+    pRedisPool->FreeConnection(pRedisConn);
+    if (!bRet)
+        return false;
+
+    // A failed BITOP (WRONGTYPE...) leaves no scratch key, so the BITCOUNT
+    // after it would happily count an empty bitmap.
+    const redisReply* reply = vReplies[0];
+    bRet = REDIS_REPLY_ERROR != reply->type;
+    if (bRet) {
+        reply = vReplies[1];
+        bRet = REDIS_REPLY_INTEGER == reply->type;
+    }
+    if (bRet)
+        value = reply->integer;
+    else if (REDIS_REPLY_ERROR == reply->type)
+        const_cast<SliceIndex&>(index).SetErrInfo(reply->str, reply->len);
+    FreeReplies(vReplies);
+    return bRet;
+}
+
+bool xRedisBitmap::bitop(xRedisClient* client, BITOP op, const DBIArray& vdbi, const KEYS& keys, string& result) {
+    result.clear();
+    if ((NULL == client) || keys.empty() || (vdbi.size() != keys.size()) || ((NOT == op) && (1 != keys.size())))
+        return false;
+
+    std::vector<BitmapTask> vTasks(keys.size());
+    std::vector<void*> vArgs;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        vTasks[i].client = client;
+        vTasks[i].index = &vdbi[i];
+        vTasks[i].key = &keys[i];
+        vTasks[i].ok = false;
+        vArgs.push_back(&vTasks[i]);
+    }
+    RunParallel(FetchTask, vArgs, BITMAP_MAX_THREADS);
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        if (!vTasks[i].ok)
+            return false;
+    }
+
+    result.swap(vTasks[0].value);
+    if (NOT == op) {
+        Combine(NOT, (uint8_t*) &result[0], (const uint8_t*) result.data(), result.size());
+        return true;
+    }
+    for (size_t i = 1; i < vTasks.size(); ++i) {
+        const string& value = vTasks[i].value;
+        if (value.size() > result.size())
+            result.resize(value.size(), '\0');
+        if (!value.empty())
+            Combine(op, (uint8_t*) &result[0], (const uint8_t*) value.data(), value.size());
+        if (AND == op)
+            std::fill(result.begin() + value.size(), result.end(), '\0');
+        string().swap(vTasks[i].value);
+    }
+    return true;
+}
+
+bool xRedisBitmap::bitop(xRedisClient* client, BITOP op, const SliceIndex& index, const KEY& destination, const DBIArray& vdbi, const KEYS& keys, int64_t& length) {
+    length = 0;
+    if ((NULL == client) || keys.empty() || (vdbi.size() != keys.size()) || ((NOT == op) && (1 != keys.size())))
+        return false;
+
+    if (IsColocated(vdbi, &index))
+        return Native(client, op, index, destination, keys, false, length);
+
+    string result;
+    if (!bitop(client, op, vdbi, keys, result) || !Store(client, index, destination, result))
+        return false;
+    length = (int64_t) result.size();
+    return true;
+}
+
+bool xRedisBitmap::bitcount(xRedisClient* client, BITOP op, const DBIArray& vdbi, const KEYS& keys, int64_t& count) {
+    count = 0;
+    if ((NULL == client) || keys.empty() || (vdbi.size() != keys.size()) || ((NOT == op) && (1 != keys.size())))
+        return false;
+
+    if ((1 == keys.size()) && (NOT != op)) {
+        VDATA vCmdData;
+        vCmdData.push_back("BITCOUNT");
+        vCmdData.push_back(keys[0]);
+        if (!vdbi[0].mIOFlag)
+            const_cast<SliceIndex&>(vdbi[0]).IOtype(SLAVE);
+        return client->commandargv_integer(vdbi[0], vCmdData, count);
+    }
+    if (IsColocated(vdbi, NULL))
+        return Native(client, op, vdbi[0], KEY(), keys, true, count);
+
+    string result;
+    if (!bitop(client, op, vdbi, keys, result))
+        return false;
+    count = (int64_t) PopCount((const uint8_t*) result.data(), result.size());
+    return true;
+}
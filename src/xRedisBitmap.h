@@ -0,0 +1,62 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_BITMAP_H_
+#define _XREDIS_BITMAP_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    // BITOP and BITCOUNT over keys on any slices. xRedisClient has no bitop
+    // of its own; callers use these directly.
+    //
+    // Keys sharing one slice (with the destination, for bitop) run as native
+    // BITOP/BITCOUNT on the server. Otherwise bitmaps are read in parallel
+    // with pipelined GETRANGE chunks, combined locally, and the result is
+    // written with pipelined SETRANGE into a temporary key renamed over the
+    // destination. Shorter bitmaps count as zero-padded, as in Redis.
+    //
+    // The combine and popcount kernels use AVX-512F, AVX2 or POPCNT when
+    // the CPU has them, chosen once at startup.
+    class xRedisBitmap {
+    public:
+        // Stores op over keys in destination; length is the result size in
+        // bytes. NOT takes exactly one key. An empty result deletes
+        // destination.
+        static bool bitop(xRedisClient* client, BITOP op, const SliceIndex& index, const KEY& destination, const DBIArray& vdbi, const KEYS& keys, int64_t& length);
+
+        // op over keys into result, without writing anything back.
+        static bool bitop(xRedisClient* client, BITOP op, const DBIArray& vdbi, const KEYS& keys, string& result);
+
+        // Set bits in op over keys, e.g. users active on every one of days.
+        static bool bitcount(xRedisClient* client, BITOP op, const DBIArray& vdbi, const KEYS& keys, int64_t& count);
+
+        // Whole string value, GETRANGE chunk by chunk.
+        static bool Fetch(xRedisClient* client, const SliceIndex& index, const KEY& key, string& value);
+
+        // Replaces key with value, SETRANGE chunk by chunk.
+        static bool Store(xRedisClient* client, const SliceIndex& index, const KEY& key, const string& value);
+
+        // dst = dst op src over len bytes; NOT ignores dst.
+        static void Combine(BITOP op, uint8_t* dst, const uint8_t* src, size_t len);
+
+        static uint64_t PopCount(const uint8_t* p, size_t len);
+
+        static const char* GetKernelName();
+
+    private:
+        static bool IsColocated(const DBIArray& vdbi, const SliceIndex* dest);
+
+        static bool Native(xRedisClient* client, BITOP op, const SliceIndex& index, const KEY& destination, const KEYS& keys, bool count, int64_t& value);
+    };
+
+}
+
+#endif
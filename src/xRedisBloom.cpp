@@ -0,0 +1,409 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include "xRedisBloom.h"
+#include "xRedisHash.h"
+
+using namespace xrcp;
+
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_MAX_HASHES 16
+#define BLOOM_DEFAULT_KEYS 1000000
+#define BLOOM_DEFAULT_FP 0.01
+#define BLOOM_DEFAULT_SCAN_COUNT 1000
+#define BLOOM_POLL_MS 100
+
+xRedisBloomFilter::xRedisBloomFilter() {
+    mBlocks = NULL;
+    mBlockCount = 0;
+    mHashCount = 0;
+}
+
+xRedisBloomFilter::~xRedisBloomFilter() {
+    free(mBlocks);
+}
+
+bool xRedisBloomFilter::Init(uint64_t expectedKeys, double fpRate) {
+    if ((0 == expectedKeys) || (fpRate <= 0) || (fpRate >= 1))
+        return false;
+
+    // Optimal bits per key of a standard filter, plus about 10% per decade
+    // below 10% to make up for the skew between blocks.
+    double bitsPerKey = -log(fpRate) / (M_LN2 * M_LN2);
+    double decades = -log10(fpRate) - 1;
+    if (decades > 0)
+        bitsPerKey *= 1.0 + 0.1 * decades;
+    uint32_t hashCount = (uint32_t) (bitsPerKey * M_LN2 + 0.5);
+    if (hashCount < 1)
+        hashCount = 1;
+    if (hashCount > BLOOM_MAX_HASHES)
+        hashCount = BLOOM_MAX_HASHES;
+
+    uint64_t blockCount = (uint64_t) ((double) expectedKeys * bitsPerKey / BLOOM_BLOCK_BITS) + 1;
+    if (blockCount > 0xFFFFFFFFULL)
+        return false;
+
+    void* blocks = NULL;
+    if (0 != posix_memalign(&blocks, 64, blockCount * 64))
+        return false;
+    memset(blocks, 0, blockCount * 64);
+
+    free(mBlocks);
+    mBlocks = static_cast<uint64_t*>(blocks);
+    mBlockCount = blockCount;
+    mHashCount = hashCount;
+    return true;
+}
+
+void xRedisBloomFilter::MakeMask(uint64_t hash, uint64_t mask[8]) const {
+    // The high half picks the block; bit positions come from the low half
+    // and a remix of the whole hash.
+    uint32_t h1 = (uint32_t) hash;
+    uint32_t h2 = (uint32_t) ((hash * 0x9E3779B97F4A7C15ULL) >> 32) | 1;
+    for (uint32_t w = 0; w < 8; ++w) {
+        mask[w] = 0;
+    }
+    for (uint32_t i = 0; i < mHashCount; ++i) {
+        uint32_t bit = (h1 + i * h2) & (BLOOM_BLOCK_BITS - 1);
+        mask[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+void xRedisBloomFilter::Add(uint64_t hash) {
+    if (NULL == mBlocks)
+        return;
+
+    uint64_t mask[8];
+    MakeMask(hash, mask);
+    uint64_t* block = mBlocks + ((hash >> 32) * mBlockCount >> 32) * 8;
+    for (uint32_t w = 0; w < 8; ++w) {
+        if (0 != mask[w])
+            __atomic_or_fetch(&block[w], mask[w], __ATOMIC_RELAXED);
+    }
+}
+
+bool xRedisBloomFilter::Test(uint64_t hash) const {
+    if (NULL == mBlocks)
+        return true;
+
+    uint64_t mask[8];
+    MakeMask(hash, mask);
+    const uint64_t* block = mBlocks + ((hash >> 32) * mBlockCount >> 32) * 8;
+    uint64_t missing = 0;
+    for (uint32_t w = 0; w < 8; ++w) {
+        missing |= mask[w] & ~__atomic_load_n(&block[w], __ATOMIC_RELAXED);
+    }
+    return 0 == missing;
+}
+
+size_t xRedisBloomFilter::GetMemorySize() const {
+    return (size_t) mBlockCount * 64;
+}
+
+xRedisBloom::xRedisBloom() {
+    mClient = NULL;
+    mOption.nodeIndex = 0;
+    mOption.fun = NULL;
+    mOption.expectedKeys = 0;
+    mOption.fpRate = 0;
+    mOption.rebuildIntervalMs = 0;
+    mOption.scanCount = 0;
+    mOption.keysPerSec = 0;
+    mOption.threads = 0;
+    mThreadStarted = false;
+    mStop = false;
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+xRedisBloom::~xRedisBloom() {
+    Release();
+}
+
+bool xRedisBloom::Init(xRedisClient* client, const BloomOption& option) {
+    if ((NULL == client) || (NULL != mClient) || (NULL == option.fun))
+        return false;
+
+    uint32_t sliceCount = client->GetRedisPool()->GetSliceCount(option.nodeIndex);
+    if ((0 == sliceCount) || (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return false;
+
+    mOption = option;
+    if (0 == mOption.expectedKeys)
+        mOption.expectedKeys = BLOOM_DEFAULT_KEYS;
+    if ((mOption.fpRate <= 0) || (mOption.fpRate >= 1))
+        mOption.fpRate = BLOOM_DEFAULT_FP;
+    if (0 == mOption.scanCount)
+        mOption.scanCount = BLOOM_DEFAULT_SCAN_COUNT;
+    if (0 == mOption.threads)
+        mOption.threads = 1;
+    mBudget.Init(mOption.keysPerSec, mOption.keysPerSec);
+
+    for (uint32_t i = 0; i < sliceCount; ++i) {
+        BloomSlice* slice = new BloomSlice;
+        slice->bloom = this;
+        slice->sliceIndex = i;
+        pthread_rwlock_init(&slice->lock, NULL);
+        slice->live = NULL;
+        slice->building = NULL;
+        slice->ok = false;
+        mSlices.push_back(slice);
+    }
+    mClient = client;
+    xRedisWriteObserver::Add(OnWrite, this);
+
+    mStop = false;
+    if (mOption.rebuildIntervalMs > 0)
+        mThreadStarted = 0 == pthread_create(&mThread, NULL, RebuildWorker, this);
+    return true;
+}
+
+void xRedisBloom::Release() {
+    // Waits out a callback in progress before the slices go.
+    if (NULL != mClient)
+        xRedisWriteObserver::Remove(OnWrite, this);
+
+    mStop = true;
+    if (mThreadStarted)
+        pthread_join(mThread, NULL);
+    mThreadStarted = false;
+
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        BloomSlice* slice = mSlices[i];
+        delete slice->live;
+        delete slice->building;
+        pthread_rwlock_destroy(&slice->lock);
+        delete slice;
+    }
+    mSlices.clear();
+    mClient = NULL;
+}
+
+void* xRedisBloom::RebuildWorker(void* arg) {
+    xRedisBloom* bloom = static_cast<xRedisBloom*>(arg);
+    while (!bloom->mStop) {
+        bloom->Rebuild();
+        for (uint32_t waitMs = 0; (waitMs < bloom->mOption.rebuildIntervalMs) && !bloom->mStop; waitMs += BLOOM_POLL_MS) {
+            usleep(BLOOM_POLL_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+void xRedisBloom::RebuildTask(void* arg) {
+    BloomSlice* slice = static_cast<BloomSlice*>(arg);
+    slice->ok = slice->bloom->RebuildSlice(slice);
+}
+
+bool xRedisBloom::Rebuild() {
+    if (NULL == mClient)
+        return false;
+
+    // A SCAN cursor is sequential; overlap comes from scanning slices in
+    // parallel.
+    std::vector<void*> vArgs;
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        vArgs.push_back(mSlices[i]);
+    }
+    RunParallel(RebuildTask, vArgs, mOption.threads);
+
+    bool bRet = true;
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        bRet = bRet && mSlices[i]->ok;
+    }
+    return bRet;
+}
+
+bool xRedisBloom::RebuildSlice(BloomSlice* slice) {
+    XLOCK(slice->rebuildLock);
+
+    // Size for what the slice holds now, with room to grow until the next
+    // rebuild.
+    uint64_t expectedKeys = mOption.expectedKeys;
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(mOption.nodeIndex, slice->sliceIndex, SLAVE);
+    if (NULL != pRedisConn) {
+        redisReply* reply = static_cast<redisReply*>(redisCommand(pRedisConn->getCtx(), "DBSIZE"));
+        if ((NULL != reply) && (REDIS_REPLY_INTEGER == reply->type) && (reply->integer > 0)) {
+            uint64_t keys = (uint64_t) reply->integer;
+            if (keys + keys / 4 > expectedKeys)
+                expectedKeys = keys + keys / 4;
+        }
+        RedisPool::FreeReply(reply);
+        pRedisPool->FreeConnection(pRedisConn);
+    }
+
+    xRedisBloomFilter* filter = new xRedisBloomFilter;
+    if (!filter->Init(expectedKeys, mOption.fpRate)) {
+        delete filter;
+        __sync_fetch_and_add(&mStats.rebuildErrors, 1);
+        return false;
+    }
+
+    // From here on, writes through this client also land in the new
+    // filter; those that finished earlier are seen by SCAN.
+    pthread_rwlock_wrlock(&slice->lock);
+    slice->building = filter;
+    pthread_rwlock_unlock(&slice->lock);
+
+    bool bRet = ScanSlice(slice, filter);
+
+    pthread_rwlock_wrlock(&slice->lock);
+    slice->building = NULL;
+    if (bRet) {
+        std::swap(slice->live, filter);
+    }
+    pthread_rwlock_unlock(&slice->lock);
+    delete filter;
+
+    __sync_fetch_and_add(bRet ? &mStats.rebuilds : &mStats.rebuildErrors, 1);
+    return bRet;
+}
+
+bool xRedisBloom::ScanSlice(BloomSlice* slice, xRedisBloomFilter* filter) {
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    int64_t cursor = 0;
+    while (!mStop) {
+        VDATA vCmdData;
+        vCmdData.push_back("SCAN");
+        vCmdData.push_back(toString(cursor));
+        vCmdData.push_back("COUNT");
+        vCmdData.push_back(toString(mOption.scanCount));
+
+        // The master: a lagging replica could miss a key whose write
+        // finished before the filter was installed.
+        RedisConn* pRedisConn = pRedisPool->GetConnection(mOption.nodeIndex, slice->sliceIndex, MASTER);
+        if (NULL == pRedisConn)
+            return false;
+        redisReply* reply = RedisCommandArgv(pRedisConn, vCmdData);
+        pRedisPool->FreeConnection(pRedisConn);
+
+        if ((NULL == reply) || (REDIS_REPLY_ARRAY != reply->type) || (2 != reply->elements) || (REDIS_REPLY_ARRAY != reply->element[1]->type)) {
+            RedisPool::FreeReply(reply);
+            return false;
+        }
+
+        cursor = atoll(reply->element[0]->str);
+        const redisReply* keys = reply->element[1];
+        for (size_t i = 0; i < keys->elements; ++i) {
+            filter->Add(xRedisHash::XXH64(keys->element[i]->str, keys->element[i]->len));
+        }
+        mBudget.Acquire(keys->elements);
+        RedisPool::FreeReply(reply);
+        if (0 == cursor)
+            return true;
+    }
+    return false;
+}
+
+xRedisBloom::BloomSlice* xRedisBloom::Locate(const string& key, SliceIndex& index) {
+    if ((NULL == mClient) || key.empty() || !index.Create(key.c_str(), mOption.fun) || (index.mSliceIndex >= mSlices.size()))
+        return NULL;
+    return mSlices[index.mSliceIndex];
+}
+
+bool xRedisBloom::TestSlice(BloomSlice* slice, const string& key) {
+    uint64_t hash = xRedisHash::XXH64(key.data(), key.size());
+    pthread_rwlock_rdlock(&slice->lock);
+    bool bRet = (NULL == slice->live) || slice->live->Test(hash);
+    pthread_rwlock_unlock(&slice->lock);
+    return bRet;
+}
+
+bool xRedisBloom::MayExist(const string& key) {
+    SliceIndex index(mClient, mOption.nodeIndex);
+    BloomSlice* slice = Locate(key, index);
+    return (NULL == slice) || TestSlice(slice, key);
+}
+
+void xRedisBloom::Add(const string& key) {
+    SliceIndex index(mClient, mOption.nodeIndex);
+    BloomSlice* slice = Locate(key, index);
+    if (NULL == slice)
+        return;
+
+    AddSlice(slice, xRedisHash::XXH64(key.data(), key.size()));
+}
+
+void xRedisBloom::AddSlice(BloomSlice* slice, uint64_t hash) {
+    pthread_rwlock_rdlock(&slice->lock);
+    if (NULL != slice->live)
+        slice->live->Add(hash);
+    if (NULL != slice->building)
+        slice->building->Add(hash);
+    pthread_rwlock_unlock(&slice->lock);
+}
+
+void xRedisBloom::OnWrite(uint32_t nodeIndex, uint32_t sliceIndex, const char* key, size_t len, void* privdata) {
+    xRedisBloom* bloom = static_cast<xRedisBloom*>(privdata);
+    if ((nodeIndex != bloom->mOption.nodeIndex) || (sliceIndex >= bloom->mSlices.size()))
+        return;
+    AddSlice(bloom->mSlices[sliceIndex], xRedisHash::XXH64(key, len));
+}
+
+bool xRedisBloom::get(const string& key, string& value) {
+    SliceIndex index(mClient, mOption.nodeIndex);
+    BloomSlice* slice = Locate(key, index);
+    if (NULL == slice)
+        return false;
+    if (!TestSlice(slice, key)) {
+        __sync_fetch_and_add(&mStats.absent, 1);
+        return false;
+    }
+
+    __sync_fetch_and_add(&mStats.passed, 1);
+    bool bRet = mClient->get(index, key, value);
+    if (!bRet && index.mStrerr.empty())
+        __sync_fetch_and_add(&mStats.falsePositives, 1);
+    return bRet;
+}
+
+bool xRedisBloom::exists(const string& key) {
+    SliceIndex index(mClient, mOption.nodeIndex);
+    BloomSlice* slice = Locate(key, index);
+    if (NULL == slice)
+        return false;
+    if (!TestSlice(slice, key)) {
+        __sync_fetch_and_add(&mStats.absent, 1);
+        return false;
+    }
+
+    __sync_fetch_and_add(&mStats.passed, 1);
+    bool bRet = mClient->exists(index, key);
+    if (!bRet && index.mStrerr.empty())
+        __sync_fetch_and_add(&mStats.falsePositives, 1);
+    return bRet;
+}
+
+bool xRedisBloom::set(const string& key, const string& value, int32_t second) {
+    SliceIndex index(mClient, mOption.nodeIndex);
+    if (NULL == Locate(key, index))
+        return false;
+
+    // Before the write so readers racing it already pass; the write
+    // observer adds it again afterwards for a filter whose SCAN may have
+    // passed the key already.
+    Add(key);
+    return (second > 0) ? mClient->set(index, key, value.c_str(), (int32_t) value.size(), second)
+                        : mClient->set(index, key, value);
+}
+
+void xRedisBloom::GetStats(BloomStats& stats) {
+    stats.absent = __atomic_load_n(&mStats.absent, __ATOMIC_RELAXED);
+    stats.passed = __atomic_load_n(&mStats.passed, __ATOMIC_RELAXED);
+    stats.falsePositives = __atomic_load_n(&mStats.falsePositives, __ATOMIC_RELAXED);
+    stats.rebuilds = __atomic_load_n(&mStats.rebuilds, __ATOMIC_RELAXED);
+    stats.rebuildErrors = __atomic_load_n(&mStats.rebuildErrors, __ATOMIC_RELAXED);
+    stats.memory = 0;
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        pthread_rwlock_rdlock(&mSlices[i]->lock);
+        if (NULL != mSlices[i]->live)
+            stats.memory += mSlices[i]->live->GetMemorySize();
+        pthread_rwlock_unlock(&mSlices[i]->lock);
+    }
+}
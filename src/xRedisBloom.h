@@ -0,0 +1,143 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_BLOOM_H_
+#define _XREDIS_BLOOM_H_
+
+#include <pthread.h>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+#include "xRedisUtil.h"
+
+namespace xrcp {
+
+    // Blocked Bloom filter: all k bits of a key fall in one 512-bit block,
+    // so a test touches a single cache line and checks eight words with no
+    // branches. Adds are atomic ORs and may run alongside tests.
+    class xRedisBloomFilter {
+    public:
+        xRedisBloomFilter();
+
+        ~xRedisBloomFilter();
+
+        bool Init(uint64_t expectedKeys, double fpRate);
+
+        void Add(uint64_t hash);
+
+        bool Test(uint64_t hash) const;
+
+        size_t GetMemorySize() const;
+
+    private:
+        void MakeMask(uint64_t hash, uint64_t mask[8]) const;
+
+    private:
+        uint64_t* mBlocks;      // mBlockCount * 8 words, 64-byte aligned
+        uint64_t mBlockCount;
+        uint32_t mHashCount;
+    };
+
+    typedef struct _BLOOM_OPTION_ {
+        uint32_t nodeIndex;
+        HASHFUN fun;
+        uint64_t expectedKeys;      // per slice; grown to 1.25 x DBSIZE at rebuild
+        double fpRate;              // target false positive rate, 0.01 by default
+        uint32_t rebuildIntervalMs; // 0 rebuilds only on Rebuild()
+        uint32_t scanCount;         // SCAN COUNT hint
+        uint64_t keysPerSec;        // rebuild budget across all slices, 0 for no limit
+        uint32_t threads;           // slices rebuilt at once
+    } BloomOption;
+
+    typedef struct _BLOOM_STATS_ {
+        uint64_t absent;            // reads answered locally as missing
+        uint64_t passed;            // reads sent to Redis
+        uint64_t falsePositives;    // reads sent to Redis that found nothing
+        uint64_t rebuilds;
+        uint64_t rebuildErrors;
+        uint64_t memory;
+    } BloomStats;
+
+    // Negative cache for get/exists: a per-slice Bloom filter of the keys
+    // that exist, rebuilt periodically from SCAN under a key rate budget.
+    // A slice answers nothing until its first rebuild has finished.
+    //
+    // Every key a write in this process may have created is never reported
+    // absent: xRedisBloom watches xRedisWriteObserver, so SET, HSET, SADD,
+    // LPUSH, INCR, MSET, RESTORE, RENAME... through any xRedisClient or
+    // module on the node are added to the live filter and to one being
+    // rebuilt, once their reply is in. Keys written by other processes are
+    // only known after the next rebuild; Add() announces them earlier.
+    // Writes to another cluster with the same node index only cost false
+    // positives.
+    class xRedisBloom {
+    public:
+        xRedisBloom();
+
+        ~xRedisBloom();
+
+        bool Init(xRedisClient* client, const BloomOption& option);
+
+        void Release();
+
+        // Rebuilds every slice now, in parallel.
+        bool Rebuild();
+
+        // false only when key definitely does not exist.
+        bool MayExist(const string& key);
+
+        void Add(const string& key);
+
+        bool get(const string& key, string& value);
+
+        bool exists(const string& key);
+
+        bool set(const string& key, const string& value, int32_t second = 0);
+
+        void GetStats(BloomStats& stats);
+
+    private:
+        typedef struct _BLOOM_SLICE_ {
+            xRedisBloom* bloom;
+            uint32_t sliceIndex;
+            pthread_rwlock_t lock;
+            xRedisBloomFilter* live;        // NULL until the first rebuild
+            xRedisBloomFilter* building;
+            xLock rebuildLock;
+            bool ok;
+        } BloomSlice;
+
+        static void RebuildTask(void* arg);
+
+        static void* RebuildWorker(void* arg);
+
+        bool RebuildSlice(BloomSlice* slice);
+
+        bool ScanSlice(BloomSlice* slice, xRedisBloomFilter* filter);
+
+        BloomSlice* Locate(const string& key, SliceIndex& index);
+
+        static void OnWrite(uint32_t nodeIndex, uint32_t sliceIndex, const char* key, size_t len, void* privdata);
+
+        static void AddSlice(BloomSlice* slice, uint64_t hash);
+
+        bool TestSlice(BloomSlice* slice, const string& key);
+
+    private:
+        xRedisClient* mClient;
+        BloomOption mOption;
+        std::vector<BloomSlice*> mSlices;
+        xRedisTokenBucket mBudget;
+        pthread_t mThread;
+        bool mThreadStarted;
+        volatile bool mStop;
+        BloomStats mStats;
+    };
+
+}
+
+#endif
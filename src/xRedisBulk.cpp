@@ -0,0 +1,241 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisBulk.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define BULK_DEFAULT_BATCH_SIZE 1000
+#define BULK_DEFAULT_WINDOW 16
+#define BULK_DEFAULT_MAX_THREADS 16
+#define BULK_QUEUE_WINDOWS 4    // queued commands per thread, in windows
+
+xRedisBulk::xRedisBulk() {
+    mClient = NULL;
+    mOption.nodeIndex = 0;
+    mOption.fun = NULL;
+    mOption.batchSize = 0;
+    mOption.window = 0;
+    mOption.threads = 0;
+    mOption.progress = NULL;
+    mOption.privdata = NULL;
+    mResult.members = 0;
+    mResult.commands = 0;
+    mResult.applied = 0;
+    mResult.failedMembers = 0;
+}
+
+xRedisBulk::~xRedisBulk() {
+    Release();
+}
+
+bool xRedisBulk::Init(xRedisClient* client, const BulkOption& option) {
+    if ((NULL == client) || (NULL != mClient) || (NULL == option.fun))
+        return false;
+
+    uint32_t sliceCount = client->GetRedisPool()->GetSliceCount(option.nodeIndex);
+    if ((0 == sliceCount) || (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return false;
+
+    mOption = option;
+    if (0 == mOption.batchSize)
+        mOption.batchSize = BULK_DEFAULT_BATCH_SIZE;
+    if (0 == mOption.window)
+        mOption.window = BULK_DEFAULT_WINDOW;
+    if (0 == mOption.threads)
+        mOption.threads = std::min(sliceCount, (uint32_t) BULK_DEFAULT_MAX_THREADS);
+    mOption.threads = std::min(mOption.threads, sliceCount);
+    mClient = client;
+
+    for (uint32_t i = 0; i < mOption.threads; ++i) {
+        BulkWorker* worker = new BulkWorker;
+        worker->bulk = this;
+        pthread_mutex_init(&worker->mutex, NULL);
+        pthread_cond_init(&worker->notEmpty, NULL);
+        pthread_cond_init(&worker->notFull, NULL);
+        worker->closing = false;
+        if (0 != pthread_create(&worker->thread, NULL, WorkerMain, worker)) {
+            pthread_cond_destroy(&worker->notFull);
+            pthread_cond_destroy(&worker->notEmpty);
+            pthread_mutex_destroy(&worker->mutex);
+            delete worker;
+            Release();
+            return false;
+        }
+        mWorkers.push_back(worker);
+    }
+    return true;
+}
+
+bool xRedisBulk::Finish(BulkResult& result) {
+    if (NULL == mClient)
+        return false;
+
+    Release();
+    XLOCK(mResultLock);
+    result = mResult;
+    mResult.members = 0;
+    mResult.commands = 0;
+    mResult.applied = 0;
+    mResult.failedMembers = 0;
+    mResult.failures.clear();
+    return result.failures.empty();
+}
+
+void xRedisBulk::Release() {
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+        BulkWorker* worker = mWorkers[i];
+        pthread_mutex_lock(&worker->mutex);
+        worker->closing = true;
+        pthread_cond_broadcast(&worker->notEmpty);
+        pthread_cond_broadcast(&worker->notFull);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+        BulkWorker* worker = mWorkers[i];
+        pthread_join(worker->thread, NULL);
+        pthread_cond_destroy(&worker->notFull);
+        pthread_cond_destroy(&worker->notEmpty);
+        pthread_mutex_destroy(&worker->mutex);
+        delete worker;
+    }
+    mWorkers.clear();
+    mClient = NULL;
+}
+
+bool xRedisBulk::Flush(VDATA& vCmdData, const KEY& key, uint64_t& offset, uint32_t width, bool last) {
+    if (vCmdData.size() <= 2)
+        return true;
+    uint32_t members = (uint32_t) ((vCmdData.size() - 2) / width);
+    if (!last && (members < mOption.batchSize))
+        return true;
+
+    SliceIndex index(mClient, mOption.nodeIndex);
+    if ((NULL == mClient) || mWorkers.empty() || !index.Create(key.c_str(), mOption.fun))
+        return false;
+
+    BulkWorker* worker = mWorkers[index.mSliceIndex % mWorkers.size()];
+    size_t maxQueued = (size_t) mOption.window * BULK_QUEUE_WINDOWS;
+    pthread_mutex_lock(&worker->mutex);
+    while ((worker->queue.size() >= maxQueued) && !worker->closing) {
+        pthread_cond_wait(&worker->notFull, &worker->mutex);
+    }
+    bool bRet = !worker->closing;
+    if (bRet) {
+        BulkChunk* chunk = new BulkChunk;
+        chunk->sliceIndex = index.mSliceIndex;
+        chunk->offset = offset;
+        chunk->members = members;
+        chunk->cmd.swap(vCmdData);
+        worker->queue.push_back(chunk);
+        pthread_cond_signal(&worker->notEmpty);
+        offset += members;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    return bRet;
+}
+
+void* xRedisBulk::WorkerMain(void* arg) {
+    BulkWorker* worker = static_cast<BulkWorker*>(arg);
+    xRedisBulk* bulk = worker->bulk;
+    for (;;) {
+        std::vector<BulkChunk*> vChunks;
+        pthread_mutex_lock(&worker->mutex);
+        while (worker->queue.empty() && !worker->closing) {
+            pthread_cond_wait(&worker->notEmpty, &worker->mutex);
+        }
+        if (worker->queue.empty()) {
+            pthread_mutex_unlock(&worker->mutex);
+            break;
+        }
+
+        // One window per round trip, all on the front command's slice.
+        uint32_t sliceIndex = worker->queue.front()->sliceIndex;
+        while (!worker->queue.empty() && (vChunks.size() < bulk->mOption.window) && (worker->queue.front()->sliceIndex == sliceIndex)) {
+            vChunks.push_back(worker->queue.front());
+            worker->queue.pop_front();
+        }
+        pthread_cond_broadcast(&worker->notFull);
+        pthread_mutex_unlock(&worker->mutex);
+
+        bulk->Send(sliceIndex, vChunks);
+        for (size_t i = 0; i < vChunks.size(); ++i) {
+            delete vChunks[i];
+        }
+    }
+    return NULL;
+}
+
+// RPUSH/LPUSH reply with the list length, not with what they added.
+static bool IsPush(const string& cmd) {
+    return (0 == strcasecmp(cmd.c_str(), "RPUSH")) || (0 == strcasecmp(cmd.c_str(), "LPUSH"));
+}
+
+void xRedisBulk::Send(uint32_t sliceIndex, std::vector<BulkChunk*>& vChunks) {
+    uint64_t members = 0;
+    uint64_t applied = 0;
+    for (size_t i = 0; i < vChunks.size(); ++i) {
+        members += vChunks[i]->members;
+    }
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(mOption.nodeIndex, sliceIndex, MASTER);
+    if (NULL == pRedisConn) {
+        for (size_t i = 0; i < vChunks.size(); ++i) {
+            Fail(vChunks[i], GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        }
+    } else {
+        std::vector<VDATA> vCmds(vChunks.size());
+        for (size_t i = 0; i < vChunks.size(); ++i) {
+            vCmds[i].swap(vChunks[i]->cmd);
+        }
+        std::vector<redisReply*> vReplies;
+        bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+        for (size_t i = 0; i < vChunks.size(); ++i) {
+            vChunks[i]->cmd.swap(vCmds[i]);
+        }
+
+        if (!bRet) {
+            pRedisConn->RedisReConnect();
+            for (size_t i = 0; i < vChunks.size(); ++i) {
+                Fail(vChunks[i], CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+            }
+        } else {
+            for (size_t i = 0; i < vReplies.size(); ++i) {
+                if (REDIS_REPLY_ERROR == vReplies[i]->type)
+                    Fail(vChunks[i], vReplies[i]->str, vReplies[i]->len);
+                else if ((REDIS_REPLY_INTEGER == vReplies[i]->type) && !IsPush(vChunks[i]->cmd[0]))
+                    applied += (uint64_t) vReplies[i]->integer;
+                else
+                    applied += vChunks[i]->members;
+            }
+            FreeReplies(vReplies);
+        }
+        pRedisPool->FreeConnection(pRedisConn);
+    }
+
+    XLOCK(mResultLock);
+    mResult.members += members;
+    mResult.commands += vChunks.size();
+    mResult.applied += applied;
+    if (NULL != mOption.progress)
+        mOption.progress(mResult.members, mResult.commands, mOption.privdata);
+}
+
+void xRedisBulk::Fail(const BulkChunk* chunk, const char* error, size_t len) {
+    BulkFailure failure;
+    failure.key = chunk->cmd[1];
+    failure.offset = chunk->offset;
+    failure.members = chunk->members;
+    failure.error.assign(error, len);
+
+    XLOCK(mResultLock);
+    mResult.failedMembers += chunk->members;
+    mResult.failures.push_back(failure);
+}
@@ -0,0 +1,189 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_BULK_H_
+#define _XREDIS_BULK_H_
+
+#include <pthread.h>
+#include <deque>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+#include "xRedisResp3.h"
+
+namespace xrcp {
+
+    // Called from a loader thread, never from two threads at once.
+    typedef void (*BULKPROGRESSFUN)(uint64_t members, uint64_t commands, void* privdata);
+
+    typedef struct _BULK_OPTION_ {
+        uint32_t nodeIndex;
+        HASHFUN fun;
+        uint32_t batchSize;         // members per command, 1000 by default
+        uint32_t window;            // commands in flight per connection, 16 by default
+        uint32_t threads;           // loader threads, slices are spread over them
+        BULKPROGRESSFUN progress;
+        void* privdata;
+    } BulkOption;
+
+    typedef struct _BULK_FAILURE_ {
+        KEY key;
+        uint64_t offset;            // position of the first member of the command
+        uint32_t members;
+        string error;
+    } BulkFailure;
+
+    typedef struct _BULK_RESULT_ {
+        uint64_t members;           // members sent
+        uint64_t commands;
+        uint64_t applied;           // sum of integer replies; HMSET and list pushes count their members
+        uint64_t failedMembers;
+        std::vector<BulkFailure> failures;
+    } BulkResult;
+
+    // Streams large collections into Redis without building one command per
+    // key. Members are cut into batchSize commands and queued to the loader
+    // thread owning the key's slice, which pipelines up to window commands
+    // at a time on one master connection. Queues are bounded, so the caller
+    // blocks instead of buffering the whole input.
+    //
+    // Commands for one key stay in order, so chunked RPUSH/LPUSH build the
+    // same list as a single command would. A failed command is reported in
+    // BulkResult and not retried; the rest of the load carries on.
+    //
+    //     xRedisBulk bulk;
+    //     bulk.Init(&client, option);
+    //     bulk.sadd("ids", ids.begin(), ids.end());
+    //     bulk.Finish(result);
+    class xRedisBulk {
+    public:
+        xRedisBulk();
+
+        ~xRedisBulk();
+
+        bool Init(xRedisClient* client, const BulkOption& option);
+
+        // Waits for every queued command and stops the loader threads.
+        bool Finish(BulkResult& result);
+
+        // *first is a string.
+        template <class Iter>
+        bool sadd(const KEY& key, Iter first, Iter last) {
+            VDATA vCmdData;
+            uint64_t offset = 0;
+            for (; first != last; ++first) {
+                Begin(vCmdData, "SADD", key);
+                vCmdData.push_back(*first);
+                if (!Flush(vCmdData, key, offset, 1, false))
+                    return false;
+            }
+            return Flush(vCmdData, key, offset, 1, true);
+        }
+
+        // *first is a pair of member and score.
+        template <class Iter>
+        bool zadd(const KEY& key, Iter first, Iter last) {
+            VDATA vCmdData;
+            uint64_t offset = 0;
+            for (; first != last; ++first) {
+                Begin(vCmdData, "ZADD", key);
+                vCmdData.push_back(xRedisNative::FormatDouble(first->second));
+                vCmdData.push_back(first->first);
+                if (!Flush(vCmdData, key, offset, 2, false))
+                    return false;
+            }
+            return Flush(vCmdData, key, offset, 2, true);
+        }
+
+        template <class Iter>
+        bool rpush(const KEY& key, Iter first, Iter last) {
+            VDATA vCmdData;
+            uint64_t offset = 0;
+            for (; first != last; ++first) {
+                Begin(vCmdData, "RPUSH", key);
+                vCmdData.push_back(*first);
+                if (!Flush(vCmdData, key, offset, 1, false))
+                    return false;
+            }
+            return Flush(vCmdData, key, offset, 1, true);
+        }
+
+        template <class Iter>
+        bool lpush(const KEY& key, Iter first, Iter last) {
+            VDATA vCmdData;
+            uint64_t offset = 0;
+            for (; first != last; ++first) {
+                Begin(vCmdData, "LPUSH", key);
+                vCmdData.push_back(*first);
+                if (!Flush(vCmdData, key, offset, 1, false))
+                    return false;
+            }
+            return Flush(vCmdData, key, offset, 1, true);
+        }
+
+        // *first is a pair of field and value.
+        template <class Iter>
+        bool hmset(const KEY& key, Iter first, Iter last) {
+            VDATA vCmdData;
+            uint64_t offset = 0;
+            for (; first != last; ++first) {
+                Begin(vCmdData, "HMSET", key);
+                vCmdData.push_back(first->first);
+                vCmdData.push_back(first->second);
+                if (!Flush(vCmdData, key, offset, 2, false))
+                    return false;
+            }
+            return Flush(vCmdData, key, offset, 2, true);
+        }
+
+    private:
+        typedef struct _BULK_CHUNK_ {
+            uint32_t sliceIndex;
+            uint64_t offset;
+            uint32_t members;
+            VDATA cmd;
+        } BulkChunk;
+
+        typedef struct _BULK_WORKER_ {
+            xRedisBulk* bulk;
+            pthread_t thread;
+            pthread_mutex_t mutex;
+            pthread_cond_t notEmpty;
+            pthread_cond_t notFull;
+            std::deque<BulkChunk*> queue;
+            bool closing;
+        } BulkWorker;
+
+        static void Begin(VDATA& vCmdData, const char* cmd, const KEY& key) {
+            if (vCmdData.empty()) {
+                vCmdData.push_back(cmd);
+                vCmdData.push_back(key);
+            }
+        }
+
+        // Queues vCmdData once it holds batchSize members, or always when last.
+        bool Flush(VDATA& vCmdData, const KEY& key, uint64_t& offset, uint32_t width, bool last);
+
+        static void* WorkerMain(void* arg);
+
+        void Send(uint32_t sliceIndex, std::vector<BulkChunk*>& vChunks);
+
+        void Fail(const BulkChunk* chunk, const char* error, size_t len);
+
+        void Release();
+
+    private:
+        xRedisClient* mClient;
+        BulkOption mOption;
+        std::vector<BulkWorker*> mWorkers;
+        xLock mResultLock;
+        BulkResult mResult;
+    };
+
+}
+
+#endif
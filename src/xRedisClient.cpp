@@ -8,6 +8,9 @@
 
 #include <redis/xredis/xRedisClient.h>
 #include <redis/xredis/xRedisPool.h>
+#include "xRedisResp3.h"
+#include "xRedisRoute.h"
+#include "xRedisUtil.h"
 
 using namespace xrcp;
 
@@ -23,21 +26,11 @@ SliceIndex::~SliceIndex() {
 }
 
 bool SliceIndex::Create(const char* key, xrcp::HASHFUN fun) {
-    uint32_t sliceCount = mClient->GetRedisPool()->GetSliceCount(mNodeIndex);
-    if ((NULL != fun) && (sliceCount > 0)) {
-        mSliceIndex = fun(key) % sliceCount;
-        return true;
-    }
-    return false;
+    return xRedisRoute::Locate(mClient->GetRedisPool(), mNodeIndex, key, fun, mSliceIndex);
 }
 
 bool SliceIndex::CreateByID(int64_t id) {
-    uint32_t sliceCount = mClient->GetRedisPool()->GetSliceCount(mNodeIndex);
-    if (sliceCount > 0) {
-        mSliceIndex = (uint32_t) (id % sliceCount);
-        return true;
-    }
-    return false;
+    return xRedisRoute::LocateByID(mClient->GetRedisPool(), mNodeIndex, id, mSliceIndex);
 }
 
 uint32_t SliceIndex::GetSliceIndex() {
@@ -91,7 +84,7 @@ void xRedisClient::Keepalive() {
         mRedisPool->Keepalive();
 }
 
-inline RedisPool* xRedisClient::GetRedisPool() {
+RedisPool* xRedisClient::GetRedisPool() {
     return mRedisPool;
 }
 
@@ -148,13 +141,21 @@ void xRedisClient::SetErrMessage(const SliceIndex& index, const char* fmt, ...)
     SetErrString(index, szBuf, ::strlen(szBuf));
 }
 
+static redisReply* SendCommand(RedisConn* pRedisConn, const char* cmd, ...) {
+    va_list args;
+    va_start(args, cmd);
+    redisReply* reply = RedisvCommand(pRedisConn, cmd, args);
+    va_end(args);
+    return reply;
+}
+
 rReply* xRedisClient::command(const SliceIndex& index, const char* cmd) {
     RedisConn* pRedisConn = mRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, index.mIOtype);
     if (NULL == pRedisConn) {
         SetErrString(index, GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
         return NULL;
     }
-    rReply* reply = static_cast<rReply*>(redisCommand(pRedisConn->getCtx(), cmd));
+    rReply* reply = SendCommand(pRedisConn, cmd);
 
     mRedisPool->FreeConnection(pRedisConn);
     return reply;
@@ -170,7 +171,7 @@ bool xRedisClient::command_bool(const SliceIndex& index, const char* cmd, ...) {
 
     va_list args;
     va_start(args, cmd);
-    redisReply* reply = static_cast<redisReply*>(redisvCommand(pRedisConn->getCtx(), cmd, args));
+    redisReply* reply = RedisvCommand(pRedisConn, cmd, args);
     va_end(args);
 
     if (RedisPool::CheckReply(reply)) {
@@ -198,7 +199,7 @@ bool xRedisClient::command_status(const SliceIndex& index, const char* cmd, ...)
 
     va_list args;
     va_start(args, cmd);
-    redisReply* reply = static_cast<redisReply*>(redisvCommand(pRedisConn->getCtx(), cmd, args));
+    redisReply* reply = RedisvCommand(pRedisConn, cmd, args);
     va_end(args);
 
     if (RedisPool::CheckReply(reply)) {
@@ -229,7 +230,7 @@ bool xRedisClient::command_integer(const SliceIndex& index, int64_t& retval, con
 
     va_list args;
     va_start(args, cmd);
-    redisReply* reply = static_cast<redisReply*>(redisvCommand(pRedisConn->getCtx(), cmd, args));
+    redisReply* reply = RedisvCommand(pRedisConn, cmd, args);
     va_end(args);
     if (RedisPool::CheckReply(reply)) {
         retval = reply->integer;
@@ -254,7 +255,7 @@ bool xRedisClient::command_string(const SliceIndex& index, string& data, const c
 
     va_list args;
     va_start(args, cmd);
-    redisReply* reply = static_cast<redisReply*>(redisvCommand(pRedisConn->getCtx(), cmd, args));
+    redisReply* reply = RedisvCommand(pRedisConn, cmd, args);
     va_end(args);
     if (RedisPool::CheckReply(reply)) {
         data.assign(reply->str, reply->len);
@@ -279,7 +280,7 @@ bool xRedisClient::command_list(const SliceIndex& index, VALUES& vValue, const c
 
     va_list args;
     va_start(args, cmd);
-    redisReply* reply = static_cast<redisReply*>(redisvCommand(pRedisConn->getCtx(), cmd, args));
+    redisReply* reply = RedisvCommand(pRedisConn, cmd, args);
     va_end(args);
     if (RedisPool::CheckReply(reply)) {
         for (size_t i = 0; i < reply->elements; i++) {
@@ -306,7 +307,7 @@ bool xRedisClient::command_array(const SliceIndex& index, ArrayReply& array, con
 
     va_list args;
     va_start(args, cmd);
-    redisReply* reply = static_cast<redisReply*>(redisvCommand(pRedisConn->getCtx(), cmd, args));
+    redisReply* reply = RedisvCommand(pRedisConn, cmd, args);
     va_end(args);
     if (RedisPool::CheckReply(reply)) {
         for (size_t i = 0; i < reply->elements; i++) {
@@ -341,6 +342,8 @@ bool xRedisClient::commandargv_array_ex(const SliceIndex& index, const VDATA& vD
     }
 
     redisReply* reply = static_cast<redisReply*>(redisCommandArgv(pRedisConn->getCtx(), static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0])));
+    xRedisResp3::ToResp2(reply, argv[0], argvlen[0]);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, argv.size(), &argv[0], &argvlen[0]);
     if (RedisPool::CheckReply(reply))
         bRet = true;
     else
@@ -403,6 +406,8 @@ bool xRedisClient::commandargv_bool(const SliceIndex& index, const VDATA& vData)
     }
 
     redisReply* reply = static_cast<redisReply*>(redisCommandArgv(pRedisConn->getCtx(), static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0])));
+    xRedisResp3::ToResp2(reply, argv[0], argvlen[0]);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, argv.size(), &argv[0], &argvlen[0]);
     if (RedisPool::CheckReply(reply))
         bRet = reply->integer == 1;
     else
@@ -430,6 +435,8 @@ bool xRedisClient::commandargv_status(const SliceIndex& index, const VDATA& vDat
     }
 
     redisReply* reply = static_cast<redisReply*>(redisCommandArgv(pRedisConn->getCtx(), static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0])));
+    xRedisResp3::ToResp2(reply, argv[0], argvlen[0]);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, argv.size(), &argv[0], &argvlen[0]);
     if (RedisPool::CheckReply(reply)) {
         // Assume good reply until further inspection
         bRet = true;
@@ -464,6 +471,8 @@ bool xRedisClient::commandargv_array(const SliceIndex& index, const VDATA& vData
     }
 
     redisReply* reply = static_cast<redisReply*>(redisCommandArgv(pRedisConn->getCtx(), static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0])));
+    xRedisResp3::ToResp2(reply, argv[0], argvlen[0]);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, argv.size(), &argv[0], &argvlen[0]);
     if (RedisPool::CheckReply(reply)) {
         for (size_t i = 0; i < reply->elements; i++) {
             DataItem item;
@@ -497,6 +506,8 @@ bool xRedisClient::commandargv_array(const SliceIndex& index, const VDATA& vData
     }
 
     redisReply* reply = static_cast<redisReply*>(redisCommandArgv(pRedisConn->getCtx(), static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0])));
+    xRedisResp3::ToResp2(reply, argv[0], argvlen[0]);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, argv.size(), &argv[0], &argvlen[0]);
     if (RedisPool::CheckReply(reply)) {
         for (size_t i = 0; i < reply->elements; i++) {
             string str(reply->element[i]->str, reply->element[i]->len);
@@ -528,6 +539,8 @@ bool xRedisClient::commandargv_integer(const SliceIndex& index, const VDATA& vDa
     }
 
     redisReply* reply = static_cast<redisReply*>(redisCommandArgv(pRedisConn->getCtx(), static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0])));
+    xRedisResp3::ToResp2(reply, argv[0], argvlen[0]);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, argv.size(), &argv[0], &argvlen[0]);
     if (RedisPool::CheckReply(reply)) {
         retval = reply->integer;
         bRet = true;
@@ -576,6 +589,7 @@ bool xRedisClient::ScanFun(const char* cmd, const SliceIndex& index, const std::
     }
 
     redisReply* reply = static_cast<redisReply*>(redisCommandArgv(pRedisConn->getCtx(), static_cast<int32_t>(argv.size()), &(argv[0]), &(argvLen[0])));
+    xRedisResp3::ToResp2(reply, argv[0], argvLen[0]);
     if (RedisPool::CheckReply(reply)) {
         if (0 == reply->elements) {
             cursor = 0;
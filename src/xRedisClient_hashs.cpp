@@ -8,6 +8,8 @@
 
 #include <redis/xredis/xRedisClient.h>
 #include <redis/xredis/xRedisPool.h>
+#include "xRedisResp3.h"
+#include "xRedisUtil.h"
 
 using namespace xrcp;
 
@@ -52,10 +54,20 @@ bool xRedisClient::hincrbyfloat(const SliceIndex& index, const string& key, cons
     if (NULL == pRedisConn)
         return false;
 
-    redisReply* reply = static_cast<redisReply*>(redisCommand(pRedisConn->getCtx(), "HINCRBYFLOAT %s %s %f", key.c_str(), field.c_str(), increment));
-    if (RedisPool::CheckReply(reply)) {
-        value = (float) atof(reply->str);
+    string strIncrement = xRedisNative::FormatFloat(increment);
+    redisReply* reply = static_cast<redisReply*>(redisCommand(pRedisConn->getCtx(), "HINCRBYFLOAT %s %s %s", key.c_str(), field.c_str(), strIncrement.c_str()));
+    if (xRedisWriteObserver::IsActive()) {
+        VDATA vCmdData;
+        vCmdData.push_back("HINCRBYFLOAT");
+        vCmdData.push_back(key);
+        xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, vCmdData);
+    }
+    double dValue = 0;
+    if (RedisPool::CheckReply(reply) && xRedisResp3::ToDouble(reply, dValue)) {
+        value = (float) dValue;
         bRet = true;
+    } else {
+        SetErrInfo(index, reply);
     }
 
     RedisPool::FreeReply(reply);
@@ -8,6 +8,7 @@
 
 #include <redis/xredis/xRedisClient.h>
 #include <redis/xredis/xRedisPool.h>
+#include "xRedisSetAlgebra.h"
 
 using namespace xrcp;
 
@@ -27,70 +28,19 @@ bool xRedisClient::scard(const SliceIndex& index, const string& key, int64_t& co
 }
 
 bool xRedisClient::sdiff(const DBIArray& vdbi, const KEYS& vkey, VALUES& sValue) {
-    size_t size = vkey.size();
-    if (0 == size) return false;
-    VALUES* setData = new VALUES[size];
-    VALUES::iterator endpos;
-
-    DBIArray::const_iterator iter_dbi = vdbi.begin();
-    KEYS::const_iterator iter_key = vkey.begin();
-    int32_t i = 0;
-    for (; iter_key != vkey.end(); ++iter_key, ++iter_dbi, ++i) {
-        const string& key = *iter_key;
-        const SliceIndex& index = *iter_dbi;
-        if (!smembers(index, key, setData[i])) {
-            delete[] setData;
-            return false;
-        }
-    }
-
-    size_t n = 0;
-    while (n++ < size - 1) {
-        endpos = set_difference(setData[n].begin(), setData[n].end(), setData[n + 1].begin(), setData[n + 1].end(), sValue.begin());
-        sValue.resize(static_cast<unsigned long>(endpos - sValue.begin()));
-    }
-    delete[] setData;
-    return true;
+    return xRedisSetAlgebra::Compute(this, SET_DIFF, vdbi, vkey, sValue);
 }
 
 bool xRedisClient::sdiffstore(const SliceIndex& index, const KEY& destinationkey, const DBIArray& vdbi, const KEYS& vkey, int64_t& count) {
-    VALUES sValue;
-    if (!sdiff(vdbi, vkey, sValue))
-        return false;
-    return sadd(index, destinationkey, sValue, count);
+    return xRedisSetAlgebra::Store(this, SET_DIFF, index, destinationkey, vdbi, vkey, count);
 }
 
 bool xRedisClient::sinter(const DBIArray& vdbi, const KEYS& vkey, VALUES& sValue) {
-    size_t size = vkey.size();
-    VALUES* setData = new VALUES[size];
-    VALUES::iterator endpos;
-
-    DBIArray::const_iterator iter_dbi = vdbi.begin();
-    KEYS::const_iterator iter_key = vkey.begin();
-    int32_t i = 0;
-    for (; iter_key != vkey.end(); ++iter_key, ++iter_dbi, ++i) {
-        const string& key = *iter_key;
-        const SliceIndex& index = *iter_dbi;
-        if (!smembers(index, key, setData[i])) {
-            delete[] setData;
-            return false;
-        }
-    }
-
-    size_t n = 0;
-    while (n++ < size - 1) {
-        endpos = set_intersection(setData[n].begin(), setData[n].end(), setData[n + 1].begin(), setData[n + 1].end(), sValue.begin());
-        sValue.resize((unsigned long) (endpos - sValue.begin()));
-    }
-    delete[] setData;
-
-    return true;
+    return xRedisSetAlgebra::Compute(this, SET_INTER, vdbi, vkey, sValue);
 }
 
 bool xRedisClient::sinterstore(const SliceIndex& des_dbi, const KEY& destinationkey, const DBIArray& vdbi, const KEYS& vkey, int64_t& count) {
-    VALUES sValue;
-    if (!sinter(vdbi, vkey, sValue)) return false;
-    return sadd(des_dbi, destinationkey, sValue, count);
+    return xRedisSetAlgebra::Store(this, SET_INTER, des_dbi, destinationkey, vdbi, vkey, count);
 }
 
 bool xRedisClient::sismember(const SliceIndex& index, const KEY& key, const VALUE& member) {
@@ -135,36 +85,11 @@ bool xRedisClient::srem(const SliceIndex& index, const KEY& key, const VALUES& v
 }
 
 bool xRedisClient::sunion(const DBIArray& vdbi, const KEYS& vkey, VALUES& sValue) {
-    size_t size = vkey.size();
-    VALUES* setData = new VALUES[size];
-    VALUES::iterator endpos;
-
-    DBIArray::const_iterator iter_dbi = vdbi.begin();
-    KEYS::const_iterator iter_key = vkey.begin();
-    int32_t i = 0;
-    for (; iter_key != vkey.end(); ++iter_key, ++iter_dbi, ++i) {
-        const string& key = *iter_key;
-        const SliceIndex& index = *iter_dbi;
-        if (!smembers(index, key, setData[i])) {
-            delete[] setData;
-            return false;
-        }
-    }
-
-    size_t n = 0;
-    while (n++ < size - 1) {
-        endpos = set_union(setData[n].begin(), setData[n].end(), setData[n + 1].begin(), setData[n + 1].end(), sValue.begin());
-        sValue.resize(static_cast<unsigned long>(endpos - sValue.begin()));
-    }
-    delete[] setData;
-    return true;
+    return xRedisSetAlgebra::Compute(this, SET_UNION, vdbi, vkey, sValue);
 }
 
 bool xRedisClient::sunionstore(const SliceIndex& index, const KEY& deskey, const DBIArray& vdbi, const KEYS& vkey, int64_t& count) {
-    VALUES sValue;
-    if (!index.mIOFlag) { SetIOtype(index, MASTER, true); }
-    if (!sunion(vdbi, vkey, sValue)) return false;
-    return sadd(index, deskey, sValue, count);
+    return xRedisSetAlgebra::Store(this, SET_UNION, index, deskey, vdbi, vkey, count);
 }
 
 bool xRedisClient::sscan(const SliceIndex& index, const std::string& key, int64_t& cursor, const char* pattern, uint32_t count, ArrayReply& array, xRedisContext& ctx) {
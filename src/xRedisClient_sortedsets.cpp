@@ -8,6 +8,7 @@
 
 #include <redis/xredis/xRedisClient.h>
 #include <redis/xredis/xRedisPool.h>
+#include "xRedisResp3.h"
 
 using namespace xrcp;
 
@@ -29,7 +30,7 @@ bool xRedisClient::zscrad(const SliceIndex& index, const string& key, int64_t& c
 bool xRedisClient::zincrby(const SliceIndex& index, const string& key, const double& increment, const string& member, string& value) {
     if (0 == key.length()) return false;
     SETDEFAULTIOTYPE(MASTER)
-    return command_string(index, value, "ZINCRBY %s %f %s", key.c_str(), increment, member.c_str());
+    return command_string(index, value, "ZINCRBY %s %s %s", key.c_str(), xRedisNative::FormatDouble(increment).c_str(), member.c_str());
 }
 
 bool xRedisClient::zrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, VALUES& vValues, bool withscore) {
@@ -86,8 +87,13 @@ bool xRedisClient::zremrangebyrank(const SliceIndex& index, const string& key, i
 
 bool xRedisClient::zremrangebyscore(const SliceIndex& index, const KEY& key, double min, double max, int64_t& count) {
     if (0 == key.length()) return false;
-    SETDEFAULTIOTYPE(SLAVE)
-    return command_integer(index, count, "ZREMRANGEBYSCORE %s %d %d", key.c_str(), min, max);
+    VDATA vCmdData;
+    vCmdData.push_back("ZREMRANGEBYSCORE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(xRedisNative::FormatDouble(min));
+    vCmdData.push_back(xRedisNative::FormatDouble(max));
+    SETDEFAULTIOTYPE(MASTER)
+    return commandargv_integer(index, vCmdData, count);
 }
 
 bool xRedisClient::zrevrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, VALUES& vValues, bool withscore) {
@@ -189,20 +189,7 @@ bool xRedisClient::bitcount(const SliceIndex& index, const string& key, int32_t&
     return bRet;
 }
 
-//// 这个实现有问题
-//bool xRedisClient::bitop(const SliceIndex& index, const BITOP operation, const string& destkey, const KEYS& keys, int32_t& lenght) {
-//    static const char *op_cmd[4]= {"AND","OR","XOR","NOT"};
-//    VDATA vCmdData;
-//    int64_t intval = 0;
-//    vCmdData.push_back("bitop");
-//    vCmdData.push_back(op_cmd[operation]);
-//    vCmdData.push_back(destkey);
-//    addParam(vCmdData, keys);
-//    SETDEFAULTIOTYPE(MASTER)
-//    bool bRet = commandargv_integer(index, vCmdData, intval);
-//    lenght = (int32_t)intval;
-//    return bRet;
-//}
+// BITOP, including keys on different slices, is xRedisBitmap::bitop().
 
 bool xRedisClient::bitpos(const SliceIndex& index, const string& key, int32_t bit, int64_t& pos, int32_t start, int32_t end) {
     SETDEFAULTIOTYPE(SLAVE)
@@ -0,0 +1,165 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisHash.h"
+#include "xRedisRoute.h"
+
+using namespace xrcp;
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t Rotl64(uint64_t x, int32_t r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Read64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t Read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t XXH64Round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = Rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t XXH64Merge(uint64_t acc, uint64_t val) {
+    acc ^= XXH64Round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xRedisHash::XXH64(const char* data, size_t len, uint64_t seed) {
+    const char* p = data;
+    const char* end = data + len;
+    uint64_t h64;
+
+    if (len >= 32) {
+        const char* limit = end - 32;
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        do {
+            v1 = XXH64Round(v1, Read64(p));
+            v2 = XXH64Round(v2, Read64(p + 8));
+            v3 = XXH64Round(v3, Read64(p + 16));
+            v4 = XXH64Round(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h64 = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+        h64 = XXH64Merge(h64, v1);
+        h64 = XXH64Merge(h64, v2);
+        h64 = XXH64Merge(h64, v3);
+        h64 = XXH64Merge(h64, v4);
+    } else {
+        h64 = seed + PRIME64_5;
+    }
+
+    h64 += (uint64_t) len;
+
+    while (p + 8 <= end) {
+        h64 ^= XXH64Round(0, Read64(p));
+        h64 = Rotl64(h64, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h64 ^= (uint64_t) Read32(p) * PRIME64_1;
+        h64 = Rotl64(h64, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h64 ^= (uint64_t) (uint8_t) (*p) * PRIME64_5;
+        h64 = Rotl64(h64, 11) * PRIME64_1;
+        ++p;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+// gCrc16Table[k][b] is the CRC of byte b followed by k zero bytes.
+static uint16_t gCrc16Table[8][256];
+
+static bool InitCrc16Table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint16_t crc = (uint16_t) (i << 8);
+        for (int32_t bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? (uint16_t) ((crc << 1) ^ 0x1021) : (uint16_t) (crc << 1);
+        }
+        gCrc16Table[0][i] = crc;
+    }
+    for (uint32_t k = 1; k < 8; ++k) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint16_t prev = gCrc16Table[k - 1][i];
+            gCrc16Table[k][i] = (uint16_t) ((prev << 8) ^ gCrc16Table[0][prev >> 8]);
+        }
+    }
+    return true;
+}
+
+static bool gCrc16Ready = InitCrc16Table();
+
+uint16_t xRedisHash::Crc16(const char* data, size_t len) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    uint16_t crc = 0;
+
+    while (len >= 8) {
+        crc = gCrc16Table[7][p[0] ^ (crc >> 8)] ^ gCrc16Table[6][p[1] ^ (crc & 0xFF)] ^
+              gCrc16Table[5][p[2]] ^ gCrc16Table[4][p[3]] ^
+              gCrc16Table[3][p[4]] ^ gCrc16Table[2][p[5]] ^
+              gCrc16Table[1][p[6]] ^ gCrc16Table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (uint16_t) ((crc << 8) ^ gCrc16Table[0][((crc >> 8) ^ *p++) & 0xFF]);
+    }
+    return crc;
+}
+
+uint32_t xRedisHash::KeySlot(const char* key, size_t len) {
+    const char* tag = NULL;
+    size_t taglen = 0;
+    if (xRedisRoute::FindHashTag(key, len, tag, taglen))
+        return Crc16(tag, taglen) & (CLUSTER_SLOT_COUNT - 1);
+    return Crc16(key, len) & (CLUSTER_SLOT_COUNT - 1);
+}
+
+uint32_t xRedisHash::XXHashFun(const char* key) {
+    uint64_t h = XXH64(key, strlen(key));
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+uint32_t xRedisHash::Crc16Fun(const char* key) {
+    return Crc16(key, strlen(key));
+}
+
+uint32_t xRedisHash::Fnv1aFun(const char* key) {
+    uint32_t h = 2166136261U;
+    for (const uint8_t* p = reinterpret_cast<const uint8_t*>(key); *p; ++p) {
+        h ^= *p;
+        h *= 16777619U;
+    }
+    return h;
+}
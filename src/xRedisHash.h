@@ -0,0 +1,41 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_HASH_H_
+#define _XREDIS_HASH_H_
+
+#include <redis/xredis/xRedisClient.h>
+
+namespace xrcp {
+
+#define CLUSTER_SLOT_COUNT 16384
+
+    // Hash kernels for key routing. The *Fun members match HASHFUN and can be
+    // passed to SliceIndex::Create as they are.
+    class xRedisHash {
+    public:
+        // XXH64, reading eight bytes per step.
+        static uint64_t XXH64(const char* data, size_t len, uint64_t seed = 0);
+
+        // CRC16-CCITT (XMODEM) as used by Redis Cluster, eight bytes per step
+        // with slicing-by-8 tables.
+        static uint16_t Crc16(const char* data, size_t len);
+
+        // Redis Cluster slot of a key, honouring {hash tags}.
+        static uint32_t KeySlot(const char* key, size_t len);
+
+        static uint32_t XXHashFun(const char* key);
+
+        static uint32_t Crc16Fun(const char* key);
+
+        static uint32_t Fnv1aFun(const char* key);
+    };
+
+}
+
+#endif
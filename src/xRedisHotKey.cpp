@@ -0,0 +1,280 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisHotKey.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define HOTKEY_DEFAULT_CAPACITY 64
+#define HOTKEY_DEFAULT_THRESHOLD 10000
+#define HOTKEY_DEFAULT_WINDOW_MS 1000
+#define HOTKEY_DEFAULT_MAX_LOCAL 1024
+#define HOTKEY_MAX_LOCAL_TTL_MS 1000
+
+static bool CompareHotKey(const HotKeyInfo& a, const HotKeyInfo& b) {
+    return a.count > b.count;
+}
+
+xRedisHotKey::xRedisHotKey() {
+    mClient = NULL;
+    mOption.nodeIndex = 0;
+    mOption.capacity = 0;
+    mOption.sampleStep = 0;
+    mOption.threshold = 0;
+    mOption.windowMs = 0;
+    mOption.localTtlMs = 0;
+    mOption.maxLocal = 0;
+    mOption.spreadReplicas = false;
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+xRedisHotKey::~xRedisHotKey() {
+    Release();
+}
+
+bool xRedisHotKey::Init(xRedisClient* client, const HotKeyOption& option) {
+    if ((NULL == client) || (NULL != mClient))
+        return false;
+
+    uint32_t sliceCount = client->GetRedisPool()->GetSliceCount(option.nodeIndex);
+    if ((0 == sliceCount) || (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return false;
+
+    mOption = option;
+    if (0 == mOption.capacity)
+        mOption.capacity = HOTKEY_DEFAULT_CAPACITY;
+    if (0 == mOption.sampleStep)
+        mOption.sampleStep = 1;
+    if (0 == mOption.threshold)
+        mOption.threshold = HOTKEY_DEFAULT_THRESHOLD;
+    if (0 == mOption.windowMs)
+        mOption.windowMs = HOTKEY_DEFAULT_WINDOW_MS;
+    if (0 == mOption.maxLocal)
+        mOption.maxLocal = HOTKEY_DEFAULT_MAX_LOCAL;
+    if (mOption.localTtlMs > HOTKEY_MAX_LOCAL_TTL_MS)
+        mOption.localTtlMs = HOTKEY_MAX_LOCAL_TTL_MS;
+
+    uint64_t now = GetMonotonicUs();
+    for (uint32_t i = 0; i < sliceCount; ++i) {
+        HotSlice* slice = new HotSlice;
+        slice->counters.reserve(mOption.capacity);
+        slice->hotCount = 0;
+        slice->windowStartUs = now;
+        slice->samples = 0;
+        mSlices.push_back(slice);
+    }
+    mClient = client;
+    return true;
+}
+
+void xRedisHotKey::Release() {
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        delete mSlices[i];
+    }
+    mSlices.clear();
+    XLOCK(mLocalLock);
+    mLocal.clear();
+    mClient = NULL;
+}
+
+xRedisHotKey::HotSlice* xRedisHotKey::GetSlice(const SliceIndex& index) {
+    if ((NULL == mClient) || (index.mNodeIndex != mOption.nodeIndex) || (index.mSliceIndex >= mSlices.size()))
+        return NULL;
+    return mSlices[index.mSliceIndex];
+}
+
+void xRedisHotKey::RollWindow(HotSlice* slice, uint32_t sliceIndex, uint64_t now) {
+    // The keys that were hot over the window just ended stay hot for the
+    // next one; counting starts over.
+    slice->hot.clear();
+    for (size_t i = 0; i < slice->counters.size(); ++i) {
+        const HotCounter& counter = slice->counters[i];
+        if (counter.count - counter.error < mOption.threshold)
+            continue;
+        HotKeyInfo& info = slice->hot[counter.key];
+        info.key = counter.key;
+        info.sliceIndex = sliceIndex;
+        info.count = counter.count;
+        info.error = counter.error;
+    }
+    __atomic_store_n(&slice->hotCount, (uint32_t) slice->hot.size(), __ATOMIC_RELEASE);
+    slice->counters.clear();
+    slice->index.clear();
+    slice->windowStartUs = now;
+}
+
+bool xRedisHotKey::Record(const SliceIndex& index, const string& key) {
+    HotSlice* slice = GetSlice(index);
+    if ((NULL == slice) || key.empty())
+        return false;
+
+    // Unsampled accesses only take the lock when the slice has hot keys.
+    if (0 != (__sync_fetch_and_add(&slice->samples, 1) % mOption.sampleStep))
+        return IsHot(index, key);
+    __sync_fetch_and_add(&mStats.sampled, 1);
+
+    XLOCK(slice->lock);
+    uint64_t now = GetMonotonicUs();
+    if (now - slice->windowStartUs >= (uint64_t) mOption.windowMs * 1000)
+        RollWindow(slice, index.mSliceIndex, now);
+
+    // Space-saving: an untracked key replaces the smallest counter and
+    // inherits its count as error.
+    uint32_t pos;
+    std::tr1::unordered_map<string, uint32_t>::iterator it = slice->index.find(key);
+    if (slice->index.end() != it) {
+        pos = it->second;
+    } else if (slice->counters.size() < mOption.capacity) {
+        pos = (uint32_t) slice->counters.size();
+        slice->counters.push_back(HotCounter());
+        slice->counters[pos].key = key;
+        slice->counters[pos].count = 0;
+        slice->counters[pos].error = 0;
+        slice->index[key] = pos;
+    } else {
+        pos = 0;
+        for (uint32_t i = 1; i < slice->counters.size(); ++i) {
+            if (slice->counters[i].count < slice->counters[pos].count)
+                pos = i;
+        }
+        slice->index.erase(slice->counters[pos].key);
+        slice->counters[pos].key = key;
+        slice->counters[pos].error = slice->counters[pos].count;
+        slice->index[key] = pos;
+    }
+
+    HotCounter& counter = slice->counters[pos];
+    counter.count += mOption.sampleStep;
+    if (counter.count - counter.error >= mOption.threshold) {
+        HotKeyInfo& info = slice->hot[key];
+        info.key = key;
+        info.sliceIndex = index.mSliceIndex;
+        info.count = counter.count;
+        info.error = counter.error;
+        __atomic_store_n(&slice->hotCount, (uint32_t) slice->hot.size(), __ATOMIC_RELEASE);
+        return true;
+    }
+    return slice->hot.end() != slice->hot.find(key);
+}
+
+bool xRedisHotKey::IsHot(const SliceIndex& index, const string& key) {
+    HotSlice* slice = GetSlice(index);
+    if ((NULL == slice) || (0 == __atomic_load_n(&slice->hotCount, __ATOMIC_ACQUIRE)))
+        return false;
+
+    XLOCK(slice->lock);
+    return slice->hot.end() != slice->hot.find(key);
+}
+
+bool xRedisHotKey::ReadLocal(const string& key, string& value) {
+    XLOCK(mLocalLock);
+    std::tr1::unordered_map<string, LocalCopy>::iterator it = mLocal.find(key);
+    if (mLocal.end() == it)
+        return false;
+    if (GetMonotonicUs() >= it->second.expireUs) {
+        mLocal.erase(it);
+        return false;
+    }
+    value = it->second.value;
+    return true;
+}
+
+void xRedisHotKey::StoreLocal(const string& key, const string& value) {
+    XLOCK(mLocalLock);
+    if ((mLocal.size() >= mOption.maxLocal) && (mLocal.end() == mLocal.find(key)))
+        mLocal.erase(mLocal.begin());
+    LocalCopy& copy = mLocal[key];
+    copy.value = value;
+    copy.expireUs = GetMonotonicUs() + (uint64_t) mOption.localTtlMs * 1000;
+}
+
+bool xRedisHotKey::get(const SliceIndex& index, const string& key, string& value) {
+    if (NULL == mClient)
+        return false;
+
+    bool hot = Record(index, key);
+    if (hot && (mOption.localTtlMs > 0) && ReadLocal(key, value)) {
+        __sync_fetch_and_add(&mStats.localHits, 1);
+        return true;
+    }
+
+    bool bRet;
+    if (hot && mOption.spreadReplicas) {
+        SliceIndex replicaIndex = index;
+        replicaIndex.IOtype(SLAVE);
+        replicaIndex.mIOFlag = true;
+        bRet = mClient->get(replicaIndex, key, value);
+        if (!bRet)
+            const_cast<SliceIndex&>(index).SetErrInfo(replicaIndex.mStrerr.c_str(), replicaIndex.mStrerr.size());
+        __sync_fetch_and_add(&mStats.replicaReads, 1);
+    } else {
+        bRet = mClient->get(index, key, value);
+    }
+
+    if (bRet && hot && (mOption.localTtlMs > 0))
+        StoreLocal(key, value);
+    return bRet;
+}
+
+rReply* xRedisHotKey::commandargv(const SliceIndex& index, const string& key, const VDATA& vData) {
+    if ((NULL == mClient) || vData.empty())
+        return NULL;
+
+    uint32_t ioType = MASTER;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+
+    bool isRead = IsReadCommand(vData[0]);
+    if (Record(index, key) && isRead && mOption.spreadReplicas) {
+        ioType = SLAVE;
+        __sync_fetch_and_add(&mStats.replicaReads, 1);
+    }
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return NULL;
+    }
+
+    redisReply* reply = RedisCommandArgv(pRedisConn, vData);
+    if (NULL == reply)
+        const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+    pRedisPool->FreeConnection(pRedisConn);
+
+    if (!isRead)
+        Invalidate(key);
+    return reply;
+}
+
+void xRedisHotKey::Invalidate(const string& key) {
+    XLOCK(mLocalLock);
+    mLocal.erase(key);
+}
+
+void xRedisHotKey::GetHotKeys(std::vector<HotKeyInfo>& vHotKeys) {
+    vHotKeys.clear();
+    uint64_t now = GetMonotonicUs();
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        HotSlice* slice = mSlices[i];
+        XLOCK(slice->lock);
+        if (now - slice->windowStartUs >= (uint64_t) mOption.windowMs * 1000)
+            RollWindow(slice, (uint32_t) i, now);
+        for (std::map<string, HotKeyInfo>::const_iterator it = slice->hot.begin(); it != slice->hot.end(); ++it) {
+            vHotKeys.push_back(it->second);
+        }
+    }
+    std::sort(vHotKeys.begin(), vHotKeys.end(), CompareHotKey);
+}
+
+void xRedisHotKey::GetStats(HotKeyStats& stats) {
+    stats.sampled = __atomic_load_n(&mStats.sampled, __ATOMIC_RELAXED);
+    stats.localHits = __atomic_load_n(&mStats.localHits, __ATOMIC_RELAXED);
+    stats.replicaReads = __atomic_load_n(&mStats.replicaReads, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,124 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_HOTKEY_H_
+#define _XREDIS_HOTKEY_H_
+
+#include <map>
+#include <tr1/unordered_map>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef struct _HOTKEY_OPTION_ {
+        uint32_t nodeIndex;
+        uint32_t capacity;          // keys tracked per slice
+        uint32_t sampleStep;        // every sampleStep-th access is counted, 1 for all
+        uint64_t threshold;         // accesses per window that make a key hot
+        uint32_t windowMs;
+        uint32_t localTtlMs;        // lifetime of a local copy of a hot key, at most 1000, 0 disables copies
+        uint32_t maxLocal;          // local copies kept
+        bool spreadReplicas;        // send reads of hot keys to replicas even if the index asks for the master
+    } HotKeyOption;
+
+    typedef struct _HOTKEY_INFO_ {
+        string key;
+        uint32_t sliceIndex;
+        uint64_t count;             // estimated accesses in the window
+        uint64_t error;             // count may overestimate by up to this much
+    } HotKeyInfo;
+
+    typedef struct _HOTKEY_STATS_ {
+        uint64_t sampled;
+        uint64_t localHits;
+        uint64_t replicaReads;
+    } HotKeyStats;
+
+    // Hot-key detection on the command path with a space-saving summary per
+    // slice. Accesses are sampled; a key whose guaranteed count in the
+    // current window reaches the threshold is hot until a whole window
+    // passes without it reaching the threshold again.
+    //
+    // Reads of hot keys are served from short-lived local copies and, when
+    // they do reach Redis, spread over the slice's replicas. Nothing tells a
+    // copy about writes from elsewhere, so it may be up to localTtlMs stale;
+    // the lifetime is capped at one second for that reason. Invalidate()
+    // only covers writes made through this process; use xRedisNearCache
+    // where copies must follow other writers.
+    class xRedisHotKey {
+    public:
+        xRedisHotKey();
+
+        ~xRedisHotKey();
+
+        bool Init(xRedisClient* client, const HotKeyOption& option);
+
+        void Release();
+
+        // Counts one access to key and returns whether it is hot.
+        bool Record(const SliceIndex& index, const string& key);
+
+        bool IsHot(const SliceIndex& index, const string& key);
+
+        bool get(const SliceIndex& index, const string& key, string& value);
+
+        // key is the key vData operates on; caller frees the reply with
+        // RedisPool::FreeReply().
+        rReply* commandargv(const SliceIndex& index, const string& key, const VDATA& vData);
+
+        // Drops the local copy of key, e.g. after writing it.
+        void Invalidate(const string& key);
+
+        // Hot keys of every slice, hottest first.
+        void GetHotKeys(std::vector<HotKeyInfo>& vHotKeys);
+
+        void GetStats(HotKeyStats& stats);
+
+    private:
+        typedef struct _HOT_COUNTER_ {
+            string key;
+            uint64_t count;
+            uint64_t error;
+        } HotCounter;
+
+        typedef struct _HOT_SLICE_ {
+            xLock lock;
+            std::vector<HotCounter> counters;
+            std::tr1::unordered_map<string, uint32_t> index;
+            std::map<string, HotKeyInfo> hot;
+            volatile uint32_t hotCount;     // hot.size(), read without the lock
+            uint64_t windowStartUs;
+            volatile uint64_t samples;
+        } HotSlice;
+
+        typedef struct _LOCAL_COPY_ {
+            string value;
+            uint64_t expireUs;
+        } LocalCopy;
+
+        HotSlice* GetSlice(const SliceIndex& index);
+
+        void RollWindow(HotSlice* slice, uint32_t sliceIndex, uint64_t now);
+
+        bool ReadLocal(const string& key, string& value);
+
+        void StoreLocal(const string& key, const string& value);
+
+    private:
+        xRedisClient* mClient;
+        HotKeyOption mOption;
+        std::vector<HotSlice*> mSlices;
+        xLock mLocalLock;
+        std::tr1::unordered_map<string, LocalCopy> mLocal;
+        HotKeyStats mStats;
+    };
+
+}
+
+#endif
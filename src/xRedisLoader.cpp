@@ -0,0 +1,257 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include "xRedisLoader.h"
+#include "xRedisHash.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define LOADER_DEFAULT_BETA 1.0
+#define LOADER_DEFAULT_LOCK_WAIT_MS 1000
+#define LOADER_POLL_US 5000
+#define LOADER_MAX_DELTAS 65536
+#define LOADER_LOCK_WAIT_ERROR "wait for loader lock timeout"
+
+static const char* gUnlockScript =
+        "if redis.call('GET', KEYS[1]) == ARGV[1] then return redis.call('DEL', KEYS[1]) end return 0";
+
+static __thread uint64_t gRandState = 0;
+
+// Uniform in (0, 1].
+static double RandomUnit() {
+    if (0 == gRandState) {
+        uint64_t seed = (uint64_t) pthread_self();
+        gRandState = xRedisHash::XXH64((const char*) &seed, sizeof(seed), GetMonotonicUs()) | 1;
+    }
+    gRandState ^= gRandState << 13;
+    gRandState ^= gRandState >> 7;
+    gRandState ^= gRandState << 17;
+    return (double) ((gRandState >> 11) + 1) / 9007199254740992.0;
+}
+
+xRedisLoader::xRedisLoader() {
+    mClient = NULL;
+    mOption.beta = 0;
+    mOption.defaultDeltaMs = 0;
+    mOption.lockTtlMs = 0;
+    mOption.lockWaitMs = 0;
+    mUnlock = INVALID_SCRIPT_HANDLE;
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+xRedisLoader::~xRedisLoader() {
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+bool xRedisLoader::Init(xRedisClient* client, const LoaderOption& option) {
+    if ((NULL == client) || (NULL != mClient) || !mScript.Init(client))
+        return false;
+
+    mOption = option;
+    if (mOption.beta <= 0)
+        mOption.beta = LOADER_DEFAULT_BETA;
+    if (0 == mOption.lockWaitMs)
+        mOption.lockWaitMs = LOADER_DEFAULT_LOCK_WAIT_MS;
+    if (mOption.lockSuffix.empty())
+        mOption.lockSuffix = ":lock";
+    mUnlock = mScript.Register(gUnlockScript);
+    mClient = client;
+    return true;
+}
+
+bool xRedisLoader::getOrLoad(const SliceIndex& index, const string& key, uint32_t ttl, LOADFUN loader, void* privdata, string& value) {
+    if ((NULL == mClient) || (NULL == loader) || key.empty())
+        return false;
+
+    FlightKey flightKey(index.mNodeIndex, key);
+    pthread_mutex_lock(&mMutex);
+    std::map<FlightKey, LoadFlight*>::iterator it = mFlights.find(flightKey);
+    if (mFlights.end() != it) {
+        LoadFlight* flight = it->second;
+        flight->refs++;
+        mStats.coalesced++;
+        while (!flight->done) {
+            pthread_cond_wait(&mCond, &mMutex);
+        }
+        bool bRet = flight->ok;
+        if (bRet)
+            value = flight->value;
+        if (0 == --flight->refs)
+            delete flight;
+        pthread_mutex_unlock(&mMutex);
+        return bRet;
+    }
+
+    LoadFlight* flight = new LoadFlight;
+    flight->done = false;
+    flight->ok = false;
+    flight->refs = 1;
+    mFlights[flightKey] = flight;
+    pthread_mutex_unlock(&mMutex);
+
+    bool bRet = Resolve(index, key, ttl, loader, privdata, value);
+
+    pthread_mutex_lock(&mMutex);
+    mFlights.erase(flightKey);
+    flight->done = true;
+    flight->ok = bRet;
+    if (bRet && (flight->refs > 1))
+        flight->value = value;
+    if (0 == --flight->refs)
+        delete flight;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mMutex);
+    return bRet;
+}
+
+bool xRedisLoader::Resolve(const SliceIndex& index, const string& key, uint32_t ttl, LOADFUN loader, void* privdata, string& value) {
+    string cached;
+    int64_t pttl = -2;
+    if (!Fetch(index, key, cached, pttl)) {
+        __sync_fetch_and_add(&mStats.misses, 1);
+        return Load(index, key, ttl, loader, privdata, NULL, value);
+    }
+
+    __sync_fetch_and_add(&mStats.hits, 1);
+    if ((pttl > 0) && ShouldRefresh(key, pttl)) {
+        __sync_fetch_and_add(&mStats.earlyRefreshes, 1);
+        return Load(index, key, ttl, loader, privdata, &cached, value);
+    }
+    value.swap(cached);
+    return true;
+}
+
+bool xRedisLoader::ShouldRefresh(const string& key, int64_t pttl) {
+    uint64_t deltaUs = (uint64_t) mOption.defaultDeltaMs * 1000;
+    {
+        XLOCK(mDeltaLock);
+        std::tr1::unordered_map<string, uint64_t>::const_iterator it = mDeltaUs.find(key);
+        if (mDeltaUs.end() != it)
+            deltaUs = it->second;
+    }
+    if (0 == deltaUs)
+        return false;
+
+    // XFetch: refresh when delta * beta * -ln(rand) reaches the remaining
+    // TTL, which gets likelier the closer expiry is.
+    return (double) deltaUs * mOption.beta * -log(RandomUnit()) >= (double) pttl * 1000.0;
+}
+
+bool xRedisLoader::Fetch(const SliceIndex& index, const string& key, string& value, int64_t& pttl) {
+    uint32_t ioType = SLAVE;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+
+    std::vector<VDATA> vCmds(2);
+    vCmds[0].push_back("GET");
+    vCmds[0].push_back(key);
+    vCmds[1].push_back("PTTL");
+    vCmds[1].push_back(key);
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+    std::vector<redisReply*> vReplies;
+    bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+    if (!bRet) {
+        const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+        pRedisConn->RedisReConnect();
+    }
+    pRedisPool->FreeConnection(pRedisConn);
+    if (!bRet)
+        return false;
+
+    bRet = REDIS_REPLY_STRING == vReplies[0]->type;
+    if (bRet) {
+        value.assign(vReplies[0]->str, vReplies[0]->len);
+        pttl = (REDIS_REPLY_INTEGER == vReplies[1]->type) ? vReplies[1]->integer : -1;
+    }
+    FreeReplies(vReplies);
+    return bRet;
+}
+
+bool xRedisLoader::Load(const SliceIndex& index, const string& key, uint32_t ttl, LOADFUN loader, void* privdata, const string* stale, string& value) {
+    string lockKey = key + mOption.lockSuffix;
+    string token;
+    bool locked = false;
+    if (mOption.lockTtlMs > 0) {
+        token = toString(getpid()) + ":" + toString(RandomUnit());
+        locked = mClient->set(index, lockKey, token, PX, (int32_t) mOption.lockTtlMs, NX);
+        if (!locked) {
+            // Another process is loading: keep serving the old value, or
+            // wait for the new one. The lock is tried again while waiting
+            // since its holder may fail or die.
+            __sync_fetch_and_add(&mStats.lockWaits, 1);
+            if (NULL != stale) {
+                value = *stale;
+                return true;
+            }
+            int64_t pttl = 0;
+            uint64_t deadline = GetMonotonicUs() + (uint64_t) mOption.lockWaitMs * 1000;
+            while (!locked) {
+                if (GetMonotonicUs() >= deadline) {
+                    const_cast<SliceIndex&>(index).SetErrInfo(LOADER_LOCK_WAIT_ERROR, ::strlen(LOADER_LOCK_WAIT_ERROR));
+                    return false;
+                }
+                usleep(LOADER_POLL_US);
+                if (Fetch(index, key, value, pttl))
+                    return true;
+                locked = mClient->set(index, lockKey, token, PX, (int32_t) mOption.lockTtlMs, NX);
+            }
+        }
+    }
+
+    uint64_t start = GetMonotonicUs();
+    bool bRet = loader(key, value, privdata);
+    uint64_t deltaUs = GetMonotonicUs() - start;
+    if (bRet) {
+        __sync_fetch_and_add(&mStats.loads, 1);
+        mClient->set(index, key, value.c_str(), (int32_t) value.size(), (int32_t) ttl);
+
+        XLOCK(mDeltaLock);
+        if (mDeltaUs.size() >= LOADER_MAX_DELTAS)
+            mDeltaUs.clear();
+        mDeltaUs[key] = deltaUs;
+    } else {
+        __sync_fetch_and_add(&mStats.loadErrors, 1);
+        if (NULL != stale) {
+            value = *stale;
+            bRet = true;
+        }
+    }
+
+    if (locked) {
+        KEYS keys(1, lockKey);
+        VALUES args(1, token);
+        int64_t deleted = 0;
+        mScript.eval_integer(index, mUnlock, keys, args, deleted);
+    }
+    return bRet;
+}
+
+void xRedisLoader::GetStats(LoaderStats& stats) {
+    pthread_mutex_lock(&mMutex);
+    uint64_t coalesced = mStats.coalesced;
+    pthread_mutex_unlock(&mMutex);
+
+    stats.hits = __atomic_load_n(&mStats.hits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&mStats.misses, __ATOMIC_RELAXED);
+    stats.loads = __atomic_load_n(&mStats.loads, __ATOMIC_RELAXED);
+    stats.loadErrors = __atomic_load_n(&mStats.loadErrors, __ATOMIC_RELAXED);
+    stats.earlyRefreshes = __atomic_load_n(&mStats.earlyRefreshes, __ATOMIC_RELAXED);
+    stats.coalesced = coalesced;
+    stats.lockWaits = __atomic_load_n(&mStats.lockWaits, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,99 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_LOADER_H_
+#define _XREDIS_LOADER_H_
+
+#include <pthread.h>
+#include <map>
+#include <tr1/unordered_map>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+#include "xRedisScript.h"
+
+namespace xrcp {
+
+    // Computes the value of key from the source of truth.
+    typedef bool (* LOADFUN)(const string& key, string& value, void* privdata);
+
+    typedef struct _LOADER_OPTION_ {
+        double beta;                // XFetch eagerness, 1.0 by default; larger refreshes earlier
+        uint32_t defaultDeltaMs;    // assumed load time of keys not yet loaded here, 0 for no early refresh
+        uint32_t lockTtlMs;         // lease of the fleet-wide recompute lock, 0 disables the lock
+        uint32_t lockWaitMs;        // how long a miss waits for another process's load before failing
+        string lockSuffix;          // lock key is key + lockSuffix, ":lock" by default
+    } LoaderOption;
+
+    typedef struct _LOADER_STATS_ {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t loads;
+        uint64_t loadErrors;
+        uint64_t earlyRefreshes;
+        uint64_t coalesced;         // calls that shared another call's flight
+        uint64_t lockWaits;         // loads left to another process
+    } LoaderStats;
+
+    // Cache-aside over plain string keys with stampede protection.
+    //
+    // Concurrent getOrLoad() calls for one key in this process share a
+    // single Redis read and loader call. A hit still recomputes ahead of
+    // expiry with probability growing as the TTL runs out, scaled by the
+    // key's last load time (XFetch), so popular keys are refreshed before
+    // they expire. With lockTtlMs set, a SET NX lock key lets one process
+    // fleet-wide load; the others keep serving the old value or wait for
+    // the new one, taking the lock over if its holder gives up. A miss
+    // never loads without the lock; it fails after lockWaitMs instead.
+    class xRedisLoader {
+    public:
+        xRedisLoader();
+
+        ~xRedisLoader();
+
+        bool Init(xRedisClient* client, const LoaderOption& option);
+
+        // ttl in seconds for the stored value.
+        bool getOrLoad(const SliceIndex& index, const string& key, uint32_t ttl, LOADFUN loader, void* privdata, string& value);
+
+        void GetStats(LoaderStats& stats);
+
+    private:
+        typedef std::pair<uint32_t, string> FlightKey;     // node index, key
+
+        typedef struct _LOAD_FLIGHT_ {
+            bool done;
+            bool ok;
+            string value;
+            uint32_t refs;
+        } LoadFlight;
+
+        bool Resolve(const SliceIndex& index, const string& key, uint32_t ttl, LOADFUN loader, void* privdata, string& value);
+
+        // GET and PTTL in one round trip; false when the key is missing.
+        bool Fetch(const SliceIndex& index, const string& key, string& value, int64_t& pttl);
+
+        bool Load(const SliceIndex& index, const string& key, uint32_t ttl, LOADFUN loader, void* privdata, const string* stale, string& value);
+
+        bool ShouldRefresh(const string& key, int64_t pttl);
+
+    private:
+        xRedisClient* mClient;
+        LoaderOption mOption;
+        xRedisScript mScript;
+        ScriptHandle mUnlock;
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCond;
+        std::map<FlightKey, LoadFlight*> mFlights;
+        xLock mDeltaLock;
+        std::tr1::unordered_map<string, uint64_t> mDeltaUs;
+        LoaderStats mStats;
+    };
+
+}
+
+#endif
@@ -0,0 +1,516 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <map>
+#include "xRedisMigrate.h"
+#include "xRedisRoute.h"
+
+using namespace xrcp;
+
+#define MIGRATE_CHECKPOINT_MAGIC "xredis-migrate 1"
+#define MIGRATE_DEFAULT_SCAN_COUNT 512
+#define MIGRATE_TOMBSTONE_SUFFIX ":xredis-migrate-del"
+#define MIGRATE_TOMBSTONE_MS 3600000   // far longer than any DUMP to RESTORE window
+
+// RESTORE unless del() left a tombstone or the key was written on the new
+// slice: 1 restored, 0 deleted meanwhile, 2 already there.
+static const char* gRestoreScript =
+        "if redis.call('EXISTS', KEYS[2]) == 1 then return 0 end "
+        "if redis.call('EXISTS', KEYS[1]) == 1 then return 2 end "
+        "redis.call('RESTORE', KEYS[1], ARGV[1], ARGV[2]) return 1";
+
+xRedisMigrate::xRedisMigrate(xRedisClient* client) {
+    mClient = client;
+    memset(&mProgress, 0, sizeof(mProgress));
+    mRestoreScript = INVALID_SCRIPT_HANDLE;
+    mStop = false;
+}
+
+xRedisMigrate::~xRedisMigrate() {
+}
+
+bool xRedisMigrate::Init(const MigrateOption& option) {
+    if ((NULL == mClient) || (NULL == option.fun))
+        return false;
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    uint32_t sliceCount = pRedisPool->GetSliceCount(option.srcNode);
+    if ((0 == sliceCount) || (0 == pRedisPool->GetSliceCount(option.dstNode)))
+        return false;
+
+    std::vector<string> vSrcServers;
+    std::vector<string> vDstServers;
+    GetServers(option.srcNode, vSrcServers);
+    GetServers(option.dstNode, vDstServers);
+
+    // Loaded on the new masters now and on every (re)connect; EVAL covers
+    // a server that lost it anyway.
+    if (INVALID_SCRIPT_HANDLE == mRestoreScript) {
+        if (!mScript.Init(mClient))
+            return false;
+        mRestoreScript = mScript.Register(gRestoreScript);
+    }
+    mScript.Preload(option.dstNode);
+
+    XLOCK(mLock);
+    mSrcServers.swap(vSrcServers);
+    mDstServers.swap(vDstServers);
+    mOption = option;
+    if (0 == mOption.scanCount)
+        mOption.scanCount = MIGRATE_DEFAULT_SCAN_COUNT;
+    if (0 == mOption.threads)
+        mOption.threads = 1;
+    mCursors.assign(sliceCount, 0);
+    mDone.assign(sliceCount, 0);
+    mFailures.clear();
+    memset(&mProgress, 0, sizeof(mProgress));
+    mProgress.sliceCount = sliceCount;
+    mKeyBucket.Init(mOption.keysPerSec, mOption.keysPerSec);
+    mByteBucket.Init(mOption.bytesPerSec, mOption.bytesPerSec);
+    mStop = false;
+    return true;
+}
+
+void xRedisMigrate::GetServers(uint32_t nodeIndex, std::vector<string>& vServers) {
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    uint32_t sliceCount = pRedisPool->GetSliceCount(nodeIndex);
+    vServers.assign(sliceCount, "");
+    for (uint32_t i = 0; i < sliceCount; ++i) {
+        RedisConn* pRedisConn = pRedisPool->GetConnection(nodeIndex, i, MASTER);
+        if (NULL != pRedisConn) {
+            vServers[i] = GetPeerName(pRedisConn->getCtx());
+            pRedisPool->FreeConnection(pRedisConn);
+        }
+    }
+}
+
+bool xRedisMigrate::Run() {
+    std::vector<SliceTask> vTasks;
+    {
+        XLOCK(mLock);
+        mStop = false;
+        for (uint32_t i = 0; i < mDone.size(); ++i) {
+            if (!mDone[i]) {
+                SliceTask task;
+                task.migrate = this;
+                task.sliceIndex = i;
+                task.ok = false;
+                vTasks.push_back(task);
+            }
+        }
+    }
+
+    std::vector<void*> vArgs;
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        vArgs.push_back(&vTasks[i]);
+    }
+    RunParallel(SliceWorker, vArgs, mOption.threads);
+
+    return IsFinished();
+}
+
+void xRedisMigrate::Stop() {
+    mStop = true;
+}
+
+bool xRedisMigrate::IsFinished() {
+    XLOCK(mLock);
+    return !mDone.empty() && (mProgress.slicesDone == mDone.size());
+}
+
+void xRedisMigrate::GetProgress(MigrateProgress& progress) {
+    XLOCK(mLock);
+    progress = mProgress;
+}
+
+void xRedisMigrate::GetFailures(std::vector<MigrateFailure>& failures) {
+    XLOCK(mLock);
+    failures = mFailures;
+}
+
+void xRedisMigrate::AddFailure(const string& key, const redisReply* reply) {
+    MigrateFailure failure;
+    failure.key = key;
+    if ((NULL != reply) && (REDIS_REPLY_ERROR == reply->type))
+        failure.error.assign(reply->str, reply->len);
+    else
+        failure.error = "unexpected reply";
+    XLOCK(mLock);
+    mFailures.push_back(failure);
+}
+
+void xRedisMigrate::AddProgress(uint64_t moved, uint64_t skipped, uint64_t failed, uint64_t bytes) {
+    XLOCK(mLock);
+    mProgress.moved += moved;
+    mProgress.skipped += skipped;
+    mProgress.failed += failed;
+    mProgress.bytes += bytes;
+}
+
+void xRedisMigrate::SliceWorker(void* arg) {
+    SliceTask* pTask = static_cast<SliceTask*>(arg);
+    pTask->ok = pTask->migrate->MigrateSlice(pTask->sliceIndex);
+}
+
+bool xRedisMigrate::MigrateSlice(uint32_t sliceIndex) {
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    int64_t cursor = 0;
+    {
+        XLOCK(mLock);
+        cursor = mCursors[sliceIndex];
+    }
+
+    while (!mStop) {
+        VDATA vCmdData;
+        vCmdData.push_back("SCAN");
+        vCmdData.push_back(toString(cursor));
+        if (!mOption.pattern.empty()) {
+            vCmdData.push_back("MATCH");
+            vCmdData.push_back(mOption.pattern);
+        }
+        vCmdData.push_back("COUNT");
+        vCmdData.push_back(toString(mOption.scanCount));
+
+        RedisConn* pRedisConn = pRedisPool->GetConnection(mOption.srcNode, sliceIndex, MASTER);
+        if (NULL == pRedisConn)
+            return false;
+        redisReply* reply = RedisCommandArgv(pRedisConn, vCmdData);
+        pRedisPool->FreeConnection(pRedisConn);
+
+        if ((NULL == reply) || (REDIS_REPLY_ARRAY != reply->type) || (2 != reply->elements)) {
+            RedisPool::FreeReply(reply);
+            return false;
+        }
+
+        int64_t next = atoll(reply->element[0]->str);
+        bool bRet = MigrateBatch(sliceIndex, reply->element[1]);
+        RedisPool::FreeReply(reply);
+        if (!bRet)
+            return false;
+
+        // The cursor only advances once the whole batch is on the new slice.
+        XLOCK(mLock);
+        mCursors[sliceIndex] = next;
+        if (0 == next) {
+            mDone[sliceIndex] = 1;
+            mProgress.slicesDone++;
+            return true;
+        }
+        cursor = next;
+    }
+    return false;
+}
+
+bool xRedisMigrate::MigrateBatch(uint32_t sliceIndex, redisReply* keys) {
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    {
+        XLOCK(mLock);
+        mProgress.scanned += keys->elements;
+    }
+
+    std::vector<string> vKeys;
+    std::vector<uint32_t> vDstSlices;
+    uint64_t skipped = 0;
+    for (size_t i = 0; i < keys->elements; ++i) {
+        string key(keys->element[i]->str, keys->element[i]->len);
+        size_t suffixLen = ::strlen(MIGRATE_TOMBSTONE_SUFFIX);
+        if ((key.size() > suffixLen) && (0 == key.compare(key.size() - suffixLen, suffixLen, MIGRATE_TOMBSTONE_SUFFIX))) {
+            ++skipped;      // our own tombstone, when both layouts share servers
+            continue;
+        }
+        uint32_t dstSlice = 0;
+        if (!xRedisRoute::Locate(pRedisPool, mOption.dstNode, key.c_str(), mOption.fun, dstSlice))
+            return false;
+        if (!mSrcServers[sliceIndex].empty() && (mSrcServers[sliceIndex] == mDstServers[dstSlice])) {
+            ++skipped;      // already on the right server
+            continue;
+        }
+        vKeys.push_back(key);
+        vDstSlices.push_back(dstSlice);
+    }
+    if (vKeys.empty()) {
+        AddProgress(0, skipped, 0, 0);
+        return true;
+    }
+
+    mKeyBucket.Acquire(vKeys.size());
+
+    std::vector<VDATA> vCmds;
+    for (size_t i = 0; i < vKeys.size(); ++i) {
+        VDATA vDump;
+        vDump.push_back("DUMP");
+        vDump.push_back(vKeys[i]);
+        vCmds.push_back(vDump);
+        VDATA vTtl;
+        vTtl.push_back("PTTL");
+        vTtl.push_back(vKeys[i]);
+        vCmds.push_back(vTtl);
+    }
+
+    RedisConn* pRedisConn = pRedisPool->GetConnection(mOption.srcNode, sliceIndex, MASTER);
+    if (NULL == pRedisConn)
+        return false;
+    string srcServer = GetPeerName(pRedisConn->getCtx());
+    std::vector<redisReply*> vReplies;
+    bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+    if (!bRet)
+        pRedisConn->RedisReConnect();
+    pRedisPool->FreeConnection(pRedisConn);
+    if (!bRet)
+        return false;
+
+    std::vector<redisReply*> vDumps(vKeys.size(), NULL);
+    std::vector<int64_t> vTtls(vKeys.size(), 0);
+    std::map<uint32_t, std::vector<size_t> > mGroups;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < vKeys.size(); ++i) {
+        redisReply* dump = vReplies[i * 2];
+        redisReply* ttl = vReplies[i * 2 + 1];
+        if ((REDIS_REPLY_STRING != dump->type) || (REDIS_REPLY_INTEGER != ttl->type) || (-2 == ttl->integer)) {
+            ++skipped;      // expired or deleted since SCAN
+            continue;
+        }
+        vDumps[i] = dump;
+        vTtls[i] = (ttl->integer > 0) ? ttl->integer : 0;
+        bytes += dump->len;
+        mGroups[vDstSlices[i]].push_back(i);
+    }
+    mByteBucket.Acquire(bytes);
+
+    std::vector<string> vDone;
+    for (std::map<uint32_t, std::vector<size_t> >::iterator iter = mGroups.begin(); iter != mGroups.end(); ++iter) {
+        if (!RestoreGroup(iter->first, srcServer, vKeys, vDumps, vTtls, iter->second, vDone)) {
+            bRet = false;
+            break;
+        }
+    }
+    FreeReplies(vReplies);
+    AddProgress(0, skipped, 0, bytes);
+
+    if (bRet && mOption.deleteSource && !vDone.empty()) {
+        vCmds.clear();
+        for (size_t i = 0; i < vDone.size(); ++i) {
+            VDATA vDel;
+            vDel.push_back("DEL");
+            vDel.push_back(vDone[i]);
+            vCmds.push_back(vDel);
+        }
+        pRedisConn = pRedisPool->GetConnection(mOption.srcNode, sliceIndex, MASTER);
+        if (NULL == pRedisConn)
+            return false;
+        bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+        if (!bRet)
+            pRedisConn->RedisReConnect();
+        pRedisPool->FreeConnection(pRedisConn);
+        FreeReplies(vReplies);
+    }
+    return bRet;
+}
+
+bool xRedisMigrate::RestoreGroup(uint32_t dstSlice, const string& srcServer, const std::vector<string>& vKeys, const std::vector<redisReply*>& vDumps,
+                                 const std::vector<int64_t>& vTtls, const std::vector<size_t>& vIdx, std::vector<string>& vDone) {
+    string sha;
+    mScript.GetSha(mRestoreScript, sha);
+    std::vector<VDATA> vCmds;
+    for (size_t i = 0; i < vIdx.size(); ++i) {
+        size_t k = vIdx[i];
+        VDATA vRestore;
+        vRestore.push_back("EVALSHA");
+        vRestore.push_back(sha);
+        vRestore.push_back("2");
+        vRestore.push_back(vKeys[k]);
+        vRestore.push_back(vKeys[k] + MIGRATE_TOMBSTONE_SUFFIX);
+        vRestore.push_back(toString(vTtls[k]));
+        vRestore.push_back(string(vDumps[k]->str, vDumps[k]->len));
+        vCmds.push_back(vRestore);
+    }
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(mOption.dstNode, dstSlice, MASTER);
+    if (NULL == pRedisConn)
+        return false;
+
+    // The source server itself (shared pools, failover since Init): the
+    // keys are where they belong, an "already there" would be the source.
+    string dstServer = GetPeerName(pRedisConn->getCtx());
+    bool verified = !srcServer.empty() && !dstServer.empty();
+    if (verified && (srcServer == dstServer)) {
+        pRedisPool->FreeConnection(pRedisConn);
+        AddProgress(0, vIdx.size(), 0, 0);
+        return true;
+    }
+
+    std::vector<redisReply*> vReplies;
+    bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+
+    // A server without the script (restart, SCRIPT FLUSH) gets the body
+    // again; the first EVAL caches it for the rest.
+    std::vector<size_t> vRetry;
+    for (size_t i = 0; bRet && (i < vReplies.size()); ++i) {
+        if ((REDIS_REPLY_ERROR == vReplies[i]->type) && (0 == strncmp(vReplies[i]->str, "NOSCRIPT", 8))) {
+            vCmds[i][0] = "EVAL";
+            vCmds[i][1] = gRestoreScript;
+            vRetry.push_back(i);
+        }
+    }
+    if (!vRetry.empty()) {
+        std::vector<VDATA> vEvals;
+        for (size_t i = 0; i < vRetry.size(); ++i) {
+            vEvals.push_back(vCmds[vRetry[i]]);
+        }
+        std::vector<redisReply*> vEvalReplies;
+        bRet = RedisPipelineArgv(pRedisConn, vEvals, vEvalReplies);
+        for (size_t i = 0; bRet && (i < vRetry.size()); ++i) {
+            RedisPool::FreeReply(vReplies[vRetry[i]]);
+            vReplies[vRetry[i]] = vEvalReplies[i];
+        }
+    }
+    if (!bRet) {
+        FreeReplies(vReplies);
+        pRedisConn->RedisReConnect();
+    }
+    pRedisPool->FreeConnection(pRedisConn);
+    if (!bRet) {
+        AddProgress(0, 0, vIdx.size(), 0);
+        return false;
+    }
+
+    uint64_t moved = 0;
+    uint64_t skipped = 0;
+    uint64_t failed = 0;
+    for (size_t i = 0; i < vReplies.size(); ++i) {
+        redisReply* reply = vReplies[i];
+        if ((REDIS_REPLY_INTEGER == reply->type) && (1 == reply->integer)) {
+            ++moved;
+            vDone.push_back(vKeys[vIdx[i]]);
+        } else if (REDIS_REPLY_INTEGER == reply->type) {
+            // Deleted, or written on the new slice, during the migration:
+            // the newer state wins. The source copy only goes when the new
+            // slice is verified to be another server.
+            ++skipped;
+            if (verified)
+                vDone.push_back(vKeys[vIdx[i]]);
+        } else {
+            // OOM, a bad payload...: the key stays on the source, listed
+            // for the caller, and the rest of the batch goes on.
+            ++failed;
+            AddFailure(vKeys[vIdx[i]], reply);
+        }
+    }
+    FreeReplies(vReplies);
+    AddProgress(moved, skipped, failed, 0);
+    return true;
+}
+
+bool xRedisMigrate::SaveCheckpoint(const char* path) {
+    if (NULL == path)
+        return false;
+
+    string tmp(path);
+    tmp += ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "w");
+    if (NULL == fp)
+        return false;
+
+    {
+        XLOCK(mLock);
+        fprintf(fp, "%s\n%u %u %zu\n", MIGRATE_CHECKPOINT_MAGIC, mOption.srcNode, mOption.dstNode, mCursors.size());
+        for (size_t i = 0; i < mCursors.size(); ++i) {
+            fprintf(fp, "%zu %lld %u\n", i, (long long) mCursors[i], (uint32_t) mDone[i]);
+        }
+    }
+
+    bool bRet = (0 == fflush(fp)) && (0 == fsync(fileno(fp)));
+    fclose(fp);
+    return bRet && (0 == rename(tmp.c_str(), path));
+}
+
+bool xRedisMigrate::LoadCheckpoint(const char* path) {
+    if (NULL == path)
+        return false;
+
+    FILE* fp = fopen(path, "r");
+    if (NULL == fp)
+        return false;
+
+    char szMagic[64] = {0};
+    uint32_t srcNode = 0;
+    uint32_t dstNode = 0;
+    size_t sliceCount = 0;
+    bool bRet = (NULL != fgets(szMagic, sizeof(szMagic), fp)) &&
+                (0 == strncmp(szMagic, MIGRATE_CHECKPOINT_MAGIC, strlen(MIGRATE_CHECKPOINT_MAGIC))) &&
+                (3 == fscanf(fp, "%u %u %zu", &srcNode, &dstNode, &sliceCount));
+
+    XLOCK(mLock);
+    if (bRet && ((srcNode != mOption.srcNode) || (dstNode != mOption.dstNode) || (sliceCount != mCursors.size())))
+        bRet = false;
+
+    std::vector<int64_t> vCursors(sliceCount, 0);
+    std::vector<uint8_t> vDone(sliceCount, 0);
+    for (size_t i = 0; bRet && (i < sliceCount); ++i) {
+        size_t slice = 0;
+        long long cursor = 0;
+        uint32_t done = 0;
+        if ((3 != fscanf(fp, "%zu %lld %u", &slice, &cursor, &done)) || (slice >= sliceCount)) {
+            bRet = false;
+            break;
+        }
+        vCursors[slice] = cursor;
+        vDone[slice] = (uint8_t) (done ? 1 : 0);
+    }
+    fclose(fp);
+
+    if (bRet) {
+        mCursors.swap(vCursors);
+        mDone.swap(vDone);
+        mProgress.slicesDone = 0;
+        for (size_t i = 0; i < mDone.size(); ++i) {
+            mProgress.slicesDone += mDone[i];
+        }
+    }
+    return bRet;
+}
+
+bool xRedisMigrate::get(const string& key, string& value) {
+    SliceIndex dstIndex(mClient, mOption.dstNode);
+    if (!dstIndex.Create(key.c_str(), mOption.fun))
+        return false;
+    if (mClient->get(dstIndex, key, value))
+        return true;
+    if (IsFinished())
+        return false;
+
+    SliceIndex srcIndex(mClient, mOption.srcNode);
+    return srcIndex.Create(key.c_str(), mOption.fun) && mClient->get(srcIndex, key, value);
+}
+
+bool xRedisMigrate::set(const string& key, const string& value) {
+    SliceIndex dstIndex(mClient, mOption.dstNode);
+    return dstIndex.Create(key.c_str(), mOption.fun) && mClient->set(dstIndex, key, value);
+}
+
+bool xRedisMigrate::del(const string& key) {
+    SliceIndex dstIndex(mClient, mOption.dstNode);
+    if (!dstIndex.Create(key.c_str(), mOption.fun))
+        return false;
+
+    // The tombstone goes first: a RESTORE of a copy dumped before this
+    // delete checks it and does not bring the key back.
+    bool finished = IsFinished();
+    if (!finished && !mClient->set(dstIndex, key + MIGRATE_TOMBSTONE_SUFFIX, "1", PX, MIGRATE_TOMBSTONE_MS, DEFAULT_NXXX))
+        return false;
+    bool bRet = mClient->del(dstIndex, key);
+
+    if (!finished) {
+        SliceIndex srcIndex(mClient, mOption.srcNode);
+        if (srcIndex.Create(key.c_str(), mOption.fun) && mClient->del(srcIndex, key))
+            bRet = true;
+    }
+    return bRet;
+}
@@ -0,0 +1,138 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_MIGRATE_H_
+#define _XREDIS_MIGRATE_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+#include "xRedisUtil.h"
+#include "xRedisScript.h"
+
+namespace xrcp {
+
+    typedef struct _MIGRATE_OPTION_ {
+        uint32_t srcNode;       // current layout
+        uint32_t dstNode;       // new layout, its slice count and placement apply
+        HASHFUN fun;            // key hash, the same for both nodes
+        std::string pattern;    // SCAN MATCH filter, empty for every key
+        uint32_t scanCount;     // SCAN COUNT hint, also the DUMP/RESTORE pipeline depth
+        uint32_t threads;       // source slices migrated in parallel
+        uint64_t keysPerSec;    // 0 for no limit
+        uint64_t bytesPerSec;   // DUMP payload bytes, 0 for no limit
+        bool deleteSource;      // drop keys from the source once on another server
+    } MigrateOption;
+
+    typedef struct _MIGRATE_PROGRESS_ {
+        uint64_t scanned;       // keys seen by SCAN
+        uint64_t moved;         // keys restored on the new slice
+        uint64_t skipped;       // staying, expired, deleted, or already written on the new slice
+        uint64_t failed;
+        uint64_t bytes;
+        uint32_t slicesDone;
+        uint32_t sliceCount;
+    } MigrateProgress;
+
+    typedef struct _MIGRATE_FAILURE_ {
+        KEY key;
+        string error;           // the RESTORE error; the key is still on the source
+    } MigrateFailure;
+
+    // Moves keys from srcNode to the slice dstNode's placement gives them,
+    // copying values and TTLs with pipelined SCAN + DUMP/PTTL + RESTORE, one
+    // source slice per worker.
+    //
+    // Servers are told apart by host:port of their connections, so a key
+    // whose new slice lives on the server it is already on stays put and is
+    // never deleted, whatever the two slice mappings.
+    //
+    // RESTORE never replaces, so a key written to the new location while the
+    // migration runs is kept over the older copy, and del() leaves a short
+    // lived tombstone (key + ":xredis-migrate-del") that stops an in-flight
+    // copy from resurrecting the key. Keep using get/set/del below until
+    // Run() returns true: reads fall back to the old slice, writes go to the
+    // new one. A key whose RESTORE fails for any other reason stays on the
+    // source and is listed by GetFailures(); the migration carries on. The
+    // restore script is registered with xRedisScript and sent by EVALSHA.
+    //
+    // Per-slice SCAN cursors form the checkpoint. After Stop() or a crash,
+    // LoadCheckpoint() and Run() carry on where the last batch ended.
+    class xRedisMigrate {
+    public:
+        explicit xRedisMigrate(xRedisClient* client);
+
+        ~xRedisMigrate();
+
+        bool Init(const MigrateOption& option);
+
+        // Blocks until every slice is done (true) or Stop()/an error ends it.
+        bool Run();
+
+        void Stop();
+
+        bool IsFinished();
+
+        void GetProgress(MigrateProgress& progress);
+
+        void GetFailures(std::vector<MigrateFailure>& failures);
+
+        bool SaveCheckpoint(const char* path);
+
+        bool LoadCheckpoint(const char* path);
+
+        bool get(const string& key, string& value);
+
+        bool set(const string& key, const string& value);
+
+        bool del(const string& key);
+
+    private:
+        typedef struct _SLICE_TASK_ {
+            xRedisMigrate* migrate;
+            uint32_t sliceIndex;
+            bool ok;
+        } SliceTask;
+
+        static void SliceWorker(void* arg);
+
+        bool MigrateSlice(uint32_t sliceIndex);
+
+        bool MigrateBatch(uint32_t sliceIndex, redisReply* keys);
+
+        // srcServer is where the payloads were dumped; keys reported already
+        // present only go to vDone when the new slice is another server.
+        bool RestoreGroup(uint32_t dstSlice, const string& srcServer, const std::vector<string>& vKeys, const std::vector<redisReply*>& vDumps,
+                          const std::vector<int64_t>& vTtls, const std::vector<size_t>& vIdx, std::vector<string>& vDone);
+
+        // host:port of every slice's master, empty where unknown.
+        void GetServers(uint32_t nodeIndex, std::vector<string>& vServers);
+
+        void AddProgress(uint64_t moved, uint64_t skipped, uint64_t failed, uint64_t bytes);
+
+        void AddFailure(const string& key, const redisReply* reply);
+
+    private:
+        xRedisClient* mClient;
+        MigrateOption mOption;
+        std::vector<int64_t> mCursors;
+        std::vector<uint8_t> mDone;
+        std::vector<string> mSrcServers;
+        std::vector<string> mDstServers;
+        MigrateProgress mProgress;
+        std::vector<MigrateFailure> mFailures;
+        xRedisScript mScript;
+        ScriptHandle mRestoreScript;
+        xLock mLock;
+        xRedisTokenBucket mKeyBucket;
+        xRedisTokenBucket mByteBucket;
+        volatile bool mStop;
+    };
+
+}
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisMirror.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define MIRROR_DEFAULT_QUEUE 65536
+
+xRedisMirror::xRedisMirror() {
+    mClient = NULL;
+    memset(&mOption, 0, sizeof(mOption));
+    memset(&mStats, 0, sizeof(mStats));
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+    mSampleSeq = 0;
+    mSampleStep = 0;
+    mStop = false;
+}
+
+xRedisMirror::~xRedisMirror() {
+    Release();
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+bool xRedisMirror::Init(xRedisClient* client, const MirrorOption& option) {
+    if ((NULL == client) || (NULL != mClient) || (NULL == option.fun) || (option.primaryNode == option.shadowNode))
+        return false;
+
+    mClient = client;
+    mOption = option;
+    if (0 == mOption.queueSize)
+        mOption.queueSize = MIRROR_DEFAULT_QUEUE;
+    if (0 == mOption.threads)
+        mOption.threads = 1;
+
+    // Every mSampleStep-th read is shadowed.
+    mSampleStep = 0;
+    if (mOption.readSampleRate >= 1.0)
+        mSampleStep = 1;
+    else if (mOption.readSampleRate > 0)
+        mSampleStep = (uint64_t) (1.0 / mOption.readSampleRate + 0.5);
+
+    mStop = false;
+    for (uint32_t i = 0; i < mOption.threads; ++i) {
+        pthread_t tid;
+        if (0 == pthread_create(&tid, NULL, Worker, this))
+            mThreads.push_back(tid);
+    }
+    return !mThreads.empty();
+}
+
+void xRedisMirror::Release() {
+    pthread_mutex_lock(&mMutex);
+    mStop = true;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mMutex);
+
+    for (size_t i = 0; i < mThreads.size(); ++i) {
+        pthread_join(mThreads[i], NULL);
+    }
+    mThreads.clear();
+
+    while (!mQueue.empty()) {
+        delete mQueue.front();
+        mQueue.pop_front();
+    }
+    mClient = NULL;
+}
+
+void xRedisMirror::Canonical(const redisReply* reply, string& out) {
+    if (NULL == reply) {
+        out += "!";
+        return;
+    }
+
+    out += toString(reply->type);
+    out += ":";
+    switch (reply->type) {
+        case REDIS_REPLY_INTEGER:
+            out += toString(reply->integer);
+            break;
+        case REDIS_REPLY_ARRAY:
+            out += toString(reply->elements);
+            out += "[";
+            for (size_t i = 0; i < reply->elements; ++i) {
+                Canonical(reply->element[i], out);
+            }
+            out += "]";
+            break;
+        case REDIS_REPLY_NIL:
+            break;
+        default:
+            out += toString(reply->len);
+            out += ":";
+            out.append(reply->str, reply->len);
+            break;
+    }
+    out += ";";
+}
+
+void xRedisMirror::AddLatency(uint64_t& count, uint64_t& total, uint64_t& max, uint64_t us) {
+    count++;
+    total += us;
+    if (us > max)
+        max = us;
+}
+
+bool xRedisMirror::Sample() {
+    if (0 == mSampleStep)
+        return false;
+    return 0 == (__sync_fetch_and_add(&mSampleSeq, 1) % mSampleStep);
+}
+
+bool xRedisMirror::Enqueue(MirrorJob* job) {
+    pthread_mutex_lock(&mMutex);
+    bool bRet = !mStop && (mQueue.size() < mOption.queueSize);
+    if (bRet) {
+        mQueue.push_back(job);
+        pthread_cond_signal(&mCond);
+    }
+    pthread_mutex_unlock(&mMutex);
+
+    if (!bRet) {
+        delete job;
+        XLOCK(mStatsLock);
+        mStats.dropped++;
+    }
+    return bRet;
+}
+
+void* xRedisMirror::Worker(void* arg) {
+    xRedisMirror* pMirror = static_cast<xRedisMirror*>(arg);
+    for (;;) {
+        pthread_mutex_lock(&pMirror->mMutex);
+        while (!pMirror->mStop && pMirror->mQueue.empty()) {
+            pthread_cond_wait(&pMirror->mCond, &pMirror->mMutex);
+        }
+        if (pMirror->mStop) {
+            pthread_mutex_unlock(&pMirror->mMutex);
+            break;
+        }
+        MirrorJob* job = pMirror->mQueue.front();
+        pMirror->mQueue.pop_front();
+        pthread_mutex_unlock(&pMirror->mMutex);
+
+        pMirror->RunJob(job);
+        delete job;
+    }
+    return NULL;
+}
+
+void xRedisMirror::RunJob(MirrorJob* job) {
+    SliceIndex index(mClient, mOption.shadowNode);
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = NULL;
+    if (index.Create(job->key.c_str(), mOption.fun))
+        pRedisConn = pRedisPool->GetConnection(mOption.shadowNode, index.mSliceIndex, MASTER);
+    if (NULL == pRedisConn) {
+        XLOCK(mStatsLock);
+        mStats.shadowErrors++;
+        return;
+    }
+
+    uint64_t start = GetMonotonicUs();
+    redisReply* reply = RedisCommandArgv(pRedisConn, job->argv);
+    uint64_t us = GetMonotonicUs() - start;
+    pRedisPool->FreeConnection(pRedisConn);
+
+    bool match = false;
+    if (job->compare) {
+        string actual;
+        Canonical(reply, actual);
+        match = actual == job->expected;
+    }
+
+    XLOCK(mStatsLock);
+    AddLatency(mStats.shadowCount, mStats.shadowUs, mStats.shadowMaxUs, us);
+    if ((NULL == reply) || (REDIS_REPLY_ERROR == reply->type))
+        mStats.shadowErrors++;
+    if (job->compare) {
+        mStats.reads++;
+        if (match)
+            mStats.matches++;
+        else
+            mStats.mismatches++;
+    } else {
+        mStats.writes++;
+    }
+    RedisPool::FreeReply(reply);
+}
+
+rReply* xRedisMirror::commandargv(const string& key, const VDATA& vData) {
+    if ((NULL == mClient) || vData.empty() || key.empty())
+        return NULL;
+
+    SliceIndex index(mClient, mOption.primaryNode);
+    if (!index.Create(key.c_str(), mOption.fun))
+        return NULL;
+
+    bool isRead = IsReadCommand(vData[0]);
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, isRead ? SLAVE : MASTER);
+    if (NULL == pRedisConn)
+        return NULL;
+
+    uint64_t start = GetMonotonicUs();
+    redisReply* reply = RedisCommandArgv(pRedisConn, vData);
+    uint64_t us = GetMonotonicUs() - start;
+    pRedisPool->FreeConnection(pRedisConn);
+    {
+        XLOCK(mStatsLock);
+        AddLatency(mStats.primaryCount, mStats.primaryUs, mStats.primaryMaxUs, us);
+    }
+
+    // Only what the primary accepted is repeated on the shadow.
+    if ((NULL != reply) && (REDIS_REPLY_ERROR != reply->type) && (!isRead || Sample())) {
+        MirrorJob* job = new MirrorJob;
+        job->key = key;
+        job->argv = vData;
+        job->compare = isRead;
+        if (isRead)
+            Canonical(reply, job->expected);
+        Enqueue(job);
+    }
+    return reply;
+}
+
+bool xRedisMirror::get(const string& key, string& value) {
+    VDATA vCmdData;
+    vCmdData.push_back("GET");
+    vCmdData.push_back(key);
+    redisReply* reply = commandargv(key, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply);
+    if (bRet)
+        value.assign(reply->str, reply->len);
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisMirror::set(const string& key, const string& value) {
+    VDATA vCmdData;
+    vCmdData.push_back("SET");
+    vCmdData.push_back(key);
+    vCmdData.push_back(value);
+    redisReply* reply = commandargv(key, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply);
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisMirror::del(const string& key) {
+    VDATA vCmdData;
+    vCmdData.push_back("DEL");
+    vCmdData.push_back(key);
+    redisReply* reply = commandargv(key, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply) && (1 == reply->integer);
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+void xRedisMirror::GetStats(MirrorStats& stats) {
+    XLOCK(mStatsLock);
+    stats = mStats;
+}
+
+void xRedisMirror::ResetStats() {
+    XLOCK(mStatsLock);
+    memset(&mStats, 0, sizeof(mStats));
+}
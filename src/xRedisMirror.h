@@ -0,0 +1,108 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_MIRROR_H_
+#define _XREDIS_MIRROR_H_
+
+#include <pthread.h>
+#include <deque>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef struct _MIRROR_OPTION_ {
+        uint32_t primaryNode;   // serves every caller request
+        uint32_t shadowNode;    // receives copies, never seen by callers
+        HASHFUN fun;            // key hash, the same for both nodes
+        uint32_t queueSize;     // pending shadow jobs, more are dropped
+        uint32_t threads;       // shadow workers; above 1, writes to one key may reach the shadow out of order
+        double readSampleRate;  // fraction of reads replayed on the shadow, 0..1
+    } MirrorOption;
+
+    typedef struct _MIRROR_STATS_ {
+        uint64_t writes;        // writes copied to the shadow
+        uint64_t reads;         // reads replayed on the shadow
+        uint64_t dropped;       // jobs dropped with a full queue
+        uint64_t shadowErrors;  // shadow connection failures and error replies
+        uint64_t matches;       // shadow read equal to the primary reply
+        uint64_t mismatches;
+        uint64_t primaryCount;
+        uint64_t primaryUs;     // total primary latency
+        uint64_t primaryMaxUs;
+        uint64_t shadowCount;
+        uint64_t shadowUs;      // total shadow latency
+        uint64_t shadowMaxUs;
+    } MirrorStats;
+
+    // Sends every request to the primary node and, off the caller's thread,
+    // repeats writes and a sample of reads on the shadow node, comparing the
+    // shadow's read replies with what the primary returned. The shadow can be
+    // slow or down: its jobs go through a bounded queue that drops when full.
+    class xRedisMirror {
+    public:
+        xRedisMirror();
+
+        ~xRedisMirror();
+
+        bool Init(xRedisClient* client, const MirrorOption& option);
+
+        void Release();
+
+        // key routes the command; caller owns the primary reply and frees it
+        // with RedisPool::FreeReply().
+        rReply* commandargv(const string& key, const VDATA& vData);
+
+        bool get(const string& key, string& value);
+
+        bool set(const string& key, const string& value);
+
+        bool del(const string& key);
+
+        void GetStats(MirrorStats& stats);
+
+        void ResetStats();
+
+        // Type and content of a reply as one comparable string.
+        static void Canonical(const redisReply* reply, string& out);
+
+    private:
+        typedef struct _MIRROR_JOB_ {
+            string key;
+            VDATA argv;
+            bool compare;
+            string expected;    // canonical primary reply for reads
+        } MirrorJob;
+
+        static void* Worker(void* arg);
+
+        void RunJob(MirrorJob* job);
+
+        bool Enqueue(MirrorJob* job);
+
+        bool Sample();
+
+        static void AddLatency(uint64_t& count, uint64_t& total, uint64_t& max, uint64_t us);
+
+    private:
+        xRedisClient* mClient;
+        MirrorOption mOption;
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCond;
+        std::deque<MirrorJob*> mQueue;
+        std::vector<pthread_t> mThreads;
+        xLock mStatsLock;
+        MirrorStats mStats;
+        uint64_t mSampleSeq;
+        uint64_t mSampleStep;
+        bool mStop;
+    };
+
+}
+
+#endif
@@ -0,0 +1,514 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <time.h>
+#include "xRedisMux.h"
+#include "xRedisResp3.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define MUX_DEFAULT_CONN_PER_SLICE 2
+#define MUX_DEFAULT_MAX_BATCH      64
+
+#define MUX_CLOSED_ERROR "mux released"
+
+// Blocking commands hold a connection but leave no state on it.
+static const char* gDedicatedCmd[] = {
+        "BLPOP", "BRPOP", "BRPOPLPUSH", "BLMOVE", "BZPOPMIN", "BZPOPMAX", "WAIT", NULL
+};
+
+// Commands that change the connection for whoever uses it next.
+static const char* gStatefulCmd[] = {
+        "SUBSCRIBE", "PSUBSCRIBE", "UNSUBSCRIBE", "PUNSUBSCRIBE", "MONITOR",
+        "SELECT", "MULTI", "EXEC", "DISCARD", "WATCH", "UNWATCH",
+        "AUTH", "HELLO", "CLIENT", "QUIT", "RESET", NULL
+};
+
+RedisMuxChannel::RedisMuxChannel(RedisConn* conn, const MuxOption& option) {
+    mConn = conn;
+    mOption = option;
+    mPending = 0;
+    mFlushing = false;
+    mDelayUs = 0;
+    memset(&mStats, 0, sizeof(mStats));
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+
+    // The batch wait is timed against the monotonic clock.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mBatchCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+RedisMuxChannel::~RedisMuxChannel() {
+    redisFree(mConn->getCtx());
+    delete mConn;
+    pthread_cond_destroy(&mBatchCond);
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+RedisConn* RedisMuxChannel::GetConn() {
+    return mConn;
+}
+
+uint32_t RedisMuxChannel::GetPending() const {
+    return mPending;
+}
+
+void RedisMuxChannel::GetStats(MuxStats& stats) {
+    pthread_mutex_lock(&mMutex);
+    stats.commands += mStats.commands;
+    stats.batches += mStats.batches;
+    stats.errors += mStats.errors;
+    pthread_mutex_unlock(&mMutex);
+}
+
+void RedisMuxChannel::Execute(MuxRequest* request) {
+    pthread_mutex_lock(&mMutex);
+    mQueue.push_back(request);
+    __sync_fetch_and_add(&mPending, 1);
+    if (mFlushing && (mQueue.size() >= mOption.maxBatch))
+        pthread_cond_signal(&mBatchCond);
+
+    while (!request->done) {
+        if (mFlushing) {
+            pthread_cond_wait(&mCond, &mMutex);
+            continue;
+        }
+
+        // This thread flushes on behalf of everyone queued behind it.
+        mFlushing = true;
+        if ((mDelayUs > 0) && (mQueue.size() < mOption.maxBatch))
+            WaitForBatch();
+
+        std::vector<MuxRequest*> batch;
+        batch.reserve(mQueue.size() < mOption.maxBatch ? mQueue.size() : mOption.maxBatch);
+        while (!mQueue.empty() && (batch.size() < mOption.maxBatch)) {
+            batch.push_back(mQueue.front());
+            mQueue.pop_front();
+        }
+        __sync_fetch_and_sub(&mPending, (uint32_t) batch.size());
+        pthread_mutex_unlock(&mMutex);
+
+        size_t failed = Flush(batch);
+
+        pthread_mutex_lock(&mMutex);
+        mStats.errors += failed;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            batch[i]->done = true;
+        }
+        mStats.commands += batch.size();
+        mStats.batches++;
+        AdaptDelay(batch.size());
+        mFlushing = false;
+        pthread_cond_broadcast(&mCond);
+    }
+
+    pthread_mutex_unlock(&mMutex);
+}
+
+size_t RedisMuxChannel::Flush(std::vector<MuxRequest*>& batch) {
+    // A connection that never came up has no context to reconnect.
+    if ((NULL == mConn->getCtx()) && !mConn->RedisConnect()) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            batch[i]->reply = NULL;
+        }
+        return batch.size();
+    }
+
+    redisContext* ctx = mConn->getCtx();
+    size_t sent = 0;
+    for (; sent < batch.size(); ++sent) {
+        if (REDIS_OK != RedisAppendCommandArgv(ctx, *batch[sent]->argv))
+            break;
+    }
+
+    // The first redisGetReply() writes the whole output buffer at once,
+    // replies then come back in the order the commands were appended.
+    size_t i = 0;
+    for (; i < sent; ++i) {
+        void* reply = NULL;
+        if (REDIS_OK != redisGetReply(ctx, &reply))
+            break;
+        batch[i]->reply = static_cast<redisReply*>(reply);
+        const VDATA& vData = *batch[i]->argv;
+        xRedisResp3::ToResp2(batch[i]->reply, vData[0].data(), vData[0].size());
+    }
+
+    for (size_t j = 0; xRedisWriteObserver::IsActive() && (j < i); ++j) {
+        xRedisWriteObserver::Notify(mConn->GetNodeIndex(), mConn->getSliceIndex(), *batch[j]->argv);
+    }
+
+    size_t failed = batch.size() - i;
+    if (failed > 0) {
+        for (; i < batch.size(); ++i) {
+            batch[i]->reply = NULL;
+        }
+        // Unread replies would be matched to the wrong callers, start over.
+        mConn->RedisReConnect();
+    }
+    return failed;
+}
+
+void RedisMuxChannel::WaitForBatch() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long) mDelayUs * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    // Execute() signals once the queue holds a full batch.
+    while (mQueue.size() < mOption.maxBatch) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&mBatchCond, &mMutex, &deadline))
+            break;
+    }
+}
+
+void RedisMuxChannel::AdaptDelay(size_t batchSize) {
+    // A lone command means nobody else was waiting: stop paying latency for it.
+    // Several commands mean there is concurrency to harvest: wait a bit longer.
+    if (batchSize <= 1) {
+        mDelayUs /= 2;
+    } else if (batchSize < mOption.maxBatch) {
+        mDelayUs = (0 == mDelayUs) ? 1 : mDelayUs * 2;
+        if (mDelayUs > mOption.maxDelayUs)
+            mDelayUs = mOption.maxDelayUs;
+    }
+}
+
+xRedisMux::xRedisMux() {
+    mClient = NULL;
+    mRedisPool = NULL;
+    mDedicated = 0;
+    mOption.connPerSlice = MUX_DEFAULT_CONN_PER_SLICE;
+    mOption.maxBatch = MUX_DEFAULT_MAX_BATCH;
+    mOption.maxDelayUs = 0;
+    mActive = 0;
+    mClosing = false;
+    pthread_mutex_init(&mStateMutex, NULL);
+    pthread_cond_init(&mStateCond, NULL);
+}
+
+xRedisMux::~xRedisMux() {
+    Release();
+    pthread_cond_destroy(&mStateCond);
+    pthread_mutex_destroy(&mStateMutex);
+}
+
+bool xRedisMux::Init(xRedisClient* client, const MuxOption& option) {
+    if ((NULL == client) || (NULL == client->GetRedisPool()))
+        return false;
+
+    mClient = client;
+    mRedisPool = client->GetRedisPool();
+    mOption = option;
+    if (0 == mOption.connPerSlice)
+        mOption.connPerSlice = MUX_DEFAULT_CONN_PER_SLICE;
+    if (0 == mOption.maxBatch)
+        mOption.maxBatch = MUX_DEFAULT_MAX_BATCH;
+
+    pthread_mutex_lock(&mStateMutex);
+    mClosing = false;
+    pthread_mutex_unlock(&mStateMutex);
+    return true;
+}
+
+bool xRedisMux::Connect(const RedisNode* nodeList, uint32_t nodeCount, uint32_t nodeIndex) {
+    if ((NULL == mRedisPool) || (NULL == nodeList) || !Enter())
+        return false;
+
+    bool bRet = true;
+    for (uint32_t sliceIndex = 0; sliceIndex < nodeCount; ++sliceIndex) {
+        const RedisNode* pNode = &nodeList[sliceIndex];
+        uint32_t role = (SLAVE == pNode->role) ? SLAVE : MASTER;
+
+        // Connect outside mLock, commands keep flowing meanwhile.
+        MuxChannelList added;
+        for (uint32_t i = 0; i < mOption.connPerSlice; ++i) {
+            RedisConn* pRedisConn = new RedisConn;
+            pRedisConn->Init(nodeIndex, sliceIndex, pNode->host, pNode->port, pNode->passwd, mOption.connPerSlice, pNode->timeout, role, 0);
+            if (!pRedisConn->RedisConnect())
+                bRet = false;
+            added.push_back(new RedisMuxChannel(pRedisConn, mOption));
+        }
+
+        XLOCK(mLock);
+        MuxChannelList& channels = mChannels[ChannelKey(nodeIndex, sliceIndex, role)];
+        channels.insert(channels.end(), added.begin(), added.end());
+    }
+
+    Leave();
+    return bRet;
+}
+
+void xRedisMux::Release() {
+    pthread_mutex_lock(&mStateMutex);
+    mClosing = true;
+    while (mActive > 0) {
+        pthread_cond_wait(&mStateCond, &mStateMutex);
+    }
+    pthread_mutex_unlock(&mStateMutex);
+
+    XLOCK(mLock);
+    for (MuxChannelMap::iterator iter = mChannels.begin(); iter != mChannels.end(); ++iter) {
+        MuxChannelList& channels = iter->second;
+        for (size_t i = 0; i < channels.size(); ++i) {
+            delete channels[i];
+        }
+    }
+    mChannels.clear();
+}
+
+bool xRedisMux::Enter() {
+    pthread_mutex_lock(&mStateMutex);
+    bool bRet = !mClosing;
+    if (bRet)
+        mActive++;
+    pthread_mutex_unlock(&mStateMutex);
+    return bRet;
+}
+
+void xRedisMux::Leave() {
+    pthread_mutex_lock(&mStateMutex);
+    if ((0 == --mActive) && mClosing)
+        pthread_cond_broadcast(&mStateCond);
+    pthread_mutex_unlock(&mStateMutex);
+}
+
+bool xRedisMux::IsDedicatedCommand(const VDATA& vData) {
+    if (vData.empty())
+        return false;
+
+    std::string cmd = ToUpperCmd(vData[0]);
+    for (uint32_t i = 0; NULL != gDedicatedCmd[i]; ++i) {
+        if (cmd == gDedicatedCmd[i])
+            return true;
+    }
+
+    // XREAD/XREADGROUP only block with the BLOCK option.
+    if ((cmd == "XREAD") || (cmd == "XREADGROUP")) {
+        for (size_t i = 1; i < vData.size(); ++i) {
+            if (ToUpperCmd(vData[i]) == "BLOCK")
+                return true;
+        }
+    }
+    return false;
+}
+
+bool xRedisMux::IsStatefulCommand(const VDATA& vData) {
+    if (vData.empty())
+        return false;
+
+    std::string cmd = ToUpperCmd(vData[0]);
+    for (uint32_t i = 0; NULL != gStatefulCmd[i]; ++i) {
+        if (cmd == gStatefulCmd[i])
+            return true;
+    }
+    return false;
+}
+
+uint64_t xRedisMux::ChannelKey(uint32_t nodeIndex, uint32_t sliceIndex, uint32_t ioType) {
+    return ((uint64_t) nodeIndex << 32) | ((uint64_t) sliceIndex << 1) | (ioType & 0x1);
+}
+
+RedisMuxChannel* xRedisMux::GetChannel(uint32_t nodeIndex, uint32_t sliceIndex, uint32_t ioType) {
+    XLOCK(mLock);
+    MuxChannelMap::iterator iter = mChannels.find(ChannelKey(nodeIndex, sliceIndex, ioType));
+    if ((iter == mChannels.end()) || iter->second.empty())
+        return NULL;
+
+    MuxChannelList& channels = iter->second;
+
+    RedisMuxChannel* pChannel = channels[0];
+    for (size_t i = 1; i < channels.size(); ++i) {
+        if (channels[i]->GetPending() < pChannel->GetPending())
+            pChannel = channels[i];
+    }
+    return pChannel;
+}
+
+void xRedisMux::SetErrInfo(const SliceIndex& index, const redisReply* reply) {
+    SliceIndex& sliceIndex = const_cast<SliceIndex&>(index);
+    if (NULL == reply)
+        sliceIndex.SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+    else
+        sliceIndex.SetErrInfo(reply->str, static_cast<size_t>(reply->len));
+}
+
+rReply* xRedisMux::DedicatedCommand(const SliceIndex& index, const VDATA& vData) {
+    RedisConn* pRedisConn = mRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, index.mIOtype);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return NULL;
+    }
+
+    redisReply* reply = RedisCommandArgv(pRedisConn, vData);
+    if (NULL == reply) {
+        // A timed out blocking command would answer the next borrower.
+        pRedisConn->RedisReConnect();
+    }
+    mRedisPool->FreeConnection(pRedisConn);
+
+    XLOCK(mLock);
+    mDedicated++;
+    return reply;
+}
+
+RedisConn* xRedisMux::Pin(const SliceIndex& index) {
+    if (NULL == mRedisPool)
+        return NULL;
+
+    uint32_t ioType = MASTER;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+    RedisConn* pRedisConn = mRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return NULL;
+    }
+
+    XLOCK(mLock);
+    mDedicated++;
+    return pRedisConn;
+}
+
+rReply* xRedisMux::commandargv(RedisConn* pinned, const VDATA& vData) {
+    if ((NULL == pinned) || vData.empty())
+        return NULL;
+    return RedisCommandArgv(pinned, vData);
+}
+
+rReply* xRedisMux::StatefulCommand(const SliceIndex& index, const VDATA& vData) {
+    RedisConn* pRedisConn = Pin(index);
+    if (NULL == pRedisConn)
+        return NULL;
+    redisReply* reply = commandargv(pRedisConn, vData);
+    Unpin(pRedisConn);
+    return reply;
+}
+
+void xRedisMux::Unpin(RedisConn* pinned) {
+    if ((NULL == pinned) || (NULL == mRedisPool))
+        return;
+
+    // Whatever DB, transaction, subscription or client setting the caller
+    // left behind goes away with the old connection.
+    pinned->RedisReConnect();
+    mRedisPool->FreeConnection(pinned);
+}
+
+rReply* xRedisMux::commandargv(const SliceIndex& index, const VDATA& vData) {
+    if ((NULL == mRedisPool) || vData.empty())
+        return NULL;
+
+    if (!Enter()) {
+        const_cast<SliceIndex&>(index).SetErrInfo(MUX_CLOSED_ERROR, ::strlen(MUX_CLOSED_ERROR));
+        return NULL;
+    }
+
+    redisReply* reply = NULL;
+    RedisMuxChannel* pChannel = NULL;
+    if (IsStatefulCommand(vData)) {
+        reply = StatefulCommand(index, vData);
+    } else if (IsDedicatedCommand(vData)) {
+        reply = DedicatedCommand(index, vData);
+    } else if (NULL == (pChannel = GetChannel(index.mNodeIndex, index.mSliceIndex, index.mIOtype))) {
+        reply = DedicatedCommand(index, vData);
+    } else {
+        MuxRequest request;
+        request.argv = &vData;
+        request.reply = NULL;
+        request.done = false;
+        pChannel->Execute(&request);
+        reply = request.reply;
+    }
+
+    Leave();
+    return reply;
+}
+
+bool xRedisMux::commandargv_status(const SliceIndex& index, const VDATA& vData) {
+    bool bRet = false;
+    redisReply* reply = commandargv(index, vData);
+    if (RedisPool::CheckReply(reply)) {
+        bRet = true;
+        if (REDIS_REPLY_STRING == reply->type) {
+            if (!reply->len || !reply->str || strcasecmp(reply->str, "OK") != 0)
+                bRet = false;
+        }
+    } else {
+        SetErrInfo(index, reply);
+    }
+
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisMux::commandargv_integer(const SliceIndex& index, const VDATA& vData, int64_t& retval) {
+    bool bRet = false;
+    redisReply* reply = commandargv(index, vData);
+    if (RedisPool::CheckReply(reply)) {
+        retval = reply->integer;
+        bRet = true;
+    } else {
+        SetErrInfo(index, reply);
+    }
+
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisMux::commandargv_string(const SliceIndex& index, const VDATA& vData, string& data) {
+    bool bRet = false;
+    redisReply* reply = commandargv(index, vData);
+    if (RedisPool::CheckReply(reply)) {
+        data.assign(reply->str, reply->len);
+        bRet = true;
+    } else {
+        SetErrInfo(index, reply);
+    }
+
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisMux::commandargv_array(const SliceIndex& index, const VDATA& vData, ArrayReply& array) {
+    bool bRet = false;
+    redisReply* reply = commandargv(index, vData);
+    if (RedisPool::CheckReply(reply)) {
+        for (size_t i = 0; i < reply->elements; i++) {
+            DataItem item;
+            item.type = reply->element[i]->type;
+            item.str.assign(reply->element[i]->str, reply->element[i]->len);
+            array.push_back(item);
+        }
+        bRet = true;
+    } else {
+        SetErrInfo(index, reply);
+    }
+
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+void xRedisMux::GetStats(MuxStats& stats) {
+    memset(&stats, 0, sizeof(stats));
+    XLOCK(mLock);
+    for (MuxChannelMap::iterator iter = mChannels.begin(); iter != mChannels.end(); ++iter) {
+        MuxChannelList& channels = iter->second;
+        for (size_t i = 0; i < channels.size(); ++i) {
+            channels[i]->GetStats(stats);
+        }
+    }
+    stats.dedicated = mDedicated;
+}
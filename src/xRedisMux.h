@@ -0,0 +1,164 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_MUX_H_
+#define _XREDIS_MUX_H_
+
+#include <pthread.h>
+#include <deque>
+#include <map>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef struct _MUX_OPTION_ {
+        uint32_t connPerSlice;  // own connections per slice and io role, outside the pool
+        uint32_t maxBatch;      // max commands coalesced into one write
+        uint32_t maxDelayUs;    // upper bound of the adaptive flush delay, 0 disables waiting
+    } MuxOption;
+
+    typedef struct _MUX_STATS_ {
+        uint64_t commands;      // commands sent over shared connections
+        uint64_t batches;       // writes issued for those commands
+        uint64_t dedicated;     // blocking, stateful and unconnected-slice commands and pins served by a pool connection
+        uint64_t errors;        // commands failed by a broken shared connection
+    } MuxStats;
+
+    typedef struct _MUX_REQUEST_ {
+        const VDATA* argv;
+        redisReply* reply;
+        bool done;
+    } MuxRequest;
+
+    // One shared connection, owned by the channel. Callers queue requests;
+    // whoever finds the channel idle becomes the flusher, writes the queued
+    // batch in one go and hands the replies back in FIFO order.
+    class RedisMuxChannel {
+    public:
+        RedisMuxChannel(RedisConn* conn, const MuxOption& option);
+
+        ~RedisMuxChannel();
+
+        void Execute(MuxRequest* request);
+
+        RedisConn* GetConn();
+
+        uint32_t GetPending() const;
+
+        void GetStats(MuxStats& stats);
+
+    private:
+        // Returns the number of requests left without a reply.
+        size_t Flush(std::vector<MuxRequest*>& batch);
+
+        // Called with mMutex held by the flusher.
+        void WaitForBatch();
+
+        void AdaptDelay(size_t batchSize);
+
+    private:
+        RedisConn* mConn;
+        MuxOption mOption;
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCond;
+        pthread_cond_t mBatchCond;
+        std::deque<MuxRequest*> mQueue;
+        volatile uint32_t mPending;
+        bool mFlushing;
+        uint32_t mDelayUs;
+        MuxStats mStats;
+    };
+
+    // Multiplexes many caller threads over a few connections per slice. The
+    // shared connections are the mux's own, opened by Connect() from the
+    // node list given to ConnectRedisCache(), so the pool keeps all of its
+    // connections; slices without them borrow a pool connection per command.
+    // Blocking commands bypass the shared connections and run on a pool
+    // connection as before. A connection-stateful command (SELECT, MULTI,
+    // WATCH, SUBSCRIBE, CLIENT, HELLO, AUTH...) sent through commandargv()
+    // runs alone on a pinned pool connection that is reset afterwards; to
+    // keep the state for later commands, Pin() a connection, run them on it
+    // and give it back with Unpin(), which reconnects it so no state reaches
+    // the next borrower.
+    //
+    // Release() waits for commands in flight and fails later ones.
+    class xRedisMux {
+    public:
+        xRedisMux();
+
+        ~xRedisMux();
+
+        bool Init(xRedisClient* client, const MuxOption& option);
+
+        // Opens connPerSlice connections to every slice in nodeList, for the
+        // role each entry has. False if any of them failed to connect; those
+        // are retried on first use.
+        bool Connect(const RedisNode* nodeList, uint32_t nodeCount, uint32_t nodeIndex);
+
+        void Release();
+
+        // Caller owns the reply and frees it with RedisPool::FreeReply().
+        rReply* commandargv(const SliceIndex& index, const VDATA& vData);
+
+        bool commandargv_status(const SliceIndex& index, const VDATA& vData);
+
+        bool commandargv_integer(const SliceIndex& index, const VDATA& vData, int64_t& retval);
+
+        bool commandargv_string(const SliceIndex& index, const VDATA& vData, string& data);
+
+        bool commandargv_array(const SliceIndex& index, const VDATA& vData, ArrayReply& array);
+
+        // A pool connection for this caller alone until Unpin().
+        RedisConn* Pin(const SliceIndex& index);
+
+        rReply* commandargv(RedisConn* pinned, const VDATA& vData);
+
+        void Unpin(RedisConn* pinned);
+
+        void GetStats(MuxStats& stats);
+
+        static bool IsDedicatedCommand(const VDATA& vData);
+
+        static bool IsStatefulCommand(const VDATA& vData);
+
+    private:
+        typedef std::vector<RedisMuxChannel*> MuxChannelList;
+        typedef std::map<uint64_t, MuxChannelList> MuxChannelMap;
+
+        static uint64_t ChannelKey(uint32_t nodeIndex, uint32_t sliceIndex, uint32_t ioType);
+
+        RedisMuxChannel* GetChannel(uint32_t nodeIndex, uint32_t sliceIndex, uint32_t ioType);
+
+        rReply* DedicatedCommand(const SliceIndex& index, const VDATA& vData);
+
+        rReply* StatefulCommand(const SliceIndex& index, const VDATA& vData);
+
+        // Shutdown handshake with Release(): false once it has started.
+        bool Enter();
+
+        void Leave();
+
+        void SetErrInfo(const SliceIndex& index, const redisReply* reply);
+
+    private:
+        xRedisClient* mClient;
+        RedisPool* mRedisPool;
+        MuxOption mOption;
+        MuxChannelMap mChannels;
+        xLock mLock;
+        uint64_t mDedicated;
+        pthread_mutex_t mStateMutex;
+        pthread_cond_t mStateCond;
+        uint32_t mActive;
+        bool mClosing;
+    };
+
+}
+
+#endif
@@ -0,0 +1,653 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include "xRedisNearCache.h"
+#include "xRedisResp3.h"
+#include "xRedisHash.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define NEARCACHE_DEFAULT_ENTRIES 100000
+#define NEARCACHE_DEFAULT_BYTES (64ULL << 20)
+#define NEARCACHE_DEFAULT_TTL_MS 60000
+#define NEARCACHE_POLL_MS 200
+#define NEARCACHE_PING_US 5000000ULL
+#define NEARCACHE_RETRY_MS 1000
+#define NEARCACHE_ENTRY_OVERHEAD 64
+#define NEARCACHE_RELEASE_WAIT_US 1000
+
+static const char* gTrackingChannel = "__redis__:invalidate";
+
+static bool IsReplyString(const redisReply* reply, const char* str) {
+    return (NULL != reply) && (NULL != reply->str) && (strlen(str) == (size_t) reply->len) && (0 == strncasecmp(reply->str, str, reply->len));
+}
+
+// Counts a public call in for Release() to wait on; closed once Release()
+// has begun.
+class NearCacheScope {
+public:
+    NearCacheScope(volatile uint32_t& active, volatile bool& stop) : mActive(active) {
+        __atomic_add_fetch(&mActive, 1, __ATOMIC_SEQ_CST);
+        mOpen = !__atomic_load_n(&stop, __ATOMIC_SEQ_CST);
+    }
+
+    ~NearCacheScope() {
+        __atomic_sub_fetch(&mActive, 1, __ATOMIC_SEQ_CST);
+    }
+
+    bool IsOpen() const {
+        return mOpen;
+    }
+
+private:
+    volatile uint32_t& mActive;
+    bool mOpen;
+};
+
+static size_t EntryBytes(const string& key, const string& value, const VALUES& members, const std::map<string, DataItem>& fields) {
+    size_t bytes = NEARCACHE_ENTRY_OVERHEAD + key.size() + value.size();
+    for (size_t i = 0; i < members.size(); ++i) {
+        bytes += members[i].size() + sizeof(string);
+    }
+    for (std::map<string, DataItem>::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+        bytes += it->first.size() + it->second.str.size() + NEARCACHE_ENTRY_OVERHEAD;
+    }
+    return bytes;
+}
+
+xRedisNearCache::xRedisNearCache() {
+    mClient = NULL;
+    mOption.nodeIndex = 0;
+    mOption.nodeList = NULL;
+    mOption.fun = NULL;
+    mOption.maxEntries = 0;
+    mOption.maxBytes = 0;
+    mOption.maxTtlMs = 0;
+    mOption.resp3Push = false;
+    mOption.invalidFun = NULL;
+    mOption.privdata = NULL;
+    mShardMaxEntries = 0;
+    mShardMaxBytes = 0;
+    for (uint32_t i = 0; i < NEARCACHE_SHARD_COUNT; ++i) {
+        mShards[i].bytes = 0;
+    }
+    memset(&mStats, 0, sizeof(mStats));
+    mStop = false;
+    mActive = 0;
+}
+
+xRedisNearCache::~xRedisNearCache() {
+    Release();
+}
+
+bool xRedisNearCache::Init(xRedisClient* client, const NearCacheOption& option) {
+    if ((NULL == client) || (NULL != mClient) || (NULL == option.fun) || (NULL == option.nodeList))
+        return false;
+
+    uint32_t sliceCount = client->GetRedisPool()->GetSliceCount(option.nodeIndex);
+    if ((0 == sliceCount) || (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return false;
+
+    mOption = option;
+    if (0 == mOption.maxEntries)
+        mOption.maxEntries = NEARCACHE_DEFAULT_ENTRIES;
+    if (0 == mOption.maxBytes)
+        mOption.maxBytes = NEARCACHE_DEFAULT_BYTES;
+    if (0 == mOption.maxTtlMs)
+        mOption.maxTtlMs = NEARCACHE_DEFAULT_TTL_MS;
+    mShardMaxEntries = (mOption.maxEntries + NEARCACHE_SHARD_COUNT - 1) / NEARCACHE_SHARD_COUNT;
+    mShardMaxBytes = (size_t) ((mOption.maxBytes + NEARCACHE_SHARD_COUNT - 1) / NEARCACHE_SHARD_COUNT);
+
+    mNodes.assign(option.nodeList, option.nodeList + sliceCount);
+    mClient = client;
+    __atomic_store_n(&mStop, false, __ATOMIC_SEQ_CST);
+    for (uint32_t i = 0; i < sliceCount; ++i) {
+        TrackingSlice* slice = new TrackingSlice;
+        slice->cache = this;
+        slice->sliceIndex = i;
+        slice->listenConn = NULL;
+        slice->trackConn = NULL;
+        slice->seq = 0;
+        slice->up = false;
+        if (0 != pthread_create(&slice->tid, NULL, ListenWorker, slice)) {
+            delete slice;
+            Release();
+            return false;
+        }
+        mSlices.push_back(slice);
+    }
+    return true;
+}
+
+void xRedisNearCache::Release() {
+    __atomic_store_n(&mStop, true, __ATOMIC_SEQ_CST);
+    while (0 != __atomic_load_n(&mActive, __ATOMIC_SEQ_CST)) {
+        usleep(NEARCACHE_RELEASE_WAIT_US);
+    }
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        pthread_join(mSlices[i]->tid, NULL);
+    }
+
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        TrackingSlice* slice = mSlices[i];
+        Close(slice->listenConn);
+        Close(slice->trackConn);
+        delete slice;
+    }
+    mSlices.clear();
+    Clear();
+    mClient = NULL;
+}
+
+RedisConn* xRedisNearCache::Connect(uint32_t sliceIndex) {
+    const RedisNode& node = mNodes[sliceIndex];
+    RedisConn* pRedisConn = new RedisConn;
+    pRedisConn->Init(mOption.nodeIndex, sliceIndex, node.host, node.port, node.passwd, 1, node.timeout, MASTER, 0);
+    // A failure leaves no context; StartTracking() sees it and retries.
+    pRedisConn->RedisConnect();
+    return pRedisConn;
+}
+
+void xRedisNearCache::Reconnect(RedisConn* conn) {
+    if (NULL == conn)
+        return;
+    if (NULL == conn->getCtx())
+        conn->RedisConnect();
+    else
+        conn->RedisReConnect();
+}
+
+void xRedisNearCache::Close(RedisConn* conn) {
+    if (NULL == conn)
+        return;
+    redisFree(conn->getCtx());
+    delete conn;
+}
+
+void* xRedisNearCache::ListenWorker(void* arg) {
+    TrackingSlice* slice = static_cast<TrackingSlice*>(arg);
+    xRedisNearCache* cache = slice->cache;
+    uint64_t lastPingUs = 0;
+    while (!cache->mStop) {
+        if (!slice->up) {
+            if (!cache->StartTracking(slice)) {
+                cache->StopTracking(slice);
+                for (uint32_t waitMs = 0; (waitMs < NEARCACHE_RETRY_MS) && !cache->mStop; waitMs += NEARCACHE_POLL_MS) {
+                    usleep(NEARCACHE_POLL_MS * 1000);
+                }
+                continue;
+            }
+            lastPingUs = GetMonotonicUs();
+        }
+
+        if (!cache->Listen(slice, lastPingUs))
+            cache->StopTracking(slice);
+    }
+    return NULL;
+}
+
+bool xRedisNearCache::StartTracking(TrackingSlice* slice) {
+    if (NULL == slice->listenConn)
+        slice->listenConn = Connect(slice->sliceIndex);
+    if (!mOption.resp3Push && (NULL == slice->trackConn))
+        slice->trackConn = Connect(slice->sliceIndex);
+    if ((NULL == slice->listenConn->getCtx()) || (!mOption.resp3Push && (NULL == slice->trackConn->getCtx())))
+        return false;
+
+    redisContext* listenCtx = slice->listenConn->getCtx();
+    VDATA vTracking;
+    vTracking.push_back("CLIENT");
+    vTracking.push_back("TRACKING");
+    vTracking.push_back("ON");
+
+    redisReply* reply = NULL;
+    if (mOption.resp3Push) {
+#ifdef XREDIS_HAVE_RESP3
+        // Invalidations arrive as push frames on the tracking connection
+        // itself; with no push callback hiredis hands them out as replies.
+        reply = static_cast<redisReply*>(redisCommand(listenCtx, "HELLO 3"));
+        bool bRet = (NULL != reply) && ((REDIS_REPLY_MAP == reply->type) || (REDIS_REPLY_ARRAY == reply->type));
+        RedisPool::FreeReply(reply);
+        if (!bRet)
+            return false;
+        redisSetPushCallback(listenCtx, NULL);
+#else
+        return false;
+#endif
+    } else {
+        reply = static_cast<redisReply*>(redisCommand(listenCtx, "CLIENT ID"));
+        bool bRet = (NULL != reply) && (REDIS_REPLY_INTEGER == reply->type);
+        int64_t id = bRet ? reply->integer : 0;
+        RedisPool::FreeReply(reply);
+        if (!bRet)
+            return false;
+
+        reply = static_cast<redisReply*>(redisCommand(listenCtx, "SUBSCRIBE %s", gTrackingChannel));
+        bRet = (NULL != reply) && (REDIS_REPLY_ARRAY == reply->type);
+        RedisPool::FreeReply(reply);
+        if (!bRet)
+            return false;
+
+        vTracking.push_back("REDIRECT");
+        vTracking.push_back(toString(id));
+    }
+
+    // Broadcast mode: every write to a matching key is reported no matter
+    // which connection read it, so reads can keep using the pool.
+    vTracking.push_back("BCAST");
+    for (size_t i = 0; i < mOption.prefixes.size(); ++i) {
+        vTracking.push_back("PREFIX");
+        vTracking.push_back(mOption.prefixes[i]);
+    }
+    redisContext* trackCtx = mOption.resp3Push ? listenCtx : slice->trackConn->getCtx();
+    reply = RedisCommandArgv(trackCtx, vTracking);
+    bool bRet = RedisPool::CheckReply(reply) && (REDIS_REPLY_ERROR != reply->type);
+    RedisPool::FreeReply(reply);
+    if (!bRet)
+        return false;
+
+    __sync_add_and_fetch(&slice->seq, 1);
+    slice->up = true;
+    return true;
+}
+
+void xRedisNearCache::StopTracking(TrackingSlice* slice) {
+    // Invalidations may have been lost: nothing cached from this slice can
+    // be trusted any more.
+    bool wasUp = slice->up;
+    slice->up = false;
+    __sync_add_and_fetch(&slice->seq, 1);
+    FlushSlice(slice->sliceIndex);
+    if (wasUp) {
+        __sync_fetch_and_add(&mStats.flushes, 1);
+        if (NULL != mOption.invalidFun)
+            mOption.invalidFun(string(), mOption.privdata);
+    }
+
+    Reconnect(slice->listenConn);
+    Reconnect(slice->trackConn);
+}
+
+bool xRedisNearCache::Listen(TrackingSlice* slice, uint64_t& lastPingUs) {
+    redisContext* ctx = slice->listenConn->getCtx();
+    if ((NULL == ctx) || ctx->err)
+        return false;
+
+    void* reply = NULL;
+    if (REDIS_OK != redisGetReplyFromReader(ctx, &reply))
+        return false;
+    if (NULL != reply) {
+        HandleMessage(slice, static_cast<redisReply*>(reply));
+        freeReplyObject(reply);
+        return true;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = ctx->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int32_t ret = poll(&pfd, 1, NEARCACHE_POLL_MS);
+    if (ret < 0)
+        return EINTR == errno;
+    if ((ret > 0) && (REDIS_OK != redisBufferRead(ctx)))
+        return false;
+
+    // Tracking dies with the connection that enabled it, which otherwise
+    // sits idle in redirect mode.
+    uint64_t now = GetMonotonicUs();
+    if ((NULL != slice->trackConn) && (now - lastPingUs >= NEARCACHE_PING_US)) {
+        lastPingUs = now;
+        redisReply* pong = static_cast<redisReply*>(redisCommand(slice->trackConn->getCtx(), "PING"));
+        bool bRet = RedisPool::CheckReply(pong) && (REDIS_REPLY_ERROR != pong->type);
+        RedisPool::FreeReply(pong);
+        return bRet;
+    }
+    return true;
+}
+
+void xRedisNearCache::HandleMessage(TrackingSlice* slice, const redisReply* reply) {
+    // RESP3: ["invalidate", keys]; redirect: ["message", channel, keys].
+    // keys is nil after FLUSHDB/FLUSHALL.
+    const redisReply* keys = NULL;
+    if ((REDIS_REPLY_PUSH == reply->type) && (reply->elements >= 2) && IsReplyString(reply->element[0], "invalidate"))
+        keys = reply->element[1];
+    else if ((REDIS_REPLY_ARRAY == reply->type) && (reply->elements >= 3) && IsReplyString(reply->element[0], "message"))
+        keys = reply->element[2];
+    else
+        return;
+
+    __sync_add_and_fetch(&slice->seq, 1);
+    if (REDIS_REPLY_NIL == keys->type) {
+        FlushSlice(slice->sliceIndex);
+        if (NULL != mOption.invalidFun)
+            mOption.invalidFun(string(), mOption.privdata);
+        return;
+    }
+    if (REDIS_REPLY_ARRAY == keys->type) {
+        for (size_t i = 0; i < keys->elements; ++i) {
+            if (NULL != keys->element[i]->str)
+                DropKey(string(keys->element[i]->str, keys->element[i]->len));
+        }
+    } else if (NULL != keys->str) {
+        DropKey(string(keys->str, keys->len));
+    }
+}
+
+xRedisNearCache::TrackingSlice* xRedisNearCache::Locate(const string& key, SliceIndex& index, uint64_t& seq) {
+    if ((NULL == mClient) || key.empty() || !index.Create(key.c_str(), mOption.fun))
+        return NULL;
+    if (index.mSliceIndex >= mSlices.size())
+        return NULL;
+
+    if (!mOption.prefixes.empty()) {
+        bool match = false;
+        for (size_t i = 0; (i < mOption.prefixes.size()) && !match; ++i) {
+            match = 0 == key.compare(0, mOption.prefixes[i].size(), mOption.prefixes[i]);
+        }
+        if (!match)
+            return NULL;
+    }
+
+    TrackingSlice* slice = mSlices[index.mSliceIndex];
+    if (!slice->up)
+        return NULL;
+
+    // Tracking runs on the master, so a fill from a lagging replica could
+    // read the old value after its invalidation and keep it until expiry.
+    index.SetIOMaster();
+    seq = __atomic_load_n(&slice->seq, __ATOMIC_ACQUIRE);
+    return slice;
+}
+
+xRedisNearCache::NearShard& xRedisNearCache::GetShard(const string& key) {
+    return mShards[xRedisHash::XXH64(key.data(), key.size()) % NEARCACHE_SHARD_COUNT];
+}
+
+xRedisNearCache::NearEntry* xRedisNearCache::FindLocked(NearShard& shard, const string& key) {
+    NearMap::iterator it = shard.entries.find(key);
+    if (shard.entries.end() == it)
+        return NULL;
+    if (GetMonotonicUs() < it->second.expireUs)
+        return &it->second;
+
+    shard.bytes -= it->second.bytes;
+    shard.entries.erase(it);
+    return NULL;
+}
+
+xRedisNearCache::NearEntry* xRedisNearCache::InsertLocked(NearShard& shard, const string& key, const TrackingSlice* slice, uint64_t seq) {
+    // Checked under the shard lock: an invalidation bumps seq before it
+    // takes the lock to drop the key, so it either rejects this insert or
+    // removes what it stored.
+    if (!slice->up || (__atomic_load_n(&slice->seq, __ATOMIC_ACQUIRE) != seq))
+        return NULL;
+
+    NearEntry* entry = FindLocked(shard, key);
+    if (NULL != entry)
+        return entry;
+
+    entry = &shard.entries[key];
+    entry->sliceIndex = slice->sliceIndex;
+    entry->expireUs = GetMonotonicUs() + (uint64_t) mOption.maxTtlMs * 1000;
+    entry->bytes = 0;
+    entry->hasValue = false;
+    entry->hasMembers = false;
+    return entry;
+}
+
+void xRedisNearCache::UpdateLocked(NearShard& shard, const string& key, NearEntry& entry) {
+    shard.bytes -= entry.bytes;
+    entry.bytes = EntryBytes(key, entry.value, entry.members, entry.fields);
+    shard.bytes += entry.bytes;
+
+    while (!shard.entries.empty() && ((shard.entries.size() > mShardMaxEntries) || (shard.bytes > mShardMaxBytes))) {
+        NearMap::iterator it = shard.entries.begin();
+        shard.bytes -= it->second.bytes;
+        shard.entries.erase(it);
+        __sync_fetch_and_add(&mStats.evictions, 1);
+    }
+}
+
+void xRedisNearCache::DropKey(const string& key) {
+    if (NULL != mOption.invalidFun)
+        mOption.invalidFun(key, mOption.privdata);
+
+    NearShard& shard = GetShard(key);
+    XLOCK(shard.lock);
+    NearMap::iterator it = shard.entries.find(key);
+    if (shard.entries.end() != it) {
+        shard.bytes -= it->second.bytes;
+        shard.entries.erase(it);
+        __sync_fetch_and_add(&mStats.invalidations, 1);
+    }
+}
+
+void xRedisNearCache::FlushSlice(uint32_t sliceIndex) {
+    for (uint32_t i = 0; i < NEARCACHE_SHARD_COUNT; ++i) {
+        NearShard& shard = mShards[i];
+        XLOCK(shard.lock);
+        NearMap::iterator it = shard.entries.begin();
+        while (shard.entries.end() != it) {
+            if (it->second.sliceIndex == sliceIndex) {
+                shard.bytes -= it->second.bytes;
+                shard.entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+bool xRedisNearCache::get(const string& key, string& value) {
+    NearCacheScope scope(mActive, mStop);
+    if (!scope.IsOpen())
+        return false;
+    SliceIndex index(mClient, mOption.nodeIndex);
+    uint64_t seq = 0;
+    TrackingSlice* slice = Locate(key, index, seq);
+    if (NULL != slice) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = FindLocked(shard, key);
+        if ((NULL != entry) && entry->hasValue) {
+            value = entry->value;
+            __sync_fetch_and_add(&mStats.hits, 1);
+            return true;
+        }
+    }
+
+    __sync_fetch_and_add(&mStats.misses, 1);
+    if ((NULL == mClient) || !mClient->get(index, key, value))
+        return false;
+
+    if (NULL != slice) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = InsertLocked(shard, key, slice, seq);
+        if (NULL != entry) {
+            entry->hasValue = true;
+            entry->value = value;
+            UpdateLocked(shard, key, *entry);
+        }
+    }
+    return true;
+}
+
+bool xRedisNearCache::hget(const string& key, const string& field, string& value) {
+    NearCacheScope scope(mActive, mStop);
+    if (!scope.IsOpen())
+        return false;
+    SliceIndex index(mClient, mOption.nodeIndex);
+    uint64_t seq = 0;
+    TrackingSlice* slice = Locate(key, index, seq);
+    if (NULL != slice) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = FindLocked(shard, key);
+        std::map<string, DataItem>::const_iterator it;
+        if ((NULL != entry) && (entry->fields.end() != (it = entry->fields.find(field))) && (REDIS_REPLY_STRING == it->second.type)) {
+            value = it->second.str;
+            __sync_fetch_and_add(&mStats.hits, 1);
+            return true;
+        }
+    }
+
+    __sync_fetch_and_add(&mStats.misses, 1);
+    if ((NULL == mClient) || !mClient->hget(index, key, field, value))
+        return false;
+
+    if (NULL != slice) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = InsertLocked(shard, key, slice, seq);
+        if (NULL != entry) {
+            DataItem& item = entry->fields[field];
+            item.type = REDIS_REPLY_STRING;
+            item.str = value;
+            UpdateLocked(shard, key, *entry);
+        }
+    }
+    return true;
+}
+
+bool xRedisNearCache::hmget(const string& key, const KEYS& fields, ArrayReply& array) {
+    NearCacheScope scope(mActive, mStop);
+    if (!scope.IsOpen())
+        return false;
+    SliceIndex index(mClient, mOption.nodeIndex);
+    uint64_t seq = 0;
+    TrackingSlice* slice = Locate(key, index, seq);
+    if ((NULL != slice) && !fields.empty()) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = FindLocked(shard, key);
+        if (NULL != entry) {
+            ArrayReply cached;
+            cached.reserve(fields.size());
+            for (size_t i = 0; i < fields.size(); ++i) {
+                std::map<string, DataItem>::const_iterator it = entry->fields.find(fields[i]);
+                if (entry->fields.end() == it)
+                    break;
+                cached.push_back(it->second);
+            }
+            if (cached.size() == fields.size()) {
+                array.swap(cached);
+                __sync_fetch_and_add(&mStats.hits, 1);
+                return true;
+            }
+        }
+    }
+
+    __sync_fetch_and_add(&mStats.misses, 1);
+    if ((NULL == mClient) || !mClient->hmget(index, key, fields, array))
+        return false;
+
+    if ((NULL != slice) && (array.size() == fields.size())) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = InsertLocked(shard, key, slice, seq);
+        if (NULL != entry) {
+            for (size_t i = 0; i < fields.size(); ++i) {
+                entry->fields[fields[i]] = array[i];
+            }
+            UpdateLocked(shard, key, *entry);
+        }
+    }
+    return true;
+}
+
+bool xRedisNearCache::smembers(const string& key, VALUES& vValue) {
+    NearCacheScope scope(mActive, mStop);
+    if (!scope.IsOpen())
+        return false;
+    SliceIndex index(mClient, mOption.nodeIndex);
+    uint64_t seq = 0;
+    TrackingSlice* slice = Locate(key, index, seq);
+    if (NULL != slice) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = FindLocked(shard, key);
+        if ((NULL != entry) && entry->hasMembers) {
+            vValue = entry->members;
+            __sync_fetch_and_add(&mStats.hits, 1);
+            return true;
+        }
+    }
+
+    __sync_fetch_and_add(&mStats.misses, 1);
+    if ((NULL == mClient) || !mClient->smembers(index, key, vValue))
+        return false;
+
+    if (NULL != slice) {
+        NearShard& shard = GetShard(key);
+        XLOCK(shard.lock);
+        NearEntry* entry = InsertLocked(shard, key, slice, seq);
+        if (NULL != entry) {
+            entry->hasMembers = true;
+            entry->members = vValue;
+            UpdateLocked(shard, key, *entry);
+        }
+    }
+    return true;
+}
+
+void xRedisNearCache::Invalidate(const string& key) {
+    NearCacheScope scope(mActive, mStop);
+    if (key.empty() || !scope.IsOpen())
+        return;
+
+    // Keeps a read racing with this call from storing the old value.
+    SliceIndex index(mClient, mOption.nodeIndex);
+    if ((NULL != mClient) && index.Create(key.c_str(), mOption.fun) && (index.mSliceIndex < mSlices.size()))
+        __sync_add_and_fetch(&mSlices[index.mSliceIndex]->seq, 1);
+
+    NearShard& shard = GetShard(key);
+    XLOCK(shard.lock);
+    NearMap::iterator it = shard.entries.find(key);
+    if (shard.entries.end() != it) {
+        shard.bytes -= it->second.bytes;
+        shard.entries.erase(it);
+    }
+}
+
+void xRedisNearCache::Flush() {
+    NearCacheScope scope(mActive, mStop);
+    if (!scope.IsOpen())
+        return;
+    for (size_t i = 0; i < mSlices.size(); ++i) {
+        __sync_add_and_fetch(&mSlices[i]->seq, 1);
+    }
+    Clear();
+}
+
+void xRedisNearCache::Clear() {
+    for (uint32_t i = 0; i < NEARCACHE_SHARD_COUNT; ++i) {
+        XLOCK(mShards[i].lock);
+        mShards[i].entries.clear();
+        mShards[i].bytes = 0;
+    }
+}
+
+void xRedisNearCache::GetStats(NearCacheStats& stats) {
+    stats.hits = __atomic_load_n(&mStats.hits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&mStats.misses, __ATOMIC_RELAXED);
+    stats.invalidations = __atomic_load_n(&mStats.invalidations, __ATOMIC_RELAXED);
+    stats.evictions = __atomic_load_n(&mStats.evictions, __ATOMIC_RELAXED);
+    stats.flushes = __atomic_load_n(&mStats.flushes, __ATOMIC_RELAXED);
+    stats.entries = 0;
+    stats.bytes = 0;
+    for (uint32_t i = 0; i < NEARCACHE_SHARD_COUNT; ++i) {
+        XLOCK(mShards[i].lock);
+        stats.entries += mShards[i].entries.size();
+        stats.bytes += mShards[i].bytes;
+    }
+}
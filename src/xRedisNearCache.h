@@ -0,0 +1,169 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_NEARCACHE_H_
+#define _XREDIS_NEARCACHE_H_
+
+#include <pthread.h>
+#include <map>
+#include <tr1/unordered_map>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+#define NEARCACHE_SHARD_COUNT 64
+
+    // Told about every invalidated key; an empty key means everything.
+    typedef void (* INVALIDFUN)(const string& key, void* privdata);
+
+    typedef struct _NEARCACHE_OPTION_ {
+        uint32_t nodeIndex;
+        const RedisNode* nodeList;  // one entry per slice as given to ConnectRedisCache(), for the tracking connections
+        HASHFUN fun;
+        uint32_t maxEntries;        // cached keys, 0 for the default
+        uint64_t maxBytes;          // approximate memory, 0 for the default
+        uint32_t maxTtlMs;          // an entry is refetched after this long even without invalidation
+        KEYS prefixes;              // only keys with one of these prefixes are cached, empty for all
+        bool resp3Push;             // track over one RESP3 connection instead of a redirect pair
+        INVALIDFUN invalidFun;      // forwards invalidations, e.g. to xRedisShmCache::OnInvalidate; may be NULL
+        void* privdata;
+    } NearCacheOption;
+
+    typedef struct _NEARCACHE_STATS_ {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t invalidations;     // keys dropped on server notice
+        uint64_t evictions;         // entries dropped for the size bounds
+        uint64_t flushes;           // full flushes after a lost tracking connection
+        uint64_t entries;
+        uint64_t bytes;
+    } NearCacheStats;
+
+    // In-process cache in front of get/hget/hmget/smembers, kept coherent by
+    // Redis CLIENT TRACKING in broadcast mode (Redis 6+).
+    //
+    // Each slice opens its own connections to its master from nodeList,
+    // outside the pool: either a SUBSCRIBE connection plus the connection
+    // tracking redirects to it, or one RESP3 connection receiving invalidate
+    // pushes. If a tracking connection breaks, the whole cache is flushed and
+    // bypassed for that slice until tracking is restored.
+    //
+    // A value read while an invalidation for its slice arrives is returned
+    // but not cached. Release() waits for calls in flight; calls after it
+    // fail.
+    class xRedisNearCache {
+    public:
+        xRedisNearCache();
+
+        ~xRedisNearCache();
+
+        bool Init(xRedisClient* client, const NearCacheOption& option);
+
+        void Release();
+
+        bool get(const string& key, string& value);
+
+        bool hget(const string& key, const string& field, string& value);
+
+        bool hmget(const string& key, const KEYS& fields, ArrayReply& array);
+
+        bool smembers(const string& key, VALUES& vValue);
+
+        // Drops key locally, e.g. after writing it through xRedisClient.
+        void Invalidate(const string& key);
+
+        void Flush();
+
+        void GetStats(NearCacheStats& stats);
+
+    private:
+        typedef struct _NEAR_ENTRY_ {
+            uint32_t sliceIndex;
+            uint64_t expireUs;
+            size_t bytes;
+            bool hasValue;                      // GET result
+            string value;
+            bool hasMembers;                    // SMEMBERS result
+            VALUES members;
+            std::map<string, DataItem> fields;  // HGET/HMGET results, NIL included
+        } NearEntry;
+
+        typedef std::tr1::unordered_map<string, NearEntry> NearMap;
+
+        typedef struct _NEAR_SHARD_ {
+            xLock lock;
+            NearMap entries;
+            size_t bytes;
+        } NearShard;
+
+        typedef struct _TRACKING_SLICE_ {
+            xRedisNearCache* cache;
+            uint32_t sliceIndex;
+            RedisConn* listenConn;
+            RedisConn* trackConn;               // NULL in RESP3 push mode
+            volatile uint64_t seq;              // bumped on every invalidation
+            volatile bool up;
+            pthread_t tid;
+        } TrackingSlice;
+
+        static void* ListenWorker(void* arg);
+
+        RedisConn* Connect(uint32_t sliceIndex);
+
+        static void Reconnect(RedisConn* conn);
+
+        static void Close(RedisConn* conn);
+
+        void Clear();
+
+        bool StartTracking(TrackingSlice* slice);
+
+        void StopTracking(TrackingSlice* slice);
+
+        bool Listen(TrackingSlice* slice, uint64_t& lastPingUs);
+
+        void HandleMessage(TrackingSlice* slice, const redisReply* reply);
+
+        // Slice of key when it may be served from the cache; seq receives the
+        // invalidation sequence to hand back to InsertLocked().
+        TrackingSlice* Locate(const string& key, SliceIndex& index, uint64_t& seq);
+
+        NearShard& GetShard(const string& key);
+
+        // Live entry of key or NULL, dropping it when expired.
+        NearEntry* FindLocked(NearShard& shard, const string& key);
+
+        // Entry to fill in for key, or NULL when an invalidation for the
+        // slice arrived since seq was taken.
+        NearEntry* InsertLocked(NearShard& shard, const string& key, const TrackingSlice* slice, uint64_t seq);
+
+        // Accounts the new size of entry and evicts while the shard is over
+        // its bounds; entry may be gone afterwards.
+        void UpdateLocked(NearShard& shard, const string& key, NearEntry& entry);
+
+        void DropKey(const string& key);
+
+        void FlushSlice(uint32_t sliceIndex);
+
+    private:
+        xRedisClient* mClient;
+        NearCacheOption mOption;
+        NearShard mShards[NEARCACHE_SHARD_COUNT];
+        size_t mShardMaxEntries;
+        size_t mShardMaxBytes;
+        std::vector<TrackingSlice*> mSlices;
+        std::vector<RedisNode> mNodes;
+        NearCacheStats mStats;
+        volatile bool mStop;
+        volatile uint32_t mActive;          // public calls in flight, for Release()
+    };
+
+}
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include <algorithm>
+#include "xRedisPlacement.h"
+
+using namespace xrcp;
+
+static PlacementTable* gTables[MAX_REDIS_NODE_COUNT];
+static std::vector<PlacementTable*> gRetired;
+static xLock gPlacementLock;
+
+uint64_t xRedisPlacement::Mix64(uint64_t x) {
+    // splitmix64 finalizer; spreads the 32-bit HASHFUN output over 64 bits.
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+int32_t xRedisPlacement::JumpHash(uint64_t key, int32_t buckets) {
+    // Lamping & Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm".
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t) ((double) (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1)));
+    }
+    return (int32_t) b;
+}
+
+void xRedisPlacement::BuildKetama(PlacementTable* table) {
+    for (uint32_t slice = 0; slice < table->sliceCount; ++slice) {
+        uint32_t points = table->weights[slice] * KETAMA_POINTS_PER_WEIGHT;
+        for (uint32_t i = 0; i < points; ++i) {
+            KetamaPoint point;
+            point.point = (uint32_t) (Mix64(((uint64_t) slice << 32) | i) >> 32);
+            point.sliceIndex = slice;
+            table->ring.push_back(point);
+        }
+    }
+    std::sort(table->ring.begin(), table->ring.end());
+}
+
+void xRedisPlacement::BuildJump(PlacementTable* table, const PlacementTable* old) {
+    // Blocks of a fixed stride per slice: appending a slice only adds
+    // buckets at the end, and a weight change only (de)activates buckets in
+    // its own block, so jump hash keeps the other keys in place.
+    uint32_t maxWeight = *std::max_element(table->weights.begin(), table->weights.end());
+    if ((NULL != old) && (PLACEMENT_JUMP == old->strategy) && (old->stride >= maxWeight)) {
+        table->stride = old->stride;
+        return;
+    }
+    // Twice the largest weight leaves room to raise weights later without
+    // a new layout, for about two draws per key.
+    table->stride = 1;
+    while (table->stride < 2 * (uint64_t) maxWeight) {
+        table->stride <<= 1;
+    }
+}
+
+uint32_t xRedisPlacement::PlaceKetama(const PlacementTable* table, uint64_t hash) {
+    KetamaPoint key;
+    key.point = (uint32_t) (Mix64(hash) >> 32);
+    key.sliceIndex = 0;
+    std::vector<KetamaPoint>::const_iterator iter = std::lower_bound(table->ring.begin(), table->ring.end(), key);
+    if (iter == table->ring.end())
+        iter = table->ring.begin();
+    return iter->sliceIndex;
+}
+
+uint32_t xRedisPlacement::PlaceJump(const PlacementTable* table, uint64_t hash) {
+    int32_t buckets = (int32_t) (table->sliceCount * table->stride);
+    uint64_t key = Mix64(hash);
+    int32_t bucket = 0;
+    for (uint32_t draw = 0; draw < JUMP_MAX_DRAWS; ++draw) {
+        bucket = JumpHash(key, buckets);
+        uint32_t slice = (uint32_t) bucket / table->stride;
+        if ((uint32_t) bucket % table->stride < table->weights[slice])
+            return slice;
+        key = Mix64(key + draw + 1);
+    }
+
+    // Very uneven weights: the next slice that takes keys.
+    for (uint32_t i = 1; i <= table->sliceCount; ++i) {
+        uint32_t slice = ((uint32_t) bucket / table->stride + i) % table->sliceCount;
+        if (table->weights[slice] > 0)
+            return slice;
+    }
+    return 0;
+}
+
+uint32_t xRedisPlacement::PlaceRendezvous(const PlacementTable* table, uint64_t hash) {
+    // Weighted rendezvous: score = -weight / ln(u), u uniform in (0,1).
+    uint32_t best = 0;
+    double bestScore = -1;
+    for (uint32_t slice = 0; slice < table->sliceCount; ++slice) {
+        uint32_t weight = table->weights[slice];
+        if (0 == weight)
+            continue;
+        uint64_t h = Mix64(hash ^ Mix64(slice));
+        double u = ((double) (h >> 11) + 0.5) / 9007199254740992.0;
+        double score = -(double) weight / log(u);
+        if (score > bestScore) {
+            bestScore = score;
+            best = slice;
+        }
+    }
+    return best;
+}
+
+PlacementTable* xRedisPlacement::Build(uint32_t strategy, uint32_t sliceCount, const uint32_t* weights, const PlacementTable* old) {
+    PlacementTable* table = new PlacementTable;
+    table->strategy = strategy;
+    table->sliceCount = sliceCount;
+    table->stride = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < sliceCount; ++i) {
+        table->weights.push_back((NULL == weights) ? 1 : weights[i]);
+        total += table->weights[i];
+    }
+    if (0 == total) {
+        delete table;
+        return NULL;
+    }
+
+    if (PLACEMENT_KETAMA == strategy) {
+        BuildKetama(table);
+    } else if (PLACEMENT_JUMP == strategy) {
+        BuildJump(table, old);
+        if ((uint64_t) sliceCount * table->stride > (uint64_t) INT32_MAX) {
+            delete table;
+            return NULL;
+        }
+    }
+    return table;
+}
+
+void xRedisPlacement::Publish(uint32_t nodeIndex, PlacementTable* table) {
+    // Under gPlacementLock.
+    PlacementTable* old = gTables[nodeIndex];
+    __atomic_store_n(&gTables[nodeIndex], table, __ATOMIC_RELEASE);
+    if (NULL != old)
+        gRetired.push_back(old);
+}
+
+bool xRedisPlacement::SetPlacement(uint32_t nodeIndex, uint32_t strategy, uint32_t sliceCount, const uint32_t* weights) {
+    if ((nodeIndex >= MAX_REDIS_NODE_COUNT) || (strategy > PLACEMENT_RENDEZVOUS) ||
+        (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return false;
+
+    XLOCK(gPlacementLock);
+    PlacementTable* table = NULL;
+    if (PLACEMENT_MODULO != strategy) {
+        if (0 == sliceCount)
+            return false;
+        table = Build(strategy, sliceCount, weights, gTables[nodeIndex]);
+        if (NULL == table)
+            return false;
+    }
+    Publish(nodeIndex, table);
+    return true;
+}
+
+const PlacementTable* xRedisPlacement::Resize(uint32_t nodeIndex, uint32_t sliceCount) {
+    XLOCK(gPlacementLock);
+    const PlacementTable* table = gTables[nodeIndex];
+    if ((NULL == table) || (table->sliceCount == sliceCount))
+        return table;
+    if ((0 == sliceCount) || (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return NULL;
+
+    std::vector<uint32_t> weights(table->weights);
+    weights.resize(sliceCount, 1);
+    PlacementTable* resized = Build(table->strategy, sliceCount, &weights[0], table);
+    if (NULL == resized)
+        return NULL;
+    Publish(nodeIndex, resized);
+    return resized;
+}
+
+uint32_t xRedisPlacement::GetPlacement(uint32_t nodeIndex) {
+    if (nodeIndex >= MAX_REDIS_NODE_COUNT)
+        return PLACEMENT_MODULO;
+    const PlacementTable* table = __atomic_load_n(&gTables[nodeIndex], __ATOMIC_ACQUIRE);
+    return (NULL == table) ? (uint32_t) PLACEMENT_MODULO : table->strategy;
+}
+
+bool xRedisPlacement::Place(uint32_t nodeIndex, uint64_t hash, uint32_t sliceCount, uint32_t& sliceIndex) {
+    if (nodeIndex >= MAX_REDIS_NODE_COUNT)
+        return false;
+
+    const PlacementTable* table = __atomic_load_n(&gTables[nodeIndex], __ATOMIC_ACQUIRE);
+    if ((NULL != table) && (table->sliceCount != sliceCount))
+        table = Resize(nodeIndex, sliceCount);
+    if (NULL == table)
+        return false;
+
+    switch (table->strategy) {
+        case PLACEMENT_KETAMA:
+            sliceIndex = PlaceKetama(table, hash);
+            break;
+        case PLACEMENT_JUMP:
+            sliceIndex = PlaceJump(table, hash);
+            break;
+        case PLACEMENT_RENDEZVOUS:
+            sliceIndex = PlaceRendezvous(table, hash);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+void xRedisPlacement::Release() {
+    XLOCK(gPlacementLock);
+    for (uint32_t i = 0; i < MAX_REDIS_NODE_COUNT; ++i) {
+        delete gTables[i];
+        gTables[i] = NULL;
+    }
+    for (size_t i = 0; i < gRetired.size(); ++i) {
+        delete gRetired[i];
+    }
+    gRetired.clear();
+}
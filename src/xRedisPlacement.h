@@ -0,0 +1,100 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_PLACEMENT_H_
+#define _XREDIS_PLACEMENT_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    enum {
+        PLACEMENT_MODULO = 0,       // hash % sliceCount, the default
+        PLACEMENT_KETAMA = 1,       // consistent hash ring with virtual nodes
+        PLACEMENT_JUMP = 2,         // jump consistent hash
+        PLACEMENT_RENDEZVOUS = 3    // highest random weight
+    };
+
+#define KETAMA_POINTS_PER_WEIGHT 160
+#define JUMP_MAX_DRAWS 64
+
+    typedef struct _KETAMA_POINT_ {
+        uint32_t point;
+        uint32_t sliceIndex;
+
+        bool operator<(const _KETAMA_POINT_& other) const {
+            return point < other.point;
+        }
+    } KetamaPoint;
+
+    typedef struct _PLACEMENT_TABLE_ {
+        uint32_t strategy;
+        uint32_t sliceCount;
+        std::vector<uint32_t> weights;      // per slice, 0 takes no keys
+        std::vector<KetamaPoint> ring;      // KETAMA
+        uint32_t stride;                    // JUMP: virtual buckets per slice, the first weight are live
+    } PlacementTable;
+
+    // Per-node choice of how a key hash picks a slice. Apart from modulo, a
+    // strategy moves only about 1/N of the keys when slice N is appended, and
+    // weights let bigger machines take a proportional share.
+    //
+    // Weighted jump gives every slice its own block of stride virtual
+    // buckets, stride being twice the largest weight rounded up to a power
+    // of two, and draws again when a key lands past its slice's weight.
+    // Changing one slice's weight within the stride only moves keys to or
+    // from that slice; a new table for the node keeps the old stride unless
+    // a weight outgrows it, which lays every block out again.
+    //
+    // Tables are built by SetPlacement() and published with one pointer
+    // store, so lookups take no lock. A table built for another slice count
+    // is rebuilt for the pool's count on first use, keeping the weights of
+    // the slices that remain and giving new ones weight 1, so growing a
+    // node moves about 1/N of the keys instead of falling back to modulo.
+    // Replaced tables are kept until Release(); configure placement at
+    // startup, not per request.
+    class xRedisPlacement {
+    public:
+        // weights may be NULL for equal weights, otherwise sliceCount entries.
+        static bool SetPlacement(uint32_t nodeIndex, uint32_t strategy, uint32_t sliceCount, const uint32_t* weights = NULL);
+
+        static uint32_t GetPlacement(uint32_t nodeIndex);
+
+        // False when the node uses modulo placement; the caller then falls
+        // back to modulo.
+        static bool Place(uint32_t nodeIndex, uint64_t hash, uint32_t sliceCount, uint32_t& sliceIndex);
+
+        static void Release();
+
+        static int32_t JumpHash(uint64_t key, int32_t buckets);
+
+        static uint64_t Mix64(uint64_t x);
+
+    private:
+        static PlacementTable* Build(uint32_t strategy, uint32_t sliceCount, const uint32_t* weights, const PlacementTable* old);
+
+        static void Publish(uint32_t nodeIndex, PlacementTable* table);
+
+        // The node's table rebuilt for sliceCount, NULL for modulo.
+        static const PlacementTable* Resize(uint32_t nodeIndex, uint32_t sliceCount);
+
+        static void BuildKetama(PlacementTable* table);
+
+        static void BuildJump(PlacementTable* table, const PlacementTable* old);
+
+        static uint32_t PlaceKetama(const PlacementTable* table, uint64_t hash);
+
+        static uint32_t PlaceJump(const PlacementTable* table, uint64_t hash);
+
+        static uint32_t PlaceRendezvous(const PlacementTable* table, uint64_t hash);
+    };
+
+}
+
+#endif
@@ -7,6 +7,8 @@
  */
 
 #include <redis/xredis/xRedisPool.h>
+#include "xRedisResp3.h"
+#include "xRedisUtil.h"
 
 using namespace xrcp;
 
@@ -70,6 +72,13 @@ bool RedisPool::CheckReply(const redisReply* reply) {
             return true;
         case REDIS_REPLY_ERROR:
             return false;
+        case REDIS_REPLY_DOUBLE:
+        case REDIS_REPLY_BOOL:
+        case REDIS_REPLY_MAP:
+        case REDIS_REPLY_SET:
+        case REDIS_REPLY_BIGNUM:
+        case REDIS_REPLY_VERB:
+            return true;
         default:
             return false;
     }
@@ -171,10 +180,12 @@ bool RedisConn::RedisConnect() {
     if (NULL == mCtx) {
         bRet = false;
     } else {
-        bRet = auth();
+        bRet = auth() && xRedisResp3::Hello(mCtx);
         mConnStatus = bRet;
     }
 
+    if (bRet)
+        xRedisConnObserver::Notify(this, CONN_EVENT_CONNECTED);
     return bRet;
 }
 
@@ -189,10 +200,12 @@ bool RedisConn::RedisReConnect() {
     } else {
         redisFree(mCtx);
         mCtx = tmp_ctx;
-        bRet = auth();
+        bRet = auth() && xRedisResp3::Hello(mCtx);
     }
 
     mConnStatus = bRet;
+    if (bRet)
+        xRedisConnObserver::Notify(this, CONN_EVENT_CONNECTED);
     return bRet;
 }
 
@@ -369,6 +382,8 @@ void RedisDBSlice::ConnPoolPing() {
             bool bRet = (*master_iter)->Ping();
             if (!bRet)
                 (*master_iter)->RedisReConnect();
+            else
+                xRedisConnObserver::Notify(*master_iter, CONN_EVENT_IDLE);
         }
     }
 
@@ -382,7 +397,8 @@ void RedisDBSlice::ConnPoolPing() {
                 bool bRet = (*iter)->Ping();
                 if (!bRet)
                     (*iter)->RedisReConnect();
-
+                else
+                    xRedisConnObserver::Notify(*iter, CONN_EVENT_IDLE);
             }
         }
     }
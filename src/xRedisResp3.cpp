@@ -0,0 +1,499 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include "xRedisResp3.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+// Commands RESP3 answers with [member, score] or [field, value] pairs
+// where RESP2 sends one flat array.
+static const char* gPairCommands[] = {
+        "ZRANGE", "ZREVRANGE", "ZRANGEBYSCORE", "ZREVRANGEBYSCORE", "ZUNION", "ZINTER", "ZDIFF",
+        "ZRANDMEMBER", "ZPOPMIN", "ZPOPMAX", "HRANDFIELD", NULL
+};
+
+static uint32_t gProtocol = REDIS_PROTO_RESP2;
+static PUSHFUN gPushFun = NULL;
+static void* gPushPrivdata = NULL;
+
+void xRedisResp3::SetProtocol(uint32_t proto) {
+    gProtocol = (REDIS_PROTO_RESP3 == proto) ? REDIS_PROTO_RESP3 : REDIS_PROTO_RESP2;
+}
+
+uint32_t xRedisResp3::GetProtocol() {
+    return gProtocol;
+}
+
+void xRedisResp3::SetPushHandler(PUSHFUN fun, void* privdata) {
+    gPushPrivdata = privdata;
+    gPushFun = fun;
+}
+
+void xRedisResp3::OnPush(void* privdata, void* reply) {
+    if (NULL != gPushFun)
+        gPushFun(static_cast<redisReply*>(reply), gPushPrivdata);
+    freeReplyObject(reply);
+}
+
+void xRedisResp3::DispatchPush(redisReply* reply) {
+    OnPush(NULL, reply);
+}
+
+void xRedisResp3::DispatchPush(const char* data, size_t len) {
+    if (NULL == gPushFun)
+        return;
+
+    redisReader* reader = redisReaderCreate();
+    if (NULL == reader)
+        return;
+    void* reply = NULL;
+    if ((REDIS_OK == redisReaderFeed(reader, data, len)) && (REDIS_OK == redisReaderGetReply(reader, &reply)) &&
+        (NULL != reply))
+        OnPush(NULL, reply);
+    redisReaderFree(reader);
+}
+
+bool xRedisResp3::Hello(redisContext* ctx) {
+    if ((NULL == ctx) || (REDIS_PROTO_RESP3 != gProtocol))
+        return true;
+
+#ifdef XREDIS_HAVE_RESP3
+    redisReply* reply = static_cast<redisReply*>(redisCommand(ctx, "HELLO 3"));
+    if (NULL == reply)
+        return false;
+
+    // Servers older than 6.0 answer with an error and the connection simply
+    // stays on RESP2.
+    if ((REDIS_REPLY_MAP == reply->type) || (REDIS_REPLY_ARRAY == reply->type))
+        redisSetPushCallback(ctx, xRedisResp3::OnPush);
+    freeReplyObject(reply);
+#endif
+    return true;
+}
+
+void xRedisResp3::Decode(const redisReply* reply, RespValue& value) {
+    value.type = reply->type;
+    value.integer = 0;
+    value.dval = 0;
+    value.str.clear();
+    value.elements.clear();
+
+    switch (reply->type) {
+        case REDIS_REPLY_INTEGER:
+        case REDIS_REPLY_BOOL:
+            value.integer = reply->integer;
+            break;
+        case REDIS_REPLY_DOUBLE:
+#ifdef XREDIS_HAVE_RESP3
+            value.dval = reply->dval;
+#else
+            value.dval = strtod(reply->str, NULL);
+#endif
+            break;
+        case REDIS_REPLY_ARRAY:
+        case REDIS_REPLY_MAP:
+        case REDIS_REPLY_SET:
+        case REDIS_REPLY_PUSH:
+        case REDIS_REPLY_ATTR:
+            value.elements.resize(reply->elements);
+            for (size_t i = 0; i < reply->elements; i++) {
+                Decode(reply->element[i], value.elements[i]);
+            }
+            break;
+        case REDIS_REPLY_NIL:
+            break;
+        default:
+            // STRING, STATUS, ERROR, BIGNUM, VERB
+            if (NULL != reply->str)
+                value.str.assign(reply->str, reply->len);
+            break;
+    }
+}
+
+static bool IsPairCommand(const char* cmd, size_t len) {
+    for (int32_t i = 0; (NULL != cmd) && (NULL != gPairCommands[i]); ++i) {
+        if ((len == strlen(gPairCommands[i])) && (0 == strncasecmp(cmd, gPairCommands[i], len)))
+            return true;
+    }
+    return false;
+}
+
+static void TypesToResp2(redisReply* reply) {
+    switch (reply->type) {
+        case REDIS_REPLY_MAP:
+        case REDIS_REPLY_SET:
+            reply->type = REDIS_REPLY_ARRAY;
+            break;
+        case REDIS_REPLY_DOUBLE:
+        case REDIS_REPLY_BIGNUM:
+        case REDIS_REPLY_VERB:
+            // hiredis keeps the text in str and frees it for all three.
+            reply->type = REDIS_REPLY_STRING;
+            break;
+        case REDIS_REPLY_BOOL:
+            reply->type = REDIS_REPLY_INTEGER;
+            break;
+        default:
+            break;
+    }
+    if (REDIS_REPLY_ARRAY == reply->type) {
+        for (size_t i = 0; i < reply->elements; ++i) {
+            TypesToResp2(reply->element[i]);
+        }
+    }
+}
+
+void xRedisResp3::ToResp2(redisReply* reply, const char* cmd, size_t len) {
+    if ((NULL == reply) || (REDIS_PROTO_RESP3 != gProtocol))
+        return;
+
+    TypesToResp2(reply);
+    if ((REDIS_REPLY_ARRAY != reply->type) || (0 == reply->elements) || !IsPairCommand(cmd, len))
+        return;
+    for (size_t i = 0; i < reply->elements; ++i) {
+        if ((REDIS_REPLY_ARRAY != reply->element[i]->type) || (2 != reply->element[i]->elements))
+            return;
+    }
+
+    // Lift the pairs' elements into one array; the emptied pair shells go
+    // back to hiredis.
+    redisReply** flat = static_cast<redisReply**>(calloc(reply->elements * 2, sizeof(redisReply*)));
+    if (NULL == flat)
+        return;
+    for (size_t i = 0; i < reply->elements; ++i) {
+        redisReply* pair = reply->element[i];
+        flat[2 * i] = pair->element[0];
+        flat[2 * i + 1] = pair->element[1];
+        pair->elements = 0;
+        freeReplyObject(pair);
+    }
+    free(reply->element);
+    reply->element = flat;
+    reply->elements *= 2;
+}
+
+bool xRedisResp3::ToDouble(const redisReply* reply, double& value) {
+    if (NULL == reply)
+        return false;
+
+#ifdef XREDIS_HAVE_RESP3
+    if (REDIS_REPLY_DOUBLE == reply->type) {
+        value = reply->dval;
+        return true;
+    }
+#endif
+    if (((REDIS_REPLY_STRING == reply->type) || (REDIS_REPLY_DOUBLE == reply->type)) && (NULL != reply->str)) {
+        char* end = NULL;
+        value = strtod(reply->str, &end);
+        return end != reply->str;
+    }
+    if (REDIS_REPLY_INTEGER == reply->type) {
+        value = (double) reply->integer;
+        return true;
+    }
+    return false;
+}
+
+std::string xRedisNative::FormatDouble(double value) {
+    if (isinf(value))
+        return (value > 0) ? "inf" : "-inf";
+
+    // Shortest representation that parses back to the same double.
+    char szBuf[32] = {0};
+    for (int32_t precision = 1; precision <= 17; ++precision) {
+        snprintf(szBuf, sizeof(szBuf), "%.*g", precision, value);
+        if (strtod(szBuf, NULL) == value)
+            break;
+    }
+    return szBuf;
+}
+
+std::string xRedisNative::FormatFloat(float value) {
+    if (isinf(value))
+        return (value > 0) ? "inf" : "-inf";
+
+    char szBuf[32] = {0};
+    for (int32_t precision = 1; precision <= 9; ++precision) {
+        snprintf(szBuf, sizeof(szBuf), "%.*g", precision, (double) value);
+        if (strtof(szBuf, NULL) == value)
+            break;
+    }
+    return szBuf;
+}
+
+xRedisNative::xRedisNative(xRedisClient* client) {
+    mClient = client;
+}
+
+xRedisNative::~xRedisNative() {
+}
+
+// Straight on the context: the RedisConn helpers would turn the reply back
+// into its RESP2 shape.
+redisReply* xRedisNative::CommandArgv(const SliceIndex& index, uint32_t ioType, const VDATA& vData) {
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return NULL;
+    }
+
+    redisReply* reply = RedisCommandArgv(pRedisConn->getCtx(), vData);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, vData);
+    if (NULL == reply)
+        const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+    else if (REDIS_REPLY_ERROR == reply->type)
+        const_cast<SliceIndex&>(index).SetErrInfo(reply->str, static_cast<size_t>(reply->len));
+
+    pRedisPool->FreeConnection(pRedisConn);
+    return reply;
+}
+
+bool xRedisNative::CommandDouble(const SliceIndex& index, uint32_t ioType, const VDATA& vData, double& value) {
+    redisReply* reply = CommandArgv(index, ioType, vData);
+    bool bRet = RedisPool::CheckReply(reply) && xRedisResp3::ToDouble(reply, value);
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisNative::command(const SliceIndex& index, const VDATA& vData, RespValue& value) {
+    redisReply* reply = CommandArgv(index, MASTER, vData);
+    if (NULL == reply)
+        return false;
+
+    xRedisResp3::Decode(reply, value);
+    bool bRet = REDIS_REPLY_ERROR != reply->type;
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisNative::zscore(const SliceIndex& index, const string& key, const string& member, double& score) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZSCORE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(member);
+    return CommandDouble(index, SLAVE, vCmdData, score);
+}
+
+bool xRedisNative::zincrby(const SliceIndex& index, const string& key, double increment, const string& member, double& score) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZINCRBY");
+    vCmdData.push_back(key);
+    vCmdData.push_back(FormatDouble(increment));
+    vCmdData.push_back(member);
+    return CommandDouble(index, MASTER, vCmdData, score);
+}
+
+bool xRedisNative::hincrbyfloat(const SliceIndex& index, const string& key, const string& field, double increment, double& value) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("HINCRBYFLOAT");
+    vCmdData.push_back(key);
+    vCmdData.push_back(field);
+    vCmdData.push_back(FormatDouble(increment));
+    return CommandDouble(index, MASTER, vCmdData, value);
+}
+
+bool xRedisNative::hgetall(const SliceIndex& index, const string& key, std::map<string, string>& fields) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("HGETALL");
+    vCmdData.push_back(key);
+
+    redisReply* reply = CommandArgv(index, SLAVE, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply);
+    if (bRet) {
+        // RESP3 sends a map, RESP2 a flat array; hiredis lays both out as
+        // field, value, field, value...
+        for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+            const redisReply* field = reply->element[i];
+            const redisReply* value = reply->element[i + 1];
+            fields[string(field->str, field->len)].assign(value->str, value->len);
+        }
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisNative::smembers(const SliceIndex& index, const KEY& key, std::set<string>& members) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("SMEMBERS");
+    vCmdData.push_back(key);
+
+    redisReply* reply = CommandArgv(index, SLAVE, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply);
+    if (bRet) {
+        for (size_t i = 0; i < reply->elements; i++) {
+            members.insert(string(reply->element[i]->str, reply->element[i]->len));
+        }
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+static void AddZaddFlags(VDATA& vCmdData, uint32_t flags) {
+    if (flags & ZADD_NX)
+        vCmdData.push_back("NX");
+    if (flags & ZADD_XX)
+        vCmdData.push_back("XX");
+    if (flags & ZADD_GT)
+        vCmdData.push_back("GT");
+    if (flags & ZADD_LT)
+        vCmdData.push_back("LT");
+    if (flags & ZADD_CH)
+        vCmdData.push_back("CH");
+}
+
+static void BuildZrange(VDATA& vCmdData, const string& key, const string& start, const string& stop, uint32_t flags, const LIMIT* limit) {
+    vCmdData.push_back("ZRANGE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(start);
+    vCmdData.push_back(stop);
+    if (flags & ZRANGE_BYSCORE)
+        vCmdData.push_back("BYSCORE");
+    else if (flags & ZRANGE_BYLEX)
+        vCmdData.push_back("BYLEX");
+    if (flags & ZRANGE_REV)
+        vCmdData.push_back("REV");
+    if (NULL != limit) {
+        vCmdData.push_back("LIMIT");
+        vCmdData.push_back(toString(limit->offset));
+        vCmdData.push_back(toString(limit->count));
+    }
+}
+
+bool xRedisNative::ParseScored(const redisReply* reply, ZMEMBERS& members) {
+    members.clear();
+    if ((NULL == reply) || (REDIS_REPLY_ARRAY != reply->type))
+        return false;
+
+    bool nested = (reply->elements > 0) && (REDIS_REPLY_ARRAY == reply->element[0]->type);
+    size_t count = nested ? reply->elements : reply->elements / 2;
+    members.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (nested && (reply->element[i]->elements < 2))
+            return false;
+        const redisReply* member = nested ? reply->element[i]->element[0] : reply->element[2 * i];
+        const redisReply* score = nested ? reply->element[i]->element[1] : reply->element[2 * i + 1];
+        members[i].first.assign(member->str, member->len);
+        if (!xRedisResp3::ToDouble(score, members[i].second))
+            return false;
+    }
+    return true;
+}
+
+bool xRedisNative::CommandScored(const SliceIndex& index, uint32_t ioType, const VDATA& vData, ZMEMBERS& members) {
+    redisReply* reply = CommandArgv(index, ioType, vData);
+    bool bRet = RedisPool::CheckReply(reply) && ParseScored(reply, members);
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisNative::zadd(const SliceIndex& index, const string& key, const ZMEMBERS& members, uint32_t flags, int64_t& count) {
+    if ((0 == key.length()) || members.empty()) return false;
+    VDATA vCmdData;
+    vCmdData.reserve(members.size() * 2 + 7);
+    vCmdData.push_back("ZADD");
+    vCmdData.push_back(key);
+    AddZaddFlags(vCmdData, flags);
+    for (ZMEMBERS::const_iterator it = members.begin(); it != members.end(); ++it) {
+        vCmdData.push_back(FormatDouble(it->second));
+        vCmdData.push_back(it->first);
+    }
+
+    redisReply* reply = CommandArgv(index, MASTER, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply) && (REDIS_REPLY_INTEGER == reply->type);
+    if (bRet)
+        count = reply->integer;
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisNative::zaddincr(const SliceIndex& index, const string& key, uint32_t flags, const string& member, double increment, double& score) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZADD");
+    vCmdData.push_back(key);
+    AddZaddFlags(vCmdData, flags);
+    vCmdData.push_back("INCR");
+    vCmdData.push_back(FormatDouble(increment));
+    vCmdData.push_back(member);
+    return CommandDouble(index, MASTER, vCmdData, score);
+}
+
+bool xRedisNative::zrange(const SliceIndex& index, const string& key, const string& start, const string& stop, uint32_t flags, const LIMIT* limit, VALUES& members) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    BuildZrange(vCmdData, key, start, stop, flags, limit);
+
+    redisReply* reply = CommandArgv(index, SLAVE, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply) && (REDIS_REPLY_ARRAY == reply->type);
+    if (bRet) {
+        members.resize(reply->elements);
+        for (size_t i = 0; i < reply->elements; ++i) {
+            members[i].assign(reply->element[i]->str, reply->element[i]->len);
+        }
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisNative::zrange(const SliceIndex& index, const string& key, const string& start, const string& stop, uint32_t flags, const LIMIT* limit, ZMEMBERS& members) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    BuildZrange(vCmdData, key, start, stop, flags, limit);
+    vCmdData.push_back("WITHSCORES");
+    return CommandScored(index, SLAVE, vCmdData, members);
+}
+
+bool xRedisNative::zmscore(const SliceIndex& index, const string& key, const VALUES& members, std::vector<double>& scores) {
+    if ((0 == key.length()) || members.empty()) return false;
+    VDATA vCmdData;
+    vCmdData.reserve(members.size() + 2);
+    vCmdData.push_back("ZMSCORE");
+    vCmdData.push_back(key);
+    vCmdData.insert(vCmdData.end(), members.begin(), members.end());
+
+    redisReply* reply = CommandArgv(index, SLAVE, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply) && (REDIS_REPLY_ARRAY == reply->type);
+    if (bRet) {
+        scores.assign(reply->elements, NAN);
+        for (size_t i = 0; i < reply->elements; ++i) {
+            if (REDIS_REPLY_NIL != reply->element[i]->type)
+                xRedisResp3::ToDouble(reply->element[i], scores[i]);
+        }
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisNative::zpopmin(const SliceIndex& index, const string& key, int64_t count, ZMEMBERS& members) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZPOPMIN");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(count));
+    return CommandScored(index, MASTER, vCmdData, members);
+}
+
+bool xRedisNative::zpopmax(const SliceIndex& index, const string& key, int64_t count, ZMEMBERS& members) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZPOPMAX");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(count));
+    return CommandScored(index, MASTER, vCmdData, members);
+}
@@ -0,0 +1,166 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_RESP3_H_
+#define _XREDIS_RESP3_H_
+
+#include <map>
+#include <set>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+// RESP3 reply types, same values as hiredis >= 1.0.
+#ifndef REDIS_REPLY_DOUBLE
+#define REDIS_REPLY_DOUBLE 7
+#define REDIS_REPLY_BOOL 8
+#define REDIS_REPLY_MAP 9
+#define REDIS_REPLY_SET 10
+#define REDIS_REPLY_ATTR 11
+#define REDIS_REPLY_PUSH 12
+#define REDIS_REPLY_BIGNUM 13
+#define REDIS_REPLY_VERB 14
+#else
+#define XREDIS_HAVE_RESP3 1
+#endif
+
+namespace xrcp {
+
+#define REDIS_PROTO_RESP2 2
+#define REDIS_PROTO_RESP3 3
+
+    typedef struct _RESP_VALUE_ {
+        int32_t type;                               // REDIS_REPLY_*
+        int64_t integer;                            // INTEGER, BOOL (0/1)
+        double dval;                                // DOUBLE
+        std::string str;                            // STRING, STATUS, ERROR, BIGNUM digits, VERB text
+        std::vector<struct _RESP_VALUE_> elements;  // ARRAY, SET, PUSH; MAP as key, value, key, value...
+    } RespValue;
+
+    typedef std::pair<std::string, double> ZMEMBER;     // member, score
+    typedef std::vector<ZMEMBER> ZMEMBERS;
+
+    // ZADD flags.
+#define ZADD_NX 0x01
+#define ZADD_XX 0x02
+#define ZADD_GT 0x04
+#define ZADD_LT 0x08
+#define ZADD_CH 0x10
+
+    // ZRANGE flags.
+#define ZRANGE_BYSCORE 0x01
+#define ZRANGE_BYLEX 0x02
+#define ZRANGE_REV 0x04
+
+    // Called for out-of-band push frames (invalidations, pubsub messages)
+    // read on any pool connection. The reply is freed after the call.
+    typedef void (* PUSHFUN)(const redisReply* reply, void* privdata);
+
+    // Protocol negotiation and native decoding. With RESP3 enabled every
+    // connection sends HELLO 3 after AUTH in RedisConn::RedisConnect(); servers
+    // or hiredis builds without RESP3 stay on RESP2.
+    //
+    // Only xRedisNative sees RESP3 shapes. Replies to the xRedisClient API
+    // and to modules sending through the xRedisUtil RedisConn helpers are
+    // turned back into what RESP2 would have given (see ToResp2), so
+    // enabling RESP3 changes no existing accessor.
+    class xRedisResp3 {
+    public:
+        static void SetProtocol(uint32_t proto);
+
+        static uint32_t GetProtocol();
+
+        static void SetPushHandler(PUSHFUN fun, void* privdata);
+
+        // Hands a push frame read outside hiredis's callback to the handler,
+        // decoded or as raw RESP bytes; a decoded reply is freed.
+        static void DispatchPush(redisReply* reply);
+
+        static void DispatchPush(const char* data, size_t len);
+
+        // Negotiate the configured protocol on a freshly authenticated context.
+        static bool Hello(redisContext* ctx);
+
+        static void Decode(const redisReply* reply, RespValue& value);
+
+        // Rewrites reply of command cmd (its name, len bytes) in place into
+        // its RESP2 shape: maps and sets become arrays, doubles, big numbers
+        // and verbatim strings bulk strings, booleans integers, and the
+        // [member, score] pairs of ZRANGE ... WITHSCORES and the like one
+        // flat array. A no-op while RESP3 is off.
+        static void ToResp2(redisReply* reply, const char* cmd, size_t len);
+
+        static bool ToDouble(const redisReply* reply, double& value);
+
+    private:
+        static void OnPush(void* privdata, void* reply);
+    };
+
+    // Typed replies without string round trips on RESP3, and with a single
+    // strtod() parse on RESP2.
+    class xRedisNative {
+    public:
+        explicit xRedisNative(xRedisClient* client);
+
+        ~xRedisNative();
+
+        bool command(const SliceIndex& index, const VDATA& vData, RespValue& value);
+
+        bool zscore(const SliceIndex& index, const string& key, const string& member, double& score);
+
+        bool zincrby(const SliceIndex& index, const string& key, double increment, const string& member, double& score);
+
+        bool hincrbyfloat(const SliceIndex& index, const string& key, const string& field, double increment, double& value);
+
+        bool hgetall(const SliceIndex& index, const string& key, std::map<string, string>& fields);
+
+        bool smembers(const SliceIndex& index, const KEY& key, std::set<string>& members);
+
+        // Typed sorted sets: scores go out in shortest round-trip form and
+        // come back as doubles, never as interleaved strings.
+        bool zadd(const SliceIndex& index, const string& key, const ZMEMBERS& members, uint32_t flags, int64_t& count);
+
+        // ZADD ... INCR; false when NX/XX/GT/LT blocked the update.
+        bool zaddincr(const SliceIndex& index, const string& key, uint32_t flags, const string& member, double increment, double& score);
+
+        // ZRANGE key start stop [BYSCORE|BYLEX] [REV] [LIMIT offset count].
+        // start/stop are ranks, scores ("(1.5", "-inf") or lex ranges ("[a").
+        // Redis rejects LIMIT without BYSCORE/BYLEX and scores with BYLEX.
+        bool zrange(const SliceIndex& index, const string& key, const string& start, const string& stop, uint32_t flags, const LIMIT* limit, VALUES& members);
+
+        bool zrange(const SliceIndex& index, const string& key, const string& start, const string& stop, uint32_t flags, const LIMIT* limit, ZMEMBERS& members);
+
+        // Members that do not exist get NAN, which no score can be.
+        bool zmscore(const SliceIndex& index, const string& key, const VALUES& members, std::vector<double>& scores);
+
+        bool zpopmin(const SliceIndex& index, const string& key, int64_t count, ZMEMBERS& members);
+
+        bool zpopmax(const SliceIndex& index, const string& key, int64_t count, ZMEMBERS& members);
+
+        static std::string FormatDouble(double value);
+
+        // Shortest form that parses back to the same float: 0.1f is "0.1",
+        // not the "0.10000000149011612" of its double widening.
+        static std::string FormatFloat(float value);
+
+        // member, score pairs from a RESP2 flat array or RESP3 nested pairs.
+        static bool ParseScored(const redisReply* reply, ZMEMBERS& members);
+
+    private:
+        redisReply* CommandArgv(const SliceIndex& index, uint32_t ioType, const VDATA& vData);
+
+        bool CommandDouble(const SliceIndex& index, uint32_t ioType, const VDATA& vData, double& value);
+
+        bool CommandScored(const SliceIndex& index, uint32_t ioType, const VDATA& vData, ZMEMBERS& members);
+
+    private:
+        xRedisClient* mClient;
+    };
+
+}
+
+#endif
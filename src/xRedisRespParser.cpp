@@ -0,0 +1,597 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include "xRedisRespParser.h"
+#include "xRedisResp3.h"
+#include "xRedisUtil.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define XREDIS_RESP_SSE2 1
+#if defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#include <immintrin.h>
+#define XREDIS_RESP_AVX2 1
+#endif
+#endif
+
+using namespace xrcp;
+
+#define RESP_READ_CHUNK (64 * 1024)
+
+typedef const char* (* FINDCRLFFUN)(const char* p, const char* end);
+
+static const char* FindCRLFScalar(const char* p, const char* end) {
+    while (p + 1 < end) {
+        const char* cr = static_cast<const char*>(memchr(p, '\r', (size_t) (end - p - 1)));
+        if (NULL == cr)
+            return NULL;
+        if ('\n' == cr[1])
+            return cr;
+        p = cr + 1;
+    }
+    return NULL;
+}
+
+#ifdef XREDIS_RESP_SSE2
+static const char* FindCRLFSSE2(const char* p, const char* end) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (p + 17 <= end) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        while (0 != mask) {
+            const char* hit = p + __builtin_ctz(mask);
+            if ('\n' == hit[1])
+                return hit;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    return FindCRLFScalar(p, end);
+}
+#endif
+
+#ifdef XREDIS_RESP_AVX2
+__attribute__((target("avx2")))
+static const char* FindCRLFAVX2(const char* p, const char* end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    while (p + 33 <= end) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        while (0 != mask) {
+            const char* hit = p + __builtin_ctz(mask);
+            if ('\n' == hit[1])
+                return hit;
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return FindCRLFScalar(p, end);
+}
+#endif
+
+static FINDCRLFFUN SelectFindCRLF(const char** name) {
+#ifdef XREDIS_RESP_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return FindCRLFAVX2;
+    }
+#endif
+#ifdef XREDIS_RESP_SSE2
+    *name = "sse2";
+    return FindCRLFSSE2;
+#else
+    *name = "scalar";
+    return FindCRLFScalar;
+#endif
+}
+
+static const char* gFindCRLFName = "scalar";
+static FINDCRLFFUN gFindCRLF = SelectFindCRLF(&gFindCRLFName);
+
+const char* RespReader::FindCRLF(const char* p, const char* end) {
+    return gFindCRLF(p, end);
+}
+
+const char* RespReader::GetKernelName() {
+    return gFindCRLFName;
+}
+
+bool RespReader::ParseInt(const char* p, size_t len, int64_t& value) {
+    bool negative = false;
+    if ((len > 0) && ('-' == *p)) {
+        negative = true;
+        ++p;
+        --len;
+    }
+    if ((0 == len) || (len > 19))
+        return false;
+    // 19 digits may not fit: 9223372036854775807, one more when negative.
+    if ((19 == len) && (memcmp(p, negative ? "9223372036854775808" : "9223372036854775807", 19) > 0))
+        return false;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    if (len <= 8) {
+        // Left-pad with '0' and convert all eight digits with three multiplies.
+        uint64_t v = 0x3030303030303030ULL;
+        memcpy(reinterpret_cast<char*>(&v) + (8 - len), p, len);
+        v -= 0x3030303030303030ULL;
+        if (0 != (((v + 0x7676767676767676ULL) | v) & 0x8080808080808080ULL))
+            return false;
+        v = (v * 10) + (v >> 8);
+        v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+             (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+        value = negative ? (int64_t) (0 - v) : (int64_t) v;
+        return true;
+    }
+#endif
+
+    uint64_t v = 0;
+    for (size_t i = 0; i < len; ++i) {
+        uint32_t digit = (uint32_t) (p[i] - '0');
+        if (digit > 9)
+            return false;
+        v = v * 10 + digit;
+    }
+    value = negative ? (int64_t) (0 - v) : (int64_t) v;
+    return true;
+}
+
+RespReader::RespReader() {
+    mPos = 0;
+    mLen = 0;
+    mSkipBase = 0;
+    mSkipping = false;
+    mDone = false;
+    mPushStart = 0;
+    mPushElements = 0;
+    mPushing = false;
+}
+
+RespReader::~RespReader() {
+}
+
+void RespReader::Reset() {
+    mPos = 0;
+    mLen = 0;
+    mStack.clear();
+    mSkipBase = 0;
+    mSkipping = false;
+    mDone = false;
+    mPushStart = 0;
+    mPushElements = 0;
+    mPushing = false;
+}
+
+char* RespReader::GetWriteBuffer(size_t minSize, size_t& avail) {
+    if (mBuf.size() - mLen < minSize)
+        mBuf.resize(mLen + minSize);
+    avail = mBuf.size() - mLen;
+    return &mBuf[mLen];
+}
+
+void RespReader::Commit(size_t len) {
+    mLen += len;
+}
+
+void RespReader::Feed(const char* data, size_t len) {
+    size_t avail = 0;
+    char* p = GetWriteBuffer(len, avail);
+    memcpy(p, data, len);
+    Commit(len);
+}
+
+void RespReader::Compact() {
+    // A push frame is returned whole, so keep it from its first byte.
+    size_t keep = mPushing ? mPushStart : mPos;
+    if (0 == keep)
+        return;
+    if (keep < mLen)
+        memmove(&mBuf[0], &mBuf[keep], mLen - keep);
+    mLen -= keep;
+    mPos -= keep;
+    mPushStart = 0;
+}
+
+size_t RespReader::GetBuffered() const {
+    return mLen - mPos;
+}
+
+const char* RespReader::GetUnread(size_t& len) const {
+    size_t from = mPushing ? mPushStart : mPos;
+    len = mLen - from;
+    return (len > 0) ? &mBuf[from] : NULL;
+}
+
+bool RespReader::IsDone() const {
+    return mDone;
+}
+
+void RespReader::Consume(const RespToken& token) {
+    if (!mStack.empty())
+        mStack.back()--;
+
+    bool aggregate = (REDIS_REPLY_ARRAY == token.type) || (REDIS_REPLY_SET == token.type) ||
+                     (REDIS_REPLY_MAP == token.type) || (REDIS_REPLY_PUSH == token.type) ||
+                     (REDIS_REPLY_ATTR == token.type);
+    if (aggregate && (token.integer > 0)) {
+        bool paired = (REDIS_REPLY_MAP == token.type) || (REDIS_REPLY_ATTR == token.type);
+        mStack.push_back(paired ? token.integer * 2 : token.integer);
+    }
+
+    while (!mStack.empty() && (0 == mStack.back())) {
+        mStack.pop_back();
+    }
+    if (!mSkipping)
+        mDone = mStack.empty();
+}
+
+int32_t RespReader::Next(RespToken& token) {
+    for (;;) {
+        if (mPos >= mLen)
+            return RESP_PARSE_INCOMPLETE;
+
+        const char* base = &mBuf[0];
+        size_t start = mPos;
+        const char* p = base + start;
+        const char* crlf = FindCRLF(p + 1, base + mLen);
+        if (NULL == crlf)
+            return RESP_PARSE_INCOMPLETE;
+
+        const char* line = p + 1;
+        size_t lineLen = (size_t) (crlf - line);
+        size_t next = (size_t) (crlf + 2 - base);
+
+        token.depth = (uint32_t) mStack.size();
+        token.integer = 0;
+        token.str = NULL;
+        token.len = 0;
+
+        switch (*p) {
+            case '+':
+                token.type = REDIS_REPLY_STATUS;
+                token.str = line;
+                token.len = lineLen;
+                break;
+            case '-':
+                token.type = REDIS_REPLY_ERROR;
+                token.str = line;
+                token.len = lineLen;
+                break;
+            case ':':
+                token.type = REDIS_REPLY_INTEGER;
+                if (!ParseInt(line, lineLen, token.integer))
+                    return RESP_PARSE_ERROR;
+                break;
+            case ',':
+                token.type = REDIS_REPLY_DOUBLE;
+                token.str = line;
+                token.len = lineLen;
+                break;
+            case '(':
+                token.type = REDIS_REPLY_BIGNUM;
+                token.str = line;
+                token.len = lineLen;
+                break;
+            case '#':
+                token.type = REDIS_REPLY_BOOL;
+                token.integer = ((lineLen > 0) && ('t' == line[0])) ? 1 : 0;
+                break;
+            case '_':
+                token.type = REDIS_REPLY_NIL;
+                break;
+            case '$':
+            case '=':
+            case '!': {
+                int64_t bulkLen = 0;
+                if (!ParseInt(line, lineLen, bulkLen))
+                    return RESP_PARSE_ERROR;
+                if (bulkLen < 0) {
+                    token.type = REDIS_REPLY_NIL;
+                    break;
+                }
+                if (next + (size_t) bulkLen + 2 > mLen)
+                    return RESP_PARSE_INCOMPLETE;
+                token.type = ('$' == *p) ? REDIS_REPLY_STRING : (('=' == *p) ? REDIS_REPLY_VERB : REDIS_REPLY_ERROR);
+                token.str = base + next;
+                token.len = (size_t) bulkLen;
+                if ((REDIS_REPLY_VERB == token.type) && (token.len >= 4)) {
+                    // Drop the "txt:" format prefix.
+                    token.str += 4;
+                    token.len -= 4;
+                }
+                next += (size_t) bulkLen + 2;
+                break;
+            }
+            case '*':
+            case '~':
+            case '%':
+            case '>':
+            case '|':
+                if (!ParseInt(line, lineLen, token.integer))
+                    return RESP_PARSE_ERROR;
+                if (token.integer < 0) {
+                    token.type = REDIS_REPLY_NIL;
+                    token.integer = 0;
+                    break;
+                }
+                token.type = ('*' == *p) ? REDIS_REPLY_ARRAY : ('~' == *p) ? REDIS_REPLY_SET :
+                             ('%' == *p) ? REDIS_REPLY_MAP : ('>' == *p) ? REDIS_REPLY_PUSH : REDIS_REPLY_ATTR;
+                break;
+            default:
+                return RESP_PARSE_ERROR;
+        }
+
+        mPos = next;
+
+        // Attributes are read through and dropped. A top-level push frame is
+        // out-of-band data too, read through and returned raw.
+        if (!mSkipping && (0 == token.depth) && (REDIS_REPLY_PUSH == token.type)) {
+            if (0 == token.integer) {
+                token.str = base + start;
+                token.len = next - start;
+                return RESP_PARSE_PUSH;
+            }
+            mPushing = true;
+            mPushStart = start;
+            mPushElements = token.integer;
+            mSkipping = true;
+            mSkipBase = mStack.size();
+            mStack.push_back(token.integer);
+            continue;
+        }
+        if (!mSkipping && (REDIS_REPLY_ATTR == token.type)) {
+            if (token.integer > 0) {
+                mSkipping = true;
+                mSkipBase = mStack.size();
+                mStack.push_back(token.integer * 2);
+            }
+            continue;
+        }
+        if (mSkipping) {
+            Consume(token);
+            if (mStack.size() > mSkipBase)
+                continue;
+            mSkipping = false;
+            if (!mPushing)
+                continue;
+            mPushing = false;
+            token.type = REDIS_REPLY_PUSH;
+            token.integer = mPushElements;
+            token.str = &mBuf[mPushStart];
+            token.len = mPos - mPushStart;
+            token.depth = 0;
+            return RESP_PARSE_PUSH;
+        }
+
+        Consume(token);
+        return RESP_PARSE_OK;
+    }
+}
+
+// Empties ctx->reader before the socket is read directly: buffered replies
+// are taken with redisGetReplyFromReader() until it has none left. Push
+// frames go to the push handler; any other reply means the connection is
+// out of step. A frame hiredis holds only part of (unread bytes, or an
+// aggregate it has started) is completed from the socket first.
+static bool DrainReader(redisContext* ctx) {
+    for (;;) {
+        void* reply = NULL;
+        if (REDIS_OK != redisGetReplyFromReader(ctx, &reply))
+            return false;
+        if (NULL != reply) {
+            if (REDIS_REPLY_PUSH != static_cast<redisReply*>(reply)->type) {
+                freeReplyObject(reply);
+                return false;
+            }
+            xRedisResp3::DispatchPush(static_cast<redisReply*>(reply));
+            continue;
+        }
+
+        redisReader* r = ctx->reader;
+        if ((r->pos >= r->len) && (NULL == redisReplyReaderGetObject(r)))
+            return true;
+        if (REDIS_OK != redisBufferRead(ctx))
+            return false;
+    }
+}
+
+xRedisFastReply::xRedisFastReply(xRedisClient* client) {
+    mClient = client;
+}
+
+xRedisFastReply::~xRedisFastReply() {
+}
+
+bool xRedisFastReply::commandargv_tokens(const SliceIndex& index, uint32_t ioType, const VDATA& vData, TOKENFUN fun, void* privdata) {
+    if ((NULL == mClient) || (NULL == fun))
+        return false;
+
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+
+    redisContext* ctx = pRedisConn->getCtx();
+    bool bRet = DrainReader(ctx) && (REDIS_OK == RedisAppendCommandArgv(ctx, vData));
+    int32_t done = 0;
+    while (bRet && !done) {
+        bRet = (REDIS_OK == redisBufferWrite(ctx, &done));
+    }
+
+    RespReader reader;
+    bool bStopped = false;
+    bool bReplyError = false;
+    while (bRet && !reader.IsDone()) {
+        RespToken token;
+        int32_t ret = reader.Next(token);
+        if (RESP_PARSE_OK == ret) {
+            if ((0 == token.depth) && (REDIS_REPLY_ERROR == token.type)) {
+                const_cast<SliceIndex&>(index).SetErrInfo(token.str, token.len);
+                bReplyError = true;
+            } else if (!bStopped && !fun(token, privdata)) {
+                bStopped = true;
+                break;
+            }
+            continue;
+        }
+        if (RESP_PARSE_PUSH == ret) {
+            xRedisResp3::DispatchPush(token.str, token.len);
+            continue;
+        }
+        if (RESP_PARSE_ERROR == ret) {
+            bRet = false;
+            break;
+        }
+
+        // Only a single element has to fit in memory at a time.
+        reader.Compact();
+        size_t avail = 0;
+        char* buf = reader.GetWriteBuffer(RESP_READ_CHUNK, avail);
+        ssize_t n = read(ctx->fd, buf, avail);
+        if (n > 0) {
+            reader.Commit((size_t) n);
+        } else if ((n < 0) && (EINTR == errno)) {
+            continue;
+        } else {
+            bRet = false;
+        }
+    }
+
+    size_t restLen = 0;
+    const char* rest = reader.GetUnread(restLen);
+    if (bRet && !bStopped && (restLen > 0)) {
+        // Bytes read past the reply (push frames) belong to hiredis.
+        bRet = (REDIS_OK == redisReaderFeed(ctx->reader, rest, restLen));
+    }
+
+    if (!bRet || bStopped) {
+        // The rest of the reply is still on the socket.
+        if (!bRet)
+            const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+        pRedisConn->RedisReConnect();
+    }
+
+    pRedisPool->FreeConnection(pRedisConn);
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, vData);
+    return bRet && !bReplyError;
+}
+
+typedef struct _FAST_ARRAY_CTX_ {
+    ArrayReply* array;
+    VALUES* values;
+    bool nil;
+} FastArrayCtx;
+
+static bool OnArrayToken(const RespToken& token, void* privdata) {
+    FastArrayCtx* pCtx = static_cast<FastArrayCtx*>(privdata);
+    if (0 == token.depth) {
+        if (REDIS_REPLY_NIL == token.type)
+            pCtx->nil = true;
+        return true;
+    }
+
+    bool aggregate = (REDIS_REPLY_ARRAY == token.type) || (REDIS_REPLY_SET == token.type) || (REDIS_REPLY_MAP == token.type);
+    if (aggregate)
+        return true;
+
+    std::string str;
+    if ((REDIS_REPLY_INTEGER == token.type) || (REDIS_REPLY_BOOL == token.type))
+        str = toString(token.integer);
+    else if (NULL != token.str)
+        str.assign(token.str, token.len);
+
+    if (NULL != pCtx->array) {
+        DataItem item;
+        item.type = token.type;
+        item.str.swap(str);
+        pCtx->array->push_back(item);
+    } else {
+        pCtx->values->push_back(str);
+    }
+    return true;
+}
+
+bool xRedisFastReply::commandargv_array(const SliceIndex& index, const VDATA& vData, ArrayReply& array) {
+    FastArrayCtx ctx;
+    ctx.array = &array;
+    ctx.values = NULL;
+    ctx.nil = false;
+    return commandargv_tokens(index, MASTER, vData, OnArrayToken, &ctx) && !ctx.nil;
+}
+
+bool xRedisFastReply::commandargv_list(const SliceIndex& index, const VDATA& vData, VALUES& values) {
+    FastArrayCtx ctx;
+    ctx.array = NULL;
+    ctx.values = &values;
+    ctx.nil = false;
+    return commandargv_tokens(index, MASTER, vData, OnArrayToken, &ctx) && !ctx.nil;
+}
+
+bool xRedisFastReply::lrange(const SliceIndex& index, const string& key, int64_t start, int64_t end, ArrayReply& array) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("LRANGE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(start));
+    vCmdData.push_back(toString(end));
+
+    FastArrayCtx ctx;
+    ctx.array = &array;
+    ctx.values = NULL;
+    ctx.nil = false;
+    return commandargv_tokens(index, SLAVE, vCmdData, OnArrayToken, &ctx) && !ctx.nil;
+}
+
+bool xRedisFastReply::hgetall(const SliceIndex& index, const string& key, ArrayReply& array) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("HGETALL");
+    vCmdData.push_back(key);
+
+    FastArrayCtx ctx;
+    ctx.array = &array;
+    ctx.values = NULL;
+    ctx.nil = false;
+    return commandargv_tokens(index, SLAVE, vCmdData, OnArrayToken, &ctx) && !ctx.nil;
+}
+
+bool xRedisFastReply::smembers(const SliceIndex& index, const KEY& key, VALUES& vValue) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("SMEMBERS");
+    vCmdData.push_back(key);
+
+    FastArrayCtx ctx;
+    ctx.array = NULL;
+    ctx.values = &vValue;
+    ctx.nil = false;
+    return commandargv_tokens(index, SLAVE, vCmdData, OnArrayToken, &ctx) && !ctx.nil;
+}
+
+bool xRedisFastReply::zrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, VALUES& vValues, bool withscore) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZRANGE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(start));
+    vCmdData.push_back(toString(end));
+    if (withscore)
+        vCmdData.push_back("WITHSCORES");
+
+    FastArrayCtx ctx;
+    ctx.array = NULL;
+    ctx.values = &vValues;
+    ctx.nil = false;
+    return commandargv_tokens(index, SLAVE, vCmdData, OnArrayToken, &ctx) && !ctx.nil;
+}
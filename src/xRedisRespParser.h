@@ -0,0 +1,127 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_RESP_PARSER_H_
+#define _XREDIS_RESP_PARSER_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+#define RESP_PARSE_OK          0
+#define RESP_PARSE_INCOMPLETE  1
+#define RESP_PARSE_ERROR      -1
+#define RESP_PARSE_PUSH        2
+
+    // One protocol element. str/len view the reader buffer and stay valid
+    // until the next Compact() or read into the reader.
+    typedef struct _RESP_TOKEN_ {
+        int32_t type;       // REDIS_REPLY_*; aggregates carry their element count
+        int64_t integer;    // INTEGER, BOOL, aggregate element count
+        const char* str;
+        size_t len;
+        uint32_t depth;     // 0 for the top-level element
+    } RespToken;
+
+    // Incremental RESP2/RESP3 tokenizer. Delimiters are located with
+    // SSE2/AVX2 when the CPU has them (chosen once at runtime) and lengths
+    // are parsed eight digits at a time, and no redisReply is allocated per
+    // element. Token order and content match hiredis's reader, which
+    // test/xRedisRespParserTest.cpp checks on random replies.
+    //
+    // Attributes are dropped. A top-level push frame is not part of the
+    // reply: Next() returns RESP_PARSE_PUSH with the whole raw frame in
+    // str/len, for xRedisResp3::DispatchPush().
+    class RespReader {
+    public:
+        RespReader();
+
+        ~RespReader();
+
+        // Room for at least minSize bytes to read() into; Commit() what was read.
+        char* GetWriteBuffer(size_t minSize, size_t& avail);
+
+        void Commit(size_t len);
+
+        void Feed(const char* data, size_t len);
+
+        int32_t Next(RespToken& token);
+
+        // True once the last element of the top-level reply was returned.
+        bool IsDone() const;
+
+        // Drop consumed bytes; invalidates the views of earlier tokens.
+        void Compact();
+
+        size_t GetBuffered() const;
+
+        // Bytes not returned yet, from the start of a push frame read in part.
+        const char* GetUnread(size_t& len) const;
+
+        void Reset();
+
+        static const char* FindCRLF(const char* p, const char* end);
+
+        static bool ParseInt(const char* p, size_t len, int64_t& value);
+
+        static const char* GetKernelName();
+
+    private:
+        void Consume(const RespToken& token);
+
+    private:
+        std::vector<char> mBuf;
+        size_t mPos;
+        size_t mLen;
+        std::vector<int64_t> mStack;      // elements left per open aggregate
+        size_t mSkipBase;
+        bool mSkipping;
+        bool mDone;
+        size_t mPushStart;                // offset of the push frame being read
+        int64_t mPushElements;
+        bool mPushing;
+    };
+
+    // Sends a command on a pool connection and decodes the reply with
+    // RespReader straight from the socket. Whatever hiredis already buffered
+    // on the connection is drained through hiredis first, and bytes read
+    // past the reply are handed back to it; push frames on either side go
+    // to the xRedisResp3 push handler.
+    class xRedisFastReply {
+    public:
+        explicit xRedisFastReply(xRedisClient* client);
+
+        ~xRedisFastReply();
+
+        // Nested arrays (e.g. SCAN) are flattened in reply order.
+        bool commandargv_array(const SliceIndex& index, const VDATA& vData, ArrayReply& array);
+
+        bool commandargv_list(const SliceIndex& index, const VDATA& vData, VALUES& values);
+
+        bool lrange(const SliceIndex& index, const string& key, int64_t start, int64_t end, ArrayReply& array);
+
+        bool hgetall(const SliceIndex& index, const string& key, ArrayReply& array);
+
+        bool smembers(const SliceIndex& index, const KEY& key, VALUES& vValue);
+
+        bool zrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, VALUES& vValues, bool withscore = false);
+
+        // Token callback, return false to stop reading early (the connection
+        // is then reset). Used by the streaming APIs.
+        typedef bool (* TOKENFUN)(const RespToken& token, void* privdata);
+
+        bool commandargv_tokens(const SliceIndex& index, uint32_t ioType, const VDATA& vData, TOKENFUN fun, void* privdata);
+
+    private:
+        xRedisClient* mClient;
+    };
+
+}
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisRoute.h"
+#include "xRedisPlacement.h"
+#include "xRedisHash.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define ERR_DETAIL_MAX 256
+#define HASH_TAG_BUF 128
+
+static __thread char gErrDetail[ERR_DETAIL_MAX];
+
+// Hash tag switches of one pool, a bit per node; two clients using the same
+// node index keep their own.
+typedef struct _HASH_TAG_POOL_ {
+    const RedisPool* pool;
+    uint32_t enabled[(MAX_REDIS_NODE_COUNT + 31) / 32];
+} HashTagPool;
+
+typedef std::vector<HashTagPool*> HashTagPools;
+
+// Read without a lock: a new pool replaces the list, entries are never freed.
+static HashTagPools* gHashTagPools = NULL;
+static std::vector<HashTagPools*> gRetiredHashTagPools;
+static xLock gHashTagLock;
+
+static HashTagPool* FindHashTagPool(const RedisPool* pool) {
+    const HashTagPools* pools = __atomic_load_n(&gHashTagPools, __ATOMIC_ACQUIRE);
+    if (NULL == pools)
+        return NULL;
+    for (size_t i = 0; i < pools->size(); ++i) {
+        if ((*pools)[i]->pool == pool)
+            return (*pools)[i];
+    }
+    return NULL;
+}
+
+static bool IsHashTagOn(const RedisPool* pool, uint32_t nodeIndex) {
+    if (nodeIndex >= MAX_REDIS_NODE_COUNT)
+        return false;
+    const HashTagPool* entry = FindHashTagPool(pool);
+    return (NULL != entry) && (0 != (__atomic_load_n(&entry->enabled[nodeIndex / 32], __ATOMIC_RELAXED) & (1U << (nodeIndex % 32))));
+}
+
+xRedisRoute::xRedisRoute(xRedisClient* client) {
+    mClient = client;
+}
+
+xRedisRoute::~xRedisRoute() {
+}
+
+static uint32_t HashKey(const RedisPool* pool, uint32_t nodeIndex, const char* key, size_t len, HASHFUN fun) {
+    const char* tag = NULL;
+    size_t taglen = 0;
+    if (IsHashTagOn(pool, nodeIndex) && xRedisRoute::FindHashTag(key, len, tag, taglen)) {
+        // HASHFUN wants a terminated string.
+        char szBuf[HASH_TAG_BUF];
+        if (taglen < sizeof(szBuf)) {
+            memcpy(szBuf, tag, taglen);
+            szBuf[taglen] = '\0';
+            return fun(szBuf);
+        }
+        return fun(std::string(tag, taglen).c_str());
+    }
+    return fun(key);
+}
+
+// Modulo only for nodes without a placement; a configured placement that
+// can't place the key (no slice left with a weight) fails the lookup.
+static bool SliceOf(uint32_t nodeIndex, uint64_t hash, uint32_t sliceCount, uint32_t& sliceIndex) {
+    if (xRedisPlacement::Place(nodeIndex, hash, sliceCount, sliceIndex))
+        return true;
+    if (PLACEMENT_MODULO != xRedisPlacement::GetPlacement(nodeIndex))
+        return false;
+    sliceIndex = (uint32_t) (hash % sliceCount);
+    return true;
+}
+
+// Counting sort of keys by bucket, groups come out in bucket order.
+static void GroupByBucket(const std::vector<uint32_t>& buckets, uint32_t bucketCount, KeyGroups& groups) {
+    std::vector<uint32_t> counts(bucketCount, 0);
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        counts[buckets[i]]++;
+    }
+
+    std::vector<uint32_t> groupOf(bucketCount, 0);
+    groups.clear();
+    for (uint32_t bucket = 0; bucket < bucketCount; ++bucket) {
+        if (0 == counts[bucket])
+            continue;
+        groupOf[bucket] = (uint32_t) groups.size();
+        groups.push_back(KeyGroup());
+        groups.back().sliceIndex = bucket;
+        groups.back().keyIndex.reserve(counts[bucket]);
+    }
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        groups[groupOf[buckets[i]]].keyIndex.push_back((uint32_t) i);
+    }
+}
+
+bool xRedisRoute::Locate(RedisPool* pool, uint32_t nodeIndex, const char* key, HASHFUN fun, uint32_t& sliceIndex) {
+    if ((NULL == pool) || (NULL == key) || (NULL == fun))
+        return false;
+
+    uint32_t sliceCount = pool->GetSliceCount(nodeIndex);
+    if (0 == sliceCount)
+        return false;
+
+    return SliceOf(nodeIndex, HashKey(pool, nodeIndex, key, strlen(key), fun), sliceCount, sliceIndex);
+}
+
+bool xRedisRoute::LocateByID(RedisPool* pool, uint32_t nodeIndex, int64_t id, uint32_t& sliceIndex) {
+    if (NULL == pool)
+        return false;
+
+    uint32_t sliceCount = pool->GetSliceCount(nodeIndex);
+    if (0 == sliceCount)
+        return false;
+
+    return SliceOf(nodeIndex, (uint64_t) id, sliceCount, sliceIndex);
+}
+
+void xRedisRoute::SetHashTag(RedisPool* pool, uint32_t nodeIndex, bool enable) {
+    if ((NULL == pool) || (nodeIndex >= MAX_REDIS_NODE_COUNT))
+        return;
+
+    XLOCK(gHashTagLock);
+    HashTagPool* entry = FindHashTagPool(pool);
+    if (NULL == entry) {
+        if (!enable)
+            return;
+        entry = new HashTagPool;
+        entry->pool = pool;
+        memset(entry->enabled, 0, sizeof(entry->enabled));
+        HashTagPools* pools = (NULL == gHashTagPools) ? new HashTagPools : new HashTagPools(*gHashTagPools);
+        pools->push_back(entry);
+        if (NULL != gHashTagPools)
+            gRetiredHashTagPools.push_back(gHashTagPools);
+        __atomic_store_n(&gHashTagPools, pools, __ATOMIC_RELEASE);
+    }
+
+    uint32_t bit = 1U << (nodeIndex % 32);
+    if (enable)
+        __atomic_fetch_or(&entry->enabled[nodeIndex / 32], bit, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(&entry->enabled[nodeIndex / 32], ~bit, __ATOMIC_RELAXED);
+}
+
+bool xRedisRoute::GetHashTag(RedisPool* pool, uint32_t nodeIndex) {
+    return IsHashTagOn(pool, nodeIndex);
+}
+
+bool xRedisRoute::FindHashTag(const char* key, size_t keylen, const char*& tag, size_t& taglen) {
+    const char* s = static_cast<const char*>(memchr(key, '{', keylen));
+    if (NULL == s)
+        return false;
+
+    const char* e = static_cast<const char*>(memchr(s + 1, '}', keylen - (size_t) (s + 1 - key)));
+    if ((NULL == e) || (e == s + 1))
+        return false;
+
+    tag = s + 1;
+    taglen = (size_t) (e - tag);
+    return true;
+}
+
+bool xRedisRoute::GroupBySlice(uint32_t nodeIndex, const KEYS& keys, HASHFUN fun, KeyGroups& groups) const {
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    uint32_t sliceCount = pRedisPool->GetSliceCount(nodeIndex);
+    if ((0 == sliceCount) || (NULL == fun))
+        return false;
+
+    std::vector<uint32_t> slices(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!SliceOf(nodeIndex, HashKey(pRedisPool, nodeIndex, keys[i].c_str(), keys[i].size(), fun), sliceCount, slices[i]))
+            return false;
+    }
+    GroupByBucket(slices, sliceCount, groups);
+    return true;
+}
+
+void xRedisRoute::GroupBySlot(const KEYS& keys, KeyGroups& groups) {
+    std::vector<uint32_t> slots(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        slots[i] = xRedisHash::KeySlot(keys[i].data(), keys[i].size());
+    }
+    GroupByBucket(slots, CLUSTER_SLOT_COUNT, groups);
+}
+
+bool xRedisRoute::IsColocated(uint32_t nodeIndex, const KEYS& keys, HASHFUN fun, uint32_t& sliceIndex) const {
+    if (keys.empty())
+        return false;
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    if (!Locate(pRedisPool, nodeIndex, keys[0].c_str(), fun, sliceIndex))
+        return false;
+
+    for (size_t i = 1; i < keys.size(); ++i) {
+        uint32_t slice = 0;
+        if (!Locate(pRedisPool, nodeIndex, keys[i].c_str(), fun, slice) || (slice != sliceIndex))
+            return false;
+    }
+    return true;
+}
+
+bool xRedisRoute::Create(uint32_t nodeIndex, const char* key, HASHFUN fun, RouteHandle& route, uint32_t ioType) const {
+    if (!Locate(mClient->GetRedisPool(), nodeIndex, key, fun, route.sliceIndex))
+        return false;
+    route.nodeIndex = nodeIndex;
+    route.ioType = ioType;
+    return true;
+}
+
+bool xRedisRoute::CreateByID(uint32_t nodeIndex, int64_t id, RouteHandle& route, uint32_t ioType) const {
+    if (!LocateByID(mClient->GetRedisPool(), nodeIndex, id, route.sliceIndex))
+        return false;
+    route.nodeIndex = nodeIndex;
+    route.ioType = ioType;
+    return true;
+}
+
+RouteHandle xRedisRoute::FromSliceIndex(const SliceIndex& index) {
+    RouteHandle route;
+    route.nodeIndex = index.mNodeIndex;
+    route.sliceIndex = index.mSliceIndex;
+    route.ioType = MASTER;
+    if (index.mIOFlag)
+        route.ioType = index.mIOtype;
+    return route;
+}
+
+const char* xRedisRoute::GetErrString(XREDISERR err) {
+    switch (err) {
+        case XREDIS_OK:
+            return "ok";
+        case XREDIS_ERR_PARAM:
+            return "invalid parameter";
+        case XREDIS_ERR_CONNECT:
+            return GET_CONNECT_ERROR;
+        case XREDIS_ERR_CLOSED:
+            return CONNECT_CLOSED_ERROR;
+        case XREDIS_ERR_REPLY:
+            return "redis error reply";
+        case XREDIS_ERR_NIL:
+            return "nil reply";
+        case XREDIS_ERR_TYPE:
+            return "unexpected reply type";
+    }
+    return "unknown error";
+}
+
+const char* xRedisRoute::GetErrDetail() {
+    return gErrDetail;
+}
+
+void xRedisRoute::SetErrDetail(const char* str, size_t len) {
+    if (len >= ERR_DETAIL_MAX)
+        len = ERR_DETAIL_MAX - 1;
+    memcpy(gErrDetail, str, len);
+    gErrDetail[len] = '\0';
+}
+
+rReply* xRedisRoute::commandargv(const RouteHandle& route, const VDATA& vData, XREDISERR& err) {
+    if ((NULL == mClient) || vData.empty()) {
+        err = XREDIS_ERR_PARAM;
+        return NULL;
+    }
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(route.nodeIndex, route.sliceIndex, route.ioType);
+    if (NULL == pRedisConn) {
+        err = XREDIS_ERR_CONNECT;
+        SetErrDetail(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return NULL;
+    }
+
+    redisReply* reply = RedisCommandArgv(pRedisConn, vData);
+    pRedisPool->FreeConnection(pRedisConn);
+
+    err = XREDIS_OK;
+    if (NULL == reply) {
+        err = XREDIS_ERR_CLOSED;
+        SetErrDetail(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+    } else if (REDIS_REPLY_ERROR == reply->type) {
+        err = XREDIS_ERR_REPLY;
+        SetErrDetail(reply->str, static_cast<size_t>(reply->len));
+    } else if (REDIS_REPLY_NIL == reply->type) {
+        err = XREDIS_ERR_NIL;
+    }
+    return reply;
+}
+
+XREDISERR xRedisRoute::commandargv_status(const RouteHandle& route, const VDATA& vData) {
+    XREDISERR err = XREDIS_OK;
+    redisReply* reply = commandargv(route, vData, err);
+    if ((XREDIS_OK == err) && (REDIS_REPLY_STATUS != reply->type))
+        err = XREDIS_ERR_TYPE;
+    RedisPool::FreeReply(reply);
+    return err;
+}
+
+XREDISERR xRedisRoute::commandargv_integer(const RouteHandle& route, const VDATA& vData, int64_t& retval) {
+    XREDISERR err = XREDIS_OK;
+    redisReply* reply = commandargv(route, vData, err);
+    if (XREDIS_OK == err) {
+        if (REDIS_REPLY_INTEGER == reply->type)
+            retval = reply->integer;
+        else
+            err = XREDIS_ERR_TYPE;
+    }
+    RedisPool::FreeReply(reply);
+    return err;
+}
+
+XREDISERR xRedisRoute::commandargv_string(const RouteHandle& route, const VDATA& vData, string& data) {
+    XREDISERR err = XREDIS_OK;
+    redisReply* reply = commandargv(route, vData, err);
+    if (XREDIS_OK == err) {
+        if ((REDIS_REPLY_STRING == reply->type) || (REDIS_REPLY_STATUS == reply->type))
+            data.assign(reply->str, reply->len);
+        else
+            err = XREDIS_ERR_TYPE;
+    }
+    RedisPool::FreeReply(reply);
+    return err;
+}
+
+XREDISERR xRedisRoute::commandargv_array(const RouteHandle& route, const VDATA& vData, ArrayReply& array) {
+    XREDISERR err = XREDIS_OK;
+    redisReply* reply = commandargv(route, vData, err);
+    if (XREDIS_OK == err) {
+        if (REDIS_REPLY_ARRAY == reply->type) {
+            for (size_t i = 0; i < reply->elements; i++) {
+                DataItem item;
+                item.type = reply->element[i]->type;
+                item.str.assign(reply->element[i]->str, reply->element[i]->len);
+                array.push_back(item);
+            }
+        } else {
+            err = XREDIS_ERR_TYPE;
+        }
+    }
+    RedisPool::FreeReply(reply);
+    return err;
+}
+
+XREDISERR xRedisRoute::get(const RouteHandle& route, const string& key, string& value) {
+    if (0 == key.length()) return XREDIS_ERR_PARAM;
+    VDATA vCmdData;
+    vCmdData.push_back("GET");
+    vCmdData.push_back(key);
+    return commandargv_string(route, vCmdData, value);
+}
+
+XREDISERR xRedisRoute::set(const RouteHandle& route, const string& key, const string& value) {
+    if (0 == key.length()) return XREDIS_ERR_PARAM;
+    VDATA vCmdData;
+    vCmdData.push_back("SET");
+    vCmdData.push_back(key);
+    vCmdData.push_back(value);
+    return commandargv_status(route, vCmdData);
+}
+
+XREDISERR xRedisRoute::del(const RouteHandle& route, const string& key, int64_t& count) {
+    if (0 == key.length()) return XREDIS_ERR_PARAM;
+    VDATA vCmdData;
+    vCmdData.push_back("DEL");
+    vCmdData.push_back(key);
+    return commandargv_integer(route, vCmdData, count);
+}
@@ -0,0 +1,117 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_ROUTE_H_
+#define _XREDIS_ROUTE_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef enum _XREDIS_ERRCODE_ {
+        XREDIS_OK = 0,
+        XREDIS_ERR_PARAM = 1,   // empty key, bad route
+        XREDIS_ERR_CONNECT = 2, // no pool connection available
+        XREDIS_ERR_CLOSED = 3,  // connection broke during the command
+        XREDIS_ERR_REPLY = 4,   // server replied with an error
+        XREDIS_ERR_NIL = 5,     // nil reply
+        XREDIS_ERR_TYPE = 6     // unexpected reply type
+    } XREDISERR;
+
+    // Where a command goes. Plain data: compute it once per key and copy or
+    // share it freely between threads, nothing in it is ever written by a
+    // command.
+    typedef struct _ROUTE_HANDLE_ {
+        uint32_t nodeIndex;
+        uint32_t sliceIndex;
+        uint32_t ioType;        // MASTER or SLAVE connection for every command
+    } RouteHandle;
+
+    // Keys of a batch that route to the same slice (or cluster slot), as
+    // indexes into the caller's key list in original order.
+    typedef struct _KEY_GROUP_ {
+        uint32_t sliceIndex;
+        std::vector<uint32_t> keyIndex;
+    } KeyGroup;
+
+    typedef std::vector<KeyGroup> KeyGroups;
+
+    // Commands addressed by RouteHandle that report failure as an XREDISERR.
+    // No string is built on any path; the server's error text, if wanted, is
+    // copied into a per-thread buffer and read with GetErrDetail().
+    class xRedisRoute {
+    public:
+        explicit xRedisRoute(xRedisClient* client);
+
+        ~xRedisRoute();
+
+        bool Create(uint32_t nodeIndex, const char* key, HASHFUN fun, RouteHandle& route, uint32_t ioType = MASTER) const;
+
+        bool CreateByID(uint32_t nodeIndex, int64_t id, RouteHandle& route, uint32_t ioType = MASTER) const;
+
+        static RouteHandle FromSliceIndex(const SliceIndex& index);
+
+        // Slice for key on nodeIndex, the rule SliceIndex::Create applies too.
+        // Placement follows xRedisPlacement when the node has a strategy.
+        static bool Locate(RedisPool* pool, uint32_t nodeIndex, const char* key, HASHFUN fun, uint32_t& sliceIndex);
+
+        static bool LocateByID(RedisPool* pool, uint32_t nodeIndex, int64_t id, uint32_t& sliceIndex);
+
+        // With hash tags on, only the part of a key between the first '{' and
+        // the next '}' is hashed when that part is non-empty, as in Redis
+        // Cluster, so "user:{42}:profile" and "user:{42}:feed" share a slice.
+        // Off by default; changing it remaps keys that contain a tag. Kept
+        // per pool, i.e. per xRedisClient, and node.
+        static void SetHashTag(RedisPool* pool, uint32_t nodeIndex, bool enable);
+
+        static bool GetHashTag(RedisPool* pool, uint32_t nodeIndex);
+
+        static bool FindHashTag(const char* key, size_t keylen, const char*& tag, size_t& taglen);
+
+        // Routes a whole batch at once; groups come back in slice order.
+        bool GroupBySlice(uint32_t nodeIndex, const KEYS& keys, HASHFUN fun, KeyGroups& groups) const;
+
+        static void GroupBySlot(const KEYS& keys, KeyGroups& groups);
+
+        // True when all keys live on one slice of nodeIndex, returned in
+        // sliceIndex; multi-key commands on them can then run server-side.
+        bool IsColocated(uint32_t nodeIndex, const KEYS& keys, HASHFUN fun, uint32_t& sliceIndex) const;
+
+        // Caller owns the reply and frees it with RedisPool::FreeReply().
+        rReply* commandargv(const RouteHandle& route, const VDATA& vData, XREDISERR& err);
+
+        XREDISERR commandargv_status(const RouteHandle& route, const VDATA& vData);
+
+        XREDISERR commandargv_integer(const RouteHandle& route, const VDATA& vData, int64_t& retval);
+
+        XREDISERR commandargv_string(const RouteHandle& route, const VDATA& vData, string& data);
+
+        XREDISERR commandargv_array(const RouteHandle& route, const VDATA& vData, ArrayReply& array);
+
+        XREDISERR get(const RouteHandle& route, const string& key, string& value);
+
+        XREDISERR set(const RouteHandle& route, const string& key, const string& value);
+
+        XREDISERR del(const RouteHandle& route, const string& key, int64_t& count);
+
+        // Detail of the last failure on the calling thread.
+        static const char* GetErrDetail();
+
+        static const char* GetErrString(XREDISERR err);
+
+    private:
+        static void SetErrDetail(const char* str, size_t len);
+
+    private:
+        xRedisClient* mClient;
+    };
+
+}
+
+#endif
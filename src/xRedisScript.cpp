@@ -0,0 +1,386 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisScript.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define SHA1_ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void Sha1Block(uint32_t state[5], const uint8_t block[64]) {
+    uint32_t w[80];
+    for (int32_t i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) |
+               ((uint32_t) block[i * 4 + 2] << 8) | ((uint32_t) block[i * 4 + 3]);
+    }
+    for (int32_t i = 16; i < 80; i++) {
+        w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int32_t i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | ((~b) & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t temp = SHA1_ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = SHA1_ROL(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+std::string xRedisScript::Sha1Hex(const std::string& data) {
+    uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    size_t len = data.size();
+
+    size_t off = 0;
+    for (; off + 64 <= len; off += 64) {
+        Sha1Block(state, p + off);
+    }
+
+    uint8_t tail[128] = {0};
+    size_t rest = len - off;
+    memcpy(tail, p + off, rest);
+    tail[rest] = 0x80;
+    size_t tailLen = (rest < 56) ? 64 : 128;
+    uint64_t bits = (uint64_t) len * 8;
+    for (int32_t i = 0; i < 8; i++) {
+        tail[tailLen - 1 - i] = (uint8_t) (bits >> (i * 8));
+    }
+    Sha1Block(state, tail);
+    if (128 == tailLen)
+        Sha1Block(state, tail + 64);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string sha(40, '0');
+    for (int32_t i = 0; i < 20; i++) {
+        uint8_t byte = (uint8_t) (state[i / 4] >> (24 - (i % 4) * 8));
+        sha[i * 2] = hex[byte >> 4];
+        sha[i * 2 + 1] = hex[byte & 0x0F];
+    }
+    return sha;
+}
+
+xRedisScript::xRedisScript() {
+    mClient = NULL;
+}
+
+xRedisScript::~xRedisScript() {
+    if (NULL != mClient)
+        xRedisConnObserver::Remove(OnConnEvent, this);
+}
+
+bool xRedisScript::Init(xRedisClient* client) {
+    if ((NULL == client) || (NULL == client->GetRedisPool()))
+        return false;
+    if (NULL == mClient)
+        xRedisConnObserver::Add(OnConnEvent, this);
+    mClient = client;
+    return true;
+}
+
+ScriptHandle xRedisScript::Register(const std::string& body) {
+    if (body.empty())
+        return INVALID_SCRIPT_HANDLE;
+
+    std::string sha = Sha1Hex(body);
+    XLOCK(mLock);
+    for (size_t i = 0; i < mScripts.size(); ++i) {
+        if (mScripts[i].sha == sha)
+            return (ScriptHandle) (i + 1);
+    }
+
+    ScriptInfo info;
+    info.body = body;
+    info.sha = sha;
+    mScripts.push_back(info);
+    return (ScriptHandle) mScripts.size();
+}
+
+bool xRedisScript::GetSha(ScriptHandle handle, std::string& sha) {
+    XLOCK(mLock);
+    if ((INVALID_SCRIPT_HANDLE == handle) || (handle > mScripts.size()))
+        return false;
+    sha = mScripts[handle - 1].sha;
+    return true;
+}
+
+uint64_t xRedisScript::ConnKey(RedisConn* conn) {
+    // Replicas of a slice are told apart by their slave index.
+    return ((uint64_t) conn->GetNodeIndex() << 48) | ((uint64_t) conn->getSliceIndex() << 16) |
+           ((uint64_t) conn->GetRole() << 15) | ((uint64_t) conn->GetSlaveIdx() & 0x7FFF);
+}
+
+bool xRedisScript::IsLoaded(uint64_t connKey, ScriptHandle handle) {
+    XLOCK(mLock);
+    LoadedMap::const_iterator iter = mLoaded.find(connKey);
+    return (iter != mLoaded.end()) && (iter->second.count(handle) > 0);
+}
+
+void xRedisScript::SetLoaded(uint64_t connKey, ScriptHandle handle, bool loaded) {
+    XLOCK(mLock);
+    if (loaded) {
+        mLoaded[connKey].insert(handle);
+    } else {
+        // NOSCRIPT or a dropped connection: the server may have lost its whole
+        // script cache (restart, failover, SCRIPT FLUSH), not just this script.
+        mLoaded.erase(connKey);
+    }
+}
+
+void xRedisScript::OnConnEvent(RedisConn* conn, uint32_t event, void* privdata) {
+    xRedisScript* pScript = static_cast<xRedisScript*>(privdata);
+    uint64_t connKey = ConnKey(conn);
+    if (CONN_EVENT_CONNECTED == event) {
+        // A reconnect may land on another server (failover, new address).
+        std::string peer = GetPeerName(conn->getCtx());
+        XLOCK(pScript->mLock);
+        PeerMap::iterator iter = pScript->mPeers.find(connKey);
+        if ((iter == pScript->mPeers.end()) || (iter->second != peer) || peer.empty()) {
+            pScript->mLoaded.erase(connKey);
+            pScript->mPeers[connKey] = peer;
+        }
+    }
+
+    // Connections of another client's pool with the same node index are
+    // loaded too; harmless, and EVALSHA falls back to EVAL on NOSCRIPT.
+    // A broken connection is left to its next user to reconnect.
+    bool broken = false;
+    pScript->Load(conn, broken);
+}
+
+bool xRedisScript::Load(RedisConn* conn, bool& broken) {
+    broken = false;
+    uint64_t connKey = ConnKey(conn);
+    std::vector<ScriptHandle> vHandles;
+    VDATA vBodies;
+    {
+        XLOCK(mLock);
+        LoadedMap::const_iterator iter = mLoaded.find(connKey);
+        for (size_t i = 0; i < mScripts.size(); ++i) {
+            ScriptHandle handle = (ScriptHandle) (i + 1);
+            if ((iter == mLoaded.end()) || (0 == iter->second.count(handle))) {
+                vHandles.push_back(handle);
+                vBodies.push_back(mScripts[i].body);
+            }
+        }
+    }
+    if (vHandles.empty())
+        return true;
+
+    redisContext* ctx = conn->getCtx();
+    bool bRet = true;
+    size_t appended = 0;
+    for (; appended < vBodies.size(); ++appended) {
+        VDATA vCmdData;
+        vCmdData.push_back("SCRIPT");
+        vCmdData.push_back("LOAD");
+        vCmdData.push_back(vBodies[appended]);
+        if (REDIS_OK != RedisAppendCommandArgv(ctx, vCmdData)) {
+            bRet = false;
+            break;
+        }
+    }
+
+    // Read back exactly what was appended so no stray reply is left behind.
+    for (size_t i = 0; i < appended; ++i) {
+        void* reply = NULL;
+        if (REDIS_OK != redisGetReply(ctx, &reply)) {
+            SetLoaded(connKey, INVALID_SCRIPT_HANDLE, false);
+            broken = true;
+            return false;
+        }
+        if (RedisPool::CheckReply(static_cast<redisReply*>(reply)))
+            SetLoaded(connKey, vHandles[i], true);
+        else
+            bRet = false;
+        RedisPool::FreeReply(static_cast<redisReply*>(reply));
+    }
+    return bRet;
+}
+
+bool xRedisScript::Preload(uint32_t nodeIndex) {
+    if (NULL == mClient)
+        return false;
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    uint32_t sliceCount = pRedisPool->GetSliceCount(nodeIndex);
+    bool bRet = true;
+    for (uint32_t sliceIndex = 0; sliceIndex < sliceCount; ++sliceIndex) {
+        RedisConn* pRedisConn = pRedisPool->GetConnection(nodeIndex, sliceIndex, MASTER);
+        if (NULL == pRedisConn) {
+            bRet = false;
+            continue;
+        }
+
+        bool broken = false;
+        if (!Load(pRedisConn, broken))
+            bRet = false;
+        if (broken)
+            pRedisConn->RedisReConnect();
+        pRedisPool->FreeConnection(pRedisConn);
+    }
+
+    // Slaves are only reachable through the pool's idle connections.
+    pRedisPool->Keepalive();
+    return bRet;
+}
+
+void xRedisScript::Invalidate(uint32_t nodeIndex) {
+    XLOCK(mLock);
+    LoadedMap::iterator iter = mLoaded.begin();
+    while (iter != mLoaded.end()) {
+        if ((uint32_t) (iter->first >> 48) == nodeIndex)
+            mLoaded.erase(iter++);
+        else
+            ++iter;
+    }
+}
+
+void xRedisScript::SetErrInfo(const SliceIndex& index, const redisReply* reply) {
+    SliceIndex& sliceIndex = const_cast<SliceIndex&>(index);
+    if (NULL == reply)
+        sliceIndex.SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+    else
+        sliceIndex.SetErrInfo(reply->str, static_cast<size_t>(reply->len));
+}
+
+rReply* xRedisScript::evalsha(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args) {
+    ScriptInfo info;
+    {
+        XLOCK(mLock);
+        if ((NULL == mClient) || (INVALID_SCRIPT_HANDLE == handle) || (handle > mScripts.size()))
+            return NULL;
+        info = mScripts[handle - 1];
+    }
+
+    uint32_t ioType = MASTER;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return NULL;
+    }
+
+    VDATA vCmdData;
+    vCmdData.push_back("EVALSHA");
+    vCmdData.push_back(info.sha);
+    vCmdData.push_back(toString(keys.size()));
+    vCmdData.insert(vCmdData.end(), keys.begin(), keys.end());
+    vCmdData.insert(vCmdData.end(), args.begin(), args.end());
+
+    uint64_t connKey = ConnKey(pRedisConn);
+    redisReply* reply = NULL;
+    if (IsLoaded(connKey, handle)) {
+        reply = RedisCommandArgv(pRedisConn, vCmdData);
+        if ((NULL != reply) && (REDIS_REPLY_ERROR == reply->type) && (0 == strncmp(reply->str, "NOSCRIPT", 8))) {
+            SetLoaded(connKey, handle, false);
+            RedisPool::FreeReply(reply);
+            reply = NULL;
+        } else if (NULL == reply) {
+            SetLoaded(connKey, handle, false);
+            pRedisConn->RedisReConnect();
+            pRedisPool->FreeConnection(pRedisConn);
+            return NULL;
+        }
+    }
+
+    if (NULL == reply) {
+        // EVAL runs the script and leaves it cached for the next EVALSHA.
+        vCmdData[0] = "EVAL";
+        vCmdData[1] = info.body;
+        reply = RedisCommandArgv(pRedisConn, vCmdData);
+        if (NULL == reply) {
+            pRedisConn->RedisReConnect();
+        } else if (REDIS_REPLY_ERROR != reply->type) {
+            SetLoaded(connKey, handle, true);
+        }
+    }
+
+    pRedisPool->FreeConnection(pRedisConn);
+    return reply;
+}
+
+bool xRedisScript::eval_status(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args) {
+    redisReply* reply = evalsha(index, handle, keys, args);
+    bool bRet = RedisPool::CheckReply(reply);
+    if (!bRet)
+        SetErrInfo(index, reply);
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisScript::eval_integer(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args, int64_t& retval) {
+    bool bRet = false;
+    redisReply* reply = evalsha(index, handle, keys, args);
+    if (RedisPool::CheckReply(reply)) {
+        retval = reply->integer;
+        bRet = true;
+    } else {
+        SetErrInfo(index, reply);
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisScript::eval_string(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args, string& data) {
+    bool bRet = false;
+    redisReply* reply = evalsha(index, handle, keys, args);
+    if (RedisPool::CheckReply(reply)) {
+        data.assign(reply->str, reply->len);
+        bRet = true;
+    } else {
+        SetErrInfo(index, reply);
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisScript::eval_array(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args, ArrayReply& array) {
+    bool bRet = false;
+    redisReply* reply = evalsha(index, handle, keys, args);
+    if (RedisPool::CheckReply(reply)) {
+        for (size_t i = 0; i < reply->elements; i++) {
+            DataItem item;
+            item.type = reply->element[i]->type;
+            if (REDIS_REPLY_INTEGER == item.type)
+                item.str = toString(reply->element[i]->integer);
+            else
+                item.str.assign(reply->element[i]->str, reply->element[i]->len);
+            array.push_back(item);
+        }
+        bRet = true;
+    } else {
+        SetErrInfo(index, reply);
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
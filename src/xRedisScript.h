@@ -0,0 +1,100 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_SCRIPT_H_
+#define _XREDIS_SCRIPT_H_
+
+#include <map>
+#include <set>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef uint32_t ScriptHandle;
+
+#define INVALID_SCRIPT_HANDLE 0
+
+    typedef struct _SCRIPT_INFO_ {
+        std::string body;
+        std::string sha;
+    } ScriptInfo;
+
+    // Lua script registry. A script is registered once and invoked by handle:
+    // EVALSHA is sent where the script is known to be cached, EVAL otherwise
+    // and on NOSCRIPT, after which the server has it cached again. Load state
+    // is tracked per slice master and per replica. Registered scripts are
+    // SCRIPT LOADed on every pool connection, master or slave, as it connects
+    // or reconnects, and on idle connections at each KeepAlive(), so a new
+    // server behind a slice gets them before its first EVALSHA.
+    class xRedisScript {
+    public:
+        xRedisScript();
+
+        ~xRedisScript();
+
+        bool Init(xRedisClient* client);
+
+        ScriptHandle Register(const std::string& body);
+
+        bool GetSha(ScriptHandle handle, std::string& sha);
+
+        // SCRIPT LOAD every registered script on all slice masters of a node
+        // now, and on its slaves through a KeepAlive() pass. Only needed for
+        // scripts registered after ConnectRedisCache(); false if any master
+        // failed.
+        bool Preload(uint32_t nodeIndex);
+
+        // Forget what is loaded on a node, e.g. after failover or restart.
+        void Invalidate(uint32_t nodeIndex);
+
+        // Caller owns the reply and frees it with RedisPool::FreeReply().
+        rReply* evalsha(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args);
+
+        bool eval_status(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args);
+
+        bool eval_integer(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args, int64_t& retval);
+
+        bool eval_string(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args, string& data);
+
+        bool eval_array(const SliceIndex& index, ScriptHandle handle, const KEYS& keys, const VALUES& args, ArrayReply& array);
+
+        static std::string Sha1Hex(const std::string& data);
+
+    private:
+        typedef std::set<ScriptHandle> LoadedSet;
+        typedef std::map<uint64_t, LoadedSet> LoadedMap;
+
+        typedef std::map<uint64_t, std::string> PeerMap;
+
+        static uint64_t ConnKey(RedisConn* conn);
+
+        static void OnConnEvent(RedisConn* conn, uint32_t event, void* privdata);
+
+        // SCRIPT LOAD whatever is not yet loaded on the server behind conn.
+        // False if a script failed to load; the connection is broken when a
+        // reply could not be read.
+        bool Load(RedisConn* conn, bool& broken);
+
+        bool IsLoaded(uint64_t connKey, ScriptHandle handle);
+
+        void SetLoaded(uint64_t connKey, ScriptHandle handle, bool loaded);
+
+        void SetErrInfo(const SliceIndex& index, const redisReply* reply);
+
+    private:
+        xRedisClient* mClient;
+        std::vector<ScriptInfo> mScripts;
+        LoadedMap mLoaded;
+        PeerMap mPeers;
+        xLock mLock;
+    };
+
+}
+
+#endif
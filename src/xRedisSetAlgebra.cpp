@@ -0,0 +1,413 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <algorithm>
+#include <tr1/unordered_set>
+#include "xRedisSetAlgebra.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define SET_MAX_THREADS 8
+#define SET_SCAN_COUNT 1000
+#define SET_PROBE_CHUNK 512
+#define SET_PROBE_RATIO 8       // probe a set when it is this many times larger than the candidates
+#define SET_WRITE_WINDOW 16     // SADD commands in flight
+
+typedef std::tr1::unordered_set<string> MemberSet;
+
+typedef struct _SET_TASK_ {
+    xRedisClient* client;
+    const SliceIndex* index;
+    const KEY* key;
+    int64_t card;
+    VALUES members;
+    bool ok;
+} SetTask;
+
+static const char* gNativeCmds[] = {"SDIFF", "SINTER", "SUNION"};
+static const char* gNativeStoreCmds[] = {"SDIFFSTORE", "SINTERSTORE", "SUNIONSTORE"};
+
+// A copy of index with ioType unless the caller chose one; the caller's
+// index is never changed apart from its error info.
+static SliceIndex WithIOType(const SliceIndex& index, uint32_t ioType) {
+    SliceIndex copy(index);
+    if (!copy.mIOFlag)
+        copy.IOtype(ioType);
+    return copy;
+}
+
+static void ReturnErrInfo(const SliceIndex& copy, const SliceIndex& index) {
+    const_cast<SliceIndex&>(index).SetErrInfo(copy.mStrerr.data(), copy.mStrerr.size());
+}
+
+static void CardTask(void* arg) {
+    SetTask* pTask = static_cast<SetTask*>(arg);
+    pTask->ok = pTask->client->scard(*pTask->index, *pTask->key, pTask->card);
+}
+
+static void FetchTask(void* arg) {
+    SetTask* pTask = static_cast<SetTask*>(arg);
+    pTask->ok = xRedisSetAlgebra::FetchMembers(pTask->client, *pTask->index, *pTask->key, pTask->members);
+}
+
+static bool RunTasks(TASKFUN fun, std::vector<SetTask>& vTasks, const std::vector<size_t>& vWhich) {
+    std::vector<void*> vArgs;
+    for (size_t i = 0; i < vWhich.size(); ++i) {
+        vArgs.push_back(&vTasks[vWhich[i]]);
+    }
+    RunParallel(fun, vArgs, SET_MAX_THREADS);
+
+    bool bRet = true;
+    for (size_t i = 0; i < vWhich.size(); ++i) {
+        bRet = bRet && vTasks[vWhich[i]].ok;
+    }
+    return bRet;
+}
+
+// Keeps the members of vIn whose SISMEMBER on key equals wantMember.
+static bool Probe(xRedisClient* client, const SliceIndex& index, const KEY& key, const VALUES& vIn, bool wantMember, VALUES& vOut) {
+    uint32_t ioType = SLAVE;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+
+    std::vector<VDATA> vCmds(vIn.size());
+    for (size_t i = 0; i < vIn.size(); ++i) {
+        vCmds[i].push_back("SISMEMBER");
+        vCmds[i].push_back(key);
+        vCmds[i].push_back(vIn[i]);
+    }
+
+    RedisPool* pRedisPool = client->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+    std::vector<redisReply*> vReplies;
+    bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+    if (!bRet) {
+        const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+        pRedisConn->RedisReConnect();
+    }
+    pRedisPool->FreeConnection(pRedisConn);
+    if (!bRet)
+        return false;
+
+    for (size_t i = 0; i < vReplies.size(); ++i) {
+        bool isMember = (REDIS_REPLY_INTEGER == vReplies[i]->type) && (1 == vReplies[i]->integer);
+        if (isMember == wantMember)
+            vOut.push_back(vIn[i]);
+    }
+    FreeReplies(vReplies);
+    return true;
+}
+
+bool xRedisSetAlgebra::FetchMembers(xRedisClient* client, const SliceIndex& index, const KEY& key, VALUES& members) {
+    uint32_t ioType = SLAVE;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+
+    members.clear();
+    RedisPool* pRedisPool = client->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+
+    bool bRet = true;
+    uint32_t rounds = 0;
+    string cursor = "0";
+    do {
+        VDATA vCmdData;
+        vCmdData.push_back("SSCAN");
+        vCmdData.push_back(key);
+        vCmdData.push_back(cursor);
+        vCmdData.push_back("COUNT");
+        vCmdData.push_back(toString(SET_SCAN_COUNT));
+        redisReply* reply = RedisCommandArgv(pRedisConn, vCmdData);
+        bRet = (NULL != reply) && (REDIS_REPLY_ARRAY == reply->type) && (2 == reply->elements) && (REDIS_REPLY_ARRAY == reply->element[1]->type);
+        if (bRet) {
+            cursor.assign(reply->element[0]->str, reply->element[0]->len);
+            const redisReply* batch = reply->element[1];
+            for (size_t i = 0; i < batch->elements; ++i) {
+                members.push_back(string(batch->element[i]->str, batch->element[i]->len));
+            }
+        } else if (NULL == reply) {
+            const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+        } else if (REDIS_REPLY_ERROR == reply->type) {
+            const_cast<SliceIndex&>(index).SetErrInfo(reply->str, reply->len);
+        }
+        RedisPool::FreeReply(reply);
+        ++rounds;
+    } while (bRet && ("0" != cursor));
+    pRedisPool->FreeConnection(pRedisConn);
+
+    // SSCAN may return a member more than once across batches.
+    if (bRet && (rounds > 1)) {
+        std::sort(members.begin(), members.end());
+        members.erase(std::unique(members.begin(), members.end()), members.end());
+    }
+    return bRet;
+}
+
+bool xRedisSetAlgebra::WriteMembers(xRedisClient* client, const SliceIndex& index, const KEY& key, const VALUES& members, uint32_t chunkSize) {
+    if (0 == chunkSize)
+        chunkSize = 1000;
+
+    RedisPool* pRedisPool = client->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, MASTER);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return false;
+    }
+
+    // Built under a temporary name and renamed over key in one step.
+    string tmpKey = key + ":xredis-tmp:" + toString(getpid()) + ":" + toString(GetMonotonicUs());
+    std::vector<VDATA> vCmds;
+    vCmds.push_back(VDATA());
+    vCmds.back().push_back("DEL");
+    vCmds.back().push_back(members.empty() ? key : tmpKey);
+
+    bool bRet = true;
+    size_t pos = 0;
+    while (bRet) {
+        while ((pos < members.size()) && (vCmds.size() < SET_WRITE_WINDOW)) {
+            size_t end = std::min(members.size(), pos + chunkSize);
+            vCmds.push_back(VDATA());
+            VDATA& vCmdData = vCmds.back();
+            vCmdData.reserve(end - pos + 2);
+            vCmdData.push_back("SADD");
+            vCmdData.push_back(tmpKey);
+            vCmdData.insert(vCmdData.end(), members.begin() + pos, members.begin() + end);
+            pos = end;
+        }
+        if ((pos == members.size()) && !members.empty()) {
+            vCmds.push_back(VDATA());
+            vCmds.back().push_back("RENAME");
+            vCmds.back().push_back(tmpKey);
+            vCmds.back().push_back(key);
+        }
+
+        std::vector<redisReply*> vReplies;
+        bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+        if (!bRet) {
+            const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+            pRedisConn->RedisReConnect();
+            break;
+        }
+        for (size_t i = 0; i < vReplies.size(); ++i) {
+            if (REDIS_REPLY_ERROR == vReplies[i]->type) {
+                const_cast<SliceIndex&>(index).SetErrInfo(vReplies[i]->str, vReplies[i]->len);
+                bRet = false;
+                break;
+            }
+        }
+        FreeReplies(vReplies);
+        vCmds.clear();
+        if (pos == members.size())
+            break;
+    }
+
+    if (!bRet && !members.empty()) {
+        redisReply* reply = static_cast<redisReply*>(redisCommand(pRedisConn->getCtx(), "DEL %b", tmpKey.data(), tmpKey.size()));
+        RedisPool::FreeReply(reply);
+    }
+    pRedisPool->FreeConnection(pRedisConn);
+    return bRet;
+}
+
+bool xRedisSetAlgebra::IsColocated(const DBIArray& vdbi, const SliceIndex* dest) {
+    const SliceIndex& first = (NULL != dest) ? *dest : vdbi[0];
+    for (size_t i = 0; i < vdbi.size(); ++i) {
+        if ((vdbi[i].mNodeIndex != first.mNodeIndex) || (vdbi[i].mSliceIndex != first.mSliceIndex))
+            return false;
+    }
+    return true;
+}
+
+bool xRedisSetAlgebra::Native(xRedisClient* client, SETOP op, const DBIArray& vdbi, const KEYS& keys, VALUES& result) {
+    VDATA vCmdData;
+    vCmdData.push_back(gNativeCmds[op]);
+    vCmdData.insert(vCmdData.end(), keys.begin(), keys.end());
+
+    SliceIndex index = WithIOType(vdbi[0], SLAVE);
+    bool bRet = client->commandargv_array(index, vCmdData, result);
+    if (!bRet)
+        ReturnErrInfo(index, vdbi[0]);
+    return bRet;
+}
+
+bool xRedisSetAlgebra::Filter(xRedisClient* client, SETOP op, const DBIArray& vdbi, const KEYS& keys, uint64_t limit, VALUES* result, int64_t& count) {
+    size_t size = keys.size();
+    std::vector<SetTask> vTasks(size);
+    std::vector<size_t> vAll;
+    for (size_t i = 0; i < size; ++i) {
+        vTasks[i].client = client;
+        vTasks[i].index = &vdbi[i];
+        vTasks[i].key = &keys[i];
+        vTasks[i].card = 0;
+        vTasks[i].ok = false;
+        vAll.push_back(i);
+    }
+    count = 0;
+    if (!RunTasks(CardTask, vTasks, vAll))
+        return false;
+
+    if (SET_UNION == op) {
+        std::vector<size_t> vFetch;
+        for (size_t i = 0; i < size; ++i) {
+            if (vTasks[i].card > 0)
+                vFetch.push_back(i);
+        }
+        if (!RunTasks(FetchTask, vTasks, vFetch))
+            return false;
+
+        MemberSet merged;
+        for (size_t i = 0; i < vFetch.size(); ++i) {
+            const VALUES& members = vTasks[vFetch[i]].members;
+            merged.insert(members.begin(), members.end());
+        }
+        count = (int64_t) merged.size();
+        if (NULL != result)
+            result->assign(merged.begin(), merged.end());
+        return true;
+    }
+
+    // Diff starts from the first set, intersection from the smallest; the
+    // other sets are applied smallest first.
+    size_t base = 0;
+    for (size_t i = 1; (SET_INTER == op) && (i < size); ++i) {
+        if (vTasks[i].card < vTasks[base].card)
+            base = i;
+    }
+    if (0 == vTasks[base].card)
+        return true;
+
+    std::vector<std::pair<int64_t, size_t> > vOthers;
+    for (size_t i = 0; i < size; ++i) {
+        if ((i != base) && ((SET_INTER == op) || (vTasks[i].card > 0)))
+            vOthers.push_back(std::make_pair(vTasks[i].card, i));
+    }
+    std::sort(vOthers.begin(), vOthers.end());
+
+    std::vector<size_t> vFetch(1, base);
+    for (size_t i = 0; i < vOthers.size(); ++i) {
+        if (vOthers[i].first <= vTasks[base].card * SET_PROBE_RATIO)
+            vFetch.push_back(vOthers[i].second);
+    }
+    if (!RunTasks(FetchTask, vTasks, vFetch))
+        return false;
+
+    VALUES candidates;
+    candidates.swap(vTasks[base].members);
+    bool wantMember = SET_INTER == op;
+    for (size_t i = 0; (i < vOthers.size()) && !candidates.empty(); ++i) {
+        if (vOthers[i].first > vTasks[base].card * SET_PROBE_RATIO)
+            continue;
+        SetTask& task = vTasks[vOthers[i].second];
+        MemberSet members(task.members.begin(), task.members.end());
+        VALUES().swap(task.members);
+
+        VALUES kept;
+        for (size_t j = 0; j < candidates.size(); ++j) {
+            if ((members.end() != members.find(candidates[j])) == wantMember)
+                kept.push_back(candidates[j]);
+        }
+        candidates.swap(kept);
+    }
+
+    // Sets too large to download are probed chunk by chunk, which also lets
+    // a limited count stop early.
+    std::vector<size_t> vProbe;
+    for (size_t i = 0; i < vOthers.size(); ++i) {
+        if (vOthers[i].first > vTasks[base].card * SET_PROBE_RATIO)
+            vProbe.push_back(vOthers[i].second);
+    }
+
+    VALUES out;
+    for (size_t pos = 0; pos < candidates.size(); pos += SET_PROBE_CHUNK) {
+        VALUES chunk(candidates.begin() + pos, candidates.begin() + std::min(candidates.size(), pos + SET_PROBE_CHUNK));
+        for (size_t i = 0; (i < vProbe.size()) && !chunk.empty(); ++i) {
+            VALUES kept;
+            if (!Probe(client, vdbi[vProbe[i]], keys[vProbe[i]], chunk, wantMember, kept))
+                return false;
+            chunk.swap(kept);
+        }
+        out.insert(out.end(), chunk.begin(), chunk.end());
+        if ((limit > 0) && (out.size() >= limit)) {
+            out.resize(limit);
+            break;
+        }
+    }
+
+    count = (int64_t) out.size();
+    if (NULL != result)
+        result->swap(out);
+    return true;
+}
+
+bool xRedisSetAlgebra::Compute(xRedisClient* client, SETOP op, const DBIArray& vdbi, const KEYS& keys, VALUES& result) {
+    result.clear();
+    if ((NULL == client) || keys.empty() || (vdbi.size() != keys.size()))
+        return false;
+
+    if (IsColocated(vdbi, NULL))
+        return Native(client, op, vdbi, keys, result);
+
+    int64_t count = 0;
+    return Filter(client, op, vdbi, keys, 0, &result, count);
+}
+
+bool xRedisSetAlgebra::InterCard(xRedisClient* client, const DBIArray& vdbi, const KEYS& keys, uint64_t limit, int64_t& count) {
+    count = 0;
+    if ((NULL == client) || keys.empty() || (vdbi.size() != keys.size()))
+        return false;
+
+    // SINTERCARD needs Redis 7; older servers fall through to the client
+    // side count.
+    if (IsColocated(vdbi, NULL)) {
+        VDATA vCmdData;
+        vCmdData.push_back("SINTERCARD");
+        vCmdData.push_back(toString(keys.size()));
+        vCmdData.insert(vCmdData.end(), keys.begin(), keys.end());
+        if (limit > 0) {
+            vCmdData.push_back("LIMIT");
+            vCmdData.push_back(toString(limit));
+        }
+        SliceIndex index = WithIOType(vdbi[0], SLAVE);
+        if (client->commandargv_integer(index, vCmdData, count))
+            return true;
+    }
+    return Filter(client, SET_INTER, vdbi, keys, limit, NULL, count);
+}
+
+bool xRedisSetAlgebra::Store(xRedisClient* client, SETOP op, const SliceIndex& index, const KEY& destination, const DBIArray& vdbi, const KEYS& keys, int64_t& count) {
+    count = 0;
+    if ((NULL == client) || keys.empty() || (vdbi.size() != keys.size()))
+        return false;
+
+    if (IsColocated(vdbi, &index)) {
+        VDATA vCmdData;
+        vCmdData.push_back(gNativeStoreCmds[op]);
+        vCmdData.push_back(destination);
+        vCmdData.insert(vCmdData.end(), keys.begin(), keys.end());
+        SliceIndex master = WithIOType(index, MASTER);
+        bool bRet = client->commandargv_integer(master, vCmdData, count);
+        if (!bRet)
+            ReturnErrInfo(master, index);
+        return bRet;
+    }
+
+    VALUES result;
+    if (!Compute(client, op, vdbi, keys, result) || !WriteMembers(client, index, destination, result))
+        return false;
+    count = (int64_t) result.size();
+    return true;
+}
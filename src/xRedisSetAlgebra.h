@@ -0,0 +1,58 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_SETALGEBRA_H_
+#define _XREDIS_SETALGEBRA_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef enum _SET_OP_ {
+        SET_DIFF = 0,
+        SET_INTER = 1,
+        SET_UNION = 2
+    } SETOP;
+
+    // SDIFF/SINTER/SUNION over keys on any slices, behind xRedisClient's
+    // sdiff/sinter/sunion and their *store variants.
+    //
+    // Keys sharing one slice are handed to the native command. Otherwise
+    // set sizes are read first and sets are streamed with SSCAN in parallel.
+    // Intersections and differences start from the smallest (first, for
+    // diff) set and probe sets much larger than the candidates with
+    // pipelined SISMEMBER instead of downloading them. Results are written
+    // with chunked, pipelined SADD into a temporary key renamed over the
+    // destination, so readers never see a partial result.
+    class xRedisSetAlgebra {
+    public:
+        static bool Compute(xRedisClient* client, SETOP op, const DBIArray& vdbi, const KEYS& keys, VALUES& result);
+
+        // Size of the intersection, counting stops at limit (0 for none).
+        static bool InterCard(xRedisClient* client, const DBIArray& vdbi, const KEYS& keys, uint64_t limit, int64_t& count);
+
+        static bool Store(xRedisClient* client, SETOP op, const SliceIndex& index, const KEY& destination, const DBIArray& vdbi, const KEYS& keys, int64_t& count);
+
+        // All members of a set, SSCAN batch by batch.
+        static bool FetchMembers(xRedisClient* client, const SliceIndex& index, const KEY& key, VALUES& members);
+
+        // Replaces key with members, SADD chunkSize members at a time.
+        static bool WriteMembers(xRedisClient* client, const SliceIndex& index, const KEY& key, const VALUES& members, uint32_t chunkSize = 1000);
+
+    private:
+        static bool IsColocated(const DBIArray& vdbi, const SliceIndex* dest);
+
+        static bool Native(xRedisClient* client, SETOP op, const DBIArray& vdbi, const KEYS& keys, VALUES& result);
+
+        static bool Filter(xRedisClient* client, SETOP op, const DBIArray& vdbi, const KEYS& keys, uint64_t limit, VALUES* result, int64_t& count);
+    };
+
+}
+
+#endif
@@ -0,0 +1,488 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include <queue>
+#include "xRedisShardedZSet.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define ZSET_DEFAULT_MAX_THREADS 16
+#define ZSET_RANK_TIE_PAGE 256
+
+typedef struct _ZSET_HEAD_ {
+    const ZMEMBER* item;
+    uint32_t list;
+    size_t pos;
+} ZSetHead;
+
+// Redis order: score, then member bytes; desc reverses both.
+static bool Before(const ZMEMBER& a, const ZMEMBER& b, bool desc) {
+    if (a.second != b.second)
+        return desc ? (a.second > b.second) : (a.second < b.second);
+    return desc ? (a.first > b.first) : (a.first < b.first);
+}
+
+// One page of the members scored exactly score, in the order of desc.
+static VDATA TiesCommand(const string& key, const string& score, bool desc, int64_t offset) {
+    VDATA vCmdData;
+    vCmdData.push_back(desc ? "ZREVRANGEBYSCORE" : "ZRANGEBYSCORE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(score);
+    vCmdData.push_back(score);
+    vCmdData.push_back("LIMIT");
+    vCmdData.push_back(toString(offset));
+    vCmdData.push_back(toString(ZSET_RANK_TIE_PAGE));
+    return vCmdData;
+}
+
+// Adds the ties on a page that sort before member; true when the next page
+// may hold more of them.
+static bool CountTies(const redisReply* ties, const string& member, bool desc, int64_t& rank) {
+    for (size_t i = 0; i < ties->elements; ++i) {
+        string tie(ties->element[i]->str, ties->element[i]->len);
+        if (desc ? (tie <= member) : (tie >= member))
+            return false;
+        ++rank;
+    }
+    return (size_t) ZSET_RANK_TIE_PAGE == ties->elements;
+}
+
+struct ZSetHeadAfter {
+    bool desc;
+
+    explicit ZSetHeadAfter(bool isDesc) : desc(isDesc) {}
+
+    bool operator()(const ZSetHead& a, const ZSetHead& b) const {
+        return Before(*b.item, *a.item, desc);
+    }
+};
+
+xRedisShardedZSet::xRedisShardedZSet() {
+    mClient = NULL;
+    mOption.nodeIndex = 0;
+    mOption.fun = NULL;
+    mOption.threads = 0;
+    mSliceCount = 0;
+}
+
+xRedisShardedZSet::~xRedisShardedZSet() {
+}
+
+bool xRedisShardedZSet::Init(xRedisClient* client, const ShardedZSetOption& option) {
+    if ((NULL == client) || (NULL != mClient) || (NULL == option.fun))
+        return false;
+
+    uint32_t sliceCount = client->GetRedisPool()->GetSliceCount(option.nodeIndex);
+    if ((0 == sliceCount) || (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return false;
+
+    mOption = option;
+    if (0 == mOption.threads)
+        mOption.threads = std::min(sliceCount, (uint32_t) ZSET_DEFAULT_MAX_THREADS);
+    mSliceCount = sliceCount;
+    mClient = client;
+    return true;
+}
+
+void xRedisShardedZSet::SliceTask(void* arg) {
+    ZSetSliceTask* pTask = static_cast<ZSetSliceTask*>(arg);
+    const ShardedZSetOption& option = pTask->zset->mOption;
+    RedisPool* pRedisPool = pTask->zset->mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(option.nodeIndex, pTask->sliceIndex, pTask->ioType);
+    if (NULL == pRedisConn) {
+        pTask->ok = false;
+        return;
+    }
+    pTask->ok = RedisPipelineArgv(pRedisConn, pTask->cmds, pTask->replies);
+    if (!pTask->ok)
+        pRedisConn->RedisReConnect();
+    pRedisPool->FreeConnection(pRedisConn);
+}
+
+void xRedisShardedZSet::MakeTasks(std::vector<ZSetSliceTask>& vTasks, uint32_t ioType) {
+    vTasks.resize(mSliceCount);
+    for (uint32_t i = 0; i < mSliceCount; ++i) {
+        vTasks[i].zset = this;
+        vTasks[i].sliceIndex = i;
+        vTasks[i].ioType = ioType;
+        vTasks[i].ok = false;
+    }
+}
+
+void xRedisShardedZSet::FreeTasks(std::vector<ZSetSliceTask>& vTasks) {
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        FreeReplies(vTasks[i].replies);
+    }
+}
+
+bool xRedisShardedZSet::Run(std::vector<ZSetSliceTask>& vTasks) {
+    std::vector<void*> vArgs;
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        if (!vTasks[i].cmds.empty())
+            vArgs.push_back(&vTasks[i]);
+    }
+    RunParallel(SliceTask, vArgs, mOption.threads);
+
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        if (vTasks[i].cmds.empty())
+            continue;
+        if (!vTasks[i].ok)
+            return false;
+        for (size_t j = 0; j < vTasks[i].replies.size(); ++j) {
+            if (REDIS_REPLY_ERROR == vTasks[i].replies[j]->type)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool xRedisShardedZSet::Locate(const string& member, SliceIndex& index) {
+    return (NULL != mClient) && index.Create(member.c_str(), mOption.fun) && (index.mSliceIndex < mSliceCount);
+}
+
+bool xRedisShardedZSet::SumIntegers(std::vector<ZSetSliceTask>& vTasks, int64_t& count) {
+    count = 0;
+    bool bRet = Run(vTasks);
+    for (size_t i = 0; bRet && (i < vTasks.size()); ++i) {
+        for (size_t j = 0; j < vTasks[i].replies.size(); ++j) {
+            if (REDIS_REPLY_INTEGER == vTasks[i].replies[j]->type)
+                count += vTasks[i].replies[j]->integer;
+        }
+    }
+    FreeTasks(vTasks);
+    return bRet;
+}
+
+void xRedisShardedZSet::Merge(const std::vector<ZMEMBERS>& vLists, bool desc, size_t skip, size_t count, ZMEMBERS& members, std::vector<uint32_t>* from) {
+    members.clear();
+    if (NULL != from)
+        from->clear();
+
+    std::priority_queue<ZSetHead, std::vector<ZSetHead>, ZSetHeadAfter> heads((ZSetHeadAfter(desc)));
+    for (size_t i = 0; i < vLists.size(); ++i) {
+        if (!vLists[i].empty()) {
+            ZSetHead head = {&vLists[i][0], (uint32_t) i, 0};
+            heads.push(head);
+        }
+    }
+
+    size_t taken = 0;
+    while (!heads.empty() && ((0 == count) || (members.size() < count))) {
+        ZSetHead head = heads.top();
+        heads.pop();
+        if (taken++ >= skip) {
+            members.push_back(*head.item);
+            if (NULL != from)
+                from->push_back(head.list);
+        }
+        if (++head.pos < vLists[head.list].size()) {
+            head.item = &vLists[head.list][head.pos];
+            heads.push(head);
+        }
+    }
+}
+
+bool xRedisShardedZSet::zadd(const string& key, const ZMEMBERS& members, uint32_t flags, int64_t& count) {
+    count = 0;
+    if ((NULL == mClient) || key.empty() || members.empty())
+        return false;
+
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, MASTER);
+    for (ZMEMBERS::const_iterator it = members.begin(); it != members.end(); ++it) {
+        SliceIndex index(mClient, mOption.nodeIndex);
+        if (!Locate(it->first, index))
+            return false;
+        std::vector<VDATA>& vCmds = vTasks[index.mSliceIndex].cmds;
+        if (vCmds.empty()) {
+            vCmds.push_back(VDATA());
+            vCmds[0].push_back("ZADD");
+            vCmds[0].push_back(key);
+            if (flags & ZADD_NX)
+                vCmds[0].push_back("NX");
+            if (flags & ZADD_XX)
+                vCmds[0].push_back("XX");
+            if (flags & ZADD_GT)
+                vCmds[0].push_back("GT");
+            if (flags & ZADD_LT)
+                vCmds[0].push_back("LT");
+            if (flags & ZADD_CH)
+                vCmds[0].push_back("CH");
+        }
+        vCmds[0].push_back(xRedisNative::FormatDouble(it->second));
+        vCmds[0].push_back(it->first);
+    }
+    return SumIntegers(vTasks, count);
+}
+
+bool xRedisShardedZSet::zincrby(const string& key, const string& member, double increment, double& score) {
+    SliceIndex index(mClient, mOption.nodeIndex);
+    if (key.empty() || !Locate(member, index))
+        return false;
+    xRedisNative native(mClient);
+    return native.zincrby(index, key, increment, member, score);
+}
+
+bool xRedisShardedZSet::zrem(const string& key, const VALUES& members, int64_t& count) {
+    count = 0;
+    if ((NULL == mClient) || key.empty() || members.empty())
+        return false;
+
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, MASTER);
+    for (VALUES::const_iterator it = members.begin(); it != members.end(); ++it) {
+        SliceIndex index(mClient, mOption.nodeIndex);
+        if (!Locate(*it, index))
+            return false;
+        std::vector<VDATA>& vCmds = vTasks[index.mSliceIndex].cmds;
+        if (vCmds.empty()) {
+            vCmds.push_back(VDATA());
+            vCmds[0].push_back("ZREM");
+            vCmds[0].push_back(key);
+        }
+        vCmds[0].push_back(*it);
+    }
+    return SumIntegers(vTasks, count);
+}
+
+bool xRedisShardedZSet::zscore(const string& key, const string& member, double& score) {
+    SliceIndex index(mClient, mOption.nodeIndex);
+    if (key.empty() || !Locate(member, index))
+        return false;
+    xRedisNative native(mClient);
+    return native.zscore(index, key, member, score);
+}
+
+bool xRedisShardedZSet::zcard(const string& key, int64_t& count) {
+    count = 0;
+    if ((NULL == mClient) || key.empty())
+        return false;
+
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, SLAVE);
+    for (uint32_t i = 0; i < mSliceCount; ++i) {
+        vTasks[i].cmds.push_back(VDATA());
+        vTasks[i].cmds[0].push_back("ZCARD");
+        vTasks[i].cmds[0].push_back(key);
+    }
+    return SumIntegers(vTasks, count);
+}
+
+bool xRedisShardedZSet::zcount(const string& key, const string& min, const string& max, int64_t& count) {
+    count = 0;
+    if ((NULL == mClient) || key.empty())
+        return false;
+
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, SLAVE);
+    for (uint32_t i = 0; i < mSliceCount; ++i) {
+        vTasks[i].cmds.push_back(VDATA());
+        VDATA& vCmdData = vTasks[i].cmds[0];
+        vCmdData.push_back("ZCOUNT");
+        vCmdData.push_back(key);
+        vCmdData.push_back(min);
+        vCmdData.push_back(max);
+    }
+    return SumIntegers(vTasks, count);
+}
+
+bool xRedisShardedZSet::top(const string& key, uint32_t k, bool desc, ZMEMBERS& members) {
+    members.clear();
+    if ((NULL == mClient) || key.empty())
+        return false;
+    if (0 == k)
+        return true;
+
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, SLAVE);
+    for (uint32_t i = 0; i < mSliceCount; ++i) {
+        vTasks[i].cmds.push_back(VDATA());
+        VDATA& vCmdData = vTasks[i].cmds[0];
+        vCmdData.push_back(desc ? "ZREVRANGE" : "ZRANGE");
+        vCmdData.push_back(key);
+        vCmdData.push_back("0");
+        vCmdData.push_back(toString(k - 1));
+        vCmdData.push_back("WITHSCORES");
+    }
+
+    bool bRet = Run(vTasks);
+    std::vector<ZMEMBERS> vLists(mSliceCount);
+    for (uint32_t i = 0; bRet && (i < mSliceCount); ++i) {
+        bRet = xRedisNative::ParseScored(vTasks[i].replies[0], vLists[i]);
+    }
+    FreeTasks(vTasks);
+    if (bRet)
+        Merge(vLists, desc, 0, k, members, NULL);
+    return bRet;
+}
+
+bool xRedisShardedZSet::rank(const string& key, const string& member, bool desc, int64_t& rank) {
+    double score = 0;
+    SliceIndex owner(mClient, mOption.nodeIndex);
+    if (!zscore(key, member, score) || !Locate(member, owner))
+        return false;
+
+    // The owner slice knows the local rank; elsewhere count the members
+    // with a better score plus the ties that sort before member.
+    string strScore = xRedisNative::FormatDouble(score);
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, SLAVE);
+    for (uint32_t i = 0; i < mSliceCount; ++i) {
+        std::vector<VDATA>& vCmds = vTasks[i].cmds;
+        if (i == owner.mSliceIndex) {
+            vCmds.push_back(VDATA());
+            vCmds[0].push_back(desc ? "ZREVRANK" : "ZRANK");
+            vCmds[0].push_back(key);
+            vCmds[0].push_back(member);
+            continue;
+        }
+        vCmds.resize(1);
+        vCmds[0].push_back("ZCOUNT");
+        vCmds[0].push_back(key);
+        vCmds[0].push_back(desc ? "(" + strScore : "-inf");
+        vCmds[0].push_back(desc ? "+inf" : "(" + strScore);
+        vCmds.push_back(TiesCommand(key, strScore, desc, 0));
+    }
+
+    bool bRet = Run(vTasks);
+    rank = 0;
+    std::vector<uint32_t> vPending;
+    for (uint32_t i = 0; bRet && (i < mSliceCount); ++i) {
+        const redisReply* counted = vTasks[i].replies[0];
+        bRet = REDIS_REPLY_INTEGER == counted->type;
+        if (bRet)
+            rank += counted->integer;
+        if (!bRet || (i == owner.mSliceIndex))
+            continue;
+        bRet = REDIS_REPLY_ARRAY == vTasks[i].replies[1]->type;
+        if (bRet && CountTies(vTasks[i].replies[1], member, desc, rank))
+            vPending.push_back(i);
+    }
+    FreeTasks(vTasks);
+
+    // Ties arrive a page at a time in member order; a slice is done at its
+    // first tie that doesn't sort before member.
+    for (int64_t offset = ZSET_RANK_TIE_PAGE; bRet && !vPending.empty(); offset += ZSET_RANK_TIE_PAGE) {
+        std::vector<ZSetSliceTask> vPages;
+        MakeTasks(vPages, SLAVE);
+        for (size_t i = 0; i < vPending.size(); ++i) {
+            vPages[vPending[i]].cmds.push_back(TiesCommand(key, strScore, desc, offset));
+        }
+        bRet = Run(vPages);
+        std::vector<uint32_t> vNext;
+        for (size_t i = 0; bRet && (i < vPending.size()); ++i) {
+            const redisReply* ties = vPages[vPending[i]].replies[0];
+            bRet = REDIS_REPLY_ARRAY == ties->type;
+            if (bRet && CountTies(ties, member, desc, rank))
+                vNext.push_back(vPending[i]);
+        }
+        vPending.swap(vNext);
+        FreeTasks(vPages);
+    }
+    return bRet;
+}
+
+bool xRedisShardedZSet::rangebyscore(const string& key, const string& min, const string& max, bool desc, const LIMIT* limit, ZMEMBERS& members) {
+    members.clear();
+    if ((NULL == mClient) || key.empty())
+        return false;
+
+    // Each slice returns at most offset + count members; the merge then
+    // skips offset.
+    size_t skip = 0;
+    size_t count = 0;
+    if ((NULL != limit) && (limit->count >= 0)) {
+        skip = (size_t) std::max(limit->offset, 0);
+        count = (size_t) limit->count;
+        if (0 == count)
+            return true;
+    } else if (NULL != limit) {
+        skip = (size_t) std::max(limit->offset, 0);
+    }
+
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, SLAVE);
+    for (uint32_t i = 0; i < mSliceCount; ++i) {
+        vTasks[i].cmds.push_back(VDATA());
+        VDATA& vCmdData = vTasks[i].cmds[0];
+        vCmdData.push_back(desc ? "ZREVRANGEBYSCORE" : "ZRANGEBYSCORE");
+        vCmdData.push_back(key);
+        vCmdData.push_back(desc ? max : min);
+        vCmdData.push_back(desc ? min : max);
+        vCmdData.push_back("WITHSCORES");
+        if (count > 0) {
+            vCmdData.push_back("LIMIT");
+            vCmdData.push_back("0");
+            vCmdData.push_back(toString(skip + count));
+        }
+    }
+
+    bool bRet = Run(vTasks);
+    std::vector<ZMEMBERS> vLists(mSliceCount);
+    for (uint32_t i = 0; bRet && (i < mSliceCount); ++i) {
+        bRet = xRedisNative::ParseScored(vTasks[i].replies[0], vLists[i]);
+    }
+    FreeTasks(vTasks);
+    if (bRet)
+        Merge(vLists, desc, skip, count, members, NULL);
+    return bRet;
+}
+
+bool xRedisShardedZSet::page(const string& key, uint32_t count, bool desc, ZSetCursor& cursor, ZMEMBERS& members) {
+    members.clear();
+    if ((NULL == mClient) || key.empty())
+        return false;
+    if (0 == count)
+        return true;
+
+    if (cursor.scores.size() != mSliceCount) {
+        cursor.scores.assign(mSliceCount, desc ? INFINITY : -INFINITY);
+        cursor.ties.assign(mSliceCount, 0);
+    }
+
+    // Each slice resumes at its own last score, skipping the members with
+    // that score it has already returned.
+    std::vector<ZSetSliceTask> vTasks;
+    MakeTasks(vTasks, SLAVE);
+    for (uint32_t i = 0; i < mSliceCount; ++i) {
+        vTasks[i].cmds.push_back(VDATA());
+        VDATA& vCmdData = vTasks[i].cmds[0];
+        vCmdData.push_back(desc ? "ZREVRANGEBYSCORE" : "ZRANGEBYSCORE");
+        vCmdData.push_back(key);
+        vCmdData.push_back(xRedisNative::FormatDouble(cursor.scores[i]));
+        vCmdData.push_back(desc ? "-inf" : "+inf");
+        vCmdData.push_back("WITHSCORES");
+        vCmdData.push_back("LIMIT");
+        vCmdData.push_back(toString(cursor.ties[i]));
+        vCmdData.push_back(toString(count));
+    }
+
+    bool bRet = Run(vTasks);
+    std::vector<ZMEMBERS> vLists(mSliceCount);
+    for (uint32_t i = 0; bRet && (i < mSliceCount); ++i) {
+        bRet = xRedisNative::ParseScored(vTasks[i].replies[0], vLists[i]);
+    }
+    FreeTasks(vTasks);
+    if (!bRet)
+        return false;
+
+    std::vector<uint32_t> vFrom;
+    Merge(vLists, desc, 0, count, members, &vFrom);
+    for (size_t i = 0; i < members.size(); ++i) {
+        uint32_t slice = vFrom[i];
+        if (members[i].second == cursor.scores[slice]) {
+            cursor.ties[slice]++;
+        } else {
+            cursor.scores[slice] = members[i].second;
+            cursor.ties[slice] = 1;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,111 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_SHARDEDZSET_H_
+#define _XREDIS_SHARDEDZSET_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+#include "xRedisResp3.h"
+
+namespace xrcp {
+
+    typedef struct _SHARDED_ZSET_OPTION_ {
+        uint32_t nodeIndex;
+        HASHFUN fun;                // places a member on a slice
+        uint32_t threads;           // slices queried at once, all by default
+    } ShardedZSetOption;
+
+    // Keyset position of a paged scan: per slice, the last score returned
+    // and how many members with that score were returned. Start with an
+    // empty cursor and keep the same order for every page.
+    typedef struct _ZSET_CURSOR_ {
+        std::vector<double> scores;
+        std::vector<uint32_t> ties;
+    } ZSetCursor;
+
+    // One logical sorted set spread over every slice of a node by member:
+    // each slice holds the members that hash to it under the same key name.
+    //
+    // Reads run one pipelined round on all slices in parallel and merge the
+    // replies with a heap, in Redis order (score, then member bytes; both
+    // reversed for desc). A top-K reads k members per slice. Paging keeps a
+    // per-slice keyset cursor, so each page reads at most count members per
+    // slice past where that slice stopped, never the prefix again.
+    // Results are not a snapshot: writes between rounds can show through.
+    class xRedisShardedZSet {
+    public:
+        xRedisShardedZSet();
+
+        ~xRedisShardedZSet();
+
+        bool Init(xRedisClient* client, const ShardedZSetOption& option);
+
+        bool zadd(const string& key, const ZMEMBERS& members, uint32_t flags, int64_t& count);
+
+        bool zincrby(const string& key, const string& member, double increment, double& score);
+
+        bool zrem(const string& key, const VALUES& members, int64_t& count);
+
+        bool zscore(const string& key, const string& member, double& score);
+
+        bool zcard(const string& key, int64_t& count);
+
+        // Members with min <= score <= max; "(" marks an exclusive bound.
+        bool zcount(const string& key, const string& min, const string& max, int64_t& count);
+
+        // The k highest (desc) or lowest members, best first.
+        bool top(const string& key, uint32_t k, bool desc, ZMEMBERS& members);
+
+        // 0-based position of member in the whole set, as ZREVRANK (desc)
+        // or ZRANK would give it on a single instance.
+        bool rank(const string& key, const string& member, bool desc, int64_t& rank);
+
+        // Members with scores between min and max in order; limit applies to
+        // the merged result.
+        bool rangebyscore(const string& key, const string& min, const string& max, bool desc, const LIMIT* limit, ZMEMBERS& members);
+
+        // Next count members after cursor; fewer than count at the end.
+        bool page(const string& key, uint32_t count, bool desc, ZSetCursor& cursor, ZMEMBERS& members);
+
+    private:
+        typedef struct _ZSET_SLICE_TASK_ {
+            xRedisShardedZSet* zset;
+            uint32_t sliceIndex;
+            uint32_t ioType;
+            std::vector<VDATA> cmds;
+            std::vector<redisReply*> replies;
+            bool ok;
+        } ZSetSliceTask;
+
+        static void SliceTask(void* arg);
+
+        // Runs every task's commands as one pipeline on its slice.
+        bool Run(std::vector<ZSetSliceTask>& vTasks);
+
+        void MakeTasks(std::vector<ZSetSliceTask>& vTasks, uint32_t ioType);
+
+        static void FreeTasks(std::vector<ZSetSliceTask>& vTasks);
+
+        bool Locate(const string& member, SliceIndex& index);
+
+        bool SumIntegers(std::vector<ZSetSliceTask>& vTasks, int64_t& count);
+
+        // Heap merge of sorted per-slice lists, stopping after skip + count
+        // (count 0 for all); from records the slice of each result.
+        static void Merge(const std::vector<ZMEMBERS>& vLists, bool desc, size_t skip, size_t count, ZMEMBERS& members, std::vector<uint32_t>* from);
+
+    private:
+        xRedisClient* mClient;
+        ShardedZSetOption mOption;
+        uint32_t mSliceCount;
+    };
+
+}
+
+#endif
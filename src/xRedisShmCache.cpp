@@ -0,0 +1,578 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include "xRedisShmCache.h"
+#include "xRedisHash.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define SHM_MAGIC 0x3230484353444552ULL     // "REDSCH02"
+#define SHM_UNIT 64
+#define SHM_PAGE_SIZE (1U << 20)
+#define SHM_PAGE_UNITS (SHM_PAGE_SIZE / SHM_UNIT)
+#define SHM_PROBE 16
+#define SHM_SPIN 4096
+#define SHM_READ_RETRY 8
+#define SHM_EVICT_STEPS 256
+#define SHM_NO_BLOCK 0xFFFFFFFF
+#define SHM_ATTACH_WAIT_MS 1000
+
+#define SHM_DEFAULT_BUCKETS (1U << 20)
+#define SHM_DEFAULT_MEMORY (256ULL << 20)
+#define SHM_DEFAULT_TTL_MS 1000
+#define SHM_DEFAULT_LEASE_MS 50
+
+enum {
+    SHM_EMPTY = 0,      // never used, ends a probe
+    SHM_USED = 1,
+    SHM_LOADING = 2,    // lease of the process filling the key
+    SHM_TOMBSTONE = 3
+};
+
+enum {
+    SHM_MISS = 0,
+    SHM_HIT = 1,
+    SHM_BUSY = 2
+};
+
+static volatile uint32_t gLeaseSeq = 0;
+
+static uint32_t ClassOf(size_t size) {
+    uint32_t cls = 0;
+    while (((size_t) SHM_UNIT << cls) < size) {
+        ++cls;
+    }
+    return cls;
+}
+
+static size_t AlignUp(size_t size) {
+    return (size + SHM_UNIT - 1) & ~((size_t) SHM_UNIT - 1);
+}
+
+xRedisShmCache::xRedisShmCache() {
+    mFd = -1;
+    mBase = NULL;
+    mSize = 0;
+    mHeader = NULL;
+    mBuckets = NULL;
+    mSlab = NULL;
+    mBlockCount = 0;
+    mOption.bucketCount = 0;
+    mOption.memoryBytes = 0;
+    mOption.defaultTtlMs = 0;
+    mOption.leaseMs = 0;
+}
+
+xRedisShmCache::~xRedisShmCache() {
+    Close();
+}
+
+bool xRedisShmCache::Open(const ShmCacheOption& option) {
+    if ((NULL != mHeader) || option.name.empty())
+        return false;
+
+    mOption = option;
+    uint32_t bucketCount = 1;
+    while (bucketCount < ((0 == option.bucketCount) ? SHM_DEFAULT_BUCKETS : option.bucketCount)) {
+        bucketCount <<= 1;
+    }
+    uint64_t memoryBytes = (0 == option.memoryBytes) ? SHM_DEFAULT_MEMORY : option.memoryBytes;
+    uint32_t pageCount = (uint32_t) (memoryBytes / SHM_PAGE_SIZE);
+    if (pageCount < SHM_CLASS_COUNT)
+        pageCount = SHM_CLASS_COUNT;
+    if (0 == mOption.defaultTtlMs)
+        mOption.defaultTtlMs = SHM_DEFAULT_TTL_MS;
+    if (0 == mOption.leaseMs)
+        mOption.leaseMs = SHM_DEFAULT_LEASE_MS;
+
+    size_t headerSize = AlignUp(sizeof(ShmHeader));
+    size_t bucketSize = AlignUp((size_t) bucketCount * sizeof(ShmBucket));
+    mSize = headerSize + bucketSize + (size_t) pageCount * SHM_PAGE_SIZE;
+
+    bool creator = true;
+    mFd = shm_open(mOption.name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ((mFd < 0) && (EEXIST == errno)) {
+        creator = false;
+        mFd = shm_open(mOption.name.c_str(), O_RDWR, 0600);
+    }
+    if (mFd < 0)
+        return false;
+
+    if (creator) {
+        if (0 != ftruncate(mFd, (off_t) mSize)) {
+            Close();
+            shm_unlink(mOption.name.c_str());
+            return false;
+        }
+    } else {
+        // The creator may still be sizing the segment.
+        struct stat st;
+        uint32_t waitMs = 0;
+        while ((0 == fstat(mFd, &st)) && ((size_t) st.st_size < mSize) && (waitMs < SHM_ATTACH_WAIT_MS)) {
+            usleep(1000);
+            ++waitMs;
+        }
+        if ((0 != fstat(mFd, &st)) || ((size_t) st.st_size != mSize)) {
+            Close();
+            return false;
+        }
+    }
+
+    mBase = mmap(NULL, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (MAP_FAILED == mBase) {
+        mBase = NULL;
+        Close();
+        return false;
+    }
+
+    mHeader = static_cast<ShmHeader*>(mBase);
+    mBuckets = reinterpret_cast<ShmBucket*>(static_cast<char*>(mBase) + headerSize);
+    mSlab = static_cast<char*>(mBase) + headerSize + bucketSize;
+    mBlockCount = pageCount * SHM_PAGE_UNITS;
+
+    if (creator) {
+        // ftruncate zero-filled the segment: every bucket is SHM_EMPTY and
+        // every free list empty.
+        mHeader->magic = SHM_MAGIC;
+        mHeader->bucketCount = bucketCount;
+        mHeader->pageCount = pageCount;
+        __atomic_store_n(&mHeader->ready, 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    uint32_t waitMs = 0;
+    while ((0 == __atomic_load_n(&mHeader->ready, __ATOMIC_ACQUIRE)) && (waitMs < SHM_ATTACH_WAIT_MS)) {
+        usleep(1000);
+        ++waitMs;
+    }
+    if ((0 == mHeader->ready) || (SHM_MAGIC != mHeader->magic) || (bucketCount != mHeader->bucketCount) || (pageCount != mHeader->pageCount)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void xRedisShmCache::Close() {
+    if (NULL != mBase)
+        munmap(mBase, mSize);
+    if (mFd >= 0)
+        close(mFd);
+    mFd = -1;
+    mBase = NULL;
+    mHeader = NULL;
+    mBuckets = NULL;
+    mSlab = NULL;
+    mBlockCount = 0;
+}
+
+bool xRedisShmCache::Unlink(const string& name) {
+    return 0 == shm_unlink(name.c_str());
+}
+
+char* xRedisShmCache::BlockAt(uint32_t block) const {
+    return mSlab + (size_t) block * SHM_UNIT;
+}
+
+bool xRedisShmCache::LockStripe(uint64_t hash) {
+    volatile int32_t* stripe = &mHeader->stripes[(hash >> 32) & (SHM_STRIPE_COUNT - 1)];
+    int32_t pid = (int32_t) getpid();
+    for (uint32_t i = 0; i < SHM_SPIN; ++i) {
+        int32_t owner = __atomic_load_n(stripe, __ATOMIC_RELAXED);
+        if ((0 == owner) && __sync_bool_compare_and_swap(stripe, 0, pid))
+            return true;
+
+        // Take over a lock whose owner died.
+        if ((0 != owner) && (0 != kill(owner, 0)) && (ESRCH == errno) && __sync_bool_compare_and_swap(stripe, owner, pid))
+            return true;
+        if (0 == (i & 63))
+            sched_yield();
+    }
+    return false;
+}
+
+void xRedisShmCache::UnlockStripe(uint64_t hash) {
+    __atomic_store_n(&mHeader->stripes[(hash >> 32) & (SHM_STRIPE_COUNT - 1)], 0, __ATOMIC_RELEASE);
+}
+
+bool xRedisShmCache::LockBucket(ShmBucket* bucket, bool wait) {
+    // owner is the lock; seq only tells readers a write is under way.
+    int32_t pid = (int32_t) getpid();
+    for (uint32_t i = 0; i < SHM_SPIN; ++i) {
+        int32_t owner = __atomic_load_n(&bucket->owner, __ATOMIC_RELAXED);
+        if ((0 == owner) && __sync_bool_compare_and_swap(&bucket->owner, 0, pid)) {
+            __sync_fetch_and_add(&bucket->seq, 1);
+            return true;
+        }
+
+        // Take over a bucket whose owner died. With seq odd it died halfway
+        // through an update, so the entry is dropped; its block may or may
+        // not be on a free list already and is left alone.
+        if ((0 != owner) && (0 != kill(owner, 0)) && (ESRCH == errno) && __sync_bool_compare_and_swap(&bucket->owner, owner, pid)) {
+            if (__atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE) & 1) {
+                bucket->block = SHM_NO_BLOCK;
+                bucket->state = SHM_TOMBSTONE;
+            } else {
+                __sync_fetch_and_add(&bucket->seq, 1);
+            }
+            return true;
+        }
+        if (!wait)
+            return false;
+        if (0 == (i & 63))
+            sched_yield();
+    }
+    return false;
+}
+
+void xRedisShmCache::UnlockBucket(ShmBucket* bucket) {
+    __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&bucket->owner, 0, __ATOMIC_RELEASE);
+}
+
+bool xRedisShmCache::KeyEqual(const ShmBucket* bucket, uint64_t hash, const string& key) const {
+    return ((SHM_USED == bucket->state) || (SHM_LOADING == bucket->state)) && (hash == bucket->hash) && (key.size() == bucket->klen)
+           && (0 == memcmp(BlockAt(bucket->block), key.data(), key.size()));
+}
+
+void xRedisShmCache::ReleaseBucket(ShmBucket* bucket) {
+    if (((SHM_USED == bucket->state) || (SHM_LOADING == bucket->state)) && (SHM_NO_BLOCK != bucket->block))
+        Free(bucket->cls, bucket->block);
+    bucket->block = SHM_NO_BLOCK;
+    bucket->state = SHM_TOMBSTONE;
+}
+
+uint32_t xRedisShmCache::Alloc(uint32_t cls) {
+    volatile uint64_t* list = &mHeader->freeList[cls];
+    uint64_t head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+    while (0 != (uint32_t) head) {
+        // next may be read from a block another process just popped; the
+        // tag then changed and the CAS fails.
+        uint32_t block = (uint32_t) head - 1;
+        uint32_t next = __atomic_load_n(reinterpret_cast<uint32_t*>(BlockAt(block)), __ATOMIC_RELAXED);
+        uint64_t update = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(list, &head, update, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return block;
+    }
+
+    if (__atomic_load_n(&mHeader->pageNext, __ATOMIC_RELAXED) >= mHeader->pageCount)
+        return SHM_NO_BLOCK;
+    uint32_t page = __sync_fetch_and_add(&mHeader->pageNext, 1);
+    if (page >= mHeader->pageCount)
+        return SHM_NO_BLOCK;
+
+    uint32_t units = 1U << cls;
+    uint32_t first = page * SHM_PAGE_UNITS;
+    for (uint32_t block = first + units; block < first + SHM_PAGE_UNITS; block += units) {
+        Free(cls, block);
+    }
+    return first;
+}
+
+void xRedisShmCache::Free(uint32_t cls, uint32_t block) {
+    volatile uint64_t* list = &mHeader->freeList[cls];
+    uint64_t head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    uint64_t update;
+    do {
+        __atomic_store_n(reinterpret_cast<uint32_t*>(BlockAt(block)), (uint32_t) head, __ATOMIC_RELAXED);
+        update = (((head >> 32) + 1) << 32) | (block + 1);
+    } while (!__atomic_compare_exchange_n(list, &head, update, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+uint32_t xRedisShmCache::Evict(uint32_t cls) {
+    // Clock sweep over the table dropping entries of the wanted class.
+    uint64_t now = GetMonotonicUs();
+    uint32_t mask = mHeader->bucketCount - 1;
+    for (uint32_t i = 0; i < SHM_EVICT_STEPS; ++i) {
+        ShmBucket* bucket = &mBuckets[__sync_fetch_and_add(&mHeader->clockHand, 1) & mask];
+        if ((SHM_USED != bucket->state) || (cls != bucket->cls) || !LockBucket(bucket, false))
+            continue;
+        bool bRet = (SHM_USED == bucket->state) && (cls == bucket->cls);
+        if (bRet) {
+            if (bucket->expireUs > now)
+                __sync_fetch_and_add(&mHeader->evictions, 1);
+            ReleaseBucket(bucket);
+        }
+        UnlockBucket(bucket);
+
+        uint32_t block = bRet ? Alloc(cls) : SHM_NO_BLOCK;
+        if (SHM_NO_BLOCK != block)
+            return block;
+    }
+    return SHM_NO_BLOCK;
+}
+
+int32_t xRedisShmCache::Find(const string& key, uint64_t hash, string* value) {
+    uint64_t now = GetMonotonicUs();
+    uint32_t mask = mHeader->bucketCount - 1;
+    for (uint32_t i = 0; i < SHM_PROBE; ++i) {
+        const ShmBucket* bucket = &mBuckets[(hash + i) & mask];
+        for (uint32_t retry = 0; retry < SHM_READ_RETRY; ++retry) {
+            uint32_t seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                sched_yield();
+                continue;
+            }
+
+            uint32_t state = bucket->state;
+            uint32_t block = bucket->block;
+            uint32_t klen = bucket->klen;
+            uint32_t vlen = bucket->vlen;
+            int32_t result = -1;
+            if (SHM_EMPTY == state) {
+                result = SHM_MISS;
+            } else if (((SHM_USED == state) || (SHM_LOADING == state)) && (hash == bucket->hash) && (key.size() == klen)
+                       && (bucket->expireUs > now) && (block < mBlockCount) && ((uint64_t) klen + vlen <= (uint64_t) (mBlockCount - block) * SHM_UNIT)
+                       && (0 == memcmp(BlockAt(block), key.data(), klen))) {
+                result = (SHM_LOADING == state) ? SHM_BUSY : SHM_HIT;
+                if ((SHM_HIT == result) && (NULL != value))
+                    value->assign(BlockAt(block) + klen, vlen);
+            }
+
+            // Anything copied above is only valid if no writer came by.
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) != seq)
+                continue;
+            if (result >= 0)
+                return result;
+            break;
+        }
+    }
+    return SHM_MISS;
+}
+
+bool xRedisShmCache::Store(const string& key, const char* data, size_t len, uint64_t ttlUs, uint32_t state, bool onlyIfAbsent, uint64_t lease) {
+    size_t size = key.size() + len;
+    if ((NULL == mHeader) || key.empty() || (size > SHM_PAGE_SIZE)) {
+        if (NULL != mHeader)
+            __sync_fetch_and_add(&mHeader->failures, 1);
+        return false;
+    }
+
+    uint64_t hash = xRedisHash::XXH64(key.data(), key.size());
+    if (!LockStripe(hash)) {
+        __sync_fetch_and_add(&mHeader->failures, 1);
+        return false;
+    }
+
+    // Look for the key itself, else the first reusable bucket, else the
+    // entry closest to expiry.
+    uint64_t now = GetMonotonicUs();
+    uint32_t mask = mHeader->bucketCount - 1;
+    ShmBucket* target = NULL;
+    ShmBucket* freeBucket = NULL;
+    ShmBucket* victim = NULL;
+    uint64_t victimExpire = 0;
+    for (uint32_t i = 0; (i < SHM_PROBE) && (NULL == target); ++i) {
+        ShmBucket* bucket = &mBuckets[(hash + i) & mask];
+        if (!LockBucket(bucket, true))
+            continue;
+        uint32_t bucketState = bucket->state;
+        if (KeyEqual(bucket, hash, key)) {
+            target = bucket;
+            break;
+        }
+        if ((NULL == freeBucket) && ((SHM_EMPTY == bucketState) || (SHM_TOMBSTONE == bucketState) || (bucket->expireUs <= now)))
+            freeBucket = bucket;
+        else if ((NULL == victim) || (bucket->expireUs < victimExpire)) {
+            victim = bucket;
+            victimExpire = bucket->expireUs;
+        }
+        UnlockBucket(bucket);
+        if (SHM_EMPTY == bucketState)
+            break;
+    }
+
+    bool live = (NULL != target) && (target->expireUs > now);
+    bool fill = (SHM_USED == state) && (0 != lease);
+    bool leased = (NULL != target) && (SHM_LOADING == target->state) && (lease == target->lease);
+    if ((onlyIfAbsent && live) || (fill && !leased)) {
+        if (NULL != target)
+            UnlockBucket(target);
+        UnlockStripe(hash);
+        return false;
+    }
+    if (NULL != target)
+        UnlockBucket(target);
+    else
+        target = (NULL != freeBucket) ? freeBucket : victim;
+
+    // Copy into a private block before publishing it.
+    uint32_t cls = ClassOf(size);
+    uint32_t block = Alloc(cls);
+    if (SHM_NO_BLOCK == block)
+        block = Evict(cls);
+    if ((NULL == target) || (SHM_NO_BLOCK == block) || !LockBucket(target, true)) {
+        if (SHM_NO_BLOCK != block)
+            Free(cls, block);
+        UnlockStripe(hash);
+        __sync_fetch_and_add(&mHeader->failures, 1);
+        return false;
+    }
+
+    // Clear() does not take the stripe and may have dropped the lease.
+    if (fill && !((SHM_LOADING == target->state) && (lease == target->lease) && KeyEqual(target, hash, key))) {
+        UnlockBucket(target);
+        Free(cls, block);
+        UnlockStripe(hash);
+        return false;
+    }
+    memcpy(BlockAt(block), key.data(), key.size());
+    if (len > 0)
+        memcpy(BlockAt(block) + key.size(), data, len);
+
+    if ((SHM_USED == target->state) && (target->expireUs > now) && !KeyEqual(target, hash, key))
+        __sync_fetch_and_add(&mHeader->evictions, 1);
+    ReleaseBucket(target);
+    target->hash = hash;
+    target->expireUs = now + ttlUs;
+    target->block = block;
+    target->cls = cls;
+    target->klen = (uint32_t) key.size();
+    target->vlen = (uint32_t) len;
+    target->lease = (SHM_LOADING == state) ? lease : 0;
+    target->state = state;
+    UnlockBucket(target);
+    UnlockStripe(hash);
+
+    if (SHM_USED == state)
+        __sync_fetch_and_add(&mHeader->sets, 1);
+    return true;
+}
+
+bool xRedisShmCache::Get(const string& key, string& value) {
+    if ((NULL == mHeader) || key.empty())
+        return false;
+
+    bool bRet = SHM_HIT == Find(key, xRedisHash::XXH64(key.data(), key.size()), &value);
+    __sync_fetch_and_add(bRet ? &mHeader->hits : &mHeader->misses, 1);
+    return bRet;
+}
+
+bool xRedisShmCache::Set(const string& key, const string& value, uint32_t ttlMs) {
+    uint64_t ttlUs = (uint64_t) ((0 == ttlMs) ? mOption.defaultTtlMs : ttlMs) * 1000;
+    return Store(key, value.data(), value.size(), ttlUs, SHM_USED, false, 0);
+}
+
+bool xRedisShmCache::Del(const string& key) {
+    return Remove(key, 0);
+}
+
+bool xRedisShmCache::Remove(const string& key, uint64_t lease) {
+    if ((NULL == mHeader) || key.empty())
+        return false;
+
+    uint64_t hash = xRedisHash::XXH64(key.data(), key.size());
+    if (!LockStripe(hash))
+        return false;
+
+    bool bRet = false;
+    uint32_t mask = mHeader->bucketCount - 1;
+    for (uint32_t i = 0; i < SHM_PROBE; ++i) {
+        ShmBucket* bucket = &mBuckets[(hash + i) & mask];
+        if (!LockBucket(bucket, true))
+            continue;
+        uint32_t state = bucket->state;
+        if (KeyEqual(bucket, hash, key) && ((0 == lease) || ((SHM_LOADING == state) && (lease == bucket->lease)))) {
+            ReleaseBucket(bucket);
+            bRet = true;
+        }
+        UnlockBucket(bucket);
+        if (SHM_EMPTY == state)
+            break;
+    }
+    UnlockStripe(hash);
+    return bRet;
+}
+
+void xRedisShmCache::Clear() {
+    if (NULL == mHeader)
+        return;
+
+    for (uint32_t i = 0; i < mHeader->bucketCount; ++i) {
+        ShmBucket* bucket = &mBuckets[i];
+        if ((SHM_EMPTY == bucket->state) || (SHM_TOMBSTONE == bucket->state) || !LockBucket(bucket, true))
+            continue;
+        ReleaseBucket(bucket);
+        UnlockBucket(bucket);
+    }
+}
+
+void xRedisShmCache::GetStats(ShmCacheStats& stats) {
+    memset(&stats, 0, sizeof(stats));
+    if (NULL == mHeader)
+        return;
+
+    stats.hits = __atomic_load_n(&mHeader->hits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&mHeader->misses, __ATOMIC_RELAXED);
+    stats.sets = __atomic_load_n(&mHeader->sets, __ATOMIC_RELAXED);
+    stats.evictions = __atomic_load_n(&mHeader->evictions, __ATOMIC_RELAXED);
+    stats.failures = __atomic_load_n(&mHeader->failures, __ATOMIC_RELAXED);
+    stats.bucketCount = mHeader->bucketCount;
+    stats.pageCount = mHeader->pageCount;
+    stats.pagesUsed = __atomic_load_n(&mHeader->pageNext, __ATOMIC_RELAXED);
+    if (stats.pagesUsed > stats.pageCount)
+        stats.pagesUsed = stats.pageCount;
+}
+
+bool xRedisShmCache::get(xRedisClient* client, const SliceIndex& index, const string& key, string& value) {
+    if (NULL == client)
+        return false;
+    if ((NULL == mHeader) || key.empty())
+        return client->get(index, key, value);
+
+    uint64_t hash = xRedisHash::XXH64(key.data(), key.size());
+    int32_t state = Find(key, hash, &value);
+    if (SHM_HIT == state) {
+        __sync_fetch_and_add(&mHeader->hits, 1);
+        return true;
+    }
+    __sync_fetch_and_add(&mHeader->misses, 1);
+
+    // One process on the host reads Redis; the rest wait out its lease.
+    uint64_t leaseUs = (uint64_t) mOption.leaseMs * 1000;
+    uint64_t lease = NewLease();
+    bool owner = (SHM_MISS == state) && Store(key, NULL, 0, leaseUs, SHM_LOADING, true, lease);
+    if (!owner) {
+        uint64_t deadline = GetMonotonicUs() + leaseUs;
+        while (GetMonotonicUs() < deadline) {
+            usleep(500);
+            state = Find(key, hash, &value);
+            if (SHM_HIT == state)
+                return true;
+            if (SHM_MISS == state)
+                break;
+        }
+    }
+
+    // Only the lease holder fills the entry, and only if nothing dropped its
+    // lease meanwhile: what it read may predate that invalidation. Waiters
+    // that gave up just return what they read.
+    bool bRet = client->get(index, key, value);
+    if (owner && (!bRet || !Store(key, value.data(), value.size(), (uint64_t) mOption.defaultTtlMs * 1000, SHM_USED, false, lease)))
+        Remove(key, lease);
+    return bRet;
+}
+
+uint64_t xRedisShmCache::NewLease() {
+    return ((uint64_t) (uint32_t) getpid() << 32) | __sync_add_and_fetch(&gLeaseSeq, 1);
+}
+
+void xRedisShmCache::OnInvalidate(const string& key, void* privdata) {
+    xRedisShmCache* cache = static_cast<xRedisShmCache*>(privdata);
+    if (key.empty())
+        cache->Clear();
+    else
+        cache->Del(key);
+}
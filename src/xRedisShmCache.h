@@ -0,0 +1,167 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_SHMCACHE_H_
+#define _XREDIS_SHMCACHE_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+#define SHM_CLASS_COUNT 15          // value blocks of 64 bytes to 1 MB
+#define SHM_STRIPE_COUNT 4096
+
+    typedef struct _SHM_CACHE_OPTION_ {
+        string name;                // POSIX shm name, "/xredis-l1"
+        uint32_t bucketCount;       // hash table slots, rounded up to a power of two
+        uint64_t memoryBytes;       // value store, in 1 MB pages
+        uint32_t defaultTtlMs;      // TTL of entries filled by get()
+        uint32_t leaseMs;           // how long other processes wait for the one filling a key
+    } ShmCacheOption;
+
+    typedef struct _SHM_CACHE_STATS_ {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t sets;
+        uint64_t evictions;         // live entries dropped to make room
+        uint64_t failures;          // values not cached: too large, no memory, lock timeout
+        uint32_t bucketCount;
+        uint32_t pageCount;
+        uint32_t pagesUsed;
+    } ShmCacheStats;
+
+    // Host-local L1 cache shared by every process mapping the same POSIX
+    // shared-memory segment, consulted before a RedisConn is checked out.
+    //
+    // Buckets are an open-addressing table guarded by per-bucket sequence
+    // locks: readers never block and retry when a writer touched the bucket
+    // while they copied it. Keys and values live in a slab store of size
+    // classes fed from 1 MB pages, with lock-free free lists. Writers of one
+    // key serialize on a striped lock, and a bucket is updated under its own
+    // lock word. Both are tagged with the holder's pid, so a lock left by a
+    // crashed process is taken over; a bucket it was updating is emptied
+    // (its block leaks rather than risk a double free).
+    //
+    // get() is read-through: on a miss one process takes a short lease and
+    // reads Redis while the others wait for its result. The value is stored
+    // only while that lease is still in place, so an invalidation that came
+    // in meanwhile is not undone.
+    class xRedisShmCache {
+    public:
+        xRedisShmCache();
+
+        ~xRedisShmCache();
+
+        // Creates the segment or attaches to it; an existing segment must
+        // have the same geometry.
+        bool Open(const ShmCacheOption& option);
+
+        void Close();
+
+        static bool Unlink(const string& name);
+
+        bool Get(const string& key, string& value);
+
+        // ttlMs 0 uses defaultTtlMs.
+        bool Set(const string& key, const string& value, uint32_t ttlMs = 0);
+
+        bool Del(const string& key);
+
+        void Clear();
+
+        void GetStats(ShmCacheStats& stats);
+
+        // Read-through get; the value read from Redis is cached for
+        // defaultTtlMs.
+        bool get(xRedisClient* client, const SliceIndex& index, const string& key, string& value);
+
+        // Invalidation callback for xRedisNearCache: drops key, or everything
+        // for an empty key.
+        static void OnInvalidate(const string& key, void* privdata);
+
+    private:
+        typedef struct _SHM_HEADER_ {
+            uint64_t magic;
+            volatile uint32_t ready;
+            uint32_t bucketCount;
+            uint32_t pageCount;
+            volatile uint32_t pageNext;
+            volatile uint32_t clockHand;
+            uint32_t reserved;
+            volatile uint64_t freeList[SHM_CLASS_COUNT];    // ABA tag << 32 | (block + 1)
+            volatile int32_t stripes[SHM_STRIPE_COUNT];     // owner pid, 0 when free
+            volatile uint64_t hits;
+            volatile uint64_t misses;
+            volatile uint64_t sets;
+            volatile uint64_t evictions;
+            volatile uint64_t failures;
+        } ShmHeader;
+
+        typedef struct _SHM_BUCKET_ {
+            volatile uint32_t seq;      // odd while a writer updates the bucket
+            volatile int32_t owner;     // pid of the writer holding the bucket, 0 when free
+            uint64_t hash;
+            uint64_t expireUs;
+            uint32_t block;             // first 64-byte unit of key + value
+            uint32_t cls;
+            uint32_t klen;
+            uint32_t vlen;
+            uint64_t lease;             // token of the process filling a LOADING entry
+            uint32_t state;
+            uint32_t reserved;
+        } ShmBucket;
+
+        int32_t Find(const string& key, uint64_t hash, string* value);
+
+        // Stores key under the stripe lock. With onlyIfAbsent nothing is
+        // replaced and false is returned when a live entry exists. A LOADING
+        // entry records lease; a USED entry with a lease only replaces the
+        // LOADING entry holding that lease.
+        bool Store(const string& key, const char* data, size_t len, uint64_t ttlUs, uint32_t state, bool onlyIfAbsent, uint64_t lease);
+
+        // Drops key, or with a lease only the LOADING entry holding it.
+        bool Remove(const string& key, uint64_t lease);
+
+        uint64_t NewLease();
+
+        bool LockStripe(uint64_t hash);
+
+        void UnlockStripe(uint64_t hash);
+
+        bool LockBucket(ShmBucket* bucket, bool wait);
+
+        void UnlockBucket(ShmBucket* bucket);
+
+        bool KeyEqual(const ShmBucket* bucket, uint64_t hash, const string& key) const;
+
+        // Drops the bucket's entry; the bucket must be locked.
+        void ReleaseBucket(ShmBucket* bucket);
+
+        uint32_t Alloc(uint32_t cls);
+
+        void Free(uint32_t cls, uint32_t block);
+
+        uint32_t Evict(uint32_t cls);
+
+        char* BlockAt(uint32_t block) const;
+
+    private:
+        int32_t mFd;
+        void* mBase;
+        size_t mSize;
+        ShmHeader* mHeader;
+        ShmBucket* mBuckets;
+        char* mSlab;
+        uint32_t mBlockCount;
+        ShmCacheOption mOption;
+    };
+
+}
+
+#endif
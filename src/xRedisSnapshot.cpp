@@ -0,0 +1,460 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <map>
+#include "xRedisSnapshot.h"
+#include "xRedisRoute.h"
+#include "xRedisUtil.h"
+#include "xRedisZeroCopy.h"
+
+using namespace xrcp;
+
+#define SNAPSHOT_MAGIC "XRSNAP02"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_HEADER_LEN 24      // magic, u64 export ms, u32 slice, u32 slice count
+#define SNAPSHOT_MANIFEST_MAGIC "XRSNAPMF"
+#define SNAPSHOT_MANIFEST_LEN 20    // magic, u64 export ms, u32 slice count
+#define SNAPSHOT_RECORD_HEAD_LEN 16 // u32 key len, u32 payload len, i64 ttl ms
+#define SNAPSHOT_DEFAULT_BATCH 512
+#define SNAPSHOT_FILE_BUFFER (1024 * 1024)
+
+static uint64_t GetWallClockMs() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + (uint64_t) tv.tv_usec / 1000;
+}
+
+// Flushes fp down to the disk and closes it.
+static bool SyncClose(FILE* fp) {
+    bool bRet = (0 == fflush(fp)) && (0 == fsync(fileno(fp)));
+    return (0 == fclose(fp)) && bRet;
+}
+
+// Makes a rename into path's directory durable.
+static bool SyncParentDir(const string& path) {
+    size_t pos = path.rfind('/');
+    string dir = (string::npos == pos) ? "." : ((0 == pos) ? "/" : path.substr(0, pos));
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool bRet = (0 == fsync(fd));
+    close(fd);
+    return bRet;
+}
+
+static void PutLE32(char* p, uint32_t v) {
+    for (int32_t i = 0; i < 4; ++i) {
+        p[i] = (char) (v >> (8 * i));
+    }
+}
+
+static void PutLE64(char* p, uint64_t v) {
+    for (int32_t i = 0; i < 8; ++i) {
+        p[i] = (char) (v >> (8 * i));
+    }
+}
+
+static uint32_t GetLE32(const char* p) {
+    uint32_t v = 0;
+    for (int32_t i = 3; i >= 0; --i) {
+        v = (v << 8) | (uint8_t) p[i];
+    }
+    return v;
+}
+
+static uint64_t GetLE64(const char* p) {
+    uint64_t v = 0;
+    for (int32_t i = 7; i >= 0; --i) {
+        v = (v << 8) | (uint8_t) p[i];
+    }
+    return v;
+}
+
+static string SnapshotPath(const char* prefix, uint32_t sliceIndex) {
+    string path(prefix);
+    path += ".";
+    path += toString(sliceIndex);
+    return path;
+}
+
+static string ManifestPath(const char* prefix) {
+    string path(prefix);
+    path += ".manifest";
+    return path;
+}
+
+// Reads exactly len bytes from the start of path.
+static bool ReadHead(const string& path, char* buf, size_t len) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (NULL == fp)
+        return false;
+    bool bRet = (1 == fread(buf, len, 1, fp));
+    fclose(fp);
+    return bRet;
+}
+
+xRedisSnapshot::xRedisSnapshot(xRedisClient* client) {
+    mClient = client;
+}
+
+xRedisSnapshot::~xRedisSnapshot() {
+}
+
+void xRedisSnapshot::MergeStats(SnapshotStats& total, const SnapshotStats& part) {
+    total.keys += part.keys;
+    total.bytes += part.bytes;
+    total.expired += part.expired;
+    total.existing += part.existing;
+    total.failed += part.failed;
+    total.files += part.files;
+}
+
+bool xRedisSnapshot::Export(const SnapshotOption& option, const char* prefix, SnapshotStats& stats) {
+    memset(&stats, 0, sizeof(stats));
+    if ((NULL == mClient) || (NULL == prefix))
+        return false;
+
+    uint32_t sliceCount = mClient->GetRedisPool()->GetSliceCount(option.nodeIndex);
+    if (0 == sliceCount)
+        return false;
+
+    // Files of an unfinished export must not pair with an older manifest.
+    string manifest = ManifestPath(prefix);
+    if ((0 != unlink(manifest.c_str())) && (ENOENT != errno))
+        return false;
+
+    uint64_t exportMs = GetWallClockMs();
+    std::vector<SnapshotTask> vTasks(sliceCount);
+    std::vector<void*> vArgs;
+    for (uint32_t i = 0; i < sliceCount; ++i) {
+        SnapshotTask& task = vTasks[i];
+        task.snapshot = this;
+        task.option = &option;
+        task.path = SnapshotPath(prefix, i);
+        task.sliceIndex = i;
+        task.sliceCount = sliceCount;
+        task.exportMs = exportMs;
+        memset(&task.stats, 0, sizeof(task.stats));
+        task.ok = false;
+        vArgs.push_back(&task);
+    }
+    RunParallel(ExportWorker, vArgs, (option.threads > 0) ? option.threads : 1);
+
+    bool bRet = true;
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        MergeStats(stats, vTasks[i].stats);
+        bRet = bRet && vTasks[i].ok;
+    }
+    if (!bRet)
+        return false;
+
+    char szManifest[SNAPSHOT_MANIFEST_LEN];
+    memcpy(szManifest, SNAPSHOT_MANIFEST_MAGIC, SNAPSHOT_MAGIC_LEN);
+    PutLE64(szManifest + 8, exportMs);
+    PutLE32(szManifest + 16, sliceCount);
+    string tmp = manifest + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (NULL == fp)
+        return false;
+    bRet = (1 == fwrite(szManifest, sizeof(szManifest), 1, fp));
+    bRet = SyncClose(fp) && bRet;
+    bRet = bRet && (0 == rename(tmp.c_str(), manifest.c_str()));
+    if (!bRet) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return SyncParentDir(manifest);
+}
+
+void xRedisSnapshot::ExportWorker(void* arg) {
+    SnapshotTask* pTask = static_cast<SnapshotTask*>(arg);
+    pTask->ok = pTask->snapshot->ExportSlice(pTask);
+}
+
+bool xRedisSnapshot::ExportSlice(SnapshotTask* task) {
+    const SnapshotOption& option = *task->option;
+    uint32_t batch = (option.batch > 0) ? option.batch : SNAPSHOT_DEFAULT_BATCH;
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+
+    string tmp = task->path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (NULL == fp)
+        return false;
+    std::vector<char> vFileBuf(SNAPSHOT_FILE_BUFFER);
+    setvbuf(fp, &vFileBuf[0], _IOFBF, vFileBuf.size());
+
+    char szHead[SNAPSHOT_HEADER_LEN];
+    memcpy(szHead, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    PutLE64(szHead + 8, task->exportMs);
+    PutLE32(szHead + 16, task->sliceIndex);
+    PutLE32(szHead + 20, task->sliceCount);
+    bool bRet = (1 == fwrite(szHead, sizeof(szHead), 1, fp));
+
+    int64_t cursor = 0;
+    do {
+        VDATA vCmdData;
+        vCmdData.push_back("SCAN");
+        vCmdData.push_back(toString(cursor));
+        if (!option.pattern.empty()) {
+            vCmdData.push_back("MATCH");
+            vCmdData.push_back(option.pattern);
+        }
+        vCmdData.push_back("COUNT");
+        vCmdData.push_back(toString(batch));
+
+        RedisConn* pRedisConn = pRedisPool->GetConnection(option.nodeIndex, task->sliceIndex, SLAVE);
+        if (NULL == pRedisConn) {
+            bRet = false;
+            break;
+        }
+
+        redisReply* reply = RedisCommandArgv(pRedisConn, vCmdData);
+        if ((NULL == reply) || (REDIS_REPLY_ARRAY != reply->type) || (2 != reply->elements)) {
+            RedisPool::FreeReply(reply);
+            pRedisPool->FreeConnection(pRedisConn);
+            bRet = false;
+            break;
+        }
+        cursor = atoll(reply->element[0]->str);
+
+        // DUMP and PTTL of the whole SCAN page in one round trip.
+        redisReply* keys = reply->element[1];
+        std::vector<VDATA> vCmds;
+        for (size_t i = 0; i < keys->elements; ++i) {
+            VDATA vDump;
+            vDump.push_back("DUMP");
+            vDump.push_back(string(keys->element[i]->str, keys->element[i]->len));
+            vCmds.push_back(vDump);
+            VDATA vTtl;
+            vTtl.push_back("PTTL");
+            vTtl.push_back(vDump[1]);
+            vCmds.push_back(vTtl);
+        }
+        std::vector<redisReply*> vReplies;
+        bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+        if (!bRet)
+            pRedisConn->RedisReConnect();
+        pRedisPool->FreeConnection(pRedisConn);
+
+        for (size_t i = 0; bRet && (i < keys->elements); ++i) {
+            const redisReply* key = keys->element[i];
+            const redisReply* dump = vReplies[i * 2];
+            const redisReply* ttl = vReplies[i * 2 + 1];
+            if ((REDIS_REPLY_STRING != dump->type) || (REDIS_REPLY_INTEGER != ttl->type) || (-2 == ttl->integer)) {
+                task->stats.expired++;
+                continue;
+            }
+
+            char szRecord[SNAPSHOT_RECORD_HEAD_LEN];
+            PutLE32(szRecord, (uint32_t) key->len);
+            PutLE32(szRecord + 4, (uint32_t) dump->len);
+            PutLE64(szRecord + 8, (uint64_t) ((ttl->integer > 0) ? ttl->integer : 0));
+            bRet = (1 == fwrite(szRecord, sizeof(szRecord), 1, fp)) &&
+                   ((size_t) key->len == fwrite(key->str, 1, key->len, fp)) &&
+                   ((size_t) dump->len == fwrite(dump->str, 1, dump->len, fp));
+            if (bRet) {
+                task->stats.keys++;
+                task->stats.bytes += dump->len;
+            }
+        }
+        FreeReplies(vReplies);
+        RedisPool::FreeReply(reply);
+    } while (bRet && (0 != cursor));
+
+    bRet = SyncClose(fp) && bRet;
+    if (bRet) {
+        bRet = (0 == rename(tmp.c_str(), task->path.c_str())) && SyncParentDir(task->path);
+        task->stats.files = 1;
+    } else {
+        unlink(tmp.c_str());
+    }
+    return bRet;
+}
+
+bool xRedisSnapshot::Import(const SnapshotOption& option, const char* prefix, SnapshotStats& stats) {
+    memset(&stats, 0, sizeof(stats));
+    if ((NULL == mClient) || (NULL == prefix) || (NULL == option.fun))
+        return false;
+
+    char szManifest[SNAPSHOT_MANIFEST_LEN];
+    if (!ReadHead(ManifestPath(prefix), szManifest, sizeof(szManifest)) ||
+        (0 != memcmp(szManifest, SNAPSHOT_MANIFEST_MAGIC, SNAPSHOT_MAGIC_LEN)))
+        return false;
+    uint64_t exportMs = GetLE64(szManifest + 8);
+    uint32_t sliceCount = GetLE32(szManifest + 16);
+    if ((0 == sliceCount) || (sliceCount > MAX_REDIS_SLICE_COUNT))
+        return false;
+
+    // Every file is checked before anything is restored.
+    std::vector<SnapshotTask> vTasks(sliceCount);
+    for (uint32_t i = 0; i < sliceCount; ++i) {
+        SnapshotTask& task = vTasks[i];
+        task.snapshot = this;
+        task.option = &option;
+        task.path = SnapshotPath(prefix, i);
+        task.sliceIndex = i;
+        task.sliceCount = sliceCount;
+        task.exportMs = exportMs;
+        memset(&task.stats, 0, sizeof(task.stats));
+        task.ok = false;
+
+        char szHead[SNAPSHOT_HEADER_LEN];
+        if (!ReadHead(task.path, szHead, sizeof(szHead)) || !CheckHeader(szHead, task))
+            return false;
+    }
+
+    std::vector<void*> vArgs;
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        vArgs.push_back(&vTasks[i]);
+    }
+    RunParallel(ImportWorker, vArgs, (option.threads > 0) ? option.threads : 1);
+
+    bool bRet = true;
+    for (size_t i = 0; i < vTasks.size(); ++i) {
+        MergeStats(stats, vTasks[i].stats);
+        bRet = bRet && vTasks[i].ok;
+    }
+    return bRet && (0 == stats.failed);
+}
+
+bool xRedisSnapshot::CheckHeader(const char* head, const SnapshotTask& task) {
+    return (0 == memcmp(head, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN)) && (task.exportMs == GetLE64(head + 8)) &&
+           (task.sliceIndex == GetLE32(head + 16)) && (task.sliceCount == GetLE32(head + 20));
+}
+
+void xRedisSnapshot::ImportWorker(void* arg) {
+    SnapshotTask* pTask = static_cast<SnapshotTask*>(arg);
+    pTask->ok = pTask->snapshot->ImportFile(pTask);
+}
+
+bool xRedisSnapshot::ImportFile(SnapshotTask* task) {
+    const SnapshotOption& option = *task->option;
+    uint32_t batch = (option.batch > 0) ? option.batch : SNAPSHOT_DEFAULT_BATCH;
+
+    xRedisMappedFile file;
+    if (!file.Open(task->path.c_str()) || (file.GetSize() < SNAPSHOT_HEADER_LEN))
+        return false;
+
+    const char* p = file.GetData();
+    const char* end = p + file.GetSize();
+    if (!CheckHeader(p, *task))
+        return false;
+
+    uint64_t nowMs = GetWallClockMs();
+    int64_t elapsed = (nowMs > task->exportMs) ? (int64_t) (nowMs - task->exportMs) : 0;
+    p += SNAPSHOT_HEADER_LEN;
+
+    bool bRet = true;
+    std::vector<SnapshotRecord> vRecords;
+    vRecords.reserve(batch);
+    while (bRet && (p < end)) {
+        if (end - p < SNAPSHOT_RECORD_HEAD_LEN) {
+            bRet = false;   // truncated file
+            break;
+        }
+        SnapshotRecord record;
+        record.keyLen = GetLE32(p);
+        record.payloadLen = GetLE32(p + 4);
+        record.ttl = (int64_t) GetLE64(p + 8);
+        p += SNAPSHOT_RECORD_HEAD_LEN;
+        if ((uint64_t) (end - p) < (uint64_t) record.keyLen + record.payloadLen) {
+            bRet = false;
+            break;
+        }
+        record.key = p;
+        record.payload = p + record.keyLen;
+        p += record.keyLen + record.payloadLen;
+
+        if (record.ttl > 0) {
+            record.ttl -= elapsed;
+            if (record.ttl <= 0) {
+                task->stats.expired++;
+                continue;
+            }
+        }
+
+        vRecords.push_back(record);
+        if (vRecords.size() >= batch)
+            bRet = RestoreBatch(option, vRecords, task->stats);
+    }
+    if (bRet && !vRecords.empty())
+        bRet = RestoreBatch(option, vRecords, task->stats);
+
+    task->stats.files = 1;
+    return bRet;
+}
+
+bool xRedisSnapshot::RestoreBatch(const SnapshotOption& option, std::vector<SnapshotRecord>& vRecords, SnapshotStats& stats) {
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    std::map<uint32_t, std::vector<size_t> > mGroups;
+    for (size_t i = 0; i < vRecords.size(); ++i) {
+        // HASHFUN wants a terminated key.
+        string key(vRecords[i].key, vRecords[i].keyLen);
+        uint32_t sliceIndex = 0;
+        if (!xRedisRoute::Locate(pRedisPool, option.nodeIndex, key.c_str(), option.fun, sliceIndex)) {
+            vRecords.clear();
+            return false;
+        }
+        mGroups[sliceIndex].push_back(i);
+    }
+
+    bool bRet = true;
+    for (std::map<uint32_t, std::vector<size_t> >::iterator iter = mGroups.begin(); bRet && (iter != mGroups.end()); ++iter) {
+        const std::vector<size_t>& vIdx = iter->second;
+        RedisConn* pRedisConn = pRedisPool->GetConnection(option.nodeIndex, iter->first, MASTER);
+        if (NULL == pRedisConn) {
+            stats.failed += vIdx.size();
+            bRet = false;
+            break;
+        }
+
+        redisContext* ctx = pRedisConn->getCtx();
+        for (size_t i = 0; bRet && (i < vIdx.size()); ++i) {
+            const SnapshotRecord& record = vRecords[vIdx[i]];
+            string ttl = toString(record.ttl);
+            const char* argv[5] = {"RESTORE", record.key, ttl.c_str(), record.payload, "REPLACE"};
+            size_t argvlen[5] = {7, record.keyLen, ttl.size(), record.payloadLen, 7};
+            bRet = (REDIS_OK == redisAppendCommandArgv(ctx, option.replace ? 5 : 4, argv, argvlen));
+        }
+
+        for (size_t i = 0; bRet && (i < vIdx.size()); ++i) {
+            void* p = NULL;
+            if (REDIS_OK != redisGetReply(ctx, &p)) {
+                bRet = false;
+                break;
+            }
+            redisReply* reply = static_cast<redisReply*>(p);
+            if (REDIS_REPLY_STATUS == reply->type) {
+                stats.keys++;
+                stats.bytes += vRecords[vIdx[i]].payloadLen;
+                if (xRedisWriteObserver::IsActive()) {
+                    const char* argv[2] = {"RESTORE", vRecords[vIdx[i]].key};
+                    size_t argvlen[2] = {7, vRecords[vIdx[i]].keyLen};
+                    xRedisWriteObserver::Notify(option.nodeIndex, iter->first, 2, argv, argvlen);
+                }
+            } else if ((REDIS_REPLY_ERROR == reply->type) && (0 == strncmp(reply->str, "BUSYKEY", 7))) {
+                stats.existing++;
+            } else {
+                stats.failed++;
+            }
+            RedisPool::FreeReply(reply);
+        }
+
+        if (!bRet)
+            pRedisConn->RedisReConnect();
+        pRedisPool->FreeConnection(pRedisConn);
+    }
+
+    vRecords.clear();
+    return bRet;
+}
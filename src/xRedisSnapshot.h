@@ -0,0 +1,103 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_SNAPSHOT_H_
+#define _XREDIS_SNAPSHOT_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef struct _SNAPSHOT_OPTION_ {
+        uint32_t nodeIndex;     // exported node, or the node to import into
+        HASHFUN fun;            // import: key hash of the target node
+        std::string pattern;    // export: SCAN MATCH filter, empty for every key
+        uint32_t batch;         // keys per SCAN COUNT and per pipelined write
+        uint32_t threads;       // files written or replayed in parallel
+        bool replace;           // import: overwrite keys that already exist
+    } SnapshotOption;
+
+    typedef struct _SNAPSHOT_STATS_ {
+        uint64_t keys;          // keys written to file / restored
+        uint64_t bytes;         // DUMP payload bytes
+        uint64_t expired;       // expired before they could be written
+        uint64_t existing;      // import: kept because the key already existed
+        uint64_t failed;        // import: rejected by RESTORE or lost with their connection
+        uint32_t files;
+    } SnapshotStats;
+
+    // Dumps a node into one file per slice, "<prefix>.<slice>", and replays
+    // such files into any node whatever its slice count: each key is routed
+    // again with the target's HASHFUN and placement.
+    //
+    // A file is a header {"XRSNAP02", export time in ms, slice, slice count}
+    // followed by records {key length, payload length, remaining TTL in ms
+    // (0 for none), key, DUMP payload}, integers little-endian. Once every
+    // file is synced to disk, "<prefix>.manifest" {"XRSNAPMF", export time in ms,
+    // slice count} is written; until then the export can't be imported.
+    // Import maps each file and hands key and payload to hiredis straight
+    // from the mapping. Remaining TTLs are reduced by the time elapsed since
+    // export.
+    class xRedisSnapshot {
+    public:
+        explicit xRedisSnapshot(xRedisClient* client);
+
+        ~xRedisSnapshot();
+
+        bool Export(const SnapshotOption& option, const char* prefix, SnapshotStats& stats);
+
+        // Replays exactly the files listed by "<prefix>.manifest". Fails
+        // before restoring anything if one is missing or belongs to another
+        // export, e.g. a leftover of an earlier export with more slices.
+        // Returns false as well when some keys could not be restored; the
+        // others are kept and stats.failed counts the rest.
+        bool Import(const SnapshotOption& option, const char* prefix, SnapshotStats& stats);
+
+    private:
+        typedef struct _SNAPSHOT_TASK_ {
+            xRedisSnapshot* snapshot;
+            const SnapshotOption* option;
+            std::string path;
+            uint32_t sliceIndex;
+            uint32_t sliceCount;
+            uint64_t exportMs;
+            SnapshotStats stats;
+            bool ok;
+        } SnapshotTask;
+
+        typedef struct _SNAPSHOT_RECORD_ {
+            const char* key;
+            uint32_t keyLen;
+            const char* payload;
+            uint32_t payloadLen;
+            int64_t ttl;
+        } SnapshotRecord;
+
+        static void ExportWorker(void* arg);
+
+        static void ImportWorker(void* arg);
+
+        bool ExportSlice(SnapshotTask* task);
+
+        bool ImportFile(SnapshotTask* task);
+
+        // Reads the header of an export file and checks it against task.
+        static bool CheckHeader(const char* head, const SnapshotTask& task);
+
+        bool RestoreBatch(const SnapshotOption& option, std::vector<SnapshotRecord>& vRecords, SnapshotStats& stats);
+
+        static void MergeStats(SnapshotStats& total, const SnapshotStats& part);
+
+    private:
+        xRedisClient* mClient;
+    };
+
+}
+
+#endif
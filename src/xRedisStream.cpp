@@ -0,0 +1,180 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisStream.h"
+#include "xRedisResp3.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+typedef struct _STREAM_ELEM_CTX_ {
+    ELEMFUN fun;
+    void* privdata;
+    bool nil;
+} StreamElemCtx;
+
+typedef struct _STREAM_PAIR_CTX_ {
+    PAIRFUN pairFun;
+    SCOREFUN scoreFun;
+    void* privdata;
+    std::string field;  // the first half must outlive a buffer compaction
+    bool haveField;
+    bool nil;
+} StreamPairCtx;
+
+xRedisStream::xRedisStream(xRedisClient* client) : mReply(client) {
+}
+
+xRedisStream::~xRedisStream() {
+}
+
+bool xRedisStream::OnElement(const RespToken& token, void* privdata) {
+    StreamElemCtx* pCtx = static_cast<StreamElemCtx*>(privdata);
+    if (0 == token.depth) {
+        if (REDIS_REPLY_NIL == token.type)
+            pCtx->nil = true;
+        return true;
+    }
+
+    if (REDIS_REPLY_NIL == token.type)
+        return pCtx->fun(NULL, 0, pCtx->privdata);
+    if ((REDIS_REPLY_INTEGER == token.type) || (REDIS_REPLY_BOOL == token.type)) {
+        std::string str = toString(token.integer);
+        return pCtx->fun(str.data(), str.size(), pCtx->privdata);
+    }
+    if (NULL == token.str)
+        return true;    // nested aggregate header
+    return pCtx->fun(token.str, token.len, pCtx->privdata);
+}
+
+bool xRedisStream::OnPair(const RespToken& token, void* privdata) {
+    StreamPairCtx* pCtx = static_cast<StreamPairCtx*>(privdata);
+    if (0 == token.depth) {
+        if (REDIS_REPLY_NIL == token.type)
+            pCtx->nil = true;
+        return true;
+    }
+
+    // RESP3 nests WITHSCORES pairs as two-element arrays; skip the headers.
+    if ((REDIS_REPLY_ARRAY == token.type) && (NULL == token.str))
+        return true;
+
+    if (!pCtx->haveField) {
+        pCtx->field.assign((NULL != token.str) ? token.str : "", token.len);
+        pCtx->haveField = true;
+        return true;
+    }
+    pCtx->haveField = false;
+
+    if (NULL != pCtx->scoreFun) {
+        double score = 0;
+        if (REDIS_REPLY_INTEGER == token.type) {
+            score = (double) token.integer;
+        } else if (NULL != token.str) {
+            std::string str(token.str, token.len);
+            score = strtod(str.c_str(), NULL);
+        }
+        return pCtx->scoreFun(pCtx->field.data(), pCtx->field.size(), score, pCtx->privdata);
+    }
+    return pCtx->pairFun(pCtx->field.data(), pCtx->field.size(), token.str, token.len, pCtx->privdata);
+}
+
+bool xRedisStream::commandargv(const SliceIndex& index, uint32_t ioType, const VDATA& vData, ELEMFUN fun, void* privdata) {
+    if (NULL == fun) return false;
+    StreamElemCtx ctx;
+    ctx.fun = fun;
+    ctx.privdata = privdata;
+    ctx.nil = false;
+    return mReply.commandargv_tokens(index, ioType, vData, OnElement, &ctx) && !ctx.nil;
+}
+
+bool xRedisStream::StreamPairs(const SliceIndex& index, const VDATA& vData, PAIRFUN pairFun, SCOREFUN scoreFun, void* privdata) {
+    StreamPairCtx ctx;
+    ctx.pairFun = pairFun;
+    ctx.scoreFun = scoreFun;
+    ctx.privdata = privdata;
+    ctx.haveField = false;
+    ctx.nil = false;
+    return mReply.commandargv_tokens(index, SLAVE, vData, OnPair, &ctx) && !ctx.nil;
+}
+
+bool xRedisStream::lrange(const SliceIndex& index, const string& key, int64_t start, int64_t end, ELEMFUN fun, void* privdata) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("LRANGE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(start));
+    vCmdData.push_back(toString(end));
+    return commandargv(index, SLAVE, vCmdData, fun, privdata);
+}
+
+bool xRedisStream::smembers(const SliceIndex& index, const KEY& key, ELEMFUN fun, void* privdata) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("SMEMBERS");
+    vCmdData.push_back(key);
+    return commandargv(index, SLAVE, vCmdData, fun, privdata);
+}
+
+bool xRedisStream::hgetall(const SliceIndex& index, const string& key, PAIRFUN fun, void* privdata) {
+    if ((0 == key.length()) || (NULL == fun)) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("HGETALL");
+    vCmdData.push_back(key);
+    return StreamPairs(index, vCmdData, fun, NULL, privdata);
+}
+
+bool xRedisStream::zrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, ELEMFUN fun, void* privdata) {
+    if (0 == key.length()) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZRANGE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(start));
+    vCmdData.push_back(toString(end));
+    return commandargv(index, SLAVE, vCmdData, fun, privdata);
+}
+
+bool xRedisStream::zrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, SCOREFUN fun, void* privdata) {
+    if ((0 == key.length()) || (NULL == fun)) return false;
+    VDATA vCmdData;
+    vCmdData.push_back("ZRANGE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(start));
+    vCmdData.push_back(toString(end));
+    vCmdData.push_back("WITHSCORES");
+    return StreamPairs(index, vCmdData, NULL, fun, privdata);
+}
+
+bool xRedisStream::sort(const SliceIndex& index, const string& key, ELEMFUN fun, void* privdata, const char* by,
+                        LIMIT* limit, bool alpha, const FILEDS* get, const SORTODER order) {
+    static const char* sort_order[2] = {"ASC", "DESC"};
+    if (0 == key.length()) return false;
+
+    VDATA vCmdData;
+    vCmdData.push_back("SORT");
+    vCmdData.push_back(key);
+    if (NULL != by) {
+        vCmdData.push_back("BY");
+        vCmdData.push_back(by);
+    }
+    if (NULL != limit) {
+        vCmdData.push_back("LIMIT");
+        vCmdData.push_back(toString(limit->offset));
+        vCmdData.push_back(toString(limit->count));
+    }
+    if (alpha)
+        vCmdData.push_back("ALPHA");
+    if (NULL != get) {
+        for (FILEDS::const_iterator iter = get->begin(); iter != get->end(); ++iter) {
+            vCmdData.push_back("GET");
+            vCmdData.push_back(*iter);
+        }
+    }
+    vCmdData.push_back(sort_order[order]);
+    return commandargv(index, SLAVE, vCmdData, fun, privdata);
+}
@@ -0,0 +1,62 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_STREAM_H_
+#define _XREDIS_STREAM_H_
+
+#include "xRedisRespParser.h"
+
+namespace xrcp {
+
+    // Element callbacks. data is NULL for a nil element (e.g. SORT ... GET of
+    // a missing key) and is only valid during the call. Return false to stop;
+    // the rest of the reply is then discarded with the connection.
+    typedef bool (* ELEMFUN)(const char* data, size_t len, void* privdata);
+
+    typedef bool (* PAIRFUN)(const char* field, size_t flen, const char* value, size_t vlen, void* privdata);
+
+    typedef bool (* SCOREFUN)(const char* member, size_t len, double score, void* privdata);
+
+    // Collection reads that hand each element to a callback as it is parsed
+    // off the socket. At most one element plus one read chunk is buffered,
+    // whatever the size of the collection.
+    class xRedisStream {
+    public:
+        explicit xRedisStream(xRedisClient* client);
+
+        ~xRedisStream();
+
+        // Streams the elements of any command replying with a flat array.
+        bool commandargv(const SliceIndex& index, uint32_t ioType, const VDATA& vData, ELEMFUN fun, void* privdata);
+
+        bool lrange(const SliceIndex& index, const string& key, int64_t start, int64_t end, ELEMFUN fun, void* privdata);
+
+        bool smembers(const SliceIndex& index, const KEY& key, ELEMFUN fun, void* privdata);
+
+        bool hgetall(const SliceIndex& index, const string& key, PAIRFUN fun, void* privdata);
+
+        bool zrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, ELEMFUN fun, void* privdata);
+
+        bool zrange(const SliceIndex& index, const string& key, int32_t start, int32_t end, SCOREFUN fun, void* privdata);
+
+        bool sort(const SliceIndex& index, const string& key, ELEMFUN fun, void* privdata, const char* by = NULL, LIMIT* limit = NULL, bool alpha = false, const FILEDS* get = NULL, const SORTODER order = ASC);
+
+    private:
+        static bool OnElement(const RespToken& token, void* privdata);
+
+        static bool OnPair(const RespToken& token, void* privdata);
+
+        bool StreamPairs(const SliceIndex& index, const VDATA& vData, PAIRFUN pairFun, SCOREFUN scoreFun, void* privdata);
+
+    private:
+        xRedisFastReply mReply;
+    };
+
+}
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisTier.h"
+#include "xRedisHash.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#define TIER_DEFAULT_WIDTH (1 << 16)
+#define TIER_DEFAULT_DEPTH 4
+#define TIER_DEFAULT_THRESHOLD 8
+#define TIER_DEFAULT_FAST_TTL 300
+#define TIER_VERSION_SUFFIX ":xredis-tier-ver"
+#define TIER_VERSION_TTL_MS 600000
+
+// KEYS[1] key, KEYS[2] its version; ARGV[1] version read before the slow
+// tier, ARGV[2] value or DUMP payload, ARGV[3] TTL in ms. Stores only if no
+// write bumped the version since and the key is not already in the fast tier.
+static const char* gPromoteSetScript =
+        "if (redis.call('GET', KEYS[2]) or '') ~= ARGV[1] then return 0 end "
+        "if redis.call('SET', KEYS[1], ARGV[2], 'PX', ARGV[3], 'NX') then return 1 end "
+        "return 0";
+
+static const char* gPromoteRestoreScript =
+        "if (redis.call('GET', KEYS[2]) or '') ~= ARGV[1] then return 0 end "
+        "if redis.call('EXISTS', KEYS[1]) == 1 then return 2 end "
+        "redis.call('RESTORE', KEYS[1], ARGV[3], ARGV[2]) return 1";
+
+xRedisCountMin::xRedisCountMin() {
+    mTable = NULL;
+    mWidth = 0;
+    mDepth = 0;
+    mAgingInterval = 0;
+    mAdds = 0;
+}
+
+xRedisCountMin::~xRedisCountMin() {
+    delete[] mTable;
+}
+
+bool xRedisCountMin::Init(uint32_t width, uint32_t depth, uint64_t agingInterval) {
+    if ((0 == width) || (0 == depth) || (depth > 16) || (width > (1U << 30)))
+        return false;
+
+    mWidth = 1;
+    while (mWidth < width) {
+        mWidth <<= 1;
+    }
+    mDepth = depth;
+    mAgingInterval = (agingInterval > 0) ? agingInterval : (uint64_t) mWidth * 10;
+    mAdds = 0;
+
+    delete[] mTable;
+    mTable = new uint32_t[(size_t) mWidth * mDepth];
+    memset(mTable, 0, sizeof(uint32_t) * mWidth * mDepth);
+    return true;
+}
+
+uint32_t xRedisCountMin::Add(const char* key, size_t len) {
+    if (NULL == mTable)
+        return 0;
+
+    // Row i uses h1 + i * h2 (Kirsch-Mitzenmacher) from one 64-bit hash.
+    uint64_t h = xRedisHash::XXH64(key, len);
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    uint32_t estimate = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < mDepth; ++i) {
+        uint32_t* counter = &mTable[(size_t) i * mWidth + ((h1 + i * h2) & (mWidth - 1))];
+        uint32_t value = __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+        if (value < estimate)
+            estimate = value;
+    }
+
+    if (__sync_add_and_fetch(&mAdds, 1) >= mAgingInterval)
+        Age();
+    return estimate;
+}
+
+uint32_t xRedisCountMin::Estimate(const char* key, size_t len) const {
+    if (NULL == mTable)
+        return 0;
+
+    uint64_t h = xRedisHash::XXH64(key, len);
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    uint32_t estimate = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < mDepth; ++i) {
+        uint32_t value = __atomic_load_n(&mTable[(size_t) i * mWidth + ((h1 + i * h2) & (mWidth - 1))], __ATOMIC_RELAXED);
+        if (value < estimate)
+            estimate = value;
+    }
+    return estimate;
+}
+
+void xRedisCountMin::Age() {
+    XLOCK(mAgeLock);
+    if (mAdds < mAgingInterval)
+        return;     // another thread just aged the table
+    mAdds = 0;
+
+    size_t count = (size_t) mWidth * mDepth;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t value = __atomic_load_n(&mTable[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&mTable[i], value >> 1, __ATOMIC_RELAXED);
+    }
+}
+
+size_t xRedisCountMin::GetMemorySize() const {
+    return sizeof(uint32_t) * mWidth * mDepth;
+}
+
+xRedisTier::xRedisTier() {
+    mClient = NULL;
+    memset(&mOption, 0, sizeof(mOption));
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+xRedisTier::~xRedisTier() {
+}
+
+bool xRedisTier::Init(xRedisClient* client, const TierOption& option) {
+    if ((NULL == client) || (NULL == option.fun) || (option.fastNode == option.slowNode))
+        return false;
+
+    mOption = option;
+    if (0 == mOption.promoteThreshold)
+        mOption.promoteThreshold = TIER_DEFAULT_THRESHOLD;
+    if (0 == mOption.fastTtl)
+        mOption.fastTtl = TIER_DEFAULT_FAST_TTL;
+    if (!mSketch.Init((mOption.sketchWidth > 0) ? mOption.sketchWidth : TIER_DEFAULT_WIDTH,
+                      (mOption.sketchDepth > 0) ? mOption.sketchDepth : TIER_DEFAULT_DEPTH, mOption.agingInterval))
+        return false;
+
+    mClient = client;
+    return true;
+}
+
+bool xRedisTier::CreateIndex(SliceIndex& index, const string& key) {
+    return (NULL != mClient) && !key.empty() && index.Create(key.c_str(), mOption.fun);
+}
+
+int64_t xRedisTier::FastTtlMs(int64_t pttl) const {
+    int64_t ttl = (int64_t) mOption.fastTtl * 1000;
+    if ((pttl > 0) && (pttl < ttl))
+        ttl = pttl;
+    return ttl;
+}
+
+bool xRedisTier::ReadSlow(const SliceIndex& slowIndex, const char* cmd, const string& key, std::vector<redisReply*>& vReplies) {
+    std::vector<VDATA> vCmds(2);
+    vCmds[0].push_back(cmd);
+    vCmds[0].push_back(key);
+    vCmds[1].push_back("PTTL");
+    vCmds[1].push_back(key);
+
+    // From the master: a replica may not have the latest write yet.
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(slowIndex.mNodeIndex, slowIndex.mSliceIndex, MASTER);
+    if (NULL == pRedisConn)
+        return false;
+    bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+    if (!bRet)
+        pRedisConn->RedisReConnect();
+    pRedisPool->FreeConnection(pRedisConn);
+    return bRet;
+}
+
+int64_t xRedisTier::StoreFast(const SliceIndex& fastIndex, const char* script, const string& key, const string& version,
+                              const string& data, int64_t ttl) {
+    VDATA vCmdData;
+    vCmdData.push_back("EVAL");
+    vCmdData.push_back(script);
+    vCmdData.push_back("2");
+    vCmdData.push_back(key);
+    vCmdData.push_back(key + TIER_VERSION_SUFFIX);
+    vCmdData.push_back(version);
+    vCmdData.push_back(data);
+    vCmdData.push_back(toString(ttl));
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(fastIndex.mNodeIndex, fastIndex.mSliceIndex, MASTER);
+    if (NULL == pRedisConn)
+        return -1;
+    redisReply* reply = RedisCommandArgv(pRedisConn, vCmdData);
+    if (NULL == reply)
+        pRedisConn->RedisReConnect();
+    pRedisPool->FreeConnection(pRedisConn);
+
+    int64_t ret = ((NULL != reply) && (REDIS_REPLY_INTEGER == reply->type)) ? reply->integer : -1;
+    RedisPool::FreeReply(reply);
+    return ret;
+}
+
+bool xRedisTier::Invalidate(const SliceIndex& fastIndex, const string& key) {
+    string versionKey = key + TIER_VERSION_SUFFIX;
+    std::vector<VDATA> vCmds(3);
+    vCmds[0].push_back("INCR");
+    vCmds[0].push_back(versionKey);
+    vCmds[1].push_back("PEXPIRE");
+    vCmds[1].push_back(versionKey);
+    vCmds[1].push_back(toString(TIER_VERSION_TTL_MS));
+    vCmds[2].push_back("DEL");
+    vCmds[2].push_back(key);
+
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(fastIndex.mNodeIndex, fastIndex.mSliceIndex, MASTER);
+    if (NULL == pRedisConn)
+        return false;
+    std::vector<redisReply*> vReplies;
+    bool bRet = RedisPipelineArgv(pRedisConn, vCmds, vReplies);
+    if (!bRet)
+        pRedisConn->RedisReConnect();
+    pRedisPool->FreeConnection(pRedisConn);
+    for (size_t i = 0; bRet && (i < vReplies.size()); ++i) {
+        bRet = REDIS_REPLY_ERROR != vReplies[i]->type;
+    }
+    FreeReplies(vReplies);
+    return bRet;
+}
+
+bool xRedisTier::get(const string& key, string& value) {
+    SliceIndex fastIndex(mClient, mOption.fastNode);
+    SliceIndex slowIndex(mClient, mOption.slowNode);
+    if (!CreateIndex(fastIndex, key) || !CreateIndex(slowIndex, key))
+        return false;
+
+    bool hot = mSketch.Add(key.data(), key.size()) >= mOption.promoteThreshold;
+    if (mClient->get(fastIndex, key, value)) {
+        __sync_fetch_and_add(&mStats.fastHits, 1);
+        return true;
+    }
+
+    if (!hot) {
+        bool bRet = mClient->get(slowIndex, key, value);
+        __sync_fetch_and_add(bRet ? &mStats.slowHits : &mStats.misses, 1);
+        return bRet;
+    }
+
+    // Hot key missing from the fast tier: note its version, fetch value and
+    // TTL together and promote it unless a write came in between.
+    string version;
+    fastIndex.SetIOMaster();
+    mClient->get(fastIndex, key + TIER_VERSION_SUFFIX, version);
+
+    std::vector<redisReply*> vReplies;
+    if (!ReadSlow(slowIndex, "GET", key, vReplies))
+        return false;
+
+    bool bRet = REDIS_REPLY_STRING == vReplies[0]->type;
+    if (bRet) {
+        value.assign(vReplies[0]->str, vReplies[0]->len);
+        int64_t pttl = (REDIS_REPLY_INTEGER == vReplies[1]->type) ? vReplies[1]->integer : -1;
+        if ((-2 != pttl) && (1 == StoreFast(fastIndex, gPromoteSetScript, key, version, value, FastTtlMs(pttl))))
+            __sync_fetch_and_add(&mStats.promotions, 1);
+    }
+    __sync_fetch_and_add(bRet ? &mStats.slowHits : &mStats.misses, 1);
+    FreeReplies(vReplies);
+    return bRet;
+}
+
+bool xRedisTier::set(const string& key, const string& value, int32_t second) {
+    SliceIndex fastIndex(mClient, mOption.fastNode);
+    SliceIndex slowIndex(mClient, mOption.slowNode);
+    if (!CreateIndex(fastIndex, key) || !CreateIndex(slowIndex, key))
+        return false;
+
+    bool bRet = (second > 0) ? mClient->set(slowIndex, key, value.c_str(), (int32_t) value.size(), second)
+                             : mClient->set(slowIndex, key, value);
+
+    // Drop the fast copy after the slow write, never rewrite it: two writers
+    // could land there in the other order. A hot key is promoted again on
+    // its next read.
+    return Invalidate(fastIndex, key) && bRet;
+}
+
+bool xRedisTier::del(const string& key) {
+    SliceIndex fastIndex(mClient, mOption.fastNode);
+    SliceIndex slowIndex(mClient, mOption.slowNode);
+    if (!CreateIndex(fastIndex, key) || !CreateIndex(slowIndex, key))
+        return false;
+
+    bool bRet = mClient->del(slowIndex, key);
+    return Invalidate(fastIndex, key) && bRet;
+}
+
+bool xRedisTier::Promote(const string& key) {
+    SliceIndex fastIndex(mClient, mOption.fastNode);
+    SliceIndex slowIndex(mClient, mOption.slowNode);
+    if (!CreateIndex(fastIndex, key) || !CreateIndex(slowIndex, key))
+        return false;
+
+    string version;
+    fastIndex.SetIOMaster();
+    mClient->get(fastIndex, key + TIER_VERSION_SUFFIX, version);
+
+    std::vector<redisReply*> vReplies;
+    if (!ReadSlow(slowIndex, "DUMP", key, vReplies))
+        return false;
+
+    bool bRet = (REDIS_REPLY_STRING == vReplies[0]->type) && (REDIS_REPLY_INTEGER == vReplies[1]->type) && (-2 != vReplies[1]->integer);
+    if (bRet) {
+        // 2: already in the fast tier, at least as new as this copy.
+        int64_t ret = StoreFast(fastIndex, gPromoteRestoreScript, key, version, string(vReplies[0]->str, vReplies[0]->len),
+                                FastTtlMs(vReplies[1]->integer));
+        bRet = (1 == ret) || (2 == ret);
+        if (1 == ret)
+            __sync_fetch_and_add(&mStats.promotions, 1);
+    }
+    FreeReplies(vReplies);
+    return bRet;
+}
+
+uint32_t xRedisTier::GetEstimate(const string& key) const {
+    return mSketch.Estimate(key.data(), key.size());
+}
+
+void xRedisTier::GetStats(TierStats& stats) {
+    stats.fastHits = __atomic_load_n(&mStats.fastHits, __ATOMIC_RELAXED);
+    stats.slowHits = __atomic_load_n(&mStats.slowHits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&mStats.misses, __ATOMIC_RELAXED);
+    stats.promotions = __atomic_load_n(&mStats.promotions, __ATOMIC_RELAXED);
+}
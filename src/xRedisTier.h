@@ -0,0 +1,122 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_TIER_H_
+#define _XREDIS_TIER_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    // Count-min sketch of key frequency with periodic halving, so counts
+    // describe recent traffic. width * depth 32-bit counters, updated with
+    // relaxed atomics.
+    class xRedisCountMin {
+    public:
+        xRedisCountMin();
+
+        ~xRedisCountMin();
+
+        // width is rounded up to a power of two; every agingInterval adds all
+        // counters are halved.
+        bool Init(uint32_t width, uint32_t depth, uint64_t agingInterval);
+
+        // Counts one access and returns the new estimate.
+        uint32_t Add(const char* key, size_t len);
+
+        uint32_t Estimate(const char* key, size_t len) const;
+
+        void Age();
+
+        size_t GetMemorySize() const;
+
+    private:
+        uint32_t* mTable;
+        uint32_t mWidth;
+        uint32_t mDepth;
+        uint64_t mAgingInterval;
+        volatile uint64_t mAdds;
+        xLock mAgeLock;
+    };
+
+    typedef struct _TIER_OPTION_ {
+        uint32_t fastNode;          // small, expensive tier holding hot keys
+        uint32_t slowNode;          // large tier holding every key
+        HASHFUN fun;                // key hash, the same for both nodes
+        uint32_t promoteThreshold;  // estimated recent accesses to count as hot
+        uint32_t fastTtl;           // seconds a promoted copy lives without use
+        uint32_t sketchWidth;
+        uint32_t sketchDepth;
+        uint64_t agingInterval;     // sketch adds between halvings
+    } TierOption;
+
+    typedef struct _TIER_STATS_ {
+        uint64_t fastHits;
+        uint64_t slowHits;
+        uint64_t misses;
+        uint64_t promotions;
+    } TierStats;
+
+    // Two-tier string cache over two node groups. The slow tier holds the
+    // data; the fast tier holds copies of keys the sketch rates hot. Reads
+    // try the fast tier first and fall through. Promoted copies carry
+    // min(fastTtl, remaining TTL), so keys that cool off age out of the fast
+    // tier by themselves. Writes go to the slow tier, then drop the fast
+    // copy and bump a per-key version there. A promotion reads the version
+    // before the slow tier's master and stores its copy only if the version
+    // is unchanged and no copy exists, so it never replaces a newer value.
+    class xRedisTier {
+    public:
+        xRedisTier();
+
+        ~xRedisTier();
+
+        bool Init(xRedisClient* client, const TierOption& option);
+
+        bool get(const string& key, string& value);
+
+        // Both also fail when the fast copy could not be dropped, even if
+        // the slow tier took the write: the fast tier may still serve the
+        // old value until its TTL runs out.
+        bool set(const string& key, const string& value, int32_t second = 0);
+
+        bool del(const string& key);
+
+        // Copies any key type into the fast tier with DUMP/RESTORE.
+        bool Promote(const string& key);
+
+        uint32_t GetEstimate(const string& key) const;
+
+        void GetStats(TierStats& stats);
+
+    private:
+        bool CreateIndex(SliceIndex& index, const string& key);
+
+        int64_t FastTtlMs(int64_t pttl) const;
+
+        // cmd (GET or DUMP) and PTTL of key on the slow tier's master.
+        bool ReadSlow(const SliceIndex& slowIndex, const char* cmd, const string& key, std::vector<redisReply*>& vReplies);
+
+        // Runs a promote script on the fast tier's master; -1 on failure.
+        int64_t StoreFast(const SliceIndex& fastIndex, const char* script, const string& key, const string& version,
+                          const string& data, int64_t ttl);
+
+        // Bumps key's version and drops its fast copy.
+        bool Invalidate(const SliceIndex& fastIndex, const string& key);
+
+    private:
+        xRedisClient* mClient;
+        TierOption mOption;
+        xRedisCountMin mSketch;
+        TierStats mStats;
+    };
+
+}
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include "xRedisTransaction.h"
+#include "xRedisResp3.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+xRedisTransaction::xRedisTransaction(xRedisClient* client, const SliceIndex& index) {
+    mClient = client;
+    mNodeIndex = index.mNodeIndex;
+    mSliceIndex = index.mSliceIndex;
+    mConn = NULL;
+    mWatching = false;
+}
+
+xRedisTransaction::~xRedisTransaction() {
+    if (NULL != mConn) {
+        if (mWatching) {
+            VDATA vCmdData;
+            vCmdData.push_back("UNWATCH");
+            RedisPool::FreeReply(RedisCommandArgv(mConn, vCmdData));
+        }
+        mClient->GetRedisPool()->FreeConnection(mConn);
+        mConn = NULL;
+    }
+}
+
+bool xRedisTransaction::Pin() {
+    if (NULL != mConn)
+        return true;
+
+    if ((NULL == mClient) || (NULL == mClient->GetRedisPool())) {
+        mStrerr = GET_CONNECT_ERROR;
+        return false;
+    }
+
+    mConn = mClient->GetRedisPool()->GetConnection(mNodeIndex, mSliceIndex, MASTER);
+    if (NULL == mConn) {
+        mStrerr = GET_CONNECT_ERROR;
+        return false;
+    }
+    return true;
+}
+
+void xRedisTransaction::Reset() {
+    // The server side state (MULTI, WATCH) is unknown after a broken exchange.
+    mConn->RedisReConnect();
+    mWatching = false;
+}
+
+void xRedisTransaction::SetErrInfo(const redisReply* reply) {
+    if (NULL == reply)
+        mStrerr = CONNECT_CLOSED_ERROR;
+    else if (NULL != reply->str)
+        mStrerr.assign(reply->str, reply->len);
+    else
+        mStrerr.clear();
+}
+
+void xRedisTransaction::ToResult(const redisReply* reply, TxnResult& result) {
+    result.type = reply->type;
+    result.integer = reply->integer;
+    result.str.clear();
+    result.elements.clear();
+    if (NULL != reply->str)
+        result.str.assign(reply->str, reply->len);
+
+    for (size_t i = 0; i < reply->elements; i++) {
+        DataItem item;
+        item.type = reply->element[i]->type;
+        if (REDIS_REPLY_INTEGER == item.type)
+            item.str = toString(reply->element[i]->integer);
+        else
+            item.str.assign(reply->element[i]->str, reply->element[i]->len);
+        result.elements.push_back(item);
+    }
+}
+
+bool xRedisTransaction::watch(const KEYS& keys) {
+    if (keys.empty() || !Pin())
+        return false;
+
+    VDATA vCmdData;
+    vCmdData.push_back("WATCH");
+    vCmdData.insert(vCmdData.end(), keys.begin(), keys.end());
+
+    redisReply* reply = RedisCommandArgv(mConn, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply);
+    if (bRet)
+        mWatching = true;
+    else
+        SetErrInfo(reply);
+    if (NULL == reply)
+        Reset();
+
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisTransaction::unwatch() {
+    if (NULL == mConn)
+        return true;
+
+    VDATA vCmdData;
+    vCmdData.push_back("UNWATCH");
+    redisReply* reply = RedisCommandArgv(mConn, vCmdData);
+    bool bRet = RedisPool::CheckReply(reply);
+    if (!bRet)
+        SetErrInfo(reply);
+    if (NULL == reply)
+        Reset();
+    mWatching = false;
+
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisTransaction::call(const VDATA& vData, TxnResult& result) {
+    if (!Pin())
+        return false;
+
+    redisReply* reply = RedisCommandArgv(mConn, vData);
+    bool bRet = false;
+    if (NULL == reply) {
+        SetErrInfo(reply);
+        Reset();
+    } else if (REDIS_REPLY_ERROR == reply->type) {
+        SetErrInfo(reply);
+    } else {
+        ToResult(reply, result);
+        bRet = true;
+    }
+
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisTransaction::get(const string& key, string& value) {
+    VDATA vCmdData;
+    vCmdData.push_back("GET");
+    vCmdData.push_back(key);
+
+    TxnResult result;
+    if (!call(vCmdData, result) || (REDIS_REPLY_NIL == result.type))
+        return false;
+    value = result.str;
+    return true;
+}
+
+bool xRedisTransaction::hget(const string& key, const string& field, string& value) {
+    VDATA vCmdData;
+    vCmdData.push_back("HGET");
+    vCmdData.push_back(key);
+    vCmdData.push_back(field);
+
+    TxnResult result;
+    if (!call(vCmdData, result) || (REDIS_REPLY_NIL == result.type))
+        return false;
+    value = result.str;
+    return true;
+}
+
+void xRedisTransaction::queue(const VDATA& vData) {
+    if (!vData.empty())
+        mQueued.push_back(vData);
+}
+
+void xRedisTransaction::set(const string& key, const string& value) {
+    VDATA vCmdData;
+    vCmdData.push_back("SET");
+    vCmdData.push_back(key);
+    vCmdData.push_back(value);
+    queue(vCmdData);
+}
+
+void xRedisTransaction::setex(const string& key, int32_t seconds, const string& value) {
+    VDATA vCmdData;
+    vCmdData.push_back("SETEX");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(seconds));
+    vCmdData.push_back(value);
+    queue(vCmdData);
+}
+
+void xRedisTransaction::del(const string& key) {
+    VDATA vCmdData;
+    vCmdData.push_back("DEL");
+    vCmdData.push_back(key);
+    queue(vCmdData);
+}
+
+void xRedisTransaction::incrby(const string& key, int64_t by) {
+    VDATA vCmdData;
+    vCmdData.push_back("INCRBY");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(by));
+    queue(vCmdData);
+}
+
+void xRedisTransaction::expire(const string& key, uint32_t second) {
+    VDATA vCmdData;
+    vCmdData.push_back("EXPIRE");
+    vCmdData.push_back(key);
+    vCmdData.push_back(toString(second));
+    queue(vCmdData);
+}
+
+void xRedisTransaction::hset(const string& key, const string& field, const string& value) {
+    VDATA vCmdData;
+    vCmdData.push_back("HSET");
+    vCmdData.push_back(key);
+    vCmdData.push_back(field);
+    vCmdData.push_back(value);
+    queue(vCmdData);
+}
+
+void xRedisTransaction::hincrby(const string& key, const string& field, int64_t increment) {
+    VDATA vCmdData;
+    vCmdData.push_back("HINCRBY");
+    vCmdData.push_back(key);
+    vCmdData.push_back(field);
+    vCmdData.push_back(toString(increment));
+    queue(vCmdData);
+}
+
+void xRedisTransaction::hdel(const string& key, const string& field) {
+    VDATA vCmdData;
+    vCmdData.push_back("HDEL");
+    vCmdData.push_back(key);
+    vCmdData.push_back(field);
+    queue(vCmdData);
+}
+
+void xRedisTransaction::sadd(const string& key, const VALUES& vValue) {
+    VDATA vCmdData;
+    vCmdData.push_back("SADD");
+    vCmdData.push_back(key);
+    vCmdData.insert(vCmdData.end(), vValue.begin(), vValue.end());
+    queue(vCmdData);
+}
+
+void xRedisTransaction::srem(const string& key, const VALUES& vValue) {
+    VDATA vCmdData;
+    vCmdData.push_back("SREM");
+    vCmdData.push_back(key);
+    vCmdData.insert(vCmdData.end(), vValue.begin(), vValue.end());
+    queue(vCmdData);
+}
+
+void xRedisTransaction::zadd(const KEY& key, const VALUES& vValues) {
+    VDATA vCmdData;
+    vCmdData.push_back("ZADD");
+    vCmdData.push_back(key);
+    vCmdData.insert(vCmdData.end(), vValues.begin(), vValues.end());
+    queue(vCmdData);
+}
+
+void xRedisTransaction::lpush(const string& key, const VALUES& vValue) {
+    VDATA vCmdData;
+    vCmdData.push_back("LPUSH");
+    vCmdData.push_back(key);
+    vCmdData.insert(vCmdData.end(), vValue.begin(), vValue.end());
+    queue(vCmdData);
+}
+
+void xRedisTransaction::rpush(const string& key, const VALUES& vValue) {
+    VDATA vCmdData;
+    vCmdData.push_back("RPUSH");
+    vCmdData.push_back(key);
+    vCmdData.insert(vCmdData.end(), vValue.begin(), vValue.end());
+    queue(vCmdData);
+}
+
+size_t xRedisTransaction::GetQueuedCount() const {
+    return mQueued.size();
+}
+
+void xRedisTransaction::discard() {
+    mQueued.clear();
+}
+
+const char* xRedisTransaction::GetErrInfo() const {
+    return mStrerr.c_str();
+}
+
+bool xRedisTransaction::exec(TxnResults& results, bool& aborted) {
+    aborted = false;
+    if (!Pin())
+        return false;
+
+    redisContext* ctx = mConn->getCtx();
+    VDATA vMulti(1, "MULTI");
+    VDATA vExec(1, "EXEC");
+
+    // MULTI, the queued commands and EXEC go out in a single write.
+    std::vector<VDATA> vQueued;
+    vQueued.swap(mQueued);
+    size_t queued = vQueued.size();
+    bool bAppend = (REDIS_OK == RedisAppendCommandArgv(ctx, vMulti));
+    for (size_t i = 0; bAppend && (i < queued); ++i) {
+        bAppend = (REDIS_OK == RedisAppendCommandArgv(ctx, vQueued[i]));
+    }
+    bAppend = bAppend && (REDIS_OK == RedisAppendCommandArgv(ctx, vExec));
+    if (!bAppend) {
+        mStrerr = CONNECT_CLOSED_ERROR;
+        Reset();
+        return false;
+    }
+
+    // +OK for MULTI, +QUEUED or an error per command, then the EXEC reply.
+    bool bRet = true;
+    for (size_t i = 0; i < queued + 1; ++i) {
+        void* p = NULL;
+        if (REDIS_OK != redisGetReply(ctx, &p)) {
+            mStrerr = CONNECT_CLOSED_ERROR;
+            Reset();
+            return false;
+        }
+        redisReply* reply = static_cast<redisReply*>(p);
+        if (bRet && (REDIS_REPLY_ERROR == reply->type)) {
+            SetErrInfo(reply);
+            bRet = false;
+        }
+        RedisPool::FreeReply(reply);
+    }
+
+    void* p = NULL;
+    if (REDIS_OK != redisGetReply(ctx, &p)) {
+        mStrerr = CONNECT_CLOSED_ERROR;
+        Reset();
+        return false;
+    }
+
+    // EXEC always discards the watch list, whatever the outcome.
+    mWatching = false;
+    redisReply* execReply = static_cast<redisReply*>(p);
+    if ((REDIS_REPLY_ARRAY == execReply->type) && (execReply->elements == queued)) {
+        for (size_t i = 0; i < queued; ++i) {
+            xRedisResp3::ToResp2(execReply->element[i], vQueued[i][0].data(), vQueued[i][0].size());
+        }
+    }
+    if (REDIS_REPLY_ARRAY == execReply->type) {
+        for (size_t i = 0; xRedisWriteObserver::IsActive() && (i < queued); ++i) {
+            xRedisWriteObserver::Notify(mConn->GetNodeIndex(), mConn->getSliceIndex(), vQueued[i]);
+        }
+    }
+    if (REDIS_REPLY_NIL == execReply->type) {
+        aborted = true;
+        bRet = true;
+    } else if (REDIS_REPLY_ARRAY == execReply->type) {
+        results.resize(execReply->elements);
+        for (size_t i = 0; i < execReply->elements; i++) {
+            ToResult(execReply->element[i], results[i]);
+        }
+    } else {
+        // EXECABORT keeps the first queueing error as the message.
+        if (bRet)
+            SetErrInfo(execReply);
+        bRet = false;
+    }
+
+    RedisPool::FreeReply(execReply);
+    return bRet;
+}
+
+bool xRedisTransaction::Run(xRedisClient* client, const SliceIndex& index, const KEYS& watchKeys,
+                            TXNFUN fun, void* privdata, uint32_t maxRetries, TxnResults& results) {
+    if (NULL == fun)
+        return false;
+
+    xRedisTransaction txn(client, index);
+    for (uint32_t attempt = 0; attempt <= maxRetries; ++attempt) {
+        if (!watchKeys.empty() && !txn.watch(watchKeys))
+            break;
+
+        if (!fun(txn, privdata)) {
+            txn.discard();
+            txn.unwatch();
+            break;
+        }
+
+        bool aborted = false;
+        results.clear();
+        if (!txn.exec(results, aborted))
+            break;
+        if (!aborted)
+            return true;
+    }
+
+    const_cast<SliceIndex&>(index).SetErrInfo(txn.GetErrInfo(), ::strlen(txn.GetErrInfo()));
+    return false;
+}
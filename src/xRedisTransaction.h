@@ -0,0 +1,119 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_TRANSACTION_H_
+#define _XREDIS_TRANSACTION_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    typedef struct _TXN_RESULT_ {
+        int32_t type;           // REDIS_REPLY_*
+        int64_t integer;
+        std::string str;
+        ArrayReply elements;
+    } TxnResult;
+
+    typedef std::vector<TxnResult> TxnResults;
+
+    class xRedisTransaction;
+
+    // Body of an optimistic transaction: read the watched keys through txn,
+    // queue the writes and return true, or return false to give up.
+    typedef bool (* TXNFUN)(xRedisTransaction& txn, void* privdata);
+
+    // MULTI/EXEC on one master connection of a slice. The connection is pinned
+    // from the first command until the object is destroyed, so WATCH, the reads
+    // that follow it and EXEC all run on the same socket. Queued commands are
+    // sent together with MULTI and EXEC as one pipelined write.
+    class xRedisTransaction {
+    public:
+        xRedisTransaction(xRedisClient* client, const SliceIndex& index);
+
+        ~xRedisTransaction();
+
+        bool watch(const KEYS& keys);
+
+        bool unwatch();
+
+        // Immediate commands on the pinned connection, e.g. reading watched keys.
+        bool call(const VDATA& vData, TxnResult& result);
+
+        bool get(const string& key, string& value);
+
+        bool hget(const string& key, const string& field, string& value);
+
+        // Queued commands, sent on exec().
+        void queue(const VDATA& vData);
+
+        void set(const string& key, const string& value);
+
+        void setex(const string& key, int32_t seconds, const string& value);
+
+        void del(const string& key);
+
+        void incrby(const string& key, int64_t by);
+
+        void expire(const string& key, uint32_t second);
+
+        void hset(const string& key, const string& field, const string& value);
+
+        void hincrby(const string& key, const string& field, int64_t increment);
+
+        void hdel(const string& key, const string& field);
+
+        void sadd(const string& key, const VALUES& vValue);
+
+        void srem(const string& key, const VALUES& vValue);
+
+        void zadd(const KEY& key, const VALUES& vValues);
+
+        void lpush(const string& key, const VALUES& vValue);
+
+        void rpush(const string& key, const VALUES& vValue);
+
+        size_t GetQueuedCount() const;
+
+        // Runs the queued commands. On success results holds one entry per
+        // queued command. aborted is set when a watched key changed and
+        // nothing was executed.
+        bool exec(TxnResults& results, bool& aborted);
+
+        void discard();
+
+        const char* GetErrInfo() const;
+
+        // WATCH keys, run fun, EXEC; repeat while a watched key changed,
+        // at most maxRetries extra times.
+        static bool Run(xRedisClient* client, const SliceIndex& index, const KEYS& watchKeys,
+                        TXNFUN fun, void* privdata, uint32_t maxRetries, TxnResults& results);
+
+    private:
+        bool Pin();
+
+        void Reset();
+
+        void SetErrInfo(const redisReply* reply);
+
+        static void ToResult(const redisReply* reply, TxnResult& result);
+
+    private:
+        xRedisClient* mClient;
+        uint32_t mNodeIndex;
+        uint32_t mSliceIndex;
+        RedisConn* mConn;
+        std::vector<VDATA> mQueued;
+        bool mWatching;
+        std::string mStrerr;
+    };
+
+}
+
+#endif
@@ -0,0 +1,561 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <set>
+#include "xRedisUtil.h"
+#include "xRedisResp3.h"
+
+using namespace xrcp;
+
+enum {
+    WRITE_KEY1 = 1,     // argv[1]
+    WRITE_KEY2,         // argv[2]: RENAME src dst, BITOP op dst
+    WRITE_PAIRS,        // argv[1], argv[3]...: MSET
+    WRITE_NUMKEYS,      // argv[3] .. argv[3 + argv[2]]: EVAL
+    WRITE_STORE,        // the argument after STORE/STOREDIST: SORT
+    WRITE_MKSTREAM      // argv[2] of XGROUP CREATE ... MKSTREAM
+};
+
+typedef struct _WRITE_RULE_ {
+    const char* name;
+    uint32_t rule;
+} WriteRule;
+
+// Sorted by name for WriteRuleOf().
+static const WriteRule gWriteRules[] = {
+        {"APPEND",            WRITE_KEY1},
+        {"BITFIELD",          WRITE_KEY1},
+        {"BITOP",             WRITE_KEY2},
+        {"BLMOVE",            WRITE_KEY2},
+        {"BRPOPLPUSH",        WRITE_KEY2},
+        {"COPY",              WRITE_KEY2},
+        {"DECR",              WRITE_KEY1},
+        {"DECRBY",            WRITE_KEY1},
+        {"EVAL",              WRITE_NUMKEYS},
+        {"EVALSHA",           WRITE_NUMKEYS},
+        {"FCALL",             WRITE_NUMKEYS},
+        {"GEOADD",            WRITE_KEY1},
+        {"GEORADIUS",         WRITE_STORE},
+        {"GEORADIUSBYMEMBER", WRITE_STORE},
+        {"GEOSEARCHSTORE",    WRITE_KEY1},
+        {"GETSET",            WRITE_KEY1},
+        {"HINCRBY",           WRITE_KEY1},
+        {"HINCRBYFLOAT",      WRITE_KEY1},
+        {"HMSET",             WRITE_KEY1},
+        {"HSET",              WRITE_KEY1},
+        {"HSETNX",            WRITE_KEY1},
+        {"INCR",              WRITE_KEY1},
+        {"INCRBY",            WRITE_KEY1},
+        {"INCRBYFLOAT",       WRITE_KEY1},
+        {"LMOVE",             WRITE_KEY2},
+        {"LPUSH",             WRITE_KEY1},
+        {"MSET",              WRITE_PAIRS},
+        {"MSETNX",            WRITE_PAIRS},
+        {"PFADD",             WRITE_KEY1},
+        {"PFMERGE",           WRITE_KEY1},
+        {"PSETEX",            WRITE_KEY1},
+        {"RENAME",            WRITE_KEY2},
+        {"RENAMENX",          WRITE_KEY2},
+        {"RESTORE",           WRITE_KEY1},
+        {"RPOPLPUSH",         WRITE_KEY2},
+        {"RPUSH",             WRITE_KEY1},
+        {"SADD",              WRITE_KEY1},
+        {"SDIFFSTORE",        WRITE_KEY1},
+        {"SET",               WRITE_KEY1},
+        {"SETBIT",            WRITE_KEY1},
+        {"SETEX",             WRITE_KEY1},
+        {"SETNX",             WRITE_KEY1},
+        {"SETRANGE",          WRITE_KEY1},
+        {"SINTERSTORE",       WRITE_KEY1},
+        {"SMOVE",             WRITE_KEY2},
+        {"SORT",              WRITE_STORE},
+        {"SUNIONSTORE",       WRITE_KEY1},
+        {"XADD",              WRITE_KEY1},
+        {"XGROUP",            WRITE_MKSTREAM},
+        {"ZADD",              WRITE_KEY1},
+        {"ZDIFFSTORE",        WRITE_KEY1},
+        {"ZINCRBY",           WRITE_KEY1},
+        {"ZINTERSTORE",       WRITE_KEY1},
+        {"ZRANGESTORE",       WRITE_KEY1},
+        {"ZUNIONSTORE",       WRITE_KEY1}
+};
+
+typedef struct _WRITE_OBSERVER_ {
+    WRITEFUN fun;
+    void* privdata;
+} WriteObserver;
+
+static std::vector<WriteObserver> gWriteObservers;
+static pthread_rwlock_t gWriteObserverLock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile uint32_t gWriteObserverCount = 0;
+
+typedef struct _CONN_OBSERVER_ {
+    CONNFUN fun;
+    void* privdata;
+} ConnObserver;
+
+static std::vector<ConnObserver> gConnObservers;
+static pthread_rwlock_t gConnObserverLock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile uint32_t gConnObserverCount = 0;
+
+static uint32_t WriteRuleOf(const char* name, size_t len) {
+    // Binary search; reads miss after a handful of compares.
+    size_t low = 0;
+    size_t high = sizeof(gWriteRules) / sizeof(gWriteRules[0]);
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        const char* rule = gWriteRules[mid].name;
+        size_t ruleLen = ::strlen(rule);
+        int32_t cmp = strncasecmp(name, rule, (len < ruleLen) ? len : ruleLen);
+        if (0 == cmp)
+            cmp = (len < ruleLen) ? -1 : ((len > ruleLen) ? 1 : 0);
+        if (0 == cmp)
+            return gWriteRules[mid].rule;
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return 0;
+}
+
+redisReply* xrcp::RedisCommandArgv(redisContext* ctx, const VDATA& vData) {
+    if ((NULL == ctx) || vData.empty())
+        return NULL;
+
+    vector<const char*> argv(vData.size());
+    vector<size_t> argvlen(vData.size());
+    uint32_t j = 0;
+    for (VDATA::const_iterator i = vData.begin(); i != vData.end(); ++i, ++j) {
+        argv[j] = i->c_str(), argvlen[j] = i->size();
+    }
+
+    return static_cast<redisReply*>(redisCommandArgv(ctx, static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0])));
+}
+
+int32_t xrcp::RedisAppendCommandArgv(redisContext* ctx, const VDATA& vData) {
+    if ((NULL == ctx) || vData.empty())
+        return REDIS_ERR;
+
+    vector<const char*> argv(vData.size());
+    vector<size_t> argvlen(vData.size());
+    uint32_t j = 0;
+    for (VDATA::const_iterator i = vData.begin(); i != vData.end(); ++i, ++j) {
+        argv[j] = i->c_str(), argvlen[j] = i->size();
+    }
+
+    return redisAppendCommandArgv(ctx, static_cast<int32_t>(argv.size()), &(argv[0]), &(argvlen[0]));
+}
+
+bool xrcp::RedisPipelineArgv(redisContext* ctx, const std::vector<VDATA>& vCmds, std::vector<redisReply*>& vReplies) {
+    vReplies.clear();
+    if (NULL == ctx)
+        return false;
+
+    for (size_t i = 0; i < vCmds.size(); ++i) {
+        if (REDIS_OK != RedisAppendCommandArgv(ctx, vCmds[i]))
+            return false;
+    }
+
+    vReplies.reserve(vCmds.size());
+    for (size_t i = 0; i < vCmds.size(); ++i) {
+        void* reply = NULL;
+        if (REDIS_OK != redisGetReply(ctx, &reply)) {
+            FreeReplies(vReplies);
+            return false;
+        }
+        vReplies.push_back(static_cast<redisReply*>(reply));
+    }
+    return true;
+}
+
+redisReply* xrcp::RedisCommandArgv(RedisConn* conn, const VDATA& vData) {
+    if (NULL == conn)
+        return NULL;
+    redisReply* reply = RedisCommandArgv(conn->getCtx(), vData);
+    if ((NULL != reply) && !vData.empty())
+        xRedisResp3::ToResp2(reply, vData[0].data(), vData[0].size());
+    xRedisWriteObserver::Notify(conn->GetNodeIndex(), conn->getSliceIndex(), vData);
+    return reply;
+}
+
+bool xrcp::RedisPipelineArgv(RedisConn* conn, const std::vector<VDATA>& vCmds, std::vector<redisReply*>& vReplies) {
+    if (NULL == conn) {
+        vReplies.clear();
+        return false;
+    }
+    bool bRet = RedisPipelineArgv(conn->getCtx(), vCmds, vReplies);
+    for (size_t i = 0; i < vReplies.size(); ++i) {
+        if (!vCmds[i].empty())
+            xRedisResp3::ToResp2(vReplies[i], vCmds[i][0].data(), vCmds[i][0].size());
+    }
+    for (size_t i = 0; xRedisWriteObserver::IsActive() && (i < vCmds.size()); ++i) {
+        xRedisWriteObserver::Notify(conn->GetNodeIndex(), conn->getSliceIndex(), vCmds[i]);
+    }
+    return bRet;
+}
+
+void xrcp::FreeReplies(std::vector<redisReply*>& vReplies) {
+    for (size_t i = 0; i < vReplies.size(); ++i) {
+        RedisPool::FreeReply(vReplies[i]);
+    }
+    vReplies.clear();
+}
+
+typedef struct _PARALLEL_CTX_ {
+    TASKFUN fun;
+    const std::vector<void*>* args;
+    volatile size_t next;
+} ParallelCtx;
+
+static void* ParallelWorker(void* arg) {
+    ParallelCtx* pCtx = static_cast<ParallelCtx*>(arg);
+    for (;;) {
+        size_t i = __sync_fetch_and_add(&pCtx->next, 1);
+        if (i >= pCtx->args->size())
+            break;
+        pCtx->fun((*pCtx->args)[i]);
+    }
+    return NULL;
+}
+
+void xrcp::RunParallel(TASKFUN fun, const std::vector<void*>& vArgs, uint32_t threads) {
+    ParallelCtx ctx;
+    ctx.fun = fun;
+    ctx.args = &vArgs;
+    ctx.next = 0;
+
+    if (threads > vArgs.size())
+        threads = (uint32_t) vArgs.size();
+
+    std::vector<pthread_t> vThreads;
+    for (uint32_t i = 1; i < threads; ++i) {
+        pthread_t tid;
+        if (0 == pthread_create(&tid, NULL, ParallelWorker, &ctx))
+            vThreads.push_back(tid);
+    }
+    ParallelWorker(&ctx);
+    for (size_t i = 0; i < vThreads.size(); ++i) {
+        pthread_join(vThreads[i], NULL);
+    }
+}
+
+xRedisTokenBucket::xRedisTokenBucket() {
+    mRate = 0;
+    mBurst = 0;
+    mTokens = 0;
+    mLastUs = 0;
+}
+
+void xRedisTokenBucket::Init(uint64_t ratePerSec, uint64_t burst) {
+    XLOCK(mLock);
+    mRate = ratePerSec;
+    mBurst = (burst > 0) ? burst : ratePerSec;
+    mTokens = (double) mBurst;
+    mLastUs = GetMonotonicUs();
+}
+
+void xRedisTokenBucket::Acquire(uint64_t n) {
+    uint64_t waitUs = 0;
+    {
+        XLOCK(mLock);
+        if (0 == mRate)
+            return;
+
+        uint64_t now = GetMonotonicUs();
+        mTokens += (double) (now - mLastUs) * (double) mRate / 1000000.0;
+        if (mTokens > (double) mBurst)
+            mTokens = (double) mBurst;
+        mLastUs = now;
+
+        mTokens -= (double) n;
+        if (mTokens < 0)
+            waitUs = (uint64_t) (-mTokens * 1000000.0 / (double) mRate);
+    }
+    if (waitUs > 0)
+        usleep((useconds_t) waitUs);
+}
+
+uint64_t xrcp::GetMonotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+}
+
+std::string xrcp::ToUpperCmd(const std::string& cmd) {
+    std::string upper(cmd);
+    for (size_t i = 0; i < upper.size(); ++i) {
+        if ((upper[i] >= 'a') && (upper[i] <= 'z'))
+            upper[i] = (char) (upper[i] - 'a' + 'A');
+    }
+    return upper;
+}
+
+static const char* gReadCommands[] = {
+        "GET", "MGET", "GETRANGE", "STRLEN", "EXISTS", "TTL", "PTTL", "TYPE", "GETBIT", "BITCOUNT",
+        "HGET", "HMGET", "HGETALL", "HKEYS", "HVALS", "HLEN", "HEXISTS", "HSTRLEN",
+        "LRANGE", "LINDEX", "LLEN",
+        "SMEMBERS", "SISMEMBER", "SCARD", "SRANDMEMBER", "SINTER", "SUNION", "SDIFF",
+        "ZRANGE", "ZREVRANGE", "ZRANGEBYSCORE", "ZREVRANGEBYSCORE", "ZRANGEBYLEX", "ZSCORE",
+        "ZRANK", "ZREVRANK", "ZCARD", "ZCOUNT", "ZLEXCOUNT", "ZMSCORE",
+        "PFCOUNT", "XRANGE", "XREVRANGE", "XLEN", NULL
+};
+
+static std::set<std::string> InitReadCommands() {
+    std::set<std::string> commands;
+    for (const char** p = gReadCommands; NULL != *p; ++p) {
+        commands.insert(*p);
+    }
+    return commands;
+}
+
+static const std::set<std::string> gReadSet = InitReadCommands();
+
+bool xrcp::IsReadCommand(const std::string& cmd) {
+    return gReadSet.end() != gReadSet.find(ToUpperCmd(cmd));
+}
+
+std::string xrcp::GetPeerName(redisContext* ctx) {
+    if ((NULL == ctx) || (ctx->fd < 0))
+        return "";
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (0 != getpeername(ctx->fd, (struct sockaddr*) &addr, &len))
+        return "";
+
+    char szHost[INET6_ADDRSTRLEN] = {0};
+    uint16_t port = 0;
+    if (AF_INET == addr.ss_family) {
+        struct sockaddr_in* in = (struct sockaddr_in*) &addr;
+        inet_ntop(AF_INET, &in->sin_addr, szHost, sizeof(szHost));
+        port = ntohs(in->sin_port);
+    } else if (AF_INET6 == addr.ss_family) {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*) &addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, szHost, sizeof(szHost));
+        port = ntohs(in6->sin6_port);
+    } else if (AF_UNIX == addr.ss_family) {
+        return ((struct sockaddr_un*) &addr)->sun_path;
+    } else {
+        return "";
+    }
+
+    std::string name(szHost);
+    name += ":";
+    name += toString(port);
+    return name;
+}
+
+void xRedisWriteObserver::Add(WRITEFUN fun, void* privdata) {
+    WriteObserver observer;
+    observer.fun = fun;
+    observer.privdata = privdata;
+    pthread_rwlock_wrlock(&gWriteObserverLock);
+    gWriteObservers.push_back(observer);
+    __atomic_store_n(&gWriteObserverCount, (uint32_t) gWriteObservers.size(), __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&gWriteObserverLock);
+}
+
+void xRedisWriteObserver::Remove(WRITEFUN fun, void* privdata) {
+    pthread_rwlock_wrlock(&gWriteObserverLock);
+    for (size_t i = 0; i < gWriteObservers.size(); ++i) {
+        if ((fun == gWriteObservers[i].fun) && (privdata == gWriteObservers[i].privdata)) {
+            gWriteObservers.erase(gWriteObservers.begin() + i);
+            break;
+        }
+    }
+    __atomic_store_n(&gWriteObserverCount, (uint32_t) gWriteObservers.size(), __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&gWriteObserverLock);
+}
+
+bool xRedisWriteObserver::IsActive() {
+    return 0 != __atomic_load_n(&gWriteObserverCount, __ATOMIC_ACQUIRE);
+}
+
+void xRedisWriteObserver::Notify(uint32_t nodeIndex, uint32_t sliceIndex, size_t argc, const char* const* argv, const size_t* argvlen) {
+    if (!IsActive() || (argc < 2))
+        return;
+    uint32_t rule = WriteRuleOf(argv[0], argvlen[0]);
+    if (0 == rule)
+        return;
+
+    // [first, last) step apart hold the keys.
+    size_t first = 1;
+    size_t last = 2;
+    size_t step = 1;
+    if (WRITE_KEY2 == rule) {
+        first = 2;
+        last = 3;
+    } else if (WRITE_PAIRS == rule) {
+        last = argc;
+        step = 2;
+    } else if (WRITE_NUMKEYS == rule) {
+        first = 3;
+        last = (argc > 2) ? 3 + (size_t) atoll(string(argv[2], argvlen[2]).c_str()) : 0;
+    } else if (WRITE_MKSTREAM == rule) {
+        // Only XGROUP CREATE ... MKSTREAM creates its key.
+        last = 0;
+        if ((argc > 5) && (6 == argvlen[1]) && (0 == strncasecmp(argv[1], "CREATE", 6))) {
+            for (size_t i = 5; i < argc; ++i) {
+                if ((8 == argvlen[i]) && (0 == strncasecmp(argv[i], "MKSTREAM", 8))) {
+                    first = 2;
+                    last = 3;
+                }
+            }
+        }
+    } else if (WRITE_STORE == rule) {
+        last = 0;
+        for (size_t i = 2; i + 1 < argc; ++i) {
+            if (((5 == argvlen[i]) && (0 == strncasecmp(argv[i], "STORE", 5))) ||
+                ((9 == argvlen[i]) && (0 == strncasecmp(argv[i], "STOREDIST", 9)))) {
+                first = i + 1;
+                last = i + 2;
+            }
+        }
+    }
+    if (last > argc)
+        last = argc;
+
+    pthread_rwlock_rdlock(&gWriteObserverLock);
+    for (size_t i = first; i < last; i += step) {
+        for (size_t j = 0; j < gWriteObservers.size(); ++j) {
+            gWriteObservers[j].fun(nodeIndex, sliceIndex, argv[i], argvlen[i], gWriteObservers[j].privdata);
+        }
+    }
+    pthread_rwlock_unlock(&gWriteObserverLock);
+}
+
+void xRedisWriteObserver::Notify(uint32_t nodeIndex, uint32_t sliceIndex, const VDATA& vData) {
+    if (!IsActive() || (vData.size() < 2) || (0 == WriteRuleOf(vData[0].data(), vData[0].size())))
+        return;
+
+    vector<const char*> argv(vData.size());
+    vector<size_t> argvlen(vData.size());
+    for (size_t i = 0; i < vData.size(); ++i) {
+        argv[i] = vData[i].data();
+        argvlen[i] = vData[i].size();
+    }
+    Notify(nodeIndex, sliceIndex, argv.size(), &argv[0], &argvlen[0]);
+}
+
+void xRedisWriteObserver::NotifyFormatted(uint32_t nodeIndex, uint32_t sliceIndex, const char* cmd, size_t len) {
+    if (!IsActive() || (NULL == cmd))
+        return;
+
+    // Point argv into the RESP form hiredis built: *N\r\n then $len\r\narg\r\n.
+    vector<const char*> argv;
+    vector<size_t> argvlen;
+    const char* p = strchr(cmd, '\n');
+    const char* end = cmd + len;
+    while ((NULL != p) && (p + 1 < end) && ('$' == p[1])) {
+        size_t argLen = (size_t) atoll(p + 2);
+        const char* arg = strchr(p + 1, '\n');
+        if ((NULL == arg) || (arg + 1 + argLen > end))
+            break;
+        if (argv.empty() && (0 == WriteRuleOf(arg + 1, argLen)))
+            return;
+        argv.push_back(arg + 1);
+        argvlen.push_back(argLen);
+        p = arg + 1 + argLen + 1;
+    }
+    if (!argv.empty())
+        Notify(nodeIndex, sliceIndex, argv.size(), &argv[0], &argvlen[0]);
+}
+
+static void FreeCommand(char* cmd) {
+#if defined(HIREDIS_MAJOR) && ((HIREDIS_MAJOR > 0) || (HIREDIS_MINOR >= 14))
+    redisFreeCommand(cmd);
+#else
+    free(cmd);
+#endif
+}
+
+void xRedisWriteObserver::NotifyFormat(uint32_t nodeIndex, uint32_t sliceIndex, const char* format, va_list args) {
+    if (!IsActive() || (NULL == format))
+        return;
+    size_t nameLen = strcspn(format, " ");
+    if ((0 == WriteRuleOf(format, nameLen)) || ('\0' == format[nameLen]))
+        return;
+
+    char* cmd = NULL;
+    int32_t len = redisvFormatCommand(&cmd, format, args);
+    if (len <= 0)
+        return;
+    NotifyFormatted(nodeIndex, sliceIndex, cmd, (size_t) len);
+    FreeCommand(cmd);
+}
+
+redisReply* xrcp::RedisvCommand(RedisConn* conn, const char* format, va_list args) {
+    if ((NULL == conn) || (NULL == format))
+        return NULL;
+
+    redisContext* ctx = conn->getCtx();
+    size_t nameLen = strcspn(format, " ");
+#if defined(HIREDIS_MAJOR) && ((HIREDIS_MAJOR > 0) || (HIREDIS_MINOR >= 13))
+    // What redisvCommand() does, keeping the formatted command for observers.
+    char* cmd = NULL;
+    int32_t len = redisvFormatCommand(&cmd, format, args);
+    if (len <= 0)
+        return NULL;
+    void* reply = NULL;
+    if ((REDIS_OK != redisAppendFormattedCommand(ctx, cmd, (size_t) len)) || (REDIS_OK != redisGetReply(ctx, &reply)))
+        reply = NULL;
+    xRedisResp3::ToResp2(static_cast<redisReply*>(reply), format, nameLen);
+    xRedisWriteObserver::NotifyFormatted(conn->GetNodeIndex(), conn->getSliceIndex(), cmd, (size_t) len);
+    FreeCommand(cmd);
+    return static_cast<redisReply*>(reply);
+#else
+    // No redisAppendFormattedCommand(): writes are formatted again.
+    va_list copy;
+    va_copy(copy, args);
+    redisReply* reply = static_cast<redisReply*>(redisvCommand(ctx, format, args));
+    xRedisResp3::ToResp2(reply, format, nameLen);
+    xRedisWriteObserver::NotifyFormat(conn->GetNodeIndex(), conn->getSliceIndex(), format, copy);
+    va_end(copy);
+    return reply;
+#endif
+}
+
+void xRedisConnObserver::Add(CONNFUN fun, void* privdata) {
+    ConnObserver observer;
+    observer.fun = fun;
+    observer.privdata = privdata;
+    pthread_rwlock_wrlock(&gConnObserverLock);
+    gConnObservers.push_back(observer);
+    __atomic_store_n(&gConnObserverCount, (uint32_t) gConnObservers.size(), __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&gConnObserverLock);
+}
+
+void xRedisConnObserver::Remove(CONNFUN fun, void* privdata) {
+    pthread_rwlock_wrlock(&gConnObserverLock);
+    for (size_t i = 0; i < gConnObservers.size(); ++i) {
+        if ((fun == gConnObservers[i].fun) && (privdata == gConnObservers[i].privdata)) {
+            gConnObservers.erase(gConnObservers.begin() + i);
+            break;
+        }
+    }
+    __atomic_store_n(&gConnObserverCount, (uint32_t) gConnObservers.size(), __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&gConnObserverLock);
+}
+
+void xRedisConnObserver::Notify(RedisConn* conn, uint32_t event) {
+    if ((NULL == conn) || (0 == __atomic_load_n(&gConnObserverCount, __ATOMIC_ACQUIRE)))
+        return;
+    pthread_rwlock_rdlock(&gConnObserverLock);
+    for (size_t i = 0; i < gConnObservers.size(); ++i) {
+        gConnObservers[i].fun(conn, event, gConnObservers[i].privdata);
+    }
+    pthread_rwlock_unlock(&gConnObserverLock);
+}
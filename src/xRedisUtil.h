@@ -0,0 +1,130 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_UTIL_H_
+#define _XREDIS_UTIL_H_
+
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    // Send a VDATA command on ctx and wait for its reply (blocking context).
+    redisReply* RedisCommandArgv(redisContext* ctx, const VDATA& vData);
+
+    // Append a VDATA command to the output buffer of ctx without flushing it.
+    int32_t RedisAppendCommandArgv(redisContext* ctx, const VDATA& vData);
+
+    // Append all commands, flush them in one write and read the replies in
+    // order. On failure the replies read so far are freed and false returned;
+    // the connection then has to be reconnected.
+    bool RedisPipelineArgv(redisContext* ctx, const std::vector<VDATA>& vCmds, std::vector<redisReply*>& vReplies);
+
+    void FreeReplies(std::vector<redisReply*>& vReplies);
+
+    // The same on a pool connection, reporting the command to
+    // xRedisWriteObserver once its reply is in.
+    redisReply* RedisCommandArgv(RedisConn* conn, const VDATA& vData);
+
+    bool RedisPipelineArgv(RedisConn* conn, const std::vector<VDATA>& vCmds, std::vector<redisReply*>& vReplies);
+
+    // A printf-style command as given to redisvCommand(), formatted once;
+    // observers get their keys out of the formatted buffer.
+    redisReply* RedisvCommand(RedisConn* conn, const char* format, va_list args);
+
+    // Called with each key a write may have created, after the reply.
+    typedef void (* WRITEFUN)(uint32_t nodeIndex, uint32_t sliceIndex, const char* key, size_t len, void* privdata);
+
+    // Process-wide observers of key-creating writes. Every xRedisClient
+    // command and every module command sent through the RedisConn helpers
+    // above is reported: the key of SET, HSET, SADD, LPUSH, INCR, RESTORE...,
+    // the destination of RENAME, COPY, SMOVE, BITOP and *STORE, every key of
+    // MSET, the KEYS of EVAL/EVALSHA and the stream of XGROUP CREATE ...
+    // MKSTREAM. Costs one load per command while no observer is registered.
+    class xRedisWriteObserver {
+    public:
+        static void Add(WRITEFUN fun, void* privdata);
+
+        static void Remove(WRITEFUN fun, void* privdata);
+
+        static bool IsActive();
+
+        static void Notify(uint32_t nodeIndex, uint32_t sliceIndex, size_t argc, const char* const* argv, const size_t* argvlen);
+
+        static void Notify(uint32_t nodeIndex, uint32_t sliceIndex, const VDATA& vData);
+
+        // A command in the RESP form redisvFormatCommand() builds.
+        static void NotifyFormatted(uint32_t nodeIndex, uint32_t sliceIndex, const char* cmd, size_t len);
+
+        // A printf-style command, formatted here only if it is a write; for
+        // hiredis without redisAppendFormattedCommand().
+        static void NotifyFormat(uint32_t nodeIndex, uint32_t sliceIndex, const char* format, va_list args);
+    };
+
+    enum {
+        CONN_EVENT_CONNECTED = 1,
+        CONN_EVENT_IDLE = 2
+    };
+
+    typedef void (* CONNFUN)(RedisConn* conn, uint32_t event, void* privdata);
+
+    // Process-wide observers of pool connections. CONN_EVENT_CONNECTED is
+    // reported after every successful connect or reconnect, including the
+    // ones KeepAlive() makes, CONN_EVENT_IDLE for every healthy idle
+    // connection each KeepAlive(); masters and slaves alike. The connection
+    // is not in use by anyone else while the observer runs, which may send
+    // commands on it but must not reconnect or return it to the pool.
+    class xRedisConnObserver {
+    public:
+        static void Add(CONNFUN fun, void* privdata);
+
+        static void Remove(CONNFUN fun, void* privdata);
+
+        static void Notify(RedisConn* conn, uint32_t event);
+    };
+
+    typedef void (* TASKFUN)(void* arg);
+
+    // Runs fun(arg) for every arg on up to threads threads (the caller's
+    // included) and returns when all have finished.
+    void RunParallel(TASKFUN fun, const std::vector<void*>& vArgs, uint32_t threads);
+
+    // Token bucket shared by worker threads. A rate of 0 disables limiting.
+    class xRedisTokenBucket {
+    public:
+        xRedisTokenBucket();
+
+        void Init(uint64_t ratePerSec, uint64_t burst);
+
+        // Takes n tokens, sleeping while the bucket is in debt.
+        void Acquire(uint64_t n);
+
+    private:
+        xLock mLock;
+        uint64_t mRate;
+        uint64_t mBurst;
+        double mTokens;
+        uint64_t mLastUs;
+    };
+
+    // Monotonic clock in microseconds.
+    uint64_t GetMonotonicUs();
+
+    // Upper-case ASCII copy of a command name.
+    std::string ToUpperCmd(const std::string& cmd);
+
+    // Whether cmd only reads keys, so it may go to a replica or be shadowed.
+    bool IsReadCommand(const std::string& cmd);
+
+    // "host:port" of the server at the other end of ctx, by address so
+    // aliases of one server compare equal; empty when unknown.
+    std::string GetPeerName(redisContext* ctx);
+
+}
+
+#endif
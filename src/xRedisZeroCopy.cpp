@@ -0,0 +1,262 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "xRedisZeroCopy.h"
+#include "xRedisUtil.h"
+
+using namespace xrcp;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+xRedisMappedFile::xRedisMappedFile() {
+    mData = NULL;
+    mSize = 0;
+}
+
+xRedisMappedFile::~xRedisMappedFile() {
+    Close();
+}
+
+bool xRedisMappedFile::Open(const char* path) {
+    Close();
+    if (NULL == path)
+        return false;
+
+    int32_t fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if ((0 != fstat(fd, &st)) || (st.st_size <= 0)) {
+        close(fd);
+        return false;
+    }
+
+    void* p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == p)
+        return false;
+
+    madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+    mData = p;
+    mSize = (size_t) st.st_size;
+    return true;
+}
+
+void xRedisMappedFile::Close() {
+    if (NULL != mData) {
+        munmap(mData, mSize);
+        mData = NULL;
+        mSize = 0;
+    }
+}
+
+const char* xRedisMappedFile::GetData() const {
+    return static_cast<const char*>(mData);
+}
+
+size_t xRedisMappedFile::GetSize() const {
+    return mSize;
+}
+
+xRedisZeroCopy::xRedisZeroCopy(xRedisClient* client) {
+    mClient = client;
+}
+
+xRedisZeroCopy::~xRedisZeroCopy() {
+}
+
+void xRedisZeroCopy::AppendBulk(std::string& out, const char* data, size_t len) {
+    char szBuf[32];
+    int32_t n = snprintf(szBuf, sizeof(szBuf), "$%zu\r\n", len);
+    out.append(szBuf, (size_t) n);
+    out.append(data, len);
+    out.append("\r\n", 2);
+}
+
+bool xRedisZeroCopy::SendAll(int32_t fd, struct iovec* iov, int32_t iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t) ((iovcnt > IOV_MAX) ? IOV_MAX : iovcnt);
+
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            return false;
+        }
+
+        // Skip what was written, possibly stopping inside an iovec.
+        size_t written = (size_t) n;
+        while ((iovcnt > 0) && (written >= iov->iov_len)) {
+            written -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+rReply* xRedisZeroCopy::commandiov(const SliceIndex& index, const VDATA& vHead, const struct iovec* iov, int32_t iovcnt, const VDATA& vTail) {
+    if ((NULL == mClient) || vHead.empty() || (iovcnt < 0))
+        return NULL;
+
+    size_t valueLen = 0;
+    for (int32_t i = 0; i < iovcnt; ++i) {
+        valueLen += iov[i].iov_len;
+    }
+
+    // Only the protocol framing and the small arguments are formatted; the
+    // value bytes stay where the caller keeps them.
+    std::string head;
+    char szBuf[32];
+    int32_t n = snprintf(szBuf, sizeof(szBuf), "*%zu\r\n", vHead.size() + 1 + vTail.size());
+    head.append(szBuf, (size_t) n);
+    for (VDATA::const_iterator iter = vHead.begin(); iter != vHead.end(); ++iter) {
+        AppendBulk(head, iter->data(), iter->size());
+    }
+    n = snprintf(szBuf, sizeof(szBuf), "$%zu\r\n", valueLen);
+    head.append(szBuf, (size_t) n);
+
+    std::string tail("\r\n");
+    for (VDATA::const_iterator iter = vTail.begin(); iter != vTail.end(); ++iter) {
+        AppendBulk(tail, iter->data(), iter->size());
+    }
+
+    std::vector<struct iovec> vIov;
+    vIov.reserve((size_t) iovcnt + 2);
+    struct iovec frame;
+    frame.iov_base = const_cast<char*>(head.data());
+    frame.iov_len = head.size();
+    vIov.push_back(frame);
+    for (int32_t i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > 0)
+            vIov.push_back(iov[i]);
+    }
+    frame.iov_base = const_cast<char*>(tail.data());
+    frame.iov_len = tail.size();
+    vIov.push_back(frame);
+
+    uint32_t ioType = MASTER;
+    if (index.mIOFlag)
+        ioType = index.mIOtype;
+    RedisPool* pRedisPool = mClient->GetRedisPool();
+    RedisConn* pRedisConn = pRedisPool->GetConnection(index.mNodeIndex, index.mSliceIndex, ioType);
+    if (NULL == pRedisConn) {
+        const_cast<SliceIndex&>(index).SetErrInfo(GET_CONNECT_ERROR, ::strlen(GET_CONNECT_ERROR));
+        return NULL;
+    }
+
+    redisContext* ctx = pRedisConn->getCtx();
+    redisReply* reply = NULL;
+
+    // Anything hiredis still buffers must reach the socket first.
+    int32_t done = 0;
+    bool bRet = true;
+    while (bRet && !done) {
+        bRet = (REDIS_OK == redisBufferWrite(ctx, &done));
+    }
+
+    if (bRet && SendAll(ctx->fd, &vIov[0], (int32_t) vIov.size())) {
+        void* p = NULL;
+        if (REDIS_OK == redisGetReply(ctx, &p))
+            reply = static_cast<redisReply*>(p);
+    }
+
+    xRedisWriteObserver::Notify(index.mNodeIndex, index.mSliceIndex, vHead);
+    if (NULL == reply) {
+        // A partial frame may be on the wire, the stream can't be reused.
+        const_cast<SliceIndex&>(index).SetErrInfo(CONNECT_CLOSED_ERROR, ::strlen(CONNECT_CLOSED_ERROR));
+        pRedisConn->RedisReConnect();
+    } else if (REDIS_REPLY_ERROR == reply->type) {
+        const_cast<SliceIndex&>(index).SetErrInfo(reply->str, static_cast<size_t>(reply->len));
+    }
+
+    pRedisPool->FreeConnection(pRedisConn);
+    return reply;
+}
+
+bool xRedisZeroCopy::CommandStatus(const SliceIndex& index, const VDATA& vHead, const struct iovec* iov, int32_t iovcnt, const VDATA& vTail) {
+    redisReply* reply = commandiov(index, vHead, iov, iovcnt, vTail);
+    bool bRet = RedisPool::CheckReply(reply);
+    if (bRet && (REDIS_REPLY_STRING == reply->type)) {
+        if (!reply->len || !reply->str || strcasecmp(reply->str, "OK") != 0)
+            bRet = false;
+    }
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisZeroCopy::CommandInteger(const SliceIndex& index, const VDATA& vHead, const struct iovec* iov, int32_t iovcnt, int64_t& retval) {
+    redisReply* reply = commandiov(index, vHead, iov, iovcnt, VDATA());
+    bool bRet = RedisPool::CheckReply(reply);
+    if (bRet)
+        retval = reply->integer;
+    RedisPool::FreeReply(reply);
+    return bRet;
+}
+
+bool xRedisZeroCopy::set(const SliceIndex& index, const string& key, const char* value, size_t len, int32_t second) {
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(value);
+    iov.iov_len = len;
+    return set(index, key, &iov, 1, second);
+}
+
+bool xRedisZeroCopy::set(const SliceIndex& index, const string& key, const struct iovec* iov, int32_t iovcnt, int32_t second) {
+    if (0 == key.length()) return false;
+
+    VDATA vHead;
+    vHead.push_back("SET");
+    vHead.push_back(key);
+
+    VDATA vTail;
+    if (second > 0) {
+        vTail.push_back("EX");
+        vTail.push_back(toString(second));
+    }
+    return CommandStatus(index, vHead, iov, iovcnt, vTail);
+}
+
+bool xRedisZeroCopy::set(const SliceIndex& index, const string& key, const xRedisMappedFile& file, int32_t second) {
+    if (NULL == file.GetData()) return false;
+    return set(index, key, file.GetData(), file.GetSize(), second);
+}
+
+bool xRedisZeroCopy::append(const SliceIndex& index, const string& key, const struct iovec* iov, int32_t iovcnt, int64_t& length) {
+    if (0 == key.length()) return false;
+
+    VDATA vHead;
+    vHead.push_back("APPEND");
+    vHead.push_back(key);
+    return CommandInteger(index, vHead, iov, iovcnt, length);
+}
+
+bool xRedisZeroCopy::hset(const SliceIndex& index, const string& key, const string& field, const struct iovec* iov, int32_t iovcnt, int64_t& retval) {
+    if (0 == key.length()) return false;
+
+    VDATA vHead;
+    vHead.push_back("HSET");
+    vHead.push_back(key);
+    vHead.push_back(field);
+    return CommandInteger(index, vHead, iov, iovcnt, retval);
+}
@@ -0,0 +1,77 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _XREDIS_ZEROCOPY_H_
+#define _XREDIS_ZEROCOPY_H_
+
+#include <sys/uio.h>
+#include <redis/xredis/xRedisClient.h>
+#include <redis/xredis/xRedisPool.h>
+
+namespace xrcp {
+
+    // Read-only memory map of a file, usable as a value buffer.
+    class xRedisMappedFile {
+    public:
+        xRedisMappedFile();
+
+        ~xRedisMappedFile();
+
+        bool Open(const char* path);
+
+        void Close();
+
+        const char* GetData() const;
+
+        size_t GetSize() const;
+
+    private:
+        void* mData;
+        size_t mSize;
+    };
+
+    // Write commands whose value is sent straight from caller memory with
+    // sendmsg(), without copying it into a VDATA string or the hiredis output
+    // buffer. All calls are synchronous: once one returns the kernel holds its
+    // own copy of the bytes, so the caller may reuse or unmap the buffer.
+    class xRedisZeroCopy {
+    public:
+        explicit xRedisZeroCopy(xRedisClient* client);
+
+        ~xRedisZeroCopy();
+
+        // Sends vHead, then one bulk argument gathered from iov, then vTail.
+        // Caller owns the reply and frees it with RedisPool::FreeReply().
+        rReply* commandiov(const SliceIndex& index, const VDATA& vHead, const struct iovec* iov, int32_t iovcnt, const VDATA& vTail);
+
+        bool set(const SliceIndex& index, const string& key, const char* value, size_t len, int32_t second = 0);
+
+        bool set(const SliceIndex& index, const string& key, const struct iovec* iov, int32_t iovcnt, int32_t second = 0);
+
+        bool set(const SliceIndex& index, const string& key, const xRedisMappedFile& file, int32_t second = 0);
+
+        bool append(const SliceIndex& index, const string& key, const struct iovec* iov, int32_t iovcnt, int64_t& length);
+
+        bool hset(const SliceIndex& index, const string& key, const string& field, const struct iovec* iov, int32_t iovcnt, int64_t& retval);
+
+    private:
+        static void AppendBulk(std::string& out, const char* data, size_t len);
+
+        static bool SendAll(int32_t fd, struct iovec* iov, int32_t iovcnt);
+
+        bool CommandStatus(const SliceIndex& index, const VDATA& vHead, const struct iovec* iov, int32_t iovcnt, const VDATA& vTail);
+
+        bool CommandInteger(const SliceIndex& index, const VDATA& vHead, const struct iovec* iov, int32_t iovcnt, int64_t& retval);
+
+    private:
+        xRedisClient* mClient;
+    };
+
+}
+
+#endif
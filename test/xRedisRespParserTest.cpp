@@ -0,0 +1,349 @@
+/*
+ * ----------------------------------------------------------------------------
+ * Copyright (c) 2013-2014, Leiwenbin
+ * All rights reserved.
+ * Distributed under GPL license.
+ * ----------------------------------------------------------------------------
+ */
+
+// Fuzz equivalence of RespReader against hiredis's reader, then a parse
+// benchmark of both.
+//
+//   xRedisRespParserTest [rounds] [bench elements]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "xRedisRespParser.h"
+#include "xRedisResp3.h"
+
+using namespace xrcp;
+
+typedef struct _FLAT_TOKEN_ {
+    int32_t type;
+    int64_t integer;
+    std::string str;
+    uint32_t depth;
+
+    bool operator==(const struct _FLAT_TOKEN_& other) const {
+        return (type == other.type) && (integer == other.integer) && (str == other.str) && (depth == other.depth);
+    }
+} FlatToken;
+
+typedef std::vector<FlatToken> FLATTOKENS;
+
+static uint64_t gSeed = 88172645463325252ULL;
+
+static uint32_t Rand(uint32_t n) {
+    gSeed ^= gSeed << 13;
+    gSeed ^= gSeed >> 7;
+    gSeed ^= gSeed << 17;
+    return (uint32_t) (gSeed % n);
+}
+
+static uint64_t NowUs() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static std::string RandBytes(uint32_t maxLen, bool binary) {
+    static const char chars[] = "abcxyz0189-_:\r\n";
+    uint32_t len = Rand(maxLen + 1);
+    std::string s;
+    for (uint32_t i = 0; i < len; ++i) {
+        s += binary ? chars[Rand(sizeof(chars) - 1)] : chars[Rand(sizeof(chars) - 3)];
+    }
+    return s;
+}
+
+static std::string RandInteger() {
+    static const int64_t samples[] = {0, 1, -1, 9, 12345678, 123456789, -987654321012LL,
+                                      9223372036854775807LL, -9223372036854775807LL};
+    char buf[32];
+    int64_t v = (Rand(2) != 0) ? samples[Rand(sizeof(samples) / sizeof(samples[0]))] : (int64_t) Rand(100000000) - 50000000;
+    snprintf(buf, sizeof(buf), "%lld", (long long) v);
+    return buf;
+}
+
+// One random reply in RESP, at most depth levels of aggregates.
+static void RandReply(std::string& out, uint32_t depth, bool resp3) {
+    // 0-5 and 7-11 are scalars, 6, 12 and 13 aggregates.
+    static const uint32_t aggregates[] = {6, 12, 13};
+    uint32_t kind = 0;
+    if ((depth > 0) && (0 == Rand(3))) {
+        kind = aggregates[Rand(resp3 ? 3 : 1)];
+    } else {
+        kind = Rand(resp3 ? 11 : 6);
+        if (kind >= 6)
+            ++kind;
+    }
+    char head[48];
+    switch (kind) {
+        case 0:
+            out += "+" + RandBytes(12, false) + "\r\n";
+            break;
+        case 1:
+            out += "-ERR " + RandBytes(12, false) + "\r\n";
+            break;
+        case 2:
+            out += ":" + RandInteger() + "\r\n";
+            break;
+        case 3: {
+            std::string s = RandBytes(40, true);
+            snprintf(head, sizeof(head), "$%u\r\n", (uint32_t) s.size());
+            out += head + s + "\r\n";
+            break;
+        }
+        case 4:
+            out += "$-1\r\n";
+            break;
+        case 5:
+            out += "*-1\r\n";
+            break;
+        case 7:
+            out += "," + RandInteger() + ".25\r\n";
+            break;
+        case 8:
+            out += "(" + RandInteger() + "123456789012345678901234567890\r\n";
+            break;
+        case 9:
+            out += (Rand(2) != 0) ? "#t\r\n" : "#f\r\n";
+            break;
+        case 10:
+            out += "_\r\n";
+            break;
+        case 11: {
+            std::string s = "txt:" + RandBytes(20, true);
+            snprintf(head, sizeof(head), "=%u\r\n", (uint32_t) s.size());
+            out += head + s + "\r\n";
+            break;
+        }
+        default: {
+            // 6 array, 12 set, 13 map.
+            uint32_t count = Rand(5);
+            char type = (6 == kind) ? '*' : ((12 == kind) ? '~' : '%');
+            snprintf(head, sizeof(head), "%c%u\r\n", type, count);
+            out += head;
+            uint32_t elements = ('%' == type) ? count * 2 : count;
+            for (uint32_t i = 0; i < elements; ++i) {
+                RandReply(out, depth - 1, resp3);
+            }
+            break;
+        }
+    }
+}
+
+static void Flatten(const redisReply* reply, uint32_t depth, FLATTOKENS& tokens) {
+    FlatToken token;
+    token.type = reply->type;
+    token.integer = 0;
+    token.depth = depth;
+    switch (reply->type) {
+        case REDIS_REPLY_INTEGER:
+        case REDIS_REPLY_BOOL:
+            token.integer = reply->integer;
+            break;
+        case REDIS_REPLY_STRING:
+        case REDIS_REPLY_STATUS:
+        case REDIS_REPLY_ERROR:
+        case REDIS_REPLY_DOUBLE:
+        case REDIS_REPLY_BIGNUM:
+        case REDIS_REPLY_VERB:
+            token.str.assign(reply->str, reply->len);
+            break;
+        case REDIS_REPLY_ARRAY:
+        case REDIS_REPLY_SET:
+        case REDIS_REPLY_PUSH:
+            token.integer = (int64_t) reply->elements;
+            break;
+        case REDIS_REPLY_MAP:
+            token.integer = (int64_t) reply->elements / 2;
+            break;
+        default:
+            break;
+    }
+    tokens.push_back(token);
+    if ((REDIS_REPLY_ARRAY == reply->type) || (REDIS_REPLY_SET == reply->type) ||
+        (REDIS_REPLY_MAP == reply->type) || (REDIS_REPLY_PUSH == reply->type)) {
+        for (size_t i = 0; i < reply->elements; ++i) {
+            Flatten(reply->element[i], depth + 1, tokens);
+        }
+    }
+}
+
+static void FlattenToken(const RespToken& token, FLATTOKENS& tokens) {
+    FlatToken flat;
+    flat.type = token.type;
+    flat.integer = token.integer;
+    flat.depth = token.depth;
+    if (NULL != token.str)
+        flat.str.assign(token.str, token.len);
+    tokens.push_back(flat);
+}
+
+// Expected tokens of every reply in data, with push frames flattened in line.
+static bool HiredisTokens(const std::string& data, FLATTOKENS& tokens, uint32_t& replies) {
+    redisReader* reader = redisReaderCreate();
+    redisReaderFeed(reader, data.data(), data.size());
+    bool bRet = true;
+    replies = 0;
+    for (;;) {
+        void* reply = NULL;
+        if (REDIS_OK != redisReaderGetReply(reader, &reply)) {
+            bRet = false;
+            break;
+        }
+        if (NULL == reply)
+            break;
+        Flatten(static_cast<redisReply*>(reply), 0, tokens);
+        if (REDIS_REPLY_PUSH != static_cast<redisReply*>(reply)->type)
+            ++replies;
+        freeReplyObject(reply);
+    }
+    redisReaderFree(reader);
+    return bRet;
+}
+
+// The same through RespReader, fed in random chunks; push frames come back
+// raw and are decoded with hiredis.
+static bool ReaderTokens(const std::string& data, FLATTOKENS& tokens, uint32_t replies) {
+    RespReader reader;
+    size_t fed = 0;
+    uint32_t done = 0;
+    while (done < replies) {
+        RespToken token;
+        int32_t ret = reader.Next(token);
+        if (RESP_PARSE_OK == ret) {
+            FlattenToken(token, tokens);
+            if (reader.IsDone())
+                ++done;
+            continue;
+        }
+        if (RESP_PARSE_PUSH == ret) {
+            std::string frame(token.str, token.len);
+            uint32_t pushes = 0;
+            if (!HiredisTokens(frame, tokens, pushes) || (0 != pushes))
+                return false;
+            continue;
+        }
+        if ((RESP_PARSE_ERROR == ret) || (fed == data.size()))
+            return false;
+
+        reader.Compact();
+        size_t len = 1 + Rand(64);
+        if (len > data.size() - fed)
+            len = data.size() - fed;
+        reader.Feed(data.data() + fed, len);
+        fed += len;
+    }
+
+    // Trailing push frames after the last reply.
+    size_t restLen = 0;
+    const char* rest = reader.GetUnread(restLen);
+    std::string tail = std::string((NULL != rest) ? rest : "", restLen) + data.substr(fed);
+    uint32_t pushes = 0;
+    return HiredisTokens(tail, tokens, pushes) && (0 == pushes);
+}
+
+static void Print(const char* name, const FLATTOKENS& tokens) {
+    printf("%s:\n", name);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        printf("  depth %u type %d integer %lld str \"%s\"\n", tokens[i].depth, tokens[i].type,
+               (long long) tokens[i].integer, tokens[i].str.c_str());
+    }
+}
+
+static bool Fuzz(uint32_t rounds, bool resp3) {
+    for (uint32_t i = 0; i < rounds; ++i) {
+        std::string data;
+        uint32_t count = 1 + Rand(4);
+        for (uint32_t j = 0; j < count; ++j) {
+            if (resp3 && (0 == Rand(3))) {
+                // An invalidation push ahead of the reply.
+                data += ">2\r\n$10\r\ninvalidate\r\n";
+                RandReply(data, 1, resp3);
+            }
+            RandReply(data, 3, resp3);
+        }
+        if (resp3 && (0 == Rand(3)))
+            data += ">1\r\n$7\r\nmessage\r\n";
+
+        FLATTOKENS expected;
+        FLATTOKENS actual;
+        uint32_t replies = 0;
+        if (!HiredisTokens(data, expected, replies) || (replies != count)) {
+            printf("hiredis rejected round %u\n", i);
+            return false;
+        }
+        if (!ReaderTokens(data, actual, replies) || !(expected == actual)) {
+            printf("mismatch in round %u (%s)\n", i, resp3 ? "RESP3" : "RESP2");
+            Print("hiredis", expected);
+            Print("RespReader", actual);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void Bench(uint32_t elements) {
+    std::string data;
+    char head[32];
+    snprintf(head, sizeof(head), "*%u\r\n", elements);
+    data += head;
+    for (uint32_t i = 0; i < elements; ++i) {
+        std::string s = RandBytes(64, false);
+        snprintf(head, sizeof(head), "$%u\r\n", (uint32_t) s.size());
+        data += head + s + "\r\n";
+    }
+
+    uint32_t loops = 20;
+    uint64_t begin = NowUs();
+    for (uint32_t i = 0; i < loops; ++i) {
+        redisReader* reader = redisReaderCreate();
+        redisReaderFeed(reader, data.data(), data.size());
+        void* reply = NULL;
+        redisReaderGetReply(reader, &reply);
+        if (NULL != reply)
+            freeReplyObject(reply);
+        redisReaderFree(reader);
+    }
+    uint64_t hiredisUs = NowUs() - begin;
+
+    begin = NowUs();
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < loops; ++i) {
+        RespReader reader;
+        reader.Feed(data.data(), data.size());
+        RespToken token;
+        while (RESP_PARSE_OK == reader.Next(token)) {
+            bytes += token.len;
+            if (reader.IsDone())
+                break;
+        }
+    }
+    uint64_t readerUs = NowUs() - begin;
+
+    double total = (double) elements * loops;
+    printf("%u elements, %u loops: hiredis %.1f ns/element, RespReader (%s) %.1f ns/element (%lu bytes)\n",
+           elements, loops, hiredisUs * 1000.0 / total, RespReader::GetKernelName(), readerUs * 1000.0 / total,
+           (unsigned long) bytes);
+}
+
+int main(int argc, char** argv) {
+    uint32_t rounds = (argc > 1) ? (uint32_t) atoi(argv[1]) : 20000;
+    uint32_t elements = (argc > 2) ? (uint32_t) atoi(argv[2]) : 100000;
+
+    if (!Fuzz(rounds, false))
+        return 1;
+#ifdef XREDIS_HAVE_RESP3
+    if (!Fuzz(rounds, true))
+        return 1;
+#endif
+    printf("fuzz: %u rounds match hiredis\n", rounds);
+
+    if (elements > 0)
+        Bench(elements);
+    return 0;
+}